@@ -6,7 +6,26 @@
  * maintains a database of dynamic endpoints and allows clients to map an  
  * interface/object UUID pair to a local dynamic endpoint. This trivial tool
  * can be used to identify services that have registered with DCE/RPC endpoint
- * mapper. Usage: epmap [-p port] hostname.
+ * mapper. Usage: epmap [-p port] [-f frag_size] [-i uuid [-v major.minor]] [-o uuid] [-H] hostname.
+ * The -i/-o filters are evaluated by the endpoint mapper itself (ept_lookup
+ * inquiry types RPC_C_EP_MATCH_BY_IF/OBJ/BOTH). -H also queries the
+ * management interface, added to the same association with ALTER_CONTEXT.
+ * -l probes the dynamic TCP endpoints concurrently (connect + BIND) and
+ * reports which ones answer, with the handshake latency. Duplicate entries
+ * are collapsed, and -g groups the endpoints by interface. Each ept_lookup
+ * call returns as many entries as fit in the negotiated fragment size (-f).
+ * -F writes machine-readable records (NDJSON, CSV or binary) instead.
+ * -S saves the scan in a memory-mappable snapshot file, -L reads one back,
+ * and -D only reports the endpoints added, removed or changed since one.
+ * -C exports the endpoints as a dictionary-encoded columnar table, and -q
+ * queries a snapshot through an inverted index of the interfaces.
+ * Targets may be names, addresses, ranges, files or stdin, expanded one at a
+ * time; -x excludes ranges and -R walks the ranges in a random order.
+ * They go through a pipeline of resolve, connect and enumerate threads (-j),
+ * linked by bounded lock-free queues, and are reported as they complete.
+ * -J journals the targets scanned, so that an interrupted sweep resumes.
+ * -A and -N order the targets by history: hosts that answered before come
+ * first, those recently refused or timed out last, or not at all (-K).
  *
  * Endpoint Mapper interface: e1af8308-5d1f-11c9-91a4-08002b14a0fa 
  * 
@@ -53,25 +72,34 @@
 #define WIN32_LEAN_AND_MEAN
 #endif
 
+/* Number of sockets select() can wait on, bounds the probe concurrency. */
+#ifndef FD_SETSIZE
+#define FD_SETSIZE 256
+#endif
+
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <io.h>
+#include <fcntl.h>
 
-typedef unsigned char byte;
+#include "epmap.h"
+
+/* WaitOnAddress(), for the queues of the scan pipeline. */
+#ifdef _MSC_VER
+#pragma comment(lib, "synchronization.lib")
+#endif
 
-typedef struct uuid {
-   uint32_t  time_low;
-   uint16_t  time_mid;
-   uint16_t  time_hi_and_version;
-   uint8_t   clock_seq_hi_and_reserved;
-   uint8_t   clock_seq_low;
-   byte      node[6];
-} uuid_t, *uuid_p_t;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EPMAP_SSE2
+#include <emmintrin.h>
+#endif
 
-#define UUID_SIZE  16
+typedef unsigned char byte;
 
 typedef uint16_t p_context_id_t;
 
@@ -169,6 +197,10 @@ typedef struct rpcconn_bind_ack_hdr {
    auth_verifier_co_t auth_verifier; /* if auth_length != 0. */
 } rpcconn_bind_ack_hdr_t;
 
+/* ALTER_CONTEXT and ALTER_CONTEXT_RESP PDUs, same layout as BIND/BIND_ACK. */
+typedef rpcconn_bind_hdr_t     rpcconn_alter_context_hdr_t;
+typedef rpcconn_bind_ack_hdr_t rpcconn_alter_context_resp_hdr_t;
+
 /* Presentation context reject */
 typedef uint16_t p_reject_reason_t;
 
@@ -276,7 +308,6 @@ typedef struct rpcconn_shutdown_hdr {
    uint32_t  call_id;
 } rpcconn_shutdown_hdr_t;
 
-#define DEFAULT_EPMAP_PORT 135
 
 /* PDU types */
 #define RPC_PTYPE_REQUEST        0x00 /* CO/CL */
@@ -331,17 +362,6 @@ typedef struct ndr_context_handle {
 } ndr_context_handle_t;
 **********************************/
 
-/* Inquiry types. */
-#define RPC_C_EP_ALL_ELTS             0  /* Return all elements from the endpoint map. */
-#define RPC_C_EP_MATCH_BY_IF          1
-#define RPC_C_EP_MATCH_BY_OBJ         2
-#define RPC_C_EP_MATCH_BY_BOTH        3
-
-#define RPC_C_VERS_ALL                1
-#define RPC_C_VERS_COMPATIBLE         2
-#define RPC_C_VERS_EXACT              3
-#define RPC_C_VERS_MAJOR_ONLY         4
-#define RPC_C_VERS_UPTO               5
 #define RPC_C_ERROR_STRING_LEN      256
 
 #define RPC_C_MGMT_INQ_IF_IDS         0
@@ -350,6 +370,13 @@ typedef struct ndr_context_handle {
 #define RPC_C_MGMT_IS_SERVER_LISTEN   3
 #define RPC_C_MGMT_STOP_SERVER_LISTEN 4
 
+/* Presentation context IDs on the association. Contexts 0 and 1 are
+ * negotiated by the BIND PDU, the management interface is added to the
+ * same association with an ALTER_CONTEXT PDU. 
+ */
+#define EPMAP_CONTEXT_ID        0
+#define EPMAP_MGMT_CONTEXT_ID   2
+
 typedef struct ept_lookup {
    uint32_t inquiry_type;
    uint32_t object_referent_id;
@@ -365,11 +392,55 @@ typedef struct ept_lookup {
 
 #define EPT_MAX_ANNOTATION_SIZE 64
 
-typedef struct ept_entry {
-   uuid_t object;
-   int tower;
-   char annotation[EPT_MAX_ANNOTATION_SIZE];
-} ept_entry_t, *ept_entry_p_t;
+/* Entries returned by a single ept_lookup call, at most. The batch size is
+ * derived from the negotiated receive fragment size, counting EPT_ENTRY_SIZE
+ * bytes per marshalled entry (a TCP tower and a short annotation) and 64
+ * bytes for the response header, entry handle, array header and status.
+ */
+#define EPT_MAX_ENTRIES 256
+#define EPT_ENTRY_SIZE  160
+
+/* Bump allocator. Memory is carved from large chunks and only released all
+ * at once, so retaining interned strings costs neither a malloc() nor a heap
+ * header each. 
+ */
+#define EPMAP_ARENA_CHUNK_SIZE 65536
+
+typedef struct arena_chunk {
+   struct arena_chunk *next;
+   size_t size;                /* Usable bytes, after this header. */
+   size_t used;
+} arena_chunk_t;
+
+typedef struct epmap_arena {
+   arena_chunk_t *chunks;      /* The chunk being filled comes first. */
+   size_t chunk_size;
+   size_t total;               /* Bytes handed out. */
+} epmap_arena_t;
+
+/* Interned strings: IDs index pages of string pointers, a page directory
+ * that never moves so that epmap_string() takes no lock. ID 0 is the empty
+ * string.
+ */
+#define STRTAB_PAGE_SHIFT 12
+#define STRTAB_PAGE_SIZE  (1 << STRTAB_PAGE_SHIFT)
+#define STRTAB_MAX_PAGES  4096
+
+typedef struct strtab_slot {
+   uint32_t hash;
+   uint32_t id;                /* 0 for an empty slot. */
+} strtab_slot_t;
+
+/* Entries enumerated on one host. Their strings are interned, so the
+ * entry array is the only allocation. 
+ */
+typedef struct epmap_result {
+   const char *server;
+   uint16_t port;
+   ept_entry_t *entries;
+   size_t n_entries;
+   size_t max_entries;
+} epmap_result_t;
 
 
 /* Internal "opaque" objects. */
@@ -383,83 +454,264 @@ typedef struct buffer {
 } buffer_t;
 
 /* Internal state. */
-typedef struct epmap {
+struct epmap_session {
    SOCKET sockfd;
    char *server;
    uint16_t port;
-   struct sockaddr_in sin;
+   struct sockaddr_storage addr; /* Peer address, IPv4 or IPv6. */
+   int addrlen;
    buffer_t buffer[2];
    uint32_t call_id;
    uint32_t assoc_group;       /* This is usually ignored. */
    ept_lookup_handle_t handle;
-   int state;
+   ept_lookup_t lookup;        /* Inquiry template, see epmap_set_filter(). */
+   uint32_t contexts;          /* Accepted presentation contexts, by ID. */
+   uint16_t frag_size;         /* Advertised max_xmit_frag and max_recv_frag. */
+   uint16_t max_xmit_frag;     /* Negotiated fragment sizes, from the BIND ACK. */
+   uint16_t max_recv_frag;
+   uint32_t max_entries;       /* ept_lookup batch size. */
+   const epmap_watchlist_t *watchlist;
+   size_t n_watched;           /* Entries decoded with EPMAP_ENTRY_WATCHED. */
+   epmap_predicate_t predicate;
+   int filtered;               /* The predicate is set. */
+   size_t n_skipped;           /* Entries rejected by the predicate. */
+   int state;                  /* Non-blocking operation, EPMAP_STATE_* */
+   int op;                     /* EPMAP_OP_* */
+   epmap_lookup_t *pending;    /* Iterator of EPMAP_OP_LOOKUP. */
    
    p_reject_reason_t reason;   /* Rejection reason code in the bind_nak PDU. */
    uint32_t status;            /* Run-time fault code or zero (fault PDU). */
    int      wsacode;           /* wsa code */
-} epmap_t;
+   struct epmap_session *next; /* Next idle session object in the pool. */
+};
+
+
+/* Progress of a non-blocking operation, see epmap_async_step(). */
+#define EPMAP_STATE_IDLE       0
+#define EPMAP_STATE_CONNECTING 1
+#define EPMAP_STATE_SENDING    2
+#define EPMAP_STATE_RECEIVING  3
+
+#define EPMAP_OP_BIND   0
+#define EPMAP_OP_LOOKUP 1
+
+/* Send buffer size. The largest PDU we encode is the 116 bytes BIND. */
+#define EPMAP_SND_BUFSIZE  128
+/* Initial receive buffer size, it grows with the PDUs received. */
+#define EPMAP_RCV_BUFSIZE  1024
+
+/* Receive buffers come from a slab pool shared by all sessions, in size
+ * classes of 512 bytes to 64 KB (the largest fragment). Each slab is carved
+ * into buffers of a single class, which are recycled through a free list 
+ * and only released by epmap_pool_cleanup().
+ */
+#define RCV_POOL_MIN_SHIFT 9
+#define RCV_POOL_CLASSES   8
+#define RCV_POOL_SLAB_SIZE 65536
+
+/* Idle session objects kept for reuse. */
+#define EPMAP_POOL_MAX     1024
+
+typedef struct slab {
+   struct slab *next;
+} slab_t;
+
+static struct {
+   SRWLOCK  lock;
+   void    *free[RCV_POOL_CLASSES];  /* Free buffers, linked through their first bytes. */
+   slab_t  *slabs;
+   epmap_t *idle;                    /* Idle session objects, linked through next. */
+   size_t   n_idle;
+} epmap_pool = { SRWLOCK_INIT };
+
+static int rcv_pool_class(size_t size)
+{
+   int index = 0;
+
+   while (index < RCV_POOL_CLASSES && ((size_t)1 << (RCV_POOL_MIN_SHIFT + index)) < size)
+       index++;
+
+   return index;
+}
+
+/* Get a buffer of the given class, carving a new slab if needed. */
+static void *rcv_pool_get(int index)
+{
+   size_t size = (size_t)1 << (RCV_POOL_MIN_SHIFT + index);
+   slab_t *slab = NULL;
+   uint8_t *ptr = NULL;
+   void *data = NULL;
+   size_t i;
+
+   AcquireSRWLockExclusive(&epmap_pool.lock);
+
+   if (epmap_pool.free[index] == NULL) {
+       slab = malloc(sizeof(slab_t) + RCV_POOL_SLAB_SIZE);
+       if (slab != NULL) {
+           slab->next = epmap_pool.slabs;
+           epmap_pool.slabs = slab;
+           /* The slab header is pointer-sized, buffers stay aligned. */
+           ptr = (uint8_t *)(slab + 1);
+           for (i = 0; i + size <= RCV_POOL_SLAB_SIZE; i += size) {
+               *(void **)(ptr + i) = epmap_pool.free[index];
+               epmap_pool.free[index] = ptr + i;
+           }
+       }
+   }
+
+   data = epmap_pool.free[index];
+   if (data != NULL)
+       epmap_pool.free[index] = *(void **)data;
+
+   ReleaseSRWLockExclusive(&epmap_pool.lock);
+
+   return data;
+}
+
+static void rcv_pool_put(void *data, int index)
+{
+   AcquireSRWLockExclusive(&epmap_pool.lock);
+   *(void **)data = epmap_pool.free[index];
+   epmap_pool.free[index] = data;
+   ReleaseSRWLockExclusive(&epmap_pool.lock);
+}
+
+/* Make sure the receive buffer can hold size bytes, keeping its content. */
+static int rcv_buffer_reserve(epmap_t *epmap, size_t size)
+{
+   buffer_t *buffer = &epmap->buffer[1];
+   void *data = NULL;
+   int index;
+
+   if (buffer->data != NULL && buffer->bufsize >= size)
+       return EPMAP_EOK;
+
+   index = rcv_pool_class(size);
+   if (index == RCV_POOL_CLASSES)
+       return EPMAP_EINVAL;
 
-/* Error and status codes. $fixme */
+   data = rcv_pool_get(index);
+   if (data == NULL)
+       return EPMAP_ENOMEM;
 
-#define EPMAP_EOK       0x000 /* Operation completed successfully. */
-#define EPMAP_ENOMEM    0x200 /* A call to malloc() failed. */
-#define EPMAP_EINVAL    0x201 /* An invalid argument was passed to a library function. */
-#define EPMAP_EBADPTR   0x202 /* An invalid pointer was detected. */
-#define EPMAP_EWSAINIT  0x203 /* WSAStartup() initialization failed. */
-#define EPMAP_EDNSFAIL  0x204 /* Could not resolve host name. */
-#define EPMAP_ESOCKET   0x205 /* Could not create socket or connect to server. */
-#define EPMAP_ESEND     0x206 /* A call to send() failed. */
-#define EPMAP_ERECV     0x207 /* A call to recv() failed. */
+   if (buffer->data != NULL) {
+       memcpy(data, buffer->data, buffer->length);
+       rcv_pool_put(buffer->data, buffer->index);
+   }
 
-#define EPMAP_EACK      0x300 /* BIND-ACK PDU */
-#define EPMAP_ENAK      0x301 /* BIND-NAK PDU */
-#define EPMAP_EFAULT    0x302 /* Received a FAULT PDU. */
-#define EPMAP_EPROTO    0x303 /* Generic protocol error. */
-#define EPMAP_ENODATA   0x304 /* Status returned by response $fixme */
-                              
-#define EPMAP_EDEBUG    0x400
+   buffer->data = data;
+   buffer->bufsize = (size_t)1 << (RCV_POOL_MIN_SHIFT + index);
+   buffer->index = index;
 
+   return EPMAP_EOK;
+}
 
+/* Return the receive buffer of an idle session to the pool. The next PDU
+ * received takes one again, of the right size. 
+ */
+EPMAPAPI void epmap_idle(epmap_t *epmap)
+{
+   buffer_t *buffer = &epmap->buffer[1];
 
-#define EPMAPAPI extern
+   if (buffer->data != NULL) {
+       rcv_pool_put(buffer->data, buffer->index);
+       buffer->data = NULL;
+       buffer->bufsize = 0;
+       buffer->length = 0;
+       buffer->offset = 0;
+   }
+}
 
 EPMAPAPI void epmap_destroy(epmap_t *epmap)
 {
-   buffer_t *buffer = NULL;
-   int i;
-   
    if (epmap != NULL) {    
        if (epmap->sockfd != INVALID_SOCKET) {
            closesocket(epmap->sockfd);
            WSACleanup();
        }
-       for (i = 0; i < 2; i++) {
-           buffer = &epmap->buffer[i];
-           if (buffer->data != NULL) { 
-               buffer->bufsize = 0;
-               buffer->length = 0;
-               free(buffer->data);   
-           }
+       epmap_idle(epmap);
+
+       /* Keep the object, and its send buffer, for the next session. */
+       AcquireSRWLockExclusive(&epmap_pool.lock);
+       if (epmap_pool.n_idle < EPMAP_POOL_MAX) {
+           epmap->next = epmap_pool.idle;
+           epmap_pool.idle = epmap;
+           epmap_pool.n_idle++;
+           epmap = NULL;
+       }
+       ReleaseSRWLockExclusive(&epmap_pool.lock);
+
+       if (epmap != NULL) {
+           free(epmap->buffer[0].data);
+           free(epmap); 
        }
-       free(epmap); 
    }
 }
 
+/* Release the idle session objects and the receive buffer slabs. Must only
+ * be called once all the sessions have been destroyed. 
+ */
+EPMAPAPI void epmap_pool_cleanup(void)
+{
+   epmap_t *epmap = NULL;
+   slab_t *slab = NULL;
+   int i;
+
+   AcquireSRWLockExclusive(&epmap_pool.lock);
+
+   while ((epmap = epmap_pool.idle) != NULL) {
+       epmap_pool.idle = epmap->next;
+       free(epmap->buffer[0].data);
+       free(epmap);
+   }
+   epmap_pool.n_idle = 0;
+
+   while ((slab = epmap_pool.slabs) != NULL) {
+       epmap_pool.slabs = slab->next;
+       free(slab);
+   }
+   for (i = 0; i < RCV_POOL_CLASSES; i++)
+       epmap_pool.free[i] = NULL;
+
+   ReleaseSRWLockExclusive(&epmap_pool.lock);
+}
+
+/* Get a session object, from the pool if possible. snd_len is the size of
+ * the send buffer, rcv_len the initial size of the receive buffer, which is
+ * only taken from the pool when the first PDU is received.
+ */
 EPMAPAPI epmap_t *epmap_init(size_t snd_len, size_t rcv_len)
 {
    epmap_t *epmap = NULL;
    buffer_t *buffer = NULL;
    int i;
 
-   epmap = (epmap_t *)malloc(sizeof(epmap_t));
+   if (snd_len == 0 || rcv_pool_class(rcv_len) == RCV_POOL_CLASSES)
+       return NULL;
+
+   AcquireSRWLockExclusive(&epmap_pool.lock);
+   epmap = epmap_pool.idle;
+   if (epmap != NULL) {
+       epmap_pool.idle = epmap->next;
+       epmap_pool.n_idle--;
+   }
+   ReleaseSRWLockExclusive(&epmap_pool.lock);
+
    if (epmap == NULL) {
-       return NULL; 
+       epmap = (epmap_t *)malloc(sizeof(epmap_t));
+       if (epmap == NULL) {
+           return NULL; 
+       }
+       epmap->buffer[0].data = NULL;
+       epmap->buffer[0].bufsize = 0;
    }
 
    epmap->sockfd = INVALID_SOCKET;
    epmap->server = NULL;
    epmap->port = 0;
    epmap->call_id = 0x00000000;
+   memset(&epmap->addr, '\0', sizeof(epmap->addr));
+   epmap->addrlen = 0;
 
    /* UUID for the ept_lookup_handle generated by the endpoint mapper. */
    epmap->handle.uuid.time_low = 0;
@@ -469,23 +721,52 @@ EPMAPAPI epmap_t *epmap_init(size_t snd_len, size_t rcv_len)
    epmap->handle.uuid.clock_seq_low = 0;
    for (i = 0; i < sizeof(epmap->handle.uuid.node); i++)
        epmap->handle.uuid.node[i] = 0;
-
-   epmap->state = 0;
+   epmap->handle.attributes = 0;
+   epmap->contexts = 0;
+
+   /* Until the BIND ACK, fragments are only limited by the buffer pool. */
+   epmap->frag_size = EPMAP_FRAG_SIZE;
+   epmap->max_xmit_frag = 0;
+   epmap->max_recv_frag = 0;
+   epmap->max_entries = 1;
+
+   epmap->watchlist = NULL;
+   epmap->n_watched = 0;
+   epmap->filtered = 0;
+   epmap->n_skipped = 0;
+
+   /* By default, ask for the whole endpoint map. */
+   memset(&epmap->lookup, '\0', sizeof(epmap->lookup));
+   epmap->lookup.inquiry_type = RPC_C_EP_ALL_ELTS;
+   epmap->lookup.vers_option = RPC_C_VERS_ALL;
+
+   epmap->state = EPMAP_STATE_IDLE;
+   epmap->op = EPMAP_OP_BIND;
+   epmap->pending = NULL;
    epmap->reason = 0;
    epmap->status = 0;
    epmap->wsacode = 0;
 
-   for (i = 0; i < 2; i++) {
-       buffer = &epmap->buffer[i]; 
-       //////buffer->bufsize = !i ? snd_len : rcv_len;
-       buffer->bufsize = 8192;   /* Size of allocated bytes. */
-
-       buffer->data = (void *)malloc(buffer->bufsize);
+   /* Receive buffer, taken from the pool on demand. */
+   buffer = &epmap->buffer[1];
+   buffer->data = NULL;
+   buffer->bufsize = 0;
+   buffer->index = rcv_pool_class(rcv_len);
+
+   /* Send buffer, reused if the pooled one is large enough. */
+   buffer = &epmap->buffer[0];
+   if (buffer->bufsize < snd_len) {
+       free(buffer->data);
+       buffer->data = malloc(snd_len);
+       buffer->bufsize = buffer->data != NULL ? snd_len : 0;
        if (buffer->data == NULL) {
            epmap_destroy(epmap);
            return NULL;   
        }
-       memset(buffer->data, '\0', buffer->bufsize); 
+   }
+
+   for (i = 0; i < 2; i++) {
+       buffer = &epmap->buffer[i]; 
        buffer->length = 0; 
        buffer->offset = 0;
        buffer->eof = 0; 
@@ -494,6 +775,266 @@ EPMAPAPI epmap_t *epmap_init(size_t snd_len, size_t rcv_len)
    return epmap;
 }
 
+EPMAPAPI void epmap_arena_init(epmap_arena_t *arena, size_t chunk_size)
+{
+   arena->chunks = NULL;
+   arena->chunk_size = chunk_size != 0 ? chunk_size : EPMAP_ARENA_CHUNK_SIZE;
+   arena->total = 0;
+}
+
+/* Allocate size bytes, 8-octet aligned. */
+EPMAPAPI void *epmap_arena_alloc(epmap_arena_t *arena, size_t size)
+{
+   arena_chunk_t *chunk = arena->chunks;
+   void *ptr = NULL;
+   size_t n;
+
+   size = (size + 7) & ~(size_t)7;
+
+   if (chunk == NULL || chunk->size - chunk->used < size) {
+       /* Large blocks get a chunk of their own, behind the current one. */
+       n = size > arena->chunk_size / 4 ? size : arena->chunk_size;
+       chunk = malloc(sizeof(arena_chunk_t) + n);
+       if (chunk == NULL)
+           return NULL;
+       chunk->size = n;
+       chunk->used = 0;
+       if (n != arena->chunk_size && arena->chunks != NULL) {
+           chunk->next = arena->chunks->next;
+           arena->chunks->next = chunk;
+       } else {
+           chunk->next = arena->chunks;
+           arena->chunks = chunk;
+       }
+   }
+
+   ptr = (uint8_t *)(chunk + 1) + chunk->used;
+   chunk->used += size;
+   arena->total += size;
+
+   return ptr;
+}
+
+EPMAPAPI void epmap_arena_free(epmap_arena_t *arena)
+{
+   arena_chunk_t *chunk = NULL;
+
+   while ((chunk = arena->chunks) != NULL) {
+       arena->chunks = chunk->next;
+       free(chunk);
+   }
+   arena->total = 0;
+}
+
+EPMAPAPI void epmap_result_init(epmap_result_t *result, const char *server, uint16_t port)
+{
+   result->server = server;
+   result->port = port;
+   result->entries = NULL;
+   result->n_entries = 0;
+   result->max_entries = 0;
+}
+
+/* Make room for n more entries and return the first one. The array doubles
+ * in place when realloc() can, so no dead copies are left behind. 
+ */
+EPMAPAPI ept_entry_t *epmap_result_reserve(epmap_result_t *result, size_t n)
+{
+   ept_entry_t *entries = NULL;
+   size_t max_entries = result->max_entries;
+
+   if (max_entries - result->n_entries < n) {
+       while (max_entries - result->n_entries < n)
+           max_entries = max_entries ? max_entries * 2 : 64;
+       entries = realloc(result->entries, sizeof(ept_entry_t) * max_entries);
+       if (entries == NULL)
+           return NULL;
+       result->entries = entries;
+       result->max_entries = max_entries;
+   }
+
+   return &result->entries[result->n_entries];
+}
+
+EPMAPAPI void epmap_result_free(epmap_result_t *result)
+{
+   free(result->entries);
+   result->entries = NULL;
+   result->n_entries = 0;
+   result->max_entries = 0;
+}
+
+/* The string table, shared by all sessions. Lookups take the lock shared,
+ * only new strings take it exclusive. 
+ */
+static struct {
+   SRWLOCK        lock;
+   const char   **pages[STRTAB_MAX_PAGES];
+   strtab_slot_t *slots;
+   uint32_t       mask;
+   uint32_t       n_strings;   /* IDs go from 1 to n_strings. */
+   epmap_arena_t  arena;       /* String storage, each one after its length. */
+} epmap_strtab = { SRWLOCK_INIT };
+
+static uint32_t strtab_hash(const char *str, size_t len)
+{
+   uint32_t hash = 0x811c9dc5;
+   size_t i;
+
+   for (i = 0; i < len; i++) 
+       hash = (hash ^ (unsigned char)str[i]) * 0x01000193;
+
+   return hash;
+}
+
+static const char *strtab_get(uint32_t id)
+{
+   return epmap_strtab.pages[id >> STRTAB_PAGE_SHIFT][id & (STRTAB_PAGE_SIZE - 1)];
+}
+
+static uint32_t strtab_find(uint32_t hash, const char *str, size_t len)
+{
+   const strtab_slot_t *slot = NULL;
+   const char *ptr = NULL;
+   uint32_t i;
+
+   if (epmap_strtab.slots == NULL)
+       return 0;
+
+   for (i = hash & epmap_strtab.mask; ; i = (i + 1) & epmap_strtab.mask) {
+       slot = &epmap_strtab.slots[i];
+       if (slot->id == 0)
+           return 0;
+       if (slot->hash == hash) {
+           ptr = strtab_get(slot->id);
+           if (((const uint32_t *)ptr)[-1] == len && memcmp(ptr, str, len) == 0)
+               return slot->id;
+       }
+   }
+}
+
+/* Double the index, the table is kept at most half full. */
+static int strtab_grow(void)
+{
+   strtab_slot_t *slots = NULL;
+   uint32_t mask = epmap_strtab.slots != NULL ? epmap_strtab.mask * 2 + 1 : 1023;
+   uint32_t i, j;
+
+   slots = calloc((size_t)mask + 1, sizeof(strtab_slot_t));
+   if (slots == NULL)
+       return EPMAP_ENOMEM;
+
+   for (i = 0; epmap_strtab.slots != NULL && i <= epmap_strtab.mask; i++) {
+       if (epmap_strtab.slots[i].id == 0)
+           continue;
+       for (j = epmap_strtab.slots[i].hash & mask; slots[j].id != 0; j = (j + 1) & mask)
+           ;
+       slots[j] = epmap_strtab.slots[i];
+   }
+
+   free(epmap_strtab.slots);
+   epmap_strtab.slots = slots;
+   epmap_strtab.mask = mask;
+
+   return EPMAP_EOK;
+}
+
+/* Intern at most len bytes of str, up to the first nul byte, and return
+ * its ID. Equal strings get the same ID, from any thread. 
+ */
+EPMAPAPI int epmap_intern(const char *str, size_t len, uint32_t *id)
+{
+   const char *end = memchr(str, '\0', len);
+   uint32_t hash;
+   uint32_t *ptr = NULL;
+   uint32_t i, n;
+   int result = EPMAP_EOK;
+
+   if (end != NULL)
+       len = end - str;
+
+   *id = 0;
+   if (len == 0)
+       return EPMAP_EOK;
+
+   hash = strtab_hash(str, len);
+
+   AcquireSRWLockShared(&epmap_strtab.lock);
+   *id = strtab_find(hash, str, len);
+   ReleaseSRWLockShared(&epmap_strtab.lock);
+
+   if (*id != 0)
+       return EPMAP_EOK;
+
+   AcquireSRWLockExclusive(&epmap_strtab.lock);
+
+   /* Somebody may have added it in the meantime. */
+   *id = strtab_find(hash, str, len);
+   n = epmap_strtab.n_strings + 1;
+
+   if (*id == 0 && n >= STRTAB_MAX_PAGES * STRTAB_PAGE_SIZE)
+       result = EPMAP_ENOMEM;
+
+   if (*id == 0 && result == EPMAP_EOK && (epmap_strtab.slots == NULL || n * 2 > epmap_strtab.mask))
+       result = strtab_grow();
+
+   if (*id == 0 && result == EPMAP_EOK && epmap_strtab.pages[n >> STRTAB_PAGE_SHIFT] == NULL) {
+       epmap_strtab.pages[n >> STRTAB_PAGE_SHIFT] = calloc(STRTAB_PAGE_SIZE, sizeof(const char *));
+       if (epmap_strtab.pages[n >> STRTAB_PAGE_SHIFT] == NULL)
+           result = EPMAP_ENOMEM;
+   }
+
+   if (*id == 0 && result == EPMAP_EOK) {
+       if (epmap_strtab.arena.chunk_size == 0)
+           epmap_arena_init(&epmap_strtab.arena, 0);
+       ptr = epmap_arena_alloc(&epmap_strtab.arena, sizeof(uint32_t) + len + 1);
+       if (ptr == NULL) {
+           result = EPMAP_ENOMEM;
+       } else {
+           *ptr = (uint32_t)len;
+           memcpy(ptr + 1, str, len);
+           ((char *)(ptr + 1))[len] = '\0';
+           epmap_strtab.pages[n >> STRTAB_PAGE_SHIFT][n & (STRTAB_PAGE_SIZE - 1)] = (const char *)(ptr + 1);
+           for (i = hash & epmap_strtab.mask; epmap_strtab.slots[i].id != 0; i = (i + 1) & epmap_strtab.mask)
+               ;
+           epmap_strtab.slots[i].hash = hash;
+           epmap_strtab.slots[i].id = n;
+           epmap_strtab.n_strings = n;
+           *id = n;
+       }
+   }
+
+   ReleaseSRWLockExclusive(&epmap_strtab.lock);
+
+   return result;
+}
+
+/* The string of an interned ID, "" for 0. */
+EPMAPAPI const char *epmap_string(uint32_t id)
+{
+   return id != 0 ? strtab_get(id) : "";
+}
+
+/* Release the string table. Must only be called once no ID is in use. */
+EPMAPAPI void epmap_strings_cleanup(void)
+{
+   uint32_t i;
+
+   AcquireSRWLockExclusive(&epmap_strtab.lock);
+
+   for (i = 0; i < STRTAB_MAX_PAGES; i++) {
+       free((void *)epmap_strtab.pages[i]);
+       epmap_strtab.pages[i] = NULL;
+   }
+   free(epmap_strtab.slots);
+   epmap_strtab.slots = NULL;
+   epmap_strtab.mask = 0;
+   epmap_strtab.n_strings = 0;
+   epmap_arena_free(&epmap_strtab.arena);
+
+   ReleaseSRWLockExclusive(&epmap_strtab.lock);
+}
+
 static int winsock_init(void)
 {
    WORD wVersionRequested;
@@ -514,7 +1055,21 @@ static int winsock_init(void)
    return error;   
 }
 
-static SOCKET create_socket(const char *server, uint16_t port, struct sockaddr_in *sin, int *ecode)
+/* Monotonic clock, in microseconds. */
+static uint64_t epmap_clock_us(void)
+{
+   static LARGE_INTEGER frequency = { 0 };
+   LARGE_INTEGER counter;
+
+   if (frequency.QuadPart == 0)
+       QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&counter);
+
+   return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+          (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+static SOCKET create_socket(const char *server, uint16_t port, struct sockaddr_storage *addr, int *addrlen, int *ecode)
 {
    SOCKET SocketID = INVALID_SOCKET;
    struct addrinfo *result = NULL;
@@ -563,8 +1118,9 @@ static SOCKET create_socket(const char *server, uint16_t port, struct sockaddr_i
    if (SocketID == INVALID_SOCKET) 
        return INVALID_SOCKET;
    else {
-       int sinlen = sizeof(struct sockaddr_in);  
-       getpeername(SocketID, sin, &sinlen);     
+       *addrlen = sizeof(struct sockaddr_storage);  
+       if (getpeername(SocketID, (struct sockaddr *)addr, addrlen) != 0)
+           *addrlen = 0;
    }
 
 
@@ -590,7 +1146,7 @@ static int epmap_connect(epmap_t *epmap, const char *server, uint16_t port)
 
    int ecode;
 
-   epmap->sockfd = create_socket(epmap->server, epmap->port, &epmap->sin, &ecode);
+   epmap->sockfd = create_socket(epmap->server, epmap->port, &epmap->addr, &epmap->addrlen, &ecode);
    if (epmap->sockfd == INVALID_SOCKET) {
    
        return ((ecode << 12) | EPMAP_ESOCKET);
@@ -599,105 +1155,261 @@ static int epmap_connect(epmap_t *epmap, const char *server, uint16_t port)
    return EPMAP_EOK;
 }
 
-static int epmap_send(epmap_t *epmap)
-{   
-   buffer_t *buffer = &epmap->buffer[0];
-   size_t length;
-   int n = 0;
-
-   length = buffer->length;
-   buffer->offset = 0;
+/* Start connecting to the server on a non-blocking socket. Only the first
+ * address the name resolves to is tried.
+ */
+static int epmap_connect_async(epmap_t *epmap, const char *server, uint16_t port)
+{
+   struct addrinfo *result = NULL;
+   struct addrinfo hints;
+   u_long mode = 1;
+   char szport[5+1];
+   int error;
 
-   while (length > 0 && n != SOCKET_ERROR) {
-       n = send(epmap->sockfd, (uint8_t *)buffer->data+buffer->offset, length, 0);
-       if (n == SOCKET_ERROR) {
-           return EPMAP_ESEND;
-       }        
-       length -= n;
-       buffer->offset += n;  
-   }
-   buffer->length = 0;
-   
-   return EPMAP_EOK;
-}
+   if (server == NULL || strlen(server) > 128)
+       return EPMAP_EINVAL;
 
-/* $fixme: Implement a proper finite state machine. */
+   epmap->server = server;
+   epmap->port   = port;
 
-/*****************
-static int _epmap_recv(epmap_t *epmap)
-{
-   buffer_t *buffer = &epmap->buffer[1];
-   int n;
-   int bufsize = 0;
-   uint8_t *ptr = NULL;
-   int length = 8;
+   if (winsock_init() != 0)
+       return EPMAP_EWSAINIT; 
 
-   ptr = (uint8_t *)buffer->data + length; 
-   
-   // Get at least 8 bytes, decode the PDU length to retrieve the rest of
-   // the packet. 
+   memset(&hints, '\0', sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_protocol = IPPROTO_TCP;
 
-   bufsize = buffer->bufsize;
-   buffer->length = 0;
+   _snprintf(szport, sizeof(szport), "%u", port); 
 
-   while(length > 0) {
-       n = recv(epmap->sockfd, buffer->data, bufsize, 0);
-           if (n == SOCKET_ERROR)
-               return SOCKET_ERROR;
-       buffer->length += n;  Data we have in the buffer. 
-       if (buffer->length >= 10) {
-            Decode length. 
-           if (!flag) {
-                
-               length = ptr[0] | ((ptr[1] << 8) & 0xff00);
-               bufsize = length - buffer->length;  Length of PDU minus what we have buffered.
-               flag = 10000;    
-           }           
-           length -= n;     
-
-            Set new length. 
-       } else {
-           length -= n;    
-       }    
+   error = getaddrinfo(server, szport, &hints, &result);
+   if (error != 0) {
+       error = WSAGetLastError();
+       WSACleanup();
+       return (error << 12) | EPMAP_ESOCKET;
    }
-   return buffer->length;
-}
-*************/
 
-/* This is wrong but it will do, for now. */
-static int epmap_recv(epmap_t *epmap)
-{
-   buffer_t *buffer = &epmap->buffer[1];
-   int n;
+   epmap->sockfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+   if (epmap->sockfd == INVALID_SOCKET) {
+       error = WSAGetLastError();
+       freeaddrinfo(result);
+       WSACleanup();
+       return (error << 12) | EPMAP_ESOCKET;
+   }
 
-   n = recv(epmap->sockfd, buffer->data, buffer->bufsize, 0);
-   if (n == SOCKET_ERROR) {
-       return EPMAP_ERECV; 
+   if (result->ai_addrlen <= sizeof(epmap->addr)) {
+       memcpy(&epmap->addr, result->ai_addr, result->ai_addrlen);
+       epmap->addrlen = (int)result->ai_addrlen;
    }
-   buffer->length = n;
 
-   return EPMAP_EOK;
+   /* The socket is closed by epmap_destroy() from now on. */
+   if (ioctlsocket(epmap->sockfd, FIONBIO, &mode) != 0)
+       error = WSAGetLastError();
+   else if (connect(epmap->sockfd, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR &&
+            WSAGetLastError() != WSAEWOULDBLOCK)
+       error = WSAGetLastError();
+
+   freeaddrinfo(result);
+
+   return error != 0 ? (error << 12) | EPMAP_ESOCKET : EPMAP_EOK;
 }
 
-static void w_byte(epmap_t *epmap, unsigned char value)
+/* Wait until the socket is ready for events (EPMAP_WANT_*), at most 
+ * timeout milliseconds if not negative. Returns 1 if ready, 0 on timeout, 
+ * SOCKET_ERROR on error, with the winsock code in epmap->wsacode.
+ */
+static int epmap_wait(epmap_t *epmap, int events, int timeout)
 {
-   buffer_t *buffer = &epmap->buffer[0];
-   unsigned char *ptr = (unsigned char *)buffer->data;
+   fd_set rfds, wfds, efds;
+   struct timeval tv;
+   int error = 0;
+   int errlen = sizeof(error);
+   int result;
 
-   buffer->eof = buffer->offset >= buffer->bufsize;
+   FD_ZERO(&rfds);
+   FD_ZERO(&wfds);
+   FD_ZERO(&efds);
+   if (events & EPMAP_WANT_READ)
+       FD_SET(epmap->sockfd, &rfds);
+   if (events & EPMAP_WANT_WRITE) {
+       FD_SET(epmap->sockfd, &wfds);
+       /* Windows reports failed connects in the exception set only. */
+       FD_SET(epmap->sockfd, &efds);
+   }
 
-   if (!buffer->eof) {
-       ptr += buffer->offset;
-       *ptr = value; 
-       buffer->offset++;
-       ptr = NULL;       
-   }   
+   tv.tv_sec = timeout / 1000;
+   tv.tv_usec = (timeout % 1000) * 1000;
 
-}
+   result = select((int)epmap->sockfd + 1, &rfds, &wfds, &efds, timeout < 0 ? NULL : &tv);
+   if (result == SOCKET_ERROR) {
+       epmap->wsacode = WSAGetLastError();
+   } else if (result > 0 && FD_ISSET(epmap->sockfd, &efds) &&
+       (getsockopt(epmap->sockfd, SOL_SOCKET, SO_ERROR, (char *)&error, &errlen) != 0 || error != 0)) {
+       epmap->wsacode = error != 0 ? error : WSAGetLastError();
+       result = SOCKET_ERROR;
+   }
 
-static void ndr_wle8(epmap_t *epmap, uint8_t value)
-{
-   w_byte(epmap, value);
+   return result;
+}
+
+/* Send what is left of the PDU in the send buffer, from offset. Returns
+ * EPMAP_EAGAIN if a non-blocking socket cannot take more yet.
+ */
+static int epmap_send_step(epmap_t *epmap)
+{   
+   buffer_t *buffer = &epmap->buffer[0];
+   int n;
+
+   while (buffer->offset < buffer->length) {
+       n = send(epmap->sockfd, (char *)buffer->data + buffer->offset, 
+           (int)(buffer->length - buffer->offset), 0);
+       if (n == SOCKET_ERROR) 
+           return WSAGetLastError() == WSAEWOULDBLOCK ? EPMAP_EAGAIN : EPMAP_ESEND;
+       buffer->offset += n;  
+   }
+   buffer->length = 0;
+   buffer->offset = 0;
+   
+   return EPMAP_EOK;
+}
+
+static int epmap_send(epmap_t *epmap)
+{   
+   int result;
+
+   epmap->buffer[0].offset = 0;
+   while ((result = epmap_send_step(epmap)) == EPMAP_EAGAIN) {
+       if (epmap_wait(epmap, EPMAP_WANT_WRITE, -1) == SOCKET_ERROR)
+           return EPMAP_ESEND;
+   }
+
+   return result;
+}
+
+/* Prepare the receive buffer for a new PDU. */
+static int epmap_recv_reset(epmap_t *epmap)
+{
+   buffer_t *buffer = &epmap->buffer[1];
+
+   buffer->length = 0;
+   buffer->offset = 0;
+
+   return rcv_buffer_reserve(epmap, (size_t)1 << (RCV_POOL_MIN_SHIFT + buffer->index));
+}
+
+/* Receive as much of the PDU in progress as the socket allows: the common
+ * header of each fragment first, then the rest as given by frag_length,
+ * the receive buffer growing to fit. length counts the bytes received and
+ * offset is where the current fragment starts. The stub data of the 
+ * following fragments of a response is appended to the first one, so that
+ * the decoders only see one PDU; anything else than a response is returned
+ * as received. Returns EPMAP_EAGAIN if a non-blocking socket has no data.
+ */
+static int epmap_recv_step(epmap_t *epmap)
+{
+   buffer_t *buffer = &epmap->buffer[1];
+   uint8_t *data = NULL;
+   size_t frag_length;
+   size_t alloc_hint;
+   size_t base, need;
+   int result;
+   int n;
+
+   for (;;) {
+       base = buffer->offset;
+       need = base + 16;
+       if (buffer->length >= need) {
+           data = (uint8_t *)buffer->data + base;
+           frag_length = data[8] | (data[9] << 8);
+           if (frag_length < 16)
+               return EPMAP_EPROTO;
+           /* The server must not exceed the negotiated fragment size. */
+           if (epmap->max_recv_frag != 0 && frag_length > epmap->max_recv_frag)
+               return EPMAP_EPROTO;
+           need = base + frag_length;
+       }
+
+       if (buffer->length < need) {
+           result = rcv_buffer_reserve(epmap, need);
+           if (result != EPMAP_EOK)
+               return result;
+           n = recv(epmap->sockfd, (char *)buffer->data + buffer->length, 
+               (int)(need - buffer->length), 0);
+           if (n == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+               return EPMAP_EAGAIN;
+           if (n == SOCKET_ERROR || n == 0) 
+               return EPMAP_ERECV;
+           buffer->length += n;
+           continue;
+       }
+
+       /* The fragment is complete. */
+       data = buffer->data;
+       if (base == 0) {
+           if (data[2] != RPC_PTYPE_RESPONSE || buffer->length < 24 || (data[3] & PFC_LAST_FRAG))
+               return EPMAP_EOK;
+
+           /* The allocation hint is the size of the whole stub, reserve it once. */
+           alloc_hint = data[16] | (data[17] << 8) | (data[18] << 16) | ((size_t)data[19] << 24);
+           if (alloc_hint > buffer->length - 24 && alloc_hint <= RCV_POOL_SLAB_SIZE - 24) {
+               result = rcv_buffer_reserve(epmap, 24 + alloc_hint);
+               if (result != EPMAP_EOK)
+                   return result;
+           }
+       } else {
+           if (buffer->length - base < 24 || data[base + 2] != RPC_PTYPE_RESPONSE ||
+               memcmp(data + base + 12, data + 12, 4) != 0)
+               return EPMAP_EPROTO;
+
+           /* Drop the header of the fragment. */
+           n = data[base + 3] & PFC_LAST_FRAG;
+           memmove(data + base, data + base + 24, buffer->length - base - 24);
+           buffer->length -= 24;
+           if (n) {
+               buffer->offset = 0;
+               return EPMAP_EOK;
+           }
+       }
+       buffer->offset = buffer->length;
+   }
+}
+
+/* Receive a PDU, all the fragments of a response. */
+static int epmap_recv(epmap_t *epmap)
+{
+   int result;
+
+   result = epmap_recv_reset(epmap);
+   if (result != EPMAP_EOK)
+       return result;
+
+   while ((result = epmap_recv_step(epmap)) == EPMAP_EAGAIN) {
+       if (epmap_wait(epmap, EPMAP_WANT_READ, -1) == SOCKET_ERROR)
+           return EPMAP_ERECV;
+   }
+
+   return result;
+}
+
+static void w_byte(epmap_t *epmap, unsigned char value)
+{
+   buffer_t *buffer = &epmap->buffer[0];
+   unsigned char *ptr = (unsigned char *)buffer->data;
+
+   buffer->eof = buffer->offset >= buffer->bufsize;
+
+   if (!buffer->eof) {
+       ptr += buffer->offset;
+       *ptr = value; 
+       buffer->offset++;
+       ptr = NULL;       
+   }   
+
+}
+
+static void ndr_wle8(epmap_t *epmap, uint8_t value)
+{
+   w_byte(epmap, value);
 }
 
 static void ndr_wle16(epmap_t *epmap, uint16_t value)
@@ -927,6 +1639,185 @@ static int uuid_compare(uuid_t *uuid1, uuid_t *uuid2)
             uuid1->node[5] == uuid2->node[5]);
 }
 
+/* 32-bit hash of a UUID, computed on its fields so that it doesn't depend on
+ * the host byte order. Must match uuid_hash() in gen_uuid_names.py. 
+ */
+static uint32_t uuid_hash(const uuid_t *uuid, uint32_t seed)
+{
+   uint64_t a, b, h;
+
+   a = (uint64_t)uuid->time_low | ((uint64_t)uuid->time_mid << 32) |
+       ((uint64_t)uuid->time_hi_and_version << 48);
+   b = (uint64_t)uuid->clock_seq_hi_and_reserved | ((uint64_t)uuid->clock_seq_low << 8) |
+       ((uint64_t)uuid->node[0] << 56) | ((uint64_t)uuid->node[1] << 48) |
+       ((uint64_t)uuid->node[2] << 40) | ((uint64_t)uuid->node[3] << 32) |
+       ((uint64_t)uuid->node[4] << 24) | ((uint64_t)uuid->node[5] << 16);
+
+   h = (a ^ (seed * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+   h ^= b + (h >> 29);
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 32;
+
+   return (uint32_t)h;
+}
+
+/* Generated by gen_uuid_names.py. */
+#include "uuid_names.h"
+
+/* Name of a well-known interface, or NULL. The table is a perfect hash: the
+ * bucket's seed gives the only slot the UUID can be in. 
+ */
+EPMAPAPI const char *epmap_uuid_name(const uuid_t *uuid)
+{
+   const struct uuid_name *entry = NULL;
+   uint32_t seed;
+
+   seed = uuid_names_seed[uuid_hash(uuid, 0) % UUID_NAMES_BUCKETS];
+   entry = &uuid_names[uuid_hash(uuid, seed) % UUID_NAMES_SIZE];
+
+   if (entry->name == NULL || uuid_compare((uuid_t *)&entry->uuid, (uuid_t *)uuid) != 0)
+       return NULL;
+
+   return entry->name;
+}
+
+/* Seeds of the two watchlist hashes, combined by double hashing. */
+#define WATCHLIST_SEED1  0x5741
+#define WATCHLIST_SEED2  0x7c15
+#define WATCHLIST_BLOOM_K 3
+
+static void watchlist_insert(epmap_watchlist_t *wl, const uuid_t *uuid)
+{
+   uint32_t h1 = uuid_hash(uuid, WATCHLIST_SEED1);
+   uint32_t h2 = uuid_hash(uuid, WATCHLIST_SEED2) | 1;
+   uint64_t key[2];
+   uint32_t i, bit;
+
+   memcpy(key, uuid, sizeof(key));
+
+   for (i = h1 & wl->mask; wl->keys[i * 2] | wl->keys[i * 2 + 1]; i = (i + 1) & wl->mask) {
+       if (wl->keys[i * 2] == key[0] && wl->keys[i * 2 + 1] == key[1])
+           return;
+   }
+   wl->keys[i * 2] = key[0];
+   wl->keys[i * 2 + 1] = key[1];
+   wl->n_keys++;
+
+   for (i = 0; i < WATCHLIST_BLOOM_K; i++) {
+       bit = (h1 + i * h2) & wl->bloom_mask;
+       wl->bloom[bit / 64] |= (uint64_t)1 << (bit % 64);
+   }
+}
+
+/* Build a watchlist from n UUIDs. Duplicates and the nil UUID are ignored. */
+EPMAPAPI int epmap_watchlist_init(epmap_watchlist_t *wl, const uuid_t *uuids, size_t n)
+{
+   size_t size = 16;
+   size_t bits = 512;
+   size_t i;
+
+   memset(wl, '\0', sizeof(*wl));
+
+   /* Keys at most half full, at least 16 filter bits per key: with k=3,
+    * at most about 0.5% of the UUIDs not on the list get through the
+    * filter. */
+   while (size < n * 2)
+       size *= 2;
+   while (bits < n * 16)
+       bits *= 2;
+   if (size > 0x80000000u)
+       return EPMAP_EINVAL;
+
+   wl->keys = calloc(size, 2 * sizeof(uint64_t));
+   wl->bloom = calloc(bits / 64, sizeof(uint64_t));
+   if (wl->keys == NULL || wl->bloom == NULL) {
+       free(wl->keys);
+       free(wl->bloom);
+       return EPMAP_ENOMEM;
+   }
+   wl->mask = (uint32_t)(size - 1);
+   wl->bloom_mask = (uint32_t)(bits - 1);
+
+   for (i = 0; i < n; i++) {
+       if (!uuid_is_nil((uuid_t *)&uuids[i]))
+           watchlist_insert(wl, &uuids[i]);
+   }
+
+   return EPMAP_EOK;
+}
+
+EPMAPAPI void epmap_watchlist_free(epmap_watchlist_t *wl)
+{
+   free(wl->keys);
+   free(wl->bloom);
+   memset(wl, '\0', sizeof(*wl));
+}
+
+/* Return 1 if the UUID is on the watchlist. */
+EPMAPAPI int epmap_watchlist_match(const epmap_watchlist_t *wl, const uuid_t *uuid)
+{
+   uint32_t h1 = uuid_hash(uuid, WATCHLIST_SEED1);
+   uint32_t h2 = uuid_hash(uuid, WATCHLIST_SEED2) | 1;
+   uint32_t i, bit;
+#ifdef EPMAP_SSE2
+   __m128i key, slot;
+   int eq;
+#else
+   uint64_t key[2];
+#endif
+
+   if (wl->n_keys == 0)
+       return 0;
+
+   for (i = 0; i < WATCHLIST_BLOOM_K; i++) {
+       bit = (h1 + i * h2) & wl->bloom_mask;
+       if (!(wl->bloom[bit / 64] & ((uint64_t)1 << (bit % 64))))
+           return 0;
+   }
+
+#ifdef EPMAP_SSE2
+   key = _mm_loadu_si128((const __m128i *)uuid);
+   for (i = h1 & wl->mask; ; i = (i + 1) & wl->mask) {
+       slot = _mm_loadu_si128((const __m128i *)&wl->keys[i * 2]);
+       /* Empty slots are all zeros: test them first, or the nil UUID would
+        * match the first one. */
+       if (_mm_movemask_epi8(_mm_cmpeq_epi8(slot, _mm_setzero_si128())) == 0xffff)
+           return 0;
+       eq = _mm_movemask_epi8(_mm_cmpeq_epi8(slot, key));
+       if (eq == 0xffff)
+           return 1;
+   }
+#else
+   memcpy(key, uuid, sizeof(key));
+   for (i = h1 & wl->mask; wl->keys[i * 2] | wl->keys[i * 2 + 1]; i = (i + 1) & wl->mask) {
+       if (wl->keys[i * 2] == key[0] && wl->keys[i * 2 + 1] == key[1])
+           return 1;
+   }
+   return 0;
+#endif
+}
+
+/* Only decode the entries matching pred from now on, or all of them if pred
+ * is NULL. The others are skipped as soon as a floor is rejected, and only
+ * counted in epmap->n_skipped. The prefix and UUID set are not copied.
+ */
+EPMAPAPI void epmap_set_predicate(epmap_t *epmap, const epmap_predicate_t *pred)
+{
+   epmap->filtered = pred != NULL;
+   if (pred != NULL) {
+       epmap->predicate = *pred;
+       epmap->predicate.prefix_len = pred->prefix != NULL ? strlen(pred->prefix) : 0;
+   }
+}
+
+/* Flag the entries decoded from now on whose interface is on the watchlist,
+ * or stop flagging them if wl is NULL. The watchlist is not copied. 
+ */
+EPMAPAPI void epmap_set_watchlist(epmap_t *epmap, const epmap_watchlist_t *wl)
+{
+   epmap->watchlist = wl;
+}
+
 /* Encode the BIND PDU to be sent to the endpoint portmapper. */
 static int epmap_encode_bind(epmap_t *epmap, rpcconn_bind_hdr_t *bind)
 {
@@ -988,12 +1879,14 @@ static int epmap_encode_bind(epmap_t *epmap, rpcconn_bind_hdr_t *bind)
    return buffer->length; 
 }
 
-/* Decode the BIND ACK PDU. 
+/* Decode a BIND ACK or ALTER CONTEXT RESP PDU, the layout is the same.
  * The server should accept, at most, one of the transfer syntaxes. If one of
  * the client proposed transfer syntaxes matches the server's preferred transfer
- * syntax, then that syntax is accepted. 
+ * syntax, then that syntax is accepted. The n-th result of the list is for 
+ * the n-th proposed context, whose IDs start at p_cont_id; accepted ones are
+ * recorded in epmap->contexts.
  */
-static int epmap_decode_bind_ack(epmap_t *epmap)
+static int epmap_decode_ack(epmap_t *epmap, int ptype, p_context_id_t p_cont_id)
 {
    rpcconn_bind_ack_hdr_t ack;
    p_result_t *ctx_result = NULL;
@@ -1007,7 +1900,7 @@ static int epmap_decode_bind_ack(epmap_t *epmap)
    ack.rpc_vers_minor = ndr_rle8(epmap);
    ack.ptype = ndr_rle8(epmap); 
 
-   if (ack.ptype != RPC_PTYPE_BIND_ACK)
+   if (ack.ptype != ptype)
        return EPMAP_EPROTO;
 
    ack.pfc_flags = ndr_rle8(epmap);
@@ -1028,6 +1921,17 @@ static int epmap_decode_bind_ack(epmap_t *epmap)
 
    ack.max_xmit_frag = ndr_rle16(epmap);
    ack.max_recv_frag = ndr_rle16(epmap);
+
+   /* The server transmits fragments of up to its max_xmit_frag and receives
+    * up to its max_recv_frag, but never more than what we advertised. The
+    * ept_lookup batch is sized to fill one received fragment. 
+    */
+   epmap->max_recv_frag = ack.max_xmit_frag < epmap->frag_size ? ack.max_xmit_frag : epmap->frag_size;
+   epmap->max_xmit_frag = ack.max_recv_frag < epmap->frag_size ? ack.max_recv_frag : epmap->frag_size;
+   epmap->max_entries = epmap->max_recv_frag > 64 + EPT_ENTRY_SIZE ? 
+       (epmap->max_recv_frag - 64) / EPT_ENTRY_SIZE : 1;
+   if (epmap->max_entries > EPT_MAX_ENTRIES)
+       epmap->max_entries = EPT_MAX_ENTRIES;
    /* The assoc_group ID is not really used for anything useful here. */
    epmap->assoc_group = ack.assoc_group_id = ndr_rle32(epmap);
    
@@ -1043,7 +1947,7 @@ static int epmap_decode_bind_ack(epmap_t *epmap)
    
    ack.p_result_list.n_results = ndr_rle8(epmap);
    ack.p_result_list.reserved = ndr_rle8(epmap);
-   ack.p_result_list.reserved2 = ndr_rle8(epmap);
+   ack.p_result_list.reserved2 = ndr_rle16(epmap);
 
    /////printf("Results: %u \n", ack.p_result_list.n_results);
 
@@ -1061,15 +1965,20 @@ static int epmap_decode_bind_ack(epmap_t *epmap)
        syntax = &ctx_result->transfer_syntax;
        ndr_decode_uuid(epmap, &syntax->if_uuid);
        syntax->if_version = ndr_rle32(epmap);
-       if (ctx_result->result != 0) {
-            /* Do nothing, for now. */
-       }
+       if (ctx_result->result == 0 && p_cont_id + i < 32) 
+           epmap->contexts |= 1u << (p_cont_id + i);
    }
    free(ack.p_result_list.p_results);
 
    return EPMAP_EOK;
 }
 
+/* Decode the BIND ACK PDU. */
+static int epmap_decode_bind_ack(epmap_t *epmap)
+{
+   return epmap_decode_ack(epmap, RPC_PTYPE_BIND_ACK, EPMAP_CONTEXT_ID);
+}
+
 /* Decode the BIND NAK PDU. */
 static int epmap_decode_bind_nak(epmap_t *epmap)
 {
@@ -1107,49 +2016,21 @@ static int epmap_decode_bind_nak(epmap_t *epmap)
 }
 
 
-/*****************
-int epmap_decode_alter_context(epmap_t *epmap)
+/* Decode the ALTER CONTEXT RESP PDU, p_cont_id is the proposed context. */
+static int epmap_decode_alter_context(epmap_t *epmap, p_context_id_t p_cont_id)
 {
-   buffer_t *buffer = &epmap->buffer[1];
-   buffer_rewind(epmap);
-   return 0;
+   return epmap_decode_ack(epmap, RPC_PTYPE_ALTER_CTX_RESP, p_cont_id);
 }
-**********************/
 
 
-/* Send a BIND request to the server.  */
-EPMAPAPI int epmap_bind(epmap_t **epmap, const char *server, uint16_t port)
+/* Encode the BIND PDU into the send buffer, advertising epmap->frag_size
+ * as both the max_xmit_frag and max_recv_frag. 
+ */
+static int epmap_encode_bind_request(epmap_t *epmap)
 {
    rpcconn_bind_hdr_t bind;
-   p_cont_elem_t *p_cont_elem = NULL;
-   uuid_t *uuid = NULL; 
-   p_syntax_id_t *syntax = NULL;
-   int ptype;
-   int result;
-   int n;
-
-   if (server == NULL || strlen(server) == 0)
-       return EPMAP_EINVAL; 
- 
-   /* Initialize the EPMAP object. */
-   *epmap = epmap_init(8192, 8192);
-   if (*epmap == NULL)
-       return EPMAP_ENOMEM;     
-
-    (*epmap)->server = server;
-    (*epmap)->port   = port;
-
-   /* Connect to server. */
-   result = epmap_connect(*epmap, (*epmap)->server, (*epmap)->port);   
-   if (result != EPMAP_EOK) {
-       /* Contains winsock error. */
-       /////result |= (WSAGetLastError() << 12); /* Winsock error. */
-
-       epmap_destroy(*epmap);  
-       return result;
-   }
-
-  
+   p_cont_elem_t p_cont_elem[2];
+   p_syntax_id_t syntax[2];
    
    /* Populate the bind request. */
    bind.rpc_vers = 5;
@@ -1165,132 +2046,145 @@ EPMAPAPI int epmap_bind(epmap_t **epmap, const char *server, uint16_t port)
    
    bind.frag_length = 0; /* Must be 116, but we set it within the encoding function. */
    bind.auth_length = 0;
-   (*epmap)->call_id = bind.call_id = 1;
+   epmap->call_id = bind.call_id = 1;
 
-   bind.max_xmit_frag = 5840;
-   bind.max_recv_frag = 5840;
+   bind.max_xmit_frag = epmap->frag_size;
+   bind.max_recv_frag = epmap->frag_size;
    bind.assoc_group_id = 0;
 
    /* Presentation context list. */  
-
-   n = bind.p_context_elem.n_context_elem = 2;
+   bind.p_context_elem.n_context_elem = 2;
    bind.p_context_elem.reserved = 0;
    bind.p_context_elem.reserved2 = 0;
-
-   bind.p_context_elem.p_cont_elem = malloc(sizeof(p_cont_elem_t) * n);
-   if (bind.p_context_elem.p_cont_elem == NULL) {
-       epmap_destroy(*epmap);
-       return EPMAP_ENOMEM;
-   }
+   bind.p_context_elem.p_cont_elem = p_cont_elem;
 
    /**** Element in the presentation context list, item #1 ****/
-   p_cont_elem = &bind.p_context_elem.p_cont_elem[0];
-
-   p_cont_elem->p_cont_id = 0x0000;
-   p_cont_elem->n_transfer_syn = 1;
-   p_cont_elem->reserved = 0;
+   p_cont_elem[0].p_cont_id = 0x0000;
+   p_cont_elem[0].n_transfer_syn = 1;
+   p_cont_elem[0].reserved = 0;
 
    /* Abstract Syntax: EPMv4 v3.0. */
    /* It will be encoded into memory as:              */
    /* 08 83 af e1 1f 5d c9 11 91 A4 08 00 2b 14 a0 fa */                               
-   uuid = &p_cont_elem->abstract_syntax.if_uuid;
-   epmap_string_to_uuid(uuid, "e1af8308-5d1f-11c9-91a4-08002b14a0fa");
-   p_cont_elem->abstract_syntax.if_version = 3;                        
-
-   p_cont_elem->transfer_syntaxes = malloc(sizeof(p_syntax_id_t) * 1);
-   if (p_cont_elem->transfer_syntaxes == NULL) {
-       epmap_destroy(*epmap); 
-       free(bind.p_context_elem.p_cont_elem);
-       return EPMAP_ENOMEM;  
-   }
-
-   syntax = &p_cont_elem->transfer_syntaxes[0];
+   epmap_string_to_uuid(&p_cont_elem[0].abstract_syntax.if_uuid, "e1af8308-5d1f-11c9-91a4-08002b14a0fa");
+   p_cont_elem[0].abstract_syntax.if_version = 3;                        
+   p_cont_elem[0].transfer_syntaxes = &syntax[0];
 
    /* Transfer Syntax: 32-bit NDR v2.0 */
    /* Reference: pubs.opengroup.org/onlinepubs/9629399/apdxi.htm  */
-   uuid = &syntax->if_uuid;
-   epmap_string_to_uuid(uuid, "8a885d04-1ceb-11c9-9fe8-08002b104860");
-   syntax->if_version = 2;
+   epmap_string_to_uuid(&syntax[0].if_uuid, "8a885d04-1ceb-11c9-9fe8-08002b104860");
+   syntax[0].if_version = 2;
 
    /**** Element in the presentation context list, item #2 ****/
-   p_cont_elem = &bind.p_context_elem.p_cont_elem[1];
-
-   p_cont_elem->p_cont_id = 0x0001;
-   p_cont_elem->n_transfer_syn = 1;
-   p_cont_elem->reserved = 0;
+   p_cont_elem[1].p_cont_id = 0x0001;
+   p_cont_elem[1].n_transfer_syn = 1;
+   p_cont_elem[1].reserved = 0;
 
    /* Abstract Syntax: EPMv4 v3.0. */
-   uuid = &p_cont_elem->abstract_syntax.if_uuid;
-   epmap_string_to_uuid(uuid, "e1af8308-5d1f-11c9-91a4-08002b14a0fa");
-   p_cont_elem->abstract_syntax.if_version = 3;                        
-    
-   p_cont_elem->transfer_syntaxes = malloc(sizeof(p_syntax_id_t) * 1);
-   if (p_cont_elem == NULL) {
-       epmap_destroy(*epmap); 
-       free(bind.p_context_elem.p_cont_elem[0].transfer_syntaxes);
-       free(bind.p_context_elem.p_cont_elem);
-       return EPMAP_ENOMEM;
-   }
-
-   syntax = &p_cont_elem->transfer_syntaxes[0];
+   epmap_string_to_uuid(&p_cont_elem[1].abstract_syntax.if_uuid, "e1af8308-5d1f-11c9-91a4-08002b14a0fa");
+   p_cont_elem[1].abstract_syntax.if_version = 3;                        
+   p_cont_elem[1].transfer_syntaxes = &syntax[1];
 
    /* Transfer Syntax: Bind time feature negotiation v1. */
-   uuid = &syntax->if_uuid;
-   epmap_string_to_uuid(uuid, "6cb71c2c-9812-4540-0300-000000000000");  
-   syntax->if_version = 1;
+   epmap_string_to_uuid(&syntax[1].if_uuid, "6cb71c2c-9812-4540-0300-000000000000");  
+   syntax[1].if_version = 1;
 
-    /* Encode the bind request. */
-   epmap_encode_bind(*epmap, &bind);
+   if (epmap_encode_bind(epmap, &bind) == 0)
+       return EPMAP_EINVAL;
 
-   free(bind.p_context_elem.p_cont_elem[0].transfer_syntaxes);
-   free(bind.p_context_elem.p_cont_elem[1].transfer_syntaxes);
-   free(bind.p_context_elem.p_cont_elem);
- 
-   /* Send the bind request. */   
-   result = epmap_send(*epmap);
-   if (result != EPMAP_EOK) {
-       result |= (WSAGetLastError() << 12); 
-       epmap_destroy(*epmap); 
-       return result;
-   }
+   return EPMAP_EOK;
+}
 
-   result = epmap_recv(*epmap);
-   if (result != EPMAP_EOK) {
-       result != (WSAGetLastError() << 12);
-       epmap_destroy(*epmap);
-       return result;
-   }
+/* Decode the answer to the BIND request. */
+static int epmap_bind_result(epmap_t *epmap)
+{
+   int ptype;
+   int result;
 
    /* Retrieve the ptype field. */
-   buffer_seek(*epmap, 1, 2, SEEK_SET); 
-   ptype = ndr_rle8(*epmap); 
+   buffer_seek(epmap, 1, 2, SEEK_SET); 
+   ptype = ndr_rle8(epmap); 
 
    switch(ptype) {
        case RPC_PTYPE_BIND_ACK:
-           result = epmap_decode_bind_ack(*epmap);
-           if (result != EPMAP_EOK)
-               epmap_destroy(*epmap);
+           result = epmap_decode_bind_ack(epmap);
            break; 
        case RPC_PTYPE_BIND_NAK:
-           result = epmap_decode_bind_nak(*epmap); 
+           result = epmap_decode_bind_nak(epmap); 
            /* Return the reason. */
-           result = ((((*epmap)->reason) << 12) & 0xfff) | EPMAP_ENAK; 
-           epmap_destroy(*epmap);
+           result = (epmap->reason << 12) | EPMAP_ENAK; 
            break;   
        default:
            /* Not a valid RPC PDU, wrong protocol? */ 
            result = EPMAP_EPROTO;
-           epmap_destroy(*epmap);
            break; 
    }
 
+   return result;
+}
+
+/* Send a BIND request to the server, advertising frag_size as both the
+ * max_xmit_frag and max_recv_frag. Larger fragments let ept_lookup return
+ * more entries per call, see epmap_decode_ack(). On failure, the session
+ * is destroyed and *epmap set to NULL.
+ */
+EPMAPAPI int epmap_bind_ex(epmap_t **epmap, const char *server, uint16_t port, uint16_t frag_size)
+{
+   int result;
+
+   if (epmap == NULL)
+       return EPMAP_EINVAL;
+
+   *epmap = NULL;
+
+   if (server == NULL || strlen(server) == 0 || frag_size < EPMAP_MIN_FRAG_SIZE)
+       return EPMAP_EINVAL; 
+ 
+   /* Initialize the EPMAP object. */
+   *epmap = epmap_init(EPMAP_SND_BUFSIZE, EPMAP_RCV_BUFSIZE);
+   if (*epmap == NULL)
+       return EPMAP_ENOMEM;
+
+   (*epmap)->frag_size = frag_size;     
+
+   /* Connect to server. */
+   result = epmap_connect(*epmap, server, port);   
+   if (result == EPMAP_EOK)
+       result = epmap_encode_bind_request(*epmap);
+
+   /* Send the bind request. */   
+   if (result == EPMAP_EOK) {
+       result = epmap_send(*epmap);
+       if (result != EPMAP_EOK) 
+           result |= (WSAGetLastError() << 12); 
+   }
+
+   if (result == EPMAP_EOK) {
+       result = epmap_recv(*epmap);
+       if (result != EPMAP_EOK) 
+           result |= (WSAGetLastError() << 12);
+   }
+
+   if (result == EPMAP_EOK)
+       result = epmap_bind_result(*epmap);
+
+   if (result != EPMAP_EOK) {
+       epmap_destroy(*epmap);
+       *epmap = NULL;
+   }
+
    return result;    
 }
 
-static int epmap_encode_request(epmap_t *epmap, const rpcconn_request_hdr_t *request, const ept_lookup_t *ept_lookup)
+/* Send a BIND request to the server, with the default fragment size. */
+EPMAPAPI int epmap_bind(epmap_t **epmap, const char *server, uint16_t port)
+{
+   return epmap_bind_ex(epmap, server, port, EPMAP_FRAG_SIZE);
+}
+
+/* Encode the REQUEST PDU header, the stub data follows. */
+static void epmap_encode_request_hdr(epmap_t *epmap, const rpcconn_request_hdr_t *request)
 {
-   size_t length;
-   buffer_t *buffer = &epmap->buffer[0];
    int i;
 
    buffer_seek(epmap, 0, 0, SEEK_SET); /* buffer_rewind(epmap) */
@@ -1310,87 +2204,66 @@ static int epmap_encode_request(epmap_t *epmap, const rpcconn_request_hdr_t *req
    ndr_wle32(epmap, request->alloc_hint);
    ndr_wle16(epmap, request->p_cont_id);
    ndr_wle16(epmap, request->opnum);
+}
 
-   /* Stub data, aligned to an 8-octet boundary. */
-   /* PortQry always generates 76 bytes. */
+/* Patch the fragment length and allocation hint once the stub is encoded. */
+static int epmap_encode_request_end(epmap_t *epmap)
+{
+   buffer_t *buffer = &epmap->buffer[0];
 
-   ndr_wle32(epmap, ept_lookup->inquiry_type);  /* rpc_c_ep_all_elts */
+   buffer->length = buffer_tell(epmap);
 
-   ndr_wle32(epmap, ept_lookup->object_referent_id); 
-   ndr_encode_uuid(epmap, &ept_lookup->object_uuid); 
+   if (buffer->eof)
+       return 0;
 
-   ndr_wle32(epmap, ept_lookup->interface_referent_id); 
-   ndr_encode_uuid(epmap, &ept_lookup->interface_uuid); 
+   buffer->offset = 8;  
+   ndr_wle16(epmap, buffer->length); 
 
-   ndr_wle16(epmap, ept_lookup->version_major);
-   ndr_wle16(epmap, ept_lookup->version_minor);
-   
-   ndr_wle32(epmap, 0); /* Version Option, or Attributes. */
+   /* The allocation hint is the size of the stub data. */
+   buffer->offset = 16;
+   ndr_wle32(epmap, buffer->length - 24);
 
-    /* UUID Handle */
+   return buffer->length;
+}
 
-   ndr_wle32(epmap, epmap->handle.attributes); /* Something preceding the UUID. */
-   
-   ndr_encode_uuid(epmap, &epmap->handle.uuid);
-  
-   /* Max entries */
-   ndr_wle32(epmap, 1);
-   
-   /* Encode the correct length. */
+static int epmap_encode_request(epmap_t *epmap, const rpcconn_request_hdr_t *request, const ept_lookup_t *ept_lookup)
+{
+   epmap_encode_request_hdr(epmap, request);
 
-   buffer->length = buffer_tell(epmap);
+   /* Stub data, aligned to an 8-octet boundary. */
+   /* PortQry always generates 76 bytes, filling the unused object and
+    * interface with garbage. Both are [ptr] parameters, so we send NULL
+    * pointers (a zero referent ID, no pointee) unless the inquiry type
+    * needs them: an unfiltered lookup only takes 40 bytes. 
+    */
 
-   if (buffer->eof)
-       return 0;
+   ndr_wle32(epmap, ept_lookup->inquiry_type);
 
-   buffer->offset = 8;  
-   ndr_wle16(epmap, buffer->length); 
+   /* Object, uuid_p_t. */
+   ndr_wle32(epmap, ept_lookup->object_referent_id); 
+   if (ept_lookup->object_referent_id != 0)
+       ndr_encode_uuid(epmap, &ept_lookup->object_uuid); 
 
-   return buffer->length;
-}
+   /* Interface, rpc_if_id_p_t: UUID and major/minor version. */
+   ndr_wle32(epmap, ept_lookup->interface_referent_id); 
+   if (ept_lookup->interface_referent_id != 0) {
+       ndr_encode_uuid(epmap, &ept_lookup->interface_uuid); 
+       ndr_wle16(epmap, ept_lookup->version_major);
+       ndr_wle16(epmap, ept_lookup->version_minor);
+   }
+   
+   ndr_wle32(epmap, ept_lookup->vers_option);
 
+   /* Entry handle, a context handle: attributes followed by the UUID. */
+   ndr_wle32(epmap, epmap->handle.attributes);
+   ndr_encode_uuid(epmap, &ept_lookup->handle);
+  
+   ndr_wle32(epmap, ept_lookup->max_entries);
+   
+   /* Encode the correct length. */
+   return epmap_encode_request_end(epmap);
+}
 
-typedef struct tower_entry {
-   unsigned int proto_id;
-   uint16_t tcp_port;
-   uint16_t udp_port;
-   uint32_t host_addr;
-   char named_pipe[128];
-   //////char netbios_name[16];
-} tower_entry_t;
-
-/* Protocol identifiers. */
-#define PROTO_ID_OSI_OID        0x00 /* OSI OID */
-#define PROTO_ID_DNA_SESSCTL    0x02 /* DNA Session Control */
-#define PROTO_ID_DNA_SESSCTL_V3 0x03 /* DNA Session Control V3 */
-#define PROTO_ID_DNA_NSP        0x04 /* DNA NSP Transport */
-#define PROTO_ID_OSI_TP4        0x05 /* OSI TP4 */
-#define PROTO_ID_OSI_CLNS       0x06 /* OSI CLNS or DNA Routing */  
-#define PROTO_ID_TCP            0x07 /* DOD TCP, 16-bit unsigned, big-endian */
-#define PROTO_ID_UDP            0x08 /* DOD UDP, 16-bit unsigned, big-endian */
-#define PROTO_ID_IP             0x09 /* DOD IP */
-#define PROTO_ID_RPC_CL         0x0a /* RPC Connectionless Protcol */
-#define PROTO_ID_RPC_CO         0x0b /* RPC Connection-Oriented Protocol */    
-#define PROTO_ID_SPX            0x0c /* Netware SPX ??? */
-#define PROTO_ID_UUID           0x0d /* UUID */
-#define PROTO_ID_IPX            0x0e /* Netware IPX ???  */
-#define PROTO_ID_NAMED_PIPES    0x0f /* Microsoft Named Pipes */
-#define PROTO_ID_NAMED_PIPES_2  0x10 /* Microsoft Named Pipes (SMB?) */   
-#define PROTO_ID_NETBIOS        0x11 /* Microsoft NetBIOS */
-#define PROTO_ID_NETBEUI        0x12 /* Microsoft NetBEUI */ 
-#define PROTO_ID_NETWARE_SPX    0x13 /* Netware SPX transport-layer protocol */
-#define PROTO_ID_NETWARE_IPX    0x14 /* Netware IPX transport-layer protocol */
-#define PROTO_ID_ATALK_STREAM   0x16 /* Appletalk Stream */
-#define PROTO_ID_ATALK_DATAGRAM 0x17 /* Appletalk Datagram */
-#define PROTO_ID_ATALK          0x18 /* Appletalk */ 
-#define PROTO_ID_NETBIOS_2      0x19 /* NetBIOS, CL over all protocols */
-#define PROTO_ID_VINES_SPP      0x1a /* Vines SPP */
-#define PROTO_ID_VINES_IPC      0x1b /* Vines IPC */
-#define PROTO_ID_STREETTALK     0x1c /* StreetTalk name */
-#define PROTO_ID_HTTP           0x1f /* RPC over HTTP */         
-#define PROTO_ID_UNIX_DOMAIN    0x20 /* Unix Domain socket */
-#define PROTO_ID_NULL           0x21 /* NULL */
-#define PROTO_ID_NETBIOS_3      0x22 /* NetBIOS */
 
 /* Reference: pubs.opengroup.org/onlinepubs/9629399/apdxb.htm */
 struct proto_sequence {
@@ -1417,24 +2290,233 @@ static const char *proto_sequence_string(int proto_id)
    return str;           
 }
 
-static int epmap_decode_response(epmap_t *epmap, tower_entry_t *tower, uuid_t *uuid, char *annot)
+/* Is the transport floor acceptable to the predicate? port is zero for 
+ * named pipes. 
+ */
+static int predicate_transport(const epmap_predicate_t *pred, unsigned int proto_id, uint16_t port)
+{
+   if (pred->protseqs != 0 && !(pred->protseqs & (1u << proto_id)))
+       return 0;
+
+   if (pred->port_hi != 0 && (port < pred->port_lo || port > pred->port_hi))
+       return 0;
+
+   return 1;
+}
+
+/* Decode a protocol tower, length bytes at the current offset. With a 
+ * predicate, the decoding stops at the first floor it rejects: *skip is set
+ * and the rest of the tower skipped, strings included.
+ */
+static int epmap_decode_tower(epmap_t *epmap, const epmap_predicate_t *pred, 
+                              tower_entry_t *tower, size_t length, int *skip)
 {
-   rpcconn_response_hdr_t response;
-   ept_lookup_t ept_lookup; 
    buffer_t *buffer = &epmap->buffer[1];
-   uuid_t object_uuid;
-   int annot_offset;
-   int annot_len;
+   size_t end = buffer->offset + length;
    unsigned int proto_id;
-   uint8_t *ptr = NULL;
    int floor_count;
    int lhslen, rhslen;
-   int i, j;
+   int j;
    unsigned long x;
+
+   *skip = 0;
+   if (end > buffer->length)
+       return EPMAP_EPROTO;
+
+   /* Floor count */
+   /* The LHS of the floor contains protocol identifier information.     */
+   /* The RHS of the floor contains related or addressing information.   */
+   /* The content of floor 4 and 5 are protoseq-specific. The layout is: */
+   /* Floor 1 - RPC interface identifier                                 */ 
+   /* Floor 2 - RPC Data representation identifier                       */
+   /* Floor 3 - RPC protocol identifier                                  */
+   /* Floor 4 - Port address (for ncacn_ip_tcp and ncadg_ip_udp)         */
+   /* Floor 5 - Host address (for ncacn_ip_tcp and ncadg_ip_udp)         */
+
+   /* Floors */
+   floor_count = ndr_rle16(epmap);
+
+   memset(&tower->if_id, '\0', sizeof(tower->if_id));
+   tower->service = NULL;
+   tower->proto_id = 0; 
+   tower->tcp_port = 0;
+   tower->udp_port = 0;
+   tower->host_addr = 0;
+   tower->pipe_id = 0;
+
+   for (j = 0; j < floor_count; j++) {
+
+       lhslen = ndr_rle16(epmap);
+       proto_id = ndr_rle8(epmap); 
+
+       switch(proto_id) {
+           case PROTO_ID_TCP:    /* 0x07 */
+               buffer->offset += lhslen - 1;
+               rhslen = ndr_rle16(epmap);
+               x = ndr_rle16(epmap);
+               tower->tcp_port = ((x >> 8) & 0xff) | ((x << 8) & 0xff00);
+               tower->proto_id = proto_id;
+               if (pred != NULL && !predicate_transport(pred, proto_id, tower->tcp_port))
+                   *skip = 1;
+               break;
+
+           case PROTO_ID_UDP:    /* 0x08 */ 
+               buffer->offset += lhslen - 1;
+               rhslen = ndr_rle16(epmap);
+               x = ndr_rle16(epmap);
+               tower->udp_port = ((x >> 8) & 0xff) | ((x << 8) & 0xff00);
+               tower->proto_id = proto_id;
+               if (pred != NULL && !predicate_transport(pred, proto_id, tower->udp_port))
+                   *skip = 1;
+               break; 
+
+           case PROTO_ID_IP:     /* 0x09 */
+               buffer->offset += lhslen - 1; 
+               rhslen = ndr_rle16(epmap);
+               tower->host_addr = ndr_rle32(epmap);  
+               break;   
+
+           case PROTO_ID_RPC_CL: /* 0x0a */
+               buffer->offset += lhslen - 1;
+               rhslen = ndr_rle16(epmap);
+               buffer->offset += rhslen;
+               break;
+
+           case PROTO_ID_RPC_CO: /* RPC connection-oriented protocol */
+               /* LHS Length: 1 */
+               buffer->offset += lhslen - 1; 
+               /* RHS Length: 2, usually 0x0000. */
+               rhslen = ndr_rle16(epmap);
+               buffer->offset += rhslen;
+               break; 
+
+           case PROTO_ID_SPX: /* SPX ??? */
+               /* LHS Length: 1 */
+               buffer->offset += lhslen - 1;
+               /* RHS Length: 2, usually 0x0000. */ 
+               rhslen = ndr_rle16(epmap);
+               buffer->offset += rhslen;
+               break;
+          
+           case PROTO_ID_UUID: /* 0x0d */  
+               if (j == 0) {
+                   ndr_decode_uuid(epmap, &tower->if_id.uuid);
+                   if (pred != NULL && pred->uuids != NULL && 
+                       !epmap_watchlist_match(pred->uuids, &tower->if_id.uuid)) {
+                       *skip = 1;
+                       break;
+                   }
+                   tower->service = epmap_uuid_name(&tower->if_id.uuid);
+                   /* Major version in the LHS, minor version in the RHS. */
+                   tower->if_id.vers_major = ndr_rle16(epmap);
+                   rhslen = ndr_rle16(epmap);
+                   if (rhslen == 2) 
+                       tower->if_id.vers_minor = ndr_rle16(epmap);
+                   else
+                       buffer->offset += rhslen;
+                   break;
+               }
+               buffer->offset += 16; 
+               /* Version */
+               ndr_rle16(epmap);
+               rhslen = ndr_rle16(epmap);
+               buffer->offset += rhslen;                   
+               break;
+
+           case PROTO_ID_NAMED_PIPES: /* 0x0f */
+               /* LHS Length: 1 */
+               buffer->offset += lhslen - 1;
+               /* nul-terminated string */
+               rhslen = ndr_rle16(epmap);
+               if (buffer->offset + rhslen > end)
+                   return EPMAP_EPROTO;
+               tower->proto_id = proto_id;
+               if (pred != NULL && !predicate_transport(pred, proto_id, 0)) {
+                   *skip = 1;
+                   break;
+               }
+               if (epmap_intern((const char *)buffer->data + buffer->offset, 
+                   rhslen, &tower->pipe_id) != EPMAP_EOK)
+                   return EPMAP_ENOMEM;
+               buffer->offset += rhslen; 
+               break;  
+
+           case PROTO_ID_NAMED_PIPES_2: /* 0x10 */ 
+               /* Don't print these, they never have annotations. */
+               /* LHS Length: 1 */
+               buffer->offset += lhslen - 1;
+               /* nul-terminated string  */ 
+               rhslen = ndr_rle16(epmap);
+               if (buffer->offset + rhslen > end)
+                   return EPMAP_EPROTO;
+               tower->proto_id = proto_id;
+               if (pred != NULL && !predicate_transport(pred, proto_id, 0)) {
+                   *skip = 1;
+                   break;
+               }
+               if (epmap_intern((const char *)buffer->data + buffer->offset, 
+                   rhslen, &tower->pipe_id) != EPMAP_EOK)
+                   return EPMAP_ENOMEM;
+               buffer->offset += rhslen;
+               break;
+
+           case 0x11: /* NETBIOS */
+               /* LHS Length: 1 */
+               buffer->offset += lhslen - 1;
+               /* nul-terminated string */
+               rhslen = ndr_rle16(epmap);
+               buffer->offset += rhslen;
+               break;
+
+           default: /* Unknown Protocol ??? */
+               buffer->offset += lhslen - 1;
+               rhslen = ndr_rle16(epmap);
+               buffer->offset += rhslen;    
+               break;    
+
+       } /* switch() */
+
+       if (buffer->eof || buffer->offset > end)
+           return EPMAP_EPROTO;
+
+       if (*skip) 
+           break;
+   } /* for() loop */
+
+   /* Towers without a transport floor we know of. */
+   if (pred != NULL && tower->proto_id == 0 && (pred->protseqs != 0 || pred->port_hi != 0))
+       *skip = 1;
+
+   buffer->offset = end;
+
+   return EPMAP_EOK;
+}
+
+/* Decode the ept_lookup response into entries, max_entries being the number
+ * of entries we asked for. Returns the status of the call, zero or
+ * 0x16c9a0d6 (no more entries), or EPMAP_EPROTO for a malformed response.
+ */
+static int epmap_decode_response(epmap_t *epmap, ept_entry_t *entries, size_t max_entries, size_t *count)
+{
+   rpcconn_response_hdr_t response;
+   buffer_t *buffer = &epmap->buffer[1];
+   const epmap_predicate_t *pred = epmap->filtered ? &epmap->predicate : NULL;
+   ept_entry_t *entry = NULL;
+   uint8_t towers[EPT_MAX_ENTRIES];
+   uint32_t annots[EPT_MAX_ENTRIES];   /* Annotation offset and length. */
+   uint8_t annot_lens[EPT_MAX_ENTRIES];
+   uint32_t kept;
+   int skip;
+   uint32_t num;
+   uint32_t max_count, offset, actual_count;
+   uint32_t annot_len;
+   uint32_t tower_len;
+   uint32_t status;
+   uint32_t i;
+   int result;
    
    buffer->offset = 0;
-   memset(annot, '\0', EPT_MAX_ANNOTATION_SIZE);
-   ptr = (uint8_t *)buffer->data + buffer->offset;
+   *count = 0;
    
    response.rpc_vers = ndr_rle8(epmap);
    response.rpc_vers_minor = ndr_rle8(epmap);
@@ -1468,36 +2550,39 @@ static int epmap_decode_response(epmap_t *epmap, tower_entry_t *tower, uuid_t *u
    else /* We already have an handle. */
        buffer->offset += 16;
 
-   /* Num entries entry_count. This is either 1 or 0. */
-   int num = ndr_rle32(epmap);
+   /* Num entries entry_count, at most max_ents. */
+   num = ndr_rle32(epmap);
 
-   /* Max count. */
-   ndr_rle32(epmap);
-   /* Offset. */
-   ndr_rle32(epmap);
-   /* Actual count. */
-   ndr_rle32(epmap);   
+   /* Conformant varying array: max count, offset and actual count. */
+   max_count = ndr_rle32(epmap);
+   offset = ndr_rle32(epmap);
+   actual_count = ndr_rle32(epmap);   
 
-   for (i = 0; i < num; i++) {
-
-       ndr_decode_uuid(epmap, &object_uuid);
-
-       ////if (uuid_compare(&epmap->handle.uuid, &object_uuid) != 0)
-       /////    printf("Error \n");
+   if (num > max_entries || offset != 0 || actual_count != num || max_count < num)
+       return EPMAP_EPROTO;
 
+   /* The entries come first, the towers they point to are deferred after 
+    * the array. Annotations are only interned once the tower is accepted.
+    */
+   for (i = 0; i < num; i++) {
+       entry = &entries[i];
 
+       ndr_decode_uuid(epmap, &entry->object);
 
-       /* Referent ID */
-       ndr_rle32(epmap);  
+       /* Referent ID of the tower, zero for a NULL pointer. */
+       towers[i] = ndr_rle32(epmap) != 0;  
     
-       /* Annotation */
-       annot_offset = ndr_rle32(epmap);  
+       /* Annotation, a varying string: offset and actual count. */
+       ndr_rle32(epmap);  
        annot_len = ndr_rle32(epmap); 
-    
-       /* Copy into annotation */   
-       if (annot_len <= EPT_MAX_ANNOTATION_SIZE) {   
-           memcpy(annot, ptr + buffer->offset, annot_len);
-       }
+       if (annot_len > EPT_MAX_ANNOTATION_SIZE || buffer->offset + annot_len > buffer->length)
+           return EPMAP_EPROTO;
+
+       annots[i] = (uint32_t)buffer->offset;
+       annot_lens[i] = (uint8_t)annot_len;
+       if (pred != NULL && pred->prefix != NULL && (annot_len < pred->prefix_len || 
+           memcmp((uint8_t *)buffer->data + buffer->offset, pred->prefix, pred->prefix_len) != 0))
+           towers[i] |= 2;
 
        /* Skip the annotation. */
        buffer->offset += annot_len;
@@ -1505,130 +2590,56 @@ static int epmap_decode_response(epmap_t *epmap, tower_entry_t *tower, uuid_t *u
        /* Restore alignment. */   
        while ((buffer->offset % 4) != 0) 
            buffer->offset++;
+   }
 
-       /* Tower length. Skip. */
-       buffer->offset += 8;   
-
-       /* Floor count */
-       /* The LHS of the floor contains protocol identifier information.     */
-       /* The RHS of the floor contains related or addressing information.   */
-       /* The content of floor 4 and 5 are protoseq-specific. The layout is: */
-       /* Floor 1 - RPC interface identifier                                 */ 
-       /* Floor 2 - RPC Data representation identifier                       */
-       /* Floor 3 - RPC protocol identifier                                  */
-       /* Floor 4 - Port address (for ncacn_ip_tcp and ncadg_ip_udp)         */
-       /* Floor 5 - Host address (for ncacn_ip_tcp and ncadg_ip_udp)         */
-
-       /* Floors */
-       floor_count = ndr_rle16(epmap);
-
-       tower->proto_id = 0; 
-       tower->tcp_port = 0;
-       tower->udp_port = 0;
-       tower->host_addr = 0;
-       memset(tower->named_pipe, '\0', sizeof(tower->named_pipe));
-
-       for (j = 0; j < floor_count; j++) {
-
-           lhslen = ndr_rle16(epmap);
-           proto_id = ndr_rle8(epmap); 
-
-           switch(proto_id) {
-               case PROTO_ID_TCP:    /* 0x07 */
-                   buffer->offset += lhslen - 1;
-                   rhslen = ndr_rle16(epmap);
-                   x = ndr_rle16(epmap);
-                   tower->tcp_port = ((x >> 8) & 0xff) | ((x << 8) & 0xff00);
-                   break;
-
-               case PROTO_ID_UDP:    /* 0x08 */ 
-                   buffer->offset += lhslen - 1;
-                   rhslen = ndr_rle16(epmap);
-                   x = ndr_rle16(epmap);
-                   tower->udp_port = ((x >> 8) & 0xff) | ((x << 8) & 0xff00);
-                   break; 
-
-               case PROTO_ID_IP:     /* 0x09 */
-                   buffer->offset += lhslen - 1; 
-                   rhslen = ndr_rle16(epmap);
-                   tower->host_addr = ndr_rle32(epmap);  
-                   break;   
-
-               case PROTO_ID_RPC_CL: /* 0x0a */
-                   buffer->offset += lhslen - 1;
-                   rhslen = ndr_rle16(epmap);
-                   buffer->offset += rhslen;
-                   break;
-
-               case PROTO_ID_RPC_CO: /* RPC connection-oriented protocol */
-                   /* LHS Length: 1 */
-                   buffer->offset += lhslen - 1; 
-                   /* RHS Length: 2, usually 0x0000. */
-                   rhslen = ndr_rle16(epmap);
-                   buffer->offset += rhslen;
-                   break; 
-
-               case PROTO_ID_SPX: /* SPX ??? */
-                   /* LHS Length: 1 */
-                   buffer->offset += lhslen - 1;
-                   /* RHS Length: 2, usually 0x0000. */ 
-                   rhslen = ndr_rle16(epmap);
-                   buffer->offset += rhslen;
-                   break;
-              
-               case PROTO_ID_UUID: /* 0x0d */  
-                   if (j == 0)
-                       ndr_decode_uuid(epmap, uuid);
-                   else
-                       buffer->offset += 16; 
-                   /* Version */
-                   ndr_rle16(epmap);
-                   rhslen = ndr_rle16(epmap);
-                   buffer->offset += rhslen;                   
-                   break;
-    
-               case PROTO_ID_NAMED_PIPES: /* 0x0f */
-                   /* LHS Length: 1 */
-                   buffer->offset += lhslen - 1;
-                   /* nul-terminated string */
-                   rhslen = ndr_rle16(epmap);
-                   tower->proto_id = proto_id;
-                   memcpy(tower->named_pipe, (uint8_t *)buffer->data + buffer->offset, rhslen);
-                   buffer->offset += rhslen; 
-                   break;  
-
-               case PROTO_ID_NAMED_PIPES_2: /* 0x10 */ 
-                   /* Don't print these, they never have annotations. */
-                   /* LHS Length: 1 */
-                   buffer->offset += lhslen - 1;
-                   /* nul-terminated string  */ 
-                   rhslen = ndr_rle16(epmap);
-                   memcpy(tower->named_pipe, (uint8_t *)buffer->data + buffer->offset, rhslen);
-                   buffer->offset += rhslen;
-                   break;
+   /* Accepted entries are moved down over the rejected ones. */
+   for (i = 0, kept = 0; i < num; i++) {
+       entry = &entries[kept];
+       skip = (towers[i] & 2) != 0;
+
+       if (towers[i] & 1) {
+           /* Tower length, as the conformance then as the first member. */
+           ndr_rle32(epmap);
+           tower_len = ndr_rle32(epmap);
+
+           if (skip) {
+               buffer->offset += tower_len;
+           } else {
+               result = epmap_decode_tower(epmap, pred, &entry->tower, tower_len, &skip);
+               if (result != EPMAP_EOK)
+                   return result;
+           }
 
-               case 0x11: /* NETBIOS */
-                   /* LHS Length: 1 */
-                   buffer->offset += lhslen - 1;
-                   /* nul-terminated string */
-                   rhslen = ndr_rle16(epmap);
-                   buffer->offset += rhslen;
-                   break;
+           /* Restore 4-octet alignment. */
+           while ((buffer->offset % 4) != 0) 
+               buffer->offset++;
+       } else {
+           memset(&entry->tower, '\0', sizeof(entry->tower));
+           if (pred != NULL && (pred->protseqs != 0 || pred->port_hi != 0 || pred->uuids != NULL))
+               skip = 1;
+       }
 
-               default: /* Unknown Protocol ??? */
-                   buffer->offset += lhslen - 1;
-                   rhslen = ndr_rle16(epmap);
-                   buffer->offset += rhslen;    
-                   break;    
+       if (skip) {
+           epmap->n_skipped++;
+           continue;
+       }
 
-           } /* switch() */
-       } /* for() loop */
-   }  /* for() loop */
+       if (kept != i)
+           entry->object = entries[i].object;
 
+       result = epmap_intern((const char *)buffer->data + annots[i], 
+           annot_lens[i], &entry->annotation_id);
+       if (result != EPMAP_EOK)
+           return result;
 
-   /* Restore 4-octet alignment. */
-   while ((buffer->offset % 4) != 0) 
-           buffer->offset++;
+       entry->flags = 0;
+       if (epmap->watchlist != NULL && 
+           epmap_watchlist_match(epmap->watchlist, &entry->tower.if_id.uuid)) {
+           entry->flags |= EPMAP_ENTRY_WATCHED;
+           epmap->n_watched++;
+       }
+       kept++;
+   }
     
    /* The status code could be either zero or 0x16c9a0cd. 
     * 0x00000000: The method call returned at least one element that matched
@@ -1636,12 +2647,12 @@ static int epmap_decode_response(epmap_t *epmap, tower_entry_t *tower, uuid_t *u
     * 0x16c9a0d6: The are no elements that satisfy the specified search criteria.
     * This is normally returned when there are no more entries.  
     */
-  
-   /* $fixme */
+   epmap->status = status = ndr_rle32(epmap);
 
-   uint32_t status;
+   if (buffer->eof)
+       return EPMAP_EPROTO;
 
-   epmap->status = status = ndr_rle32(epmap);
+   *count = kept;
 
    return status; /* $fixme return EPMAP_EOK */
 }
@@ -1671,7 +2682,7 @@ static int epmap_decode_fault(epmap_t *epmap)
    fault.reserved = ndr_rle8(epmap);
 
    /* Status can be */
-   fault.status = ndr_rle32(epmap);
+   epmap->status = fault.status = ndr_rle32(epmap);
    /* 4 bytes of padding here? */
 
    return 0;
@@ -1714,7 +2725,7 @@ static int epmap_encode_shutdown(epmap_t *epmap, rpcconn_shutdown_hdr_t *shutdow
 } 
 
 /* Encode and send shutdown? */
-static int epmap_shutdown(epmap_t *epmap)
+EPMAPAPI int epmap_shutdown(epmap_t *epmap)
 {
    rpcconn_shutdown_hdr_t shutdown;
    int result;
@@ -1754,18 +2765,63 @@ static int epmap_shutdown(epmap_t *epmap)
 }
 
 
-/* epmap_request */
-static int epmap_request(epmap_t *epmap, tower_entry_t *tower, uuid_t *uuid, char *annot)
+/* Restrict the following ept_lookup calls to the entries matching the given
+ * object and/or interface, so that the endpoint mapper does the filtering.
+ * The inquiry type is one of RPC_C_EP_*, the version option one of
+ * RPC_C_VERS_* (only relevant when matching by interface). Changing the
+ * filter restarts the enumeration from the first entry.
+ */
+EPMAPAPI int epmap_set_filter(epmap_t *epmap, uint32_t inquiry_type,
+                              const uuid_t *object, const uuid_t *if_uuid,
+                              uint16_t vers_major, uint16_t vers_minor,
+                              uint32_t vers_option)
 {
-   rpcconn_request_hdr_t request;
-   ept_lookup_t ept_lookup;
-   uuid_t *p_uuid = NULL;
-   int ptype;
-   int result;
+   ept_lookup_t *lookup = NULL;
 
-   if (epmap == NULL || uuid == NULL)
+   if (epmap == NULL || inquiry_type > RPC_C_EP_MATCH_BY_BOTH)
        return EPMAP_EINVAL;
 
+   if ((inquiry_type & RPC_C_EP_MATCH_BY_OBJ) && object == NULL)
+       return EPMAP_EINVAL;
+
+   if ((inquiry_type & RPC_C_EP_MATCH_BY_IF) && if_uuid == NULL)
+       return EPMAP_EINVAL;
+
+   if (vers_option < RPC_C_VERS_ALL || vers_option > RPC_C_VERS_UPTO)
+       return EPMAP_EINVAL;
+
+   lookup = &epmap->lookup;
+   memset(lookup, '\0', sizeof(*lookup));
+   lookup->inquiry_type = inquiry_type;
+   lookup->vers_option = vers_option;
+
+   if (inquiry_type & RPC_C_EP_MATCH_BY_OBJ) {
+       lookup->object_referent_id = 1;
+       lookup->object_uuid = *object;
+   }
+
+   if (inquiry_type & RPC_C_EP_MATCH_BY_IF) {
+       lookup->interface_referent_id = 2;
+       lookup->interface_uuid = *if_uuid;
+       lookup->version_major = vers_major;
+       lookup->version_minor = vers_minor;
+   }
+
+   /* Start over with a NULL entry handle. */
+   memset(&epmap->handle, '\0', sizeof(epmap->handle));
+
+   return EPMAP_EOK;
+}
+
+/* Encode the ept_lookup REQUEST for the next batch of entries, at most
+ * max_entries and at most the batch size negotiated at bind time 
+ * (epmap->max_entries). Returns the number of entries asked for.
+ */
+static uint32_t epmap_encode_lookup(epmap_t *epmap, size_t max_entries)
+{
+   rpcconn_request_hdr_t request;
+   ept_lookup_t ept_lookup;
+
    /* Populate the request. */
    request.rpc_vers = 5;
    request.rpc_vers_minor = 0;
@@ -1783,65 +2839,55 @@ static int epmap_request(epmap_t *epmap, tower_entry_t *tower, uuid_t *uuid, cha
 
    request.call_id = ++(epmap->call_id);
 
-   request.alloc_hint = 156; /* This is usually ignored. */
+   request.alloc_hint = 0; /* Set within the encoding function. */
    request.p_cont_id = 0x0000;
    request.opnum = EPT_LOOKUP;
 
    /* PFC_OBJECT_UUID is not set, there is no optional object UID. */
    /* Stub data, 8-octet aligned. */
-   
-   ept_lookup.inquiry_type = RPC_C_EP_ALL_ELTS;
-
-   /* Object */
-   ept_lookup.object_referent_id = 1;    
-   /* UUID filled with garbage. */
-   p_uuid = &ept_lookup.object_uuid;
-   epmap_string_to_uuid(p_uuid, "cafebabe-cafe-babe-cafe-babecafebabe");
-   
-   /* Interface */
-   ept_lookup.interface_referent_id = 2;
-   /* UUID filled with garbage. */
-   p_uuid = &ept_lookup.interface_uuid;
-   epmap_string_to_uuid(p_uuid, "cafebabe-cafe-babe-cafe-babecafebabe");
 
-   ept_lookup.version_major = 0;
-   ept_lookup.version_minor = 0;
+   /* Inquiry type, object, interface and version option. */
+   ept_lookup = epmap->lookup;
 
    /* Entry handle. */
-   ept_lookup.vers_option = 0;
-
    epmap->handle.attributes = 0;
    ept_lookup.handle = epmap->handle.uuid;
-   ept_lookup.max_entries = 1; 
+   ept_lookup.max_entries = max_entries < epmap->max_entries ? (uint32_t)max_entries : epmap->max_entries; 
  
    int n = epmap_encode_request(epmap, &request, &ept_lookup);
    if (n == 0) {
      //////  $fixme
    }
 
+   return ept_lookup.max_entries;
+}
 
-   result = epmap_send(epmap);
-   if (result != EPMAP_EOK) {
-       result |= (WSAGetLastError() << 12);  
-       return result;     
-   } 
+/* Decode the answer to ept_lookup. count is set to the number of entries
+ * returned, which may be non-zero with EPMAP_ENODATA.
+ */
+static int epmap_lookup_result(epmap_t *epmap, ept_entry_t *entries, size_t max_entries, size_t *count)
+{
+   size_t skipped;
+   int ptype;
+   int result;
 
-   result = epmap_recv(epmap);
-   if (result != EPMAP_EOK) {
-       result |= (WSAGetLastError() << 12); 
-       return result;
-   }
+   *count = 0;
 
    buffer_seek(epmap, 1, 2, SEEK_SET);
    ptype = ndr_rle8(epmap);
       
    switch(ptype) {
        case RPC_PTYPE_RESPONSE:
-           result = epmap_decode_response(epmap, tower, uuid, annot);
+           skipped = epmap->n_skipped;
+           result = epmap_decode_response(epmap, entries, max_entries, count);
            /* $fixme check epmap->status instead. */ 
            /* if result == EPMAP_EOK and epmap->status == ) $fixme */
-           if (result == 0x16c9a0d6) {
-               epmap_shutdown(epmap); 
+           /* An empty batch also ends the enumeration, or we would loop. */
+           if (result == 0x16c9a0d6 || 
+               (result == EPMAP_EOK && *count == 0 && epmap->n_skipped == skipped)) {
+               /* Keep the association for further calls, but the next
+                * lookup starts over with a NULL entry handle. */
+               memset(&epmap->handle, '\0', sizeof(epmap->handle));
                return EPMAP_ENODATA;
            }
            break; 
@@ -1861,180 +2907,6704 @@ static int epmap_request(epmap_t *epmap, tower_entry_t *tower, uuid_t *uuid, cha
    return result;
 }
 
-EPMAPAPI char *epmap_uuid_to_string(const uuid_t *uuid)
+/* Fetch the next batch of entries, at most max_entries and at most the
+ * batch size negotiated at bind time (epmap->max_entries). count is set to
+ * the number of entries returned, which may be non-zero with EPMAP_ENODATA.
+ */
+static int epmap_request(epmap_t *epmap, ept_entry_t *entries, size_t max_entries, size_t *count)
 {
-   static char str[100] = { 0 };
-
-   _snprintf(str, 100, "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-       uuid->time_low, uuid->time_mid, uuid->time_hi_and_version,
-       uuid->clock_seq_hi_and_reserved, uuid->clock_seq_low,
-       uuid->node[0], uuid->node[1], uuid->node[2], 
-       uuid->node[3], uuid->node[4], uuid->node[5]); 
-   
-   return str;   
-}
+   int result;
 
-/************************
-struct bind_rejection {
-   int check;    
-   const char *str;
-} rejection[7] = { 0 }; 
-*****************************/
+   if (epmap == NULL || entries == NULL || count == NULL || max_entries == 0)
+       return EPMAP_EINVAL;
 
-struct epmap_error {
-   uint32_t code;
-   const char *str;
-} list[] = { 
-   { EPMAP_EOK,      "Operation completed successfully" },
-   { EPMAP_ENOMEM,   "Insufficient memory to perform the requested operation" },
-   { EPMAP_EINVAL,   "An invalid argument was passed to a library function" }, 
-   { EPMAP_EBADPTR,  "The system attempted to perform an invalid memory access" }, 
-   { EPMAP_EWSAINIT, "The system could not initialize Windows Sockets" },
-   { EPMAP_EDNSFAIL, "Could not resolve host name" },
-   { EPMAP_ESOCKET,  "Could not connect to the endpoint mapper" },
-   { EPMAP_ESEND,    "An error has occurred while sending " },
-   { EPMAP_ERECV,    "An error has occurred while receiving " },
+   *count = 0;
+   max_entries = epmap_encode_lookup(epmap, max_entries);
 
-   { EPMAP_EACK,     "ACK received. " },
-   { EPMAP_ENAK,     "The endpoint mapper did not acknowledge the bind request" }, 
-   { EPMAP_EFAULT,   "The endpoint mapped rejected the call request" },
-   { EPMAP_EPROTO,   "Protocol error" },
-   { 0x402,          "??????????????????????" },
+   result = epmap_send(epmap);
+   if (result != EPMAP_EOK) {
+       result |= (WSAGetLastError() << 12);  
+       return result;     
+   } 
 
-   { EPMAP_ENODATA,  "The endpoint mapped completed. " },
-   { 0x407,          "?????????????????????????????????????????????" },
-   { 0x408,          "?????????????????????????????????????" },
+   result = epmap_recv(epmap);
+   if (result != EPMAP_EOK) {
+       result |= (WSAGetLastError() << 12); 
+       return result;
+   }
 
-   { 0xffffffff,      NULL }, 
-};
+   return epmap_lookup_result(epmap, entries, max_entries, count);
+}
 
-EPMAPAPI char *epmap_error(int result)
+/* Start a streaming enumeration of the endpoint map, with the filters set
+ * on the session. Entries are then returned one at a time by
+ * epmap_lookup_next(), or a batch at a time by epmap_lookup_batch(), each
+ * ept_lookup call being made when the previous batch has been consumed.
+ * The enumeration restarts from the first entry.
+ */
+EPMAPAPI int epmap_lookup_begin(epmap_t *epmap, epmap_lookup_t *lookup)
 {
-   static char buffer[256] = { 0 };
-   int i, n;
-   int offset = 0;
-   int status = result & 0xfff;
+   if (epmap == NULL || lookup == NULL)
+       return EPMAP_EINVAL;
 
-   for (i = 0; list[i].str != NULL; i++) {
-       if (list[i].code ==  status) { /* Mask extended errors, if any. */
-           n = i; 
-       } 
-   }
+   lookup->epmap = epmap;
+   lookup->max_entries = epmap->max_entries;
+   lookup->entries = malloc(lookup->max_entries * sizeof(ept_entry_t));
+   lookup->n_entries = 0;
+   lookup->next = 0;
+   lookup->result = EPMAP_EOK;
+   if (lookup->entries == NULL)
+       return EPMAP_ENOMEM;
 
-   offset = _snprintf(buffer, sizeof(buffer), "%s", list[n].str); 
+   memset(&epmap->handle, '\0', sizeof(epmap->handle));
 
-   if (status == EPMAP_ESOCKET) 
-       offset = _snprintf(buffer+offset, sizeof(buffer)-offset, " (errno: %u)", result>>12);
-   else if (status == EPMAP_ENAK) 
-       offset = _snprintf(buffer+offset, sizeof(buffer)-offset, " (reason: %u)", result>>12); 
-   else if (status == EPMAP_EFAULT) 
-       offset = 0;
-  
-   return &buffer[0];
+   return EPMAP_EOK;
 }
 
-/* $fixme */
-void display_usage(char *progname)
+/* Fetch the next batch once the current one has been consumed. */
+static int lookup_fill(epmap_lookup_t *lookup)
 {
-    printf("display_usage here!\n");
-}
+   while (lookup->next == lookup->n_entries) {
+       /* EPMAP_ENODATA once the last batch has been returned. */
+       if (lookup->result != EPMAP_EOK)
+           return lookup->result;
+
+       lookup->next = 0;
+       lookup->result = epmap_request(lookup->epmap, lookup->entries, 
+           lookup->max_entries, &lookup->n_entries);
+       if (lookup->result != EPMAP_EOK && lookup->result != EPMAP_ENODATA)
+           lookup->n_entries = 0;
+   }
 
+   return EPMAP_EOK;
+}
 
-int main(int argc, char *argv[])
+/* Return the next entry, EPMAP_ENODATA at the end of the endpoint map. */
+EPMAPAPI int epmap_lookup_next(epmap_lookup_t *lookup, const ept_entry_t **entry)
 {
-   epmap_t *epmap = NULL;
-   uuid_t uuid;
-   uint16_t port; 
-   const char *server; 
-   char annotation[64+1];
-   tower_entry_t tower;
-   int count = 0;
-   int result = EPMAP_EOK;
-   
-   if (argc != 2 && argc != 4) {
-       fprintf(stderr, "-epmap: Invalid number of arguments.\n");
-       display_usage("test");
-       return EXIT_FAILURE;
-   }
- 
-   /* Parse arguments here. */
-   if (argc == 2) {
-       server = argv[1];
-       port = DEFAULT_EPMAP_PORT;
-   } else { /* argc == 4 */ 
-
-     if (argv[0][1] != 'p' && argv[0][1] !='P') {
-         display_usage("Test");
-         return EXIT_FAILURE;
-      
-     }
-       server = argv[3];
-       port = atoi(argv[2]);
-       /* Check port? */
-        
-   } 
+   int result;
 
-   printf("\nBinding to endpoint portmapper: %s[%u] ...\n", server, port);
-   result = epmap_bind(&epmap, server, port);
-   if (result != EPMAP_EOK) {
-     //////  fprintf(stderr, "-epmap: failed to bind to endpoint portmapper\n"); 
-     /////////  fprintf(stderr, "-epmap: An error has occurred: ");
+   if (lookup == NULL || lookup->entries == NULL || entry == NULL)
+       return EPMAP_EINVAL;
 
-       
-       fprintf(stderr, "-epmap: %s.\n", epmap_error(result));   
-       return EXIT_FAILURE;
-   }
+   result = lookup_fill(lookup);
+   if (result != EPMAP_EOK)
+       return result;
 
-   printf("Querying Endpoint Mapper Database...\n\n");
+   *entry = &lookup->entries[lookup->next++];
 
-   /* */
-   do {
+   return EPMAP_EOK;
+}
+
+/* Return the entries left in the current batch, fetching the next one if
+ * needed. count is never zero with EPMAP_EOK.
+ */
+EPMAPAPI int epmap_lookup_batch(epmap_lookup_t *lookup, const ept_entry_t **entries, size_t *count)
+{
+   int result;
+
+   if (lookup == NULL || lookup->entries == NULL || entries == NULL || count == NULL)
+       return EPMAP_EINVAL;
+
+   *count = 0;
+   result = lookup_fill(lookup);
+   if (result != EPMAP_EOK)
+       return result;
+
+   *entries = &lookup->entries[lookup->next];
+   *count = lookup->n_entries - lookup->next;
+   lookup->next = lookup->n_entries;
+
+   return EPMAP_EOK;
+}
+
+EPMAPAPI void epmap_lookup_end(epmap_lookup_t *lookup)
+{
+   if (lookup != NULL) {
+       free(lookup->entries);
+       lookup->entries = NULL;
+       lookup->n_entries = 0;
+       lookup->next = 0;
+   }
+}
+
+/* Enumerate the endpoint map, calling callback for each entry as its batch
+ * is decoded. Returns EPMAP_EOK once all the entries have been seen, 
+ * EPMAP_ESTOPPED if callback returned non-zero to stop early, or the error
+ * that ended the enumeration. The callback's own value is not returned, so
+ * it cannot be mistaken for an EPMAP_* code; keep it in context if needed.
+ */
+EPMAPAPI int epmap_lookup_each(epmap_t *epmap, epmap_entry_cb callback, void *context)
+{
+   epmap_lookup_t lookup;
+   const ept_entry_t *entry = NULL;
+   int result;
+
+   if (callback == NULL)
+       return EPMAP_EINVAL;
+
+   result = epmap_lookup_begin(epmap, &lookup);
+   if (result != EPMAP_EOK)
+       return result;
+
+   do {
+       result = epmap_lookup_next(&lookup, &entry);
+       if (result == EPMAP_EOK && callback(context, entry) != 0)
+           result = EPMAP_ESTOPPED;
+   } while (result == EPMAP_EOK);
+
+   epmap_lookup_end(&lookup);
+
+   return result == EPMAP_ENODATA ? EPMAP_EOK : result;
+}
+
+/* Complete the non-blocking operation once the answer has been received,
+ * or on error. A lookup that only got filtered entries asks for the next
+ * batch straight away.
+ */
+static int async_finish(epmap_t *epmap, int result)
+{
+   epmap_lookup_t *lookup = epmap->pending;
+
+   epmap->state = EPMAP_STATE_IDLE;
+
+   if (epmap->op == EPMAP_OP_BIND)
+       return result == EPMAP_EOK ? epmap_bind_result(epmap) : result;
+
+   if (result == EPMAP_EOK)
+       result = epmap_lookup_result(epmap, lookup->entries, lookup->max_entries, &lookup->n_entries);
+   else 
+       lookup->n_entries = 0;
+   lookup->next = 0;
+   lookup->result = result;
+
+   if (lookup->n_entries != 0)
+       return EPMAP_EOK;
+   if (result != EPMAP_EOK)
+       return result;
+
+   epmap_encode_lookup(epmap, lookup->max_entries);
+   epmap->buffer[0].offset = 0;
+   epmap->state = EPMAP_STATE_SENDING;
+
+   return EPMAP_EAGAIN;
+}
+
+/* Extend a failed send or receive with its Windows Sockets error. Other
+ * results, protocol or allocation errors, did not come from the socket.
+ */
+static int socket_result(int result)
+{
+   if (result == EPMAP_ESEND || result == EPMAP_ERECV)
+       result |= WSAGetLastError() << 12;
+
+   return result;
+}
+
+/* Advance the non-blocking operation in progress as far as the socket 
+ * allows. Returns EPMAP_EAGAIN until it completes.
+ */
+EPMAPAPI int epmap_async_step(epmap_t *epmap)
+{
+   int error = 0;
+   int errlen = sizeof(error);
+   int result;
+
+   if (epmap == NULL || epmap->state == EPMAP_STATE_IDLE)
+       return EPMAP_EINVAL;
+
+   do {
+       if (epmap->state == EPMAP_STATE_CONNECTING) {
+           result = epmap_wait(epmap, EPMAP_WANT_WRITE, 0);
+           if (result == 0)
+               return EPMAP_EAGAIN;
+           if (result == SOCKET_ERROR)
+               return async_finish(epmap, (epmap->wsacode << 12) | EPMAP_ESOCKET);
+           if (getsockopt(epmap->sockfd, SOL_SOCKET, SO_ERROR, (char *)&error, &errlen) != 0)
+               error = WSAGetLastError();
+           if (error != 0)
+               return async_finish(epmap, (error << 12) | EPMAP_ESOCKET);
+           epmap->state = EPMAP_STATE_SENDING;
+       }
+
+       if (epmap->state == EPMAP_STATE_SENDING) {
+           result = socket_result(epmap_send_step(epmap));
+           if (result == EPMAP_EAGAIN)
+               return result;
+           if (result == EPMAP_EOK)
+               result = epmap_recv_reset(epmap);
+           if (result != EPMAP_EOK)
+               return async_finish(epmap, result);
+           epmap->state = EPMAP_STATE_RECEIVING;
+       }
+
+       result = epmap_recv_step(epmap);
+       if (result == EPMAP_EAGAIN)
+           return result;
+
+       result = async_finish(epmap, socket_result(result));
+   } while (result == EPMAP_EAGAIN);
+
+   return result;
+}
+
+/* Socket events the operation in progress waits for, 0 if none. */
+EPMAPAPI int epmap_async_events(const epmap_t *epmap)
+{
+   switch (epmap->state) {
+       case EPMAP_STATE_CONNECTING:
+       case EPMAP_STATE_SENDING:
+           return EPMAP_WANT_WRITE;
+       case EPMAP_STATE_RECEIVING:
+           return EPMAP_WANT_READ;
+       default:
+           return 0;
+   }
+}
+
+EPMAPAPI uintptr_t epmap_async_socket(const epmap_t *epmap)
+{
+   return (uintptr_t)epmap->sockfd;
+}
+
+/* Start binding to the server, as epmap_bind_ex() does, on a non-blocking
+ * socket. If it cannot even start, the session is destroyed and *epmap set
+ * to NULL; if the operation fails later, the session must be destroyed by
+ * the caller.
+ */
+EPMAPAPI int epmap_bind_async(epmap_t **epmap, const char *server, uint16_t port, uint16_t frag_size)
+{
+   int result;
+
+   if (epmap == NULL)
+       return EPMAP_EINVAL;
+
+   *epmap = NULL;
+
+   if (server == NULL || strlen(server) == 0 || frag_size < EPMAP_MIN_FRAG_SIZE)
+       return EPMAP_EINVAL; 
+
+   *epmap = epmap_init(EPMAP_SND_BUFSIZE, EPMAP_RCV_BUFSIZE);
+   if (*epmap == NULL)
+       return EPMAP_ENOMEM;
+
+   (*epmap)->frag_size = frag_size;     
+
+   result = epmap_connect_async(*epmap, server, port);   
+   if (result == EPMAP_EOK)
+       result = epmap_encode_bind_request(*epmap);
+   if (result != EPMAP_EOK) {
+       epmap_destroy(*epmap);
+       *epmap = NULL;
+       return result;
+   }
+
+   (*epmap)->buffer[0].offset = 0;
+   (*epmap)->op = EPMAP_OP_BIND;
+   (*epmap)->state = EPMAP_STATE_CONNECTING;
+
+   return epmap_async_step(*epmap);
+}
+
+/* Start fetching the next batch of an enumeration, see epmap_lookup_begin().
+ * Completes at once if entries are left in the current batch, or with
+ * EPMAP_ENODATA after the last one.
+ */
+EPMAPAPI int epmap_lookup_async(epmap_lookup_t *lookup)
+{
+   epmap_t *epmap = NULL;
+
+   if (lookup == NULL || lookup->entries == NULL)
+       return EPMAP_EINVAL;
+
+   epmap = lookup->epmap;
+   if (epmap->state != EPMAP_STATE_IDLE)
+       return EPMAP_EINVAL;
+
+   if (lookup->next < lookup->n_entries)
+       return EPMAP_EOK;
+   if (lookup->result != EPMAP_EOK)
+       return lookup->result;
+
+   epmap_encode_lookup(epmap, lookup->max_entries);
+   epmap->buffer[0].offset = 0;
+   epmap->op = EPMAP_OP_LOOKUP;
+   epmap->pending = lookup;
+   epmap->state = EPMAP_STATE_SENDING;
+
+   return epmap_async_step(epmap);
+}
+
+/* Add an interface to the existing association with an ALTER_CONTEXT PDU,
+ * unless the presentation context has already been accepted. The transfer
+ * syntax is 32-bit NDR, as for the endpoint mapper itself.
+ */
+static int epmap_alter_context(epmap_t *epmap, p_context_id_t p_cont_id, 
+                               const char *if_uuid, uint32_t if_version)
+{
+   rpcconn_alter_context_hdr_t alter;
+   p_cont_elem_t p_cont_elem;
+   p_syntax_id_t syntax;
+   int ptype;
+   int result;
+
+   if (epmap->contexts & (1u << p_cont_id))
+       return EPMAP_EOK;
+
+   alter.rpc_vers = 5;
+   alter.rpc_vers_minor = 0;
+   alter.ptype = RPC_PTYPE_ALTER_CTX;
+   alter.pfc_flags = PFC_FIRST_FRAG | PFC_LAST_FRAG; /* 0x03 */
+
+   alter.packed_drep[0] = 0x10; /* Byte order: Little-endian; Charset: ASCII. */
+   alter.packed_drep[1] = 0x00; /* Floating-point: IEEE 754. */
+   alter.packed_drep[2] = 0x00; /* Reserved for future use. */
+   alter.packed_drep[3] = 0x00; /* Reserved for future use. */
+
+   alter.frag_length = 0; /* Set within the encoding function. */
+   alter.auth_length = 0;
+   alter.call_id = ++(epmap->call_id);
+
+   alter.max_xmit_frag = epmap->frag_size;
+   alter.max_recv_frag = epmap->frag_size;
+   alter.assoc_group_id = epmap->assoc_group;
+
+   /* A single element in the presentation context list. */
+   alter.p_context_elem.n_context_elem = 1;
+   alter.p_context_elem.reserved = 0;
+   alter.p_context_elem.reserved2 = 0;
+   alter.p_context_elem.p_cont_elem = &p_cont_elem;
+
+   p_cont_elem.p_cont_id = p_cont_id;
+   p_cont_elem.n_transfer_syn = 1;
+   p_cont_elem.reserved = 0;
+   epmap_string_to_uuid(&p_cont_elem.abstract_syntax.if_uuid, if_uuid);
+   p_cont_elem.abstract_syntax.if_version = if_version;
+   p_cont_elem.transfer_syntaxes = &syntax;
+
+   /* Transfer Syntax: 32-bit NDR v2.0 */
+   epmap_string_to_uuid(&syntax.if_uuid, "8a885d04-1ceb-11c9-9fe8-08002b104860");
+   syntax.if_version = 2;
+
+   /* Same layout as the bind request. */
+   if (epmap_encode_bind(epmap, &alter) == 0)
+       return EPMAP_EINVAL;
+
+   result = epmap_send(epmap);
+   if (result != EPMAP_EOK) 
+       return result | (WSAGetLastError() << 12);
+
+   result = epmap_recv(epmap);
+   if (result != EPMAP_EOK) 
+       return result | (WSAGetLastError() << 12);
+
+   buffer_seek(epmap, 1, 2, SEEK_SET);
+   ptype = ndr_rle8(epmap);
+
+   switch(ptype) {
+       case RPC_PTYPE_ALTER_CTX_RESP:
+           result = epmap_decode_alter_context(epmap, p_cont_id);
+           if (result == EPMAP_EOK && !(epmap->contexts & (1u << p_cont_id)))
+               result = EPMAP_ECONTEXT;
+           break;
+       case RPC_PTYPE_FAULT:
+           epmap_decode_fault(epmap);
+           result = ((epmap->status) << 12) | EPMAP_EFAULT;
+           break;
+       default:
+           result = EPMAP_EPROTO;
+           break;
+   }
+
+   return result;
+}
+
+/* Call a management interface operation on the existing association. On
+ * success, the receive buffer is positioned at the start of the stub data.
+ * The rpc__mgmt operations we use take no input besides the binding handle.
+ */
+static int epmap_mgmt_call(epmap_t *epmap, uint16_t opnum)
+{
+   rpcconn_request_hdr_t request;
+   int ptype;
+   int result;
+
+   /* Management interface: afa8bd80-7d8a-11c9-bef4-08002b102989 v1.0 */
+   result = epmap_alter_context(epmap, EPMAP_MGMT_CONTEXT_ID,
+       "afa8bd80-7d8a-11c9-bef4-08002b102989", 1);
+   if (result != EPMAP_EOK)
+       return result;
+
+   request.rpc_vers = 5;
+   request.rpc_vers_minor = 0;
+   request.ptype = RPC_PTYPE_REQUEST;
+   request.pfc_flags = PFC_FIRST_FRAG | PFC_LAST_FRAG; /* 0x03 */
+
+   request.packed_drep[0] = 0x10; 
+   request.packed_drep[1] = 0x00; 
+   request.packed_drep[2] = 0x00; 
+   request.packed_drep[3] = 0x00; 
+
+   request.frag_length = 0; 
+   request.auth_length = 0;
+   request.call_id = ++(epmap->call_id);
+   request.alloc_hint = 0;
+   request.p_cont_id = EPMAP_MGMT_CONTEXT_ID;
+   request.opnum = opnum;
+
+   epmap_encode_request_hdr(epmap, &request);
+   if (epmap_encode_request_end(epmap) == 0)
+       return EPMAP_EINVAL;
+
+   result = epmap_send(epmap);
+   if (result != EPMAP_EOK) 
+       return result | (WSAGetLastError() << 12);
+
+   result = epmap_recv(epmap);
+   if (result != EPMAP_EOK) 
+       return result | (WSAGetLastError() << 12);
+
+   buffer_seek(epmap, 1, 2, SEEK_SET);
+   ptype = ndr_rle8(epmap);
+
+   switch(ptype) {
+       case RPC_PTYPE_RESPONSE:
+           /* Skip the response header, the stub data follows. */
+           buffer_seek(epmap, 1, 24, SEEK_SET);
+           result = EPMAP_EOK;
+           break;
+       case RPC_PTYPE_FAULT:
+           epmap_decode_fault(epmap);
+           result = ((epmap->status) << 12) | EPMAP_EFAULT;
+           break;
+       default:
+           result = EPMAP_EPROTO;
+           break;
+   }
+
+   return result;
+}
+
+/* rpc__mgmt_inq_if_ids: list the interfaces registered with the RPC server.
+ * Up to max_ids identifiers are stored in if_ids, count receives the total
+ * number returned by the server (which may be larger). 
+ */
+EPMAPAPI int epmap_mgmt_inq_if_ids(epmap_t *epmap, rpc_if_id_t *if_ids, 
+                                   size_t max_ids, size_t *count)
+{
+   rpc_if_id_t if_id;
+   uint32_t referent;
+   uint32_t n, present;
+   uint32_t status;
+   uint32_t i;
+   int result;
+
+   if (epmap == NULL || count == NULL || (if_ids == NULL && max_ids != 0))
+       return EPMAP_EINVAL;
+
+   *count = 0;
+
+   result = epmap_mgmt_call(epmap, RPC_C_MGMT_INQ_IF_IDS);
+   if (result != EPMAP_EOK)
+       return result;
+
+   /* [out] rpc_if_id_vector_p_t *if_id_vector, a NULL vector on failure. */
+   referent = ndr_rle32(epmap);
+   if (referent != 0) {
+       /* Conformant structure: max count, then the count field. */
+       ndr_rle32(epmap);
+       n = ndr_rle32(epmap);
+
+       /* Array of [ptr] rpc_if_id_p_t, pointees are deferred. */
+       for (present = 0, i = 0; i < n; i++) {
+           if (ndr_rle32(epmap) != 0)
+               present++;
+       }
+
+       for (i = 0; i < present; i++) {
+           ndr_decode_uuid(epmap, &if_id.uuid);
+           if_id.vers_major = ndr_rle16(epmap);
+           if_id.vers_minor = ndr_rle16(epmap);
+           if (i < max_ids)
+               if_ids[i] = if_id;
+       }
+       *count = present;
+   }
+
+   epmap->status = status = ndr_rle32(epmap);
+   if (epmap->buffer[1].eof)
+       return EPMAP_EPROTO;
+
+   if (status != 0)
+       return (status << 12) | EPMAP_EFAULT;
+
+   return EPMAP_EOK;
+}
+
+/* rpc__mgmt_is_server_listening. */
+EPMAPAPI int epmap_mgmt_is_server_listening(epmap_t *epmap, int *listening)
+{
+   uint32_t value;
+   uint32_t status;
+   int result;
+
+   if (epmap == NULL || listening == NULL)
+       return EPMAP_EINVAL;
+
+   *listening = 0;
+
+   result = epmap_mgmt_call(epmap, RPC_C_MGMT_IS_SERVER_LISTEN);
+   if (result != EPMAP_EOK)
+       return result;
+
+   /* boolean32 return value, then [out] error_status_t *status. */
+   value = ndr_rle32(epmap);
+   epmap->status = status = ndr_rle32(epmap);
+   if (epmap->buffer[1].eof)
+       return EPMAP_EPROTO;
+
+   *listening = value != 0 && status == 0;
+
+   return EPMAP_EOK;
+}
+
+/* Liveness probe of a dynamic TCP endpoint: connect, send a BIND for one of
+ * the interfaces registered on the port and wait for a BIND_ACK or BIND_NAK.
+ * Either answer proves that an RPC server is listening on the port. 
+ */
+typedef struct epmap_probe {
+   uint16_t    port;        /* In: TCP port. */
+   rpc_if_id_t if_id;       /* In: interface proposed in the BIND. */
+   int         state;       /* Out: EPMAP_PROBE_* */
+   int         wsacode;     /* Out: winsock error, if any. */
+   uint32_t    latency;     /* Out: connect + BIND handshake, in microseconds. */
+} epmap_probe_t;
+
+#define EPMAP_PROBE_PENDING  0 /* Not probed yet. */
+#define EPMAP_PROBE_ALIVE    1 /* Answered the BIND. */
+#define EPMAP_PROBE_REFUSED  2 /* Connection refused, reset or closed. */
+#define EPMAP_PROBE_TIMEOUT  3 /* No answer before the deadline. */
+#define EPMAP_PROBE_NOTRPC   4 /* Answered, but not with a BIND_ACK/NAK. */
+#define EPMAP_PROBE_ERROR    5 /* Local error (socket creation...). */
+
+#define EPMAP_PROBE_MAX_CONCURRENCY FD_SETSIZE
+
+/* Probe in flight. */
+typedef struct probe_slot {
+   SOCKET   sockfd;
+   size_t   index;          /* Into the probes array. */
+   int      phase;          /* Connecting, sending or receiving. */
+   uint64_t start;          /* Connect time, in microseconds. */
+   uint8_t  pdu[128];       /* Encoded BIND PDU. */
+   size_t   length;
+   size_t   offset;         /* Bytes of the PDU sent, or of the answer received. */
+} probe_slot_t;
+
+#define PROBE_CONNECTING 0
+#define PROBE_SENDING    1
+#define PROBE_RECEIVING  2
+
+static void probe_finish(epmap_probe_t *probes, probe_slot_t *slot, int state, int wsacode)
+{
+   epmap_probe_t *probe = &probes[slot->index];
+
+   probe->state = state;
+   probe->wsacode = wsacode;
+   probe->latency = (uint32_t)(epmap_clock_us() - slot->start);
+
+   closesocket(slot->sockfd);
+   slot->sockfd = INVALID_SOCKET;
+}
+
+/* Encode the BIND PDU of a probe into the slot. */
+static int probe_encode_bind(epmap_t *epmap, probe_slot_t *slot, const rpc_if_id_t *if_id)
+{
+   rpcconn_bind_hdr_t bind;
+   p_cont_elem_t p_cont_elem;
+   p_syntax_id_t syntax;
+   buffer_t *buffer = &epmap->buffer[0];
+
+   bind.rpc_vers = 5;
+   bind.rpc_vers_minor = 0;
+   bind.ptype = RPC_PTYPE_BIND;
+   bind.pfc_flags = PFC_FIRST_FRAG | PFC_LAST_FRAG; /* 0x03 */
+
+   bind.packed_drep[0] = 0x10; 
+   bind.packed_drep[1] = 0x00; 
+   bind.packed_drep[2] = 0x00; 
+   bind.packed_drep[3] = 0x00; 
+
+   bind.frag_length = 0;
+   bind.auth_length = 0;
+   bind.call_id = 1;
+   bind.max_xmit_frag = 5840;
+   bind.max_recv_frag = 5840;
+   bind.assoc_group_id = 0;
+
+   bind.p_context_elem.n_context_elem = 1;
+   bind.p_context_elem.reserved = 0;
+   bind.p_context_elem.reserved2 = 0;
+   bind.p_context_elem.p_cont_elem = &p_cont_elem;
+
+   p_cont_elem.p_cont_id = 0x0000;
+   p_cont_elem.n_transfer_syn = 1;
+   p_cont_elem.reserved = 0;
+   p_cont_elem.abstract_syntax.if_uuid = if_id->uuid;
+   p_cont_elem.abstract_syntax.if_version = if_id->vers_major | (if_id->vers_minor << 16);
+   p_cont_elem.transfer_syntaxes = &syntax;
+
+   /* Transfer Syntax: 32-bit NDR v2.0 */
+   epmap_string_to_uuid(&syntax.if_uuid, "8a885d04-1ceb-11c9-9fe8-08002b104860");
+   syntax.if_version = 2;
+
+   /* The send buffer of the session is used as scratch space. */
+   if (epmap_encode_bind(epmap, &bind) == 0 || buffer->length > sizeof(slot->pdu))
+       return EPMAP_EINVAL;
+
+   memcpy(slot->pdu, buffer->data, buffer->length);
+   slot->length = buffer->length;
+   buffer->length = 0;
+
+   return EPMAP_EOK;
+}
+
+/* Start the next probe in a free slot. Returns 0 if the probe failed
+ * immediately, leaving the slot free. 
+ */
+static int probe_start(epmap_t *epmap, epmap_probe_t *probes, size_t index, probe_slot_t *slot)
+{
+   struct sockaddr_storage addr = epmap->addr;
+   u_long mode = 1;
+   int result;
+
+   slot->index = index;
+   slot->phase = PROBE_CONNECTING;
+   slot->offset = 0;
+   slot->start = epmap_clock_us();
+
+   slot->sockfd = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+   if (slot->sockfd == INVALID_SOCKET) {
+       probes[index].state = EPMAP_PROBE_ERROR;
+       probes[index].wsacode = WSAGetLastError();
+       return 0;
+   }
+
+   if (probe_encode_bind(epmap, slot, &probes[index].if_id) != EPMAP_EOK ||
+       ioctlsocket(slot->sockfd, FIONBIO, &mode) != 0) {
+       probe_finish(probes, slot, EPMAP_PROBE_ERROR, WSAGetLastError());
+       return 0;
+   }
+
+   if (addr.ss_family == AF_INET6)
+       ((struct sockaddr_in6 *)&addr)->sin6_port = htons(probes[index].port);
+   else
+       ((struct sockaddr_in *)&addr)->sin_port = htons(probes[index].port);
+   result = connect(slot->sockfd, (struct sockaddr *)&addr, epmap->addrlen);
+   if (result == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) {
+       probe_finish(probes, slot, EPMAP_PROBE_REFUSED, WSAGetLastError());
+       return 0;
+   }
+
+   return 1;
+}
+
+/* Advance a probe whose socket is ready. */
+static void probe_step(epmap_probe_t *probes, probe_slot_t *slot, int readable, int writable, int failed)
+{
+   int error = 0;
+   int errlen = sizeof(error);
+   int n;
+
+   if (slot->phase == PROBE_CONNECTING) {
+       if (failed) {
+           /* Windows reports failed connects in the exception set. */
+           getsockopt(slot->sockfd, SOL_SOCKET, SO_ERROR, (char *)&error, &errlen);
+           probe_finish(probes, slot, EPMAP_PROBE_REFUSED, error);
+           return;
+       }
+       if (!writable) 
+           return;
+       if (getsockopt(slot->sockfd, SOL_SOCKET, SO_ERROR, (char *)&error, &errlen) != 0 || error != 0) {
+           probe_finish(probes, slot, EPMAP_PROBE_REFUSED, error);
+           return;
+       }
+       slot->phase = PROBE_SENDING;
+   }
+
+   if (slot->phase == PROBE_SENDING) {
+       n = send(slot->sockfd, (char *)slot->pdu + slot->offset, (int)(slot->length - slot->offset), 0);
+       if (n == SOCKET_ERROR) {
+           if (WSAGetLastError() != WSAEWOULDBLOCK)
+               probe_finish(probes, slot, EPMAP_PROBE_REFUSED, WSAGetLastError());
+           return;
+       }
+       slot->offset += n;
+       if (slot->offset == slot->length) {
+           /* The answer is received into the PDU buffer. */
+           slot->phase = PROBE_RECEIVING;
+           slot->offset = 0;
+       }
+       return;
+   }
+
+   /* Reset after the BIND was sent: fail now, not at the deadline. A
+    * reset seen as readable is caught by recv() below. */
+   if (slot->phase == PROBE_RECEIVING && failed) {
+       if (getsockopt(slot->sockfd, SOL_SOCKET, SO_ERROR, (char *)&error, &errlen) != 0)
+           error = WSAGetLastError();
+       if (error != 0) {
+           probe_finish(probes, slot, EPMAP_PROBE_REFUSED, error);
+           return;
+       }
+   }
+
+   if (slot->phase == PROBE_RECEIVING && readable) {
+       /* rpc_vers, rpc_vers_minor, ptype and pfc_flags are enough. */
+       n = recv(slot->sockfd, (char *)slot->pdu + slot->offset, (int)(4 - slot->offset), 0);
+       /* A reset or a close before the header is a socket failure, not an
+        * answer from a server that does not speak RPC. */
+       if (n == SOCKET_ERROR || n == 0) {
+           if (n == 0 || WSAGetLastError() != WSAEWOULDBLOCK)
+               probe_finish(probes, slot, EPMAP_PROBE_REFUSED, n == 0 ? WSAECONNRESET : WSAGetLastError());
+           return;
+       }
+       slot->offset += n;
+       if (slot->offset == 4) {
+           if (slot->pdu[0] == 5 && (slot->pdu[2] == RPC_PTYPE_BIND_ACK || slot->pdu[2] == RPC_PTYPE_BIND_NAK))
+               probe_finish(probes, slot, EPMAP_PROBE_ALIVE, 0);
+           else 
+               probe_finish(probes, slot, EPMAP_PROBE_NOTRPC, 0);
+       }
+   }
+}
+
+/* Probe the TCP endpoints of the server epmap is bound to. At most 
+ * concurrency probes are in flight, each with a deadline of timeout 
+ * milliseconds. Ports should be unique: each one costs a connection. 
+ */
+EPMAPAPI int epmap_probe(epmap_t *epmap, epmap_probe_t *probes, size_t n, int concurrency, int timeout)
+{
+   probe_slot_t *slots = NULL;
+   fd_set rfds, wfds, efds;
+   struct timeval tv;
+   uint64_t now, deadline;
+   size_t next = 0;
+   int active = 0;
+   SOCKET maxfd;
+   int i;
+
+   if (epmap == NULL || (probes == NULL && n != 0) || concurrency <= 0 || timeout <= 0)
+       return EPMAP_EINVAL;
+
+   if (epmap->addrlen == 0 || (epmap->addr.ss_family != AF_INET && epmap->addr.ss_family != AF_INET6))
+       return EPMAP_EINVAL;
+
+   if (concurrency > EPMAP_PROBE_MAX_CONCURRENCY)
+       concurrency = EPMAP_PROBE_MAX_CONCURRENCY;
+   if (concurrency > n)
+       concurrency = (int)n;
+   if (n == 0)
+       return EPMAP_EOK;
+
+   slots = malloc(sizeof(probe_slot_t) * concurrency);
+   if (slots == NULL)
+       return EPMAP_ENOMEM;
+
+   for (i = 0; i < concurrency; i++)
+       slots[i].sockfd = INVALID_SOCKET;
+
+   while (next < n || active > 0) {
+       /* Fill the free slots. */
+       for (i = 0; i < concurrency && next < n; i++) {
+           if (slots[i].sockfd != INVALID_SOCKET)
+               continue;
+           probes[next].state = EPMAP_PROBE_PENDING;
+           if (probe_start(epmap, probes, next++, &slots[i]))
+               active++;
+       }
+       if (active == 0)
+           continue;
+
+       FD_ZERO(&rfds);
+       FD_ZERO(&wfds);
+       FD_ZERO(&efds);
+       maxfd = 0;
+       now = epmap_clock_us();
+       deadline = now + (uint64_t)timeout * 1000;
+
+       for (i = 0; i < concurrency; i++) {
+           probe_slot_t *slot = &slots[i];
+           if (slot->sockfd == INVALID_SOCKET)
+               continue;
+           if (now - slot->start >= (uint64_t)timeout * 1000) {
+               probe_finish(probes, slot, EPMAP_PROBE_TIMEOUT, WSAETIMEDOUT);
+               active--;
+               continue;
+           }
+           if (slot->start + (uint64_t)timeout * 1000 < deadline)
+               deadline = slot->start + (uint64_t)timeout * 1000;
+           if (slot->phase == PROBE_RECEIVING)
+               FD_SET(slot->sockfd, &rfds);
+           else
+               FD_SET(slot->sockfd, &wfds);
+           FD_SET(slot->sockfd, &efds);
+           if (slot->sockfd > maxfd)
+               maxfd = slot->sockfd;
+       }
+       if (active == 0)
+           continue;
+
+       tv.tv_sec = (long)((deadline - now) / 1000000);
+       tv.tv_usec = (long)((deadline - now) % 1000000);
+
+       /* The first argument is ignored by Winsock. */
+       if (select((int)maxfd + 1, &rfds, &wfds, &efds, &tv) == SOCKET_ERROR) {
+           epmap->wsacode = WSAGetLastError();
+           for (i = 0; i < concurrency; i++) {
+               if (slots[i].sockfd != INVALID_SOCKET)
+                   probe_finish(probes, &slots[i], EPMAP_PROBE_ERROR, epmap->wsacode);
+           }
+           free(slots);
+           return (epmap->wsacode << 12) | EPMAP_ESOCKET;
+       }
+
+       for (i = 0; i < concurrency; i++) {
+           probe_slot_t *slot = &slots[i];
+           if (slot->sockfd == INVALID_SOCKET)
+               continue;
+           probe_step(probes, slot, FD_ISSET(slot->sockfd, &rfds), 
+               FD_ISSET(slot->sockfd, &wfds), FD_ISSET(slot->sockfd, &efds));
+           if (slot->sockfd == INVALID_SOCKET)
+               active--;
+       }
+   }
+
+   free(slots);
+
+   return EPMAP_EOK;
+}
+
+/* Aggregation of the entries of a host. The endpoint mapper returns one 
+ * entry per tower, so the same interface comes back once per protocol 
+ * sequence and endpoint, and sometimes several times for the same one. 
+ * Entries are collapsed on (interface UUID, version, protseq, endpoint) and
+ * the distinct endpoints are grouped by interface, in order of appearance.
+ * All the memory is allocated up front: at most max distinct endpoints are
+ * kept per host, the others are counted as dropped.
+ */
+#define EPMAP_NONE 0xffffffff
+
+typedef struct epmap_endpoint {
+   const ept_entry_t *entry;   /* First entry with this endpoint. */
+   uint32_t hash;
+   uint32_t group;             /* Interface group. */
+   uint32_t next;              /* Next endpoint of the group, or EPMAP_NONE. */
+   uint32_t count;             /* Number of entries collapsed into this one. */
+} epmap_endpoint_t;
+
+typedef struct epmap_group {
+   const ept_entry_t *entry;   /* Entry holding the interface annotation. */
+   uint32_t hash;
+   uint32_t first, last;       /* Endpoints of the interface. */
+   uint32_t n_endpoints;
+} epmap_group_t;
+
+typedef struct epmap_aggregate {
+   epmap_endpoint_t *endpoints;
+   epmap_group_t    *groups;
+   uint32_t *endpoint_slots;   /* Open addressing: index + 1, or 0. */
+   uint32_t *group_slots;
+   uint32_t mask;
+   size_t   max;               /* Distinct endpoints kept per host. */
+   size_t   n_endpoints;
+   size_t   n_groups;
+   size_t   n_entries;         /* Entries added. */
+   size_t   dropped;           /* Distinct endpoints over the bound. */
+} epmap_aggregate_t;
+
+/* Protocol sequence of the endpoint of a tower. */
+static unsigned int tower_protseq(const tower_entry_t *tower)
+{
+   if (tower->tcp_port != 0)
+       return PROTO_ID_TCP;
+   if (tower->udp_port != 0)
+       return PROTO_ID_UDP;
+
+   return tower->proto_id;
+}
+
+static uint32_t interface_hash(const tower_entry_t *tower)
+{
+   return uuid_hash(&tower->if_id.uuid, tower->if_id.vers_major | (tower->if_id.vers_minor << 16));
+}
+
+/* Pipe names are case insensitive: \pipe\lsass and \PIPE\lsass are the same. */
+static uint32_t endpoint_hash(const tower_entry_t *tower, uint32_t hash)
+{
+   const unsigned char *ptr = NULL;
+
+   hash = (hash ^ tower_protseq(tower)) * 0x01000193;
+   hash = (hash ^ tower->tcp_port ^ tower->udp_port) * 0x01000193;
+
+   for (ptr = (const unsigned char *)epmap_string(tower->pipe_id); *ptr != '\0'; ptr++) 
+       hash = (hash ^ (*ptr | 0x20)) * 0x01000193;
+
+   return hash;
+}
+
+static int interface_equal(const tower_entry_t *a, const tower_entry_t *b)
+{
+   return uuid_compare((uuid_t *)&a->if_id.uuid, (uuid_t *)&b->if_id.uuid) == 0 &&
+          a->if_id.vers_major == b->if_id.vers_major &&
+          a->if_id.vers_minor == b->if_id.vers_minor;
+}
+
+static int endpoint_equal(const tower_entry_t *a, const tower_entry_t *b)
+{
+   return interface_equal(a, b) && tower_protseq(a) == tower_protseq(b) &&
+          a->tcp_port == b->tcp_port && a->udp_port == b->udp_port &&
+          (a->pipe_id == b->pipe_id || 
+           _stricmp(epmap_string(a->pipe_id), epmap_string(b->pipe_id)) == 0);
+}
+
+EPMAPAPI void epmap_aggregate_free(epmap_aggregate_t *agg)
+{
+   if (agg != NULL) {
+       free(agg->endpoints);
+       free(agg->groups);
+       free(agg->endpoint_slots);
+       free(agg->group_slots);
+       memset(agg, '\0', sizeof(*agg));
+   }
+}
+
+EPMAPAPI void epmap_aggregate_reset(epmap_aggregate_t *agg)
+{
+   memset(agg->endpoint_slots, '\0', sizeof(uint32_t) * (agg->mask + 1));
+   memset(agg->group_slots, '\0', sizeof(uint32_t) * (agg->mask + 1));
+   agg->n_endpoints = 0;
+   agg->n_groups = 0;
+   agg->n_entries = 0;
+   agg->dropped = 0;
+}
+
+EPMAPAPI int epmap_aggregate_init(epmap_aggregate_t *agg, size_t max)
+{
+   size_t size = 2;
+
+   if (agg == NULL || max == 0 || max >= EPMAP_NONE / 2)
+       return EPMAP_EINVAL;
+
+   memset(agg, '\0', sizeof(*agg));
+
+   /* Keep the tables at most half full. */
+   while (size < max * 2)
+       size <<= 1;
+
+   agg->max = max;
+   agg->mask = (uint32_t)(size - 1);
+   agg->endpoints = malloc(sizeof(epmap_endpoint_t) * max);
+   agg->groups = malloc(sizeof(epmap_group_t) * max);
+   agg->endpoint_slots = calloc(size, sizeof(uint32_t));
+   agg->group_slots = calloc(size, sizeof(uint32_t));
+
+   if (agg->endpoints == NULL || agg->groups == NULL ||
+       agg->endpoint_slots == NULL || agg->group_slots == NULL) {
+       epmap_aggregate_free(agg);
+       return EPMAP_ENOMEM;
+   }
+
+   return EPMAP_EOK;
+}
+
+/* Find or create the interface group of a tower, EPMAP_NONE if full. */
+static uint32_t aggregate_group(epmap_aggregate_t *agg, const ept_entry_t *entry)
+{
+   uint32_t hash = interface_hash(&entry->tower);
+   uint32_t i, index;
+   epmap_group_t *group = NULL;
+
+   for (i = hash & agg->mask; agg->group_slots[i] != 0; i = (i + 1) & agg->mask) {
+       group = &agg->groups[agg->group_slots[i] - 1];
+       if (group->hash == hash && interface_equal(&group->entry->tower, &entry->tower)) {
+           /* Prefer an entry with an annotation. */
+           if (group->entry->annotation_id == 0)
+               group->entry = entry;
+           return agg->group_slots[i] - 1;
+       }
+   }
+
+   if (agg->n_groups == agg->max)
+       return EPMAP_NONE;
+
+   index = (uint32_t)agg->n_groups++;
+   group = &agg->groups[index];
+   group->entry = entry;
+   group->hash = hash;
+   group->first = group->last = EPMAP_NONE;
+   group->n_endpoints = 0;
+   agg->group_slots[i] = index + 1;
+
+   return index;
+}
+
+/* Add an entry. Returns 1 if it is a new endpoint, 0 if it is a duplicate
+ * (or over the bound) and has been collapsed. The entry must outlive the
+ * aggregate, or the next reset. 
+ */
+EPMAPAPI int epmap_aggregate_add(epmap_aggregate_t *agg, const ept_entry_t *entry)
+{
+   epmap_endpoint_t *endpoint = NULL;
+   epmap_group_t *group = NULL;
+   uint32_t hash, index;
+   uint32_t i;
+
+   agg->n_entries++;
+
+   hash = endpoint_hash(&entry->tower, interface_hash(&entry->tower));
+   for (i = hash & agg->mask; agg->endpoint_slots[i] != 0; i = (i + 1) & agg->mask) {
+       endpoint = &agg->endpoints[agg->endpoint_slots[i] - 1];
+       if (endpoint->hash == hash && endpoint_equal(&endpoint->entry->tower, &entry->tower)) {
+           endpoint->count++;
+           return 0;
+       }
+   }
+
+   if (agg->n_endpoints == agg->max) {
+       agg->dropped++;
+       return 0;
+   }
+
+   /* There are never more groups than endpoints. */
+   index = (uint32_t)agg->n_endpoints++;
+   endpoint = &agg->endpoints[index];
+   endpoint->entry = entry;
+   endpoint->hash = hash;
+   endpoint->group = aggregate_group(agg, entry);
+   endpoint->next = EPMAP_NONE;
+   endpoint->count = 1;
+   agg->endpoint_slots[i] = index + 1;
+
+   group = &agg->groups[endpoint->group];
+   if (group->last == EPMAP_NONE)
+       group->first = index;
+   else
+       agg->endpoints[group->last].next = index;
+   group->last = index;
+   group->n_endpoints++;
+
+   return 1;
+}
+
+/* Result table, one column per field so that a filter only streams the 
+ * columns it reads. Rows are appended per host, host being the caller's
+ * index for it. Columns are allocated in multiples of 64 rows, the width of
+ * a selection word, and zeroed as they grow, so the kernels below never 
+ * need a scalar tail nor read the rows past n_rows uninitialized.
+ */
+#define EPMAP_UUID_LANES 4
+
+typedef struct epmap_table {
+   uint32_t *host;
+   uint32_t *uuid[EPMAP_UUID_LANES]; /* Interface UUID, 4 bytes per lane. */
+   uint32_t *version;          /* Major version in the high 16 bits. */
+   uint8_t  *protseq;
+   uint16_t *port;             /* TCP or UDP port, 0 for named pipes. */
+   uint32_t *pipe_id;
+   uint32_t *annotation_id;
+   size_t    n_rows;
+   size_t    max_rows;
+} epmap_table_t;
+
+EPMAPAPI void epmap_table_init(epmap_table_t *table)
+{
+   memset(table, '\0', sizeof(*table));
+}
+
+EPMAPAPI void epmap_table_free(epmap_table_t *table)
+{
+   int i;
+
+   free(table->host);
+   for (i = 0; i < EPMAP_UUID_LANES; i++)
+       free(table->uuid[i]);
+   free(table->version);
+   free(table->protseq);
+   free(table->port);
+   free(table->pipe_id);
+   free(table->annotation_id);
+   epmap_table_init(table);
+}
+
+/* Grow a column from n_rows to max_rows rows, zeroing the new ones. */
+static int table_column(void **column, size_t size, size_t n_rows, size_t max_rows)
+{
+   void *ptr = realloc(*column, size * max_rows);
+
+   if (ptr == NULL)
+       return EPMAP_ENOMEM;
+   memset((char *)ptr + size * n_rows, '\0', size * (max_rows - n_rows));
+   *column = ptr;
+
+   return EPMAP_EOK;
+}
+
+static int table_reserve(epmap_table_t *table, size_t n)
+{
+   size_t max_rows = table->max_rows;
+   size_t old = table->max_rows;
+   int result = EPMAP_EOK;
+   int i;
+
+   if (max_rows - table->n_rows >= n)
+       return EPMAP_EOK;
+
+   while (max_rows - table->n_rows < n)
+       max_rows = max_rows ? max_rows * 2 : 1024;
+
+   if (table_column((void **)&table->host, sizeof(uint32_t), old, max_rows) != EPMAP_EOK ||
+       table_column((void **)&table->version, sizeof(uint32_t), old, max_rows) != EPMAP_EOK ||
+       table_column((void **)&table->protseq, sizeof(uint8_t), old, max_rows) != EPMAP_EOK ||
+       table_column((void **)&table->port, sizeof(uint16_t), old, max_rows) != EPMAP_EOK ||
+       table_column((void **)&table->pipe_id, sizeof(uint32_t), old, max_rows) != EPMAP_EOK ||
+       table_column((void **)&table->annotation_id, sizeof(uint32_t), old, max_rows) != EPMAP_EOK)
+       result = EPMAP_ENOMEM;
+   for (i = 0; result == EPMAP_EOK && i < EPMAP_UUID_LANES; i++)
+       result = table_column((void **)&table->uuid[i], sizeof(uint32_t), old, max_rows);
+
+   /* The columns that did grow are fine as they are, only max_rows lags. */
+   if (result == EPMAP_EOK)
+       table->max_rows = max_rows;
+
+   return result;
+}
+
+static void table_set_uuid(epmap_table_t *table, size_t row, const uuid_t *uuid)
+{
+   uint32_t lanes[EPMAP_UUID_LANES];
+   int i;
+
+   memcpy(lanes, uuid, sizeof(lanes));
+   for (i = 0; i < EPMAP_UUID_LANES; i++)
+       table->uuid[i][row] = lanes[i];
+}
+
+static void table_get_uuid(const epmap_table_t *table, size_t row, uuid_t *uuid)
+{
+   uint32_t lanes[EPMAP_UUID_LANES];
+   int i;
+
+   for (i = 0; i < EPMAP_UUID_LANES; i++)
+       lanes[i] = table->uuid[i][row];
+   memcpy(uuid, lanes, sizeof(lanes));
+}
+
+/* Append the entries of a host. */
+EPMAPAPI int epmap_table_append(epmap_table_t *table, uint32_t host, 
+                                const ept_entry_t *entries, size_t n)
+{
+   const tower_entry_t *tower = NULL;
+   size_t row;
+   size_t i;
+
+   if (table_reserve(table, n) != EPMAP_EOK)
+       return EPMAP_ENOMEM;
+
+   for (i = 0; i < n; i++) {
+       tower = &entries[i].tower;
+       row = table->n_rows++;
+       table->host[row] = host;
+       table_set_uuid(table, row, &tower->if_id.uuid);
+       table->version[row] = ((uint32_t)tower->if_id.vers_major << 16) | tower->if_id.vers_minor;
+       table->protseq[row] = (uint8_t)tower_protseq(tower);
+       table->port[row] = tower->tcp_port ? tower->tcp_port : tower->udp_port;
+       table->pipe_id[row] = tower->pipe_id;
+       table->annotation_id[row] = entries[i].annotation_id;
+   }
+
+   return EPMAP_EOK;
+}
+
+/* Selections are bitmaps of the table rows, one bit per row in 64-bit 
+ * words. The filters below clear the bits of the rows that do not match,
+ * so they can be applied in sequence. 
+ */
+EPMAPAPI size_t epmap_select_words(const epmap_table_t *table)
+{
+   return (table->n_rows + 63) / 64;
+}
+
+EPMAPAPI void epmap_select_all(const epmap_table_t *table, uint64_t *select)
+{
+   size_t n = epmap_select_words(table);
+
+   memset(select, 0xff, n * sizeof(uint64_t));
+   if (table->n_rows % 64)
+       select[n - 1] = ((uint64_t)1 << (table->n_rows % 64)) - 1;
+}
+
+/* Rows with this interface UUID. Each lane is compared on four rows at
+ * once with SSE2, the rows match where all four lanes do. 
+ */
+EPMAPAPI void epmap_filter_uuid(const epmap_table_t *table, const uuid_t *uuid, uint64_t *select)
+{
+   size_t n = epmap_select_words(table);
+   uint32_t key[EPMAP_UUID_LANES];
+   uint64_t bits;
+   size_t w, i, row;
+#ifdef EPMAP_SSE2
+   __m128i k0, k1, k2, k3, eq;
+#endif
+
+   memcpy(key, uuid, sizeof(key));
+#ifdef EPMAP_SSE2
+   k0 = _mm_set1_epi32((int)key[0]);
+   k1 = _mm_set1_epi32((int)key[1]);
+   k2 = _mm_set1_epi32((int)key[2]);
+   k3 = _mm_set1_epi32((int)key[3]);
+#endif
+
+   for (w = 0; w < n; w++) {
+       if (select[w] == 0)
+           continue;
+       bits = 0;
+#ifdef EPMAP_SSE2
+       for (i = 0; i < 64; i += 4) {
+           row = w * 64 + i;
+           eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&table->uuid[0][row]), k0);
+           eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&table->uuid[1][row]), k1));
+           eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&table->uuid[2][row]), k2));
+           eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&table->uuid[3][row]), k3));
+           bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+       }
+#else
+       for (i = 0; i < 64; i++) {
+           row = w * 64 + i;
+           bits |= (uint64_t)(((table->uuid[0][row] ^ key[0]) | (table->uuid[1][row] ^ key[1]) |
+                               (table->uuid[2][row] ^ key[2]) | (table->uuid[3][row] ^ key[3])) == 0) << i;
+       }
+#endif
+       select[w] &= bits;
+   }
+}
+
+/* Rows with a port in [lo, hi], named pipes having port 0. */
+EPMAPAPI void epmap_filter_port(const epmap_table_t *table, uint16_t lo, uint16_t hi, uint64_t *select)
+{
+   size_t n = epmap_select_words(table);
+   uint64_t bits;
+   size_t w, i;
+#ifdef EPMAP_SSE2
+   __m128i vlo = _mm_set1_epi16((short)lo);
+   __m128i range = _mm_set1_epi16((short)(uint16_t)(hi - lo));
+   __m128i zero = _mm_setzero_si128();
+   __m128i d;
+#endif
+
+   if (hi < lo) {
+       memset(select, '\0', n * sizeof(uint64_t));
+       return;
+   }
+
+   for (w = 0; w < n; w++) {
+       if (select[w] == 0)
+           continue;
+       bits = 0;
+#ifdef EPMAP_SSE2
+       /* port - lo <= hi - lo, unsigned: the saturated difference is zero. */
+       for (i = 0; i < 64; i += 8) {
+           d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)&table->port[w * 64 + i]), vlo);
+           d = _mm_cmpeq_epi16(_mm_subs_epu16(d, range), zero);
+           bits |= (uint64_t)(_mm_movemask_epi8(_mm_packs_epi16(d, zero)) & 0xff) << i;
+       }
+#else
+       for (i = 0; i < 64; i++) 
+           bits |= (uint64_t)((uint16_t)(table->port[w * 64 + i] - lo) <= (uint16_t)(hi - lo)) << i;
+#endif
+       select[w] &= bits;
+   }
+}
+
+/* Rows with this protocol sequence, PROTO_ID_TCP, PROTO_ID_UDP or
+ * PROTO_ID_NAMED_PIPES. 
+ */
+EPMAPAPI void epmap_filter_protseq(const epmap_table_t *table, unsigned int protseq, uint64_t *select)
+{
+   size_t n = epmap_select_words(table);
+   uint64_t bits;
+   size_t w, i;
+#ifdef EPMAP_SSE2
+   __m128i p = _mm_set1_epi8((char)protseq);
+#endif
+
+   for (w = 0; w < n; w++) {
+       if (select[w] == 0)
+           continue;
+       bits = 0;
+#ifdef EPMAP_SSE2
+       for (i = 0; i < 64; i += 16) {
+           __m128i row = _mm_loadu_si128((const __m128i *)&table->protseq[w * 64 + i]);
+           bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(row, p)) << i;
+       }
+#else
+       for (i = 0; i < 64; i++) 
+           bits |= (uint64_t)(table->protseq[w * 64 + i] == protseq) << i;
+#endif
+       select[w] &= bits;
+   }
+}
+
+/* Index of the lowest set bit, bits being nonzero. */
+static unsigned int lowest_bit(uint64_t bits)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+   unsigned long i;
+
+   _BitScanForward64(&i, bits);
+   return (unsigned int)i;
+#elif defined(_MSC_VER)
+   unsigned long i;
+
+   if (_BitScanForward(&i, (unsigned long)bits))
+       return (unsigned int)i;
+   _BitScanForward(&i, (unsigned long)(bits >> 32));
+   return (unsigned int)i + 32;
+#else
+   return (unsigned int)__builtin_ctzll(bits);
+#endif
+}
+
+/* Store the indexes of the selected rows in rows, return their number. */
+EPMAPAPI size_t epmap_select_rows(const epmap_table_t *table, const uint64_t *select, uint32_t *rows)
+{
+   size_t n = epmap_select_words(table);
+   size_t count = 0;
+   uint64_t bits;
+   size_t w;
+
+   /* One step per selected row, clearing the lowest bit each time. */
+   for (w = 0; w < n; w++) {
+       for (bits = select[w]; bits != 0; bits &= bits - 1)
+           rows[count++] = (uint32_t)(w * 64 + lowest_bit(bits));
+   }
+
+   return count;
+}
+
+/* Machine-readable output: NDJSON, CSV or binary records, see
+ * epmap_output_open(). Records are formatted by the caller into one of
+ * EPMAP_OUTPUT_BUFFERS large buffers, which are handed in turn to a writer
+ * thread once full. The caller only waits when all of them are still being
+ * written (backpressure), never on the stream itself. A writer left idle
+ * for EPMAP_OUTPUT_FLUSH_MS takes the partial buffer, so that records of a
+ * slow scan do not sit in memory until 256 KB have been formatted.
+ */
+#define EPMAP_OUTPUT_NDJSON 1
+#define EPMAP_OUTPUT_CSV    2
+#define EPMAP_OUTPUT_BINARY 3
+
+#define EPMAP_OUTPUT_BUFSIZE (256 * 1024)
+#define EPMAP_OUTPUT_BUFFERS 4
+#define EPMAP_OUTPUT_FLUSH_MS 200
+
+/* Binary format: an 8-byte header, then one record per endpoint, all the
+ * integers little-endian:
+ *
+ *   u16 length      whole record, this field included
+ *   u8  flags       EPMAP_ENTRY_*
+ *   u8  protseq     PROTO_ID_*
+ *   u16 port        TCP or UDP port, 0 for named pipes
+ *   u8  probe       EPMAP_PROBE_*, EPMAP_PROBE_PENDING if not probed
+ *   u8  host_len
+ *   u8  uuid[16]    NDR layout
+ *   u16 vers_major
+ *   u16 vers_minor
+ *   u32 latency     microseconds, if the probe succeeded
+ *   u16 pipe_len
+ *   u8  annotation_len
+ *   u8  change      EPMAP_CHANGE_*
+ *   u16 previous_port
+ *   u16 previous_pipe_len
+ *   u8  previous_annotation_len
+ *   host, pipe, annotation, previous pipe and annotation, not terminated
+ *
+ * The previous endpoint and annotation are only set for
+ * EPMAP_CHANGE_CHANGED records.
+ */
+#define EPMAP_OUTPUT_MAGIC   "EPMB"
+#define EPMAP_OUTPUT_VERSION 2
+
+/* Records of a differential scan, see epmap_snapshot_diff(). */
+#define EPMAP_CHANGE_NONE    0
+#define EPMAP_CHANGE_ADDED   1
+#define EPMAP_CHANGE_REMOVED 2
+#define EPMAP_CHANGE_CHANGED 3 /* Same interface and protseq, new endpoint or annotation. */
+
+typedef struct epmap_output {
+   FILE    *stream;
+   int      format;
+   char    *buffers[EPMAP_OUTPUT_BUFFERS];
+   size_t   lengths[EPMAP_OUTPUT_BUFFERS];
+   char    *current;           /* Buffer being filled, or NULL, under lock. */
+   size_t   length;
+   uint64_t submitted;         /* Buffers handed to the writer... */
+   uint64_t written;           /* ...and written by it, both under lock. */
+   int      closing;
+   int      error;             /* Set by the writer. */
+   SRWLOCK  lock;
+   CONDITION_VARIABLE cond;
+   HANDLE   thread;
+   size_t   n_records;
+   size_t   n_stalls;          /* Times the caller waited for the writer. */
+} epmap_output_t;
+
+/* Hand the current buffer to the writer, if any. Called under lock, by the
+ * caller once the buffer is full or by the writer once idle.
+ */
+static void output_submit(epmap_output_t *out)
+{
+   if (out->current == NULL)
+       return;
+
+   out->lengths[out->submitted % EPMAP_OUTPUT_BUFFERS] = out->length;
+   out->submitted++;
+   WakeAllConditionVariable(&out->cond);
+   out->current = NULL;
+   out->length = 0;
+}
+
+static DWORD WINAPI output_thread(LPVOID param)
+{
+   epmap_output_t *out = param;
+   int index;
+   int error;
+
+   for (;;) {
+       AcquireSRWLockExclusive(&out->lock);
+       while (out->written == out->submitted && !out->closing) {
+           /* Idle: hand off what the caller has formatted so far. */
+           if (!SleepConditionVariableSRW(&out->cond, &out->lock, EPMAP_OUTPUT_FLUSH_MS, 0) &&
+               out->written == out->submitted && out->length != 0)
+               output_submit(out);
+       }
+       if (out->written == out->submitted) {
+           ReleaseSRWLockExclusive(&out->lock);
+           break;
+       }
+       index = (int)(out->written % EPMAP_OUTPUT_BUFFERS);
+       ReleaseSRWLockExclusive(&out->lock);
+
+       /* After an error, buffers are still consumed so the caller never
+        * waits forever. Flushed each time, a partial buffer would else
+        * stay in the CRT's. */
+       error = fwrite(out->buffers[index], 1, out->lengths[index], out->stream) != out->lengths[index] ||
+           fflush(out->stream) != 0;
+
+       AcquireSRWLockExclusive(&out->lock);
+       out->error |= error;
+       out->written++;
+       WakeAllConditionVariable(&out->cond);
+       ReleaseSRWLockExclusive(&out->lock);
+   }
+
+   if (fflush(out->stream) != 0)
+       out->error = 1;
+
+   return 0;
+}
+
+/* Return room for size bytes, waiting for a free buffer if needed. Called
+ * under lock, which is held until the record is complete and out->length
+ * counts it, so that the writer never takes a buffer half-formatted.
+ */
+static char *output_reserve(epmap_output_t *out, size_t size)
+{
+   if (out->current != NULL && EPMAP_OUTPUT_BUFSIZE - out->length >= size)
+       return out->current + out->length;
+
+   output_submit(out);
+
+   if (out->submitted - out->written == EPMAP_OUTPUT_BUFFERS) {
+       out->n_stalls++;
+       do {
+           SleepConditionVariableSRW(&out->cond, &out->lock, INFINITE, 0);
+       } while (out->submitted - out->written == EPMAP_OUTPUT_BUFFERS);
+   }
+   out->current = out->buffers[out->submitted % EPMAP_OUTPUT_BUFFERS];
+   out->length = 0;
+
+   return out->current;
+}
+
+static char *put_str(char *p, const char *str)
+{
+   size_t len = strlen(str);
+
+   memcpy(p, str, len);
+   return p + len;
+}
+
+static char *put_uint(char *p, uint32_t value)
+{
+   char digits[10];
+   int n = 0;
+
+   do {
+       digits[n++] = (char)('0' + value % 10);
+       value /= 10;
+   } while (value != 0);
+   while (n > 0)
+       *p++ = digits[--n];
+
+   return p;
+}
+
+static char *put_hex(char *p, uint32_t value, int digits)
+{
+   static const char hex[] = "0123456789abcdef";
+
+   while (digits-- > 0)
+       *p++ = hex[(value >> (digits * 4)) & 0xf];
+
+   return p;
+}
+
+static char *put_uuid(char *p, const uuid_t *uuid)
+{
+   int i;
+
+   p = put_hex(p, uuid->time_low, 8);
+   *p++ = '-';
+   p = put_hex(p, uuid->time_mid, 4);
+   *p++ = '-';
+   p = put_hex(p, uuid->time_hi_and_version, 4);
+   *p++ = '-';
+   p = put_hex(p, uuid->clock_seq_hi_and_reserved, 2);
+   p = put_hex(p, uuid->clock_seq_low, 2);
+   *p++ = '-';
+   for (i = 0; i < 6; i++)
+       p = put_hex(p, uuid->node[i], 2);
+
+   return p;
+}
+
+/* JSON string, at most 6 bytes per character plus the quotes. Host names
+ * and annotations need not be UTF-8, so bytes above 0x7f are escaped as
+ * \u00XX too (read as Latin-1), which keeps the output valid.
+ */
+static char *put_json(char *p, const char *str)
+{
+   unsigned char c;
+
+   *p++ = '"';
+   for (; (c = (unsigned char)*str) != '\0'; str++) {
+       if (c == '"' || c == '\\') {
+           *p++ = '\\';
+           *p++ = c;
+       } else if (c < 0x20 || c >= 0x7f) {
+           p = put_str(p, "\\u00");
+           p = put_hex(p, c, 2);
+       } else
+           *p++ = c;
+   }
+   *p++ = '"';
+
+   return p;
+}
+
+/* CSV field (RFC 4180), at most 2 bytes per character plus the quotes. */
+static char *put_csv(char *p, const char *str)
+{
+   if (strpbrk(str, ",\"\r\n") == NULL)
+       return put_str(p, str);
+
+   *p++ = '"';
+   for (; *str != '\0'; str++) {
+       if (*str == '"')
+           *p++ = '"';
+       *p++ = *str;
+   }
+   *p++ = '"';
+
+   return p;
+}
+
+static char *put_le16(char *p, uint16_t value)
+{
+   *p++ = (char)(value & 0xff);
+   *p++ = (char)(value >> 8);
+   return p;
+}
+
+static char *put_le32(char *p, uint32_t value)
+{
+   p = put_le16(p, (uint16_t)(value & 0xffff));
+   return put_le16(p, (uint16_t)(value >> 16));
+}
+
+static const char *probe_state_string(int state)
+{
+   static const char *states[] = {
+       "pending", "alive", "refused", "timeout", "notrpc", "error"
+   };
+
+   return state >= 0 && state <= EPMAP_PROBE_ERROR ? states[state] : "unknown";
+}
+
+static const char *change_string(int change)
+{
+   static const char *changes[] = { "none", "added", "removed", "changed" };
+
+   return change >= 0 && change <= EPMAP_CHANGE_CHANGED ? changes[change] : "unknown";
+}
+
+static uint16_t tower_port(const tower_entry_t *tower)
+{
+   return tower->tcp_port != 0 ? tower->tcp_port : tower->udp_port;
+}
+
+static char *format_ndjson(char *p, const char *server, const ept_entry_t *entry,
+                           const epmap_probe_t *probe, int change, const ept_entry_t *previous)
+{
+   const tower_entry_t *tower = &entry->tower;
+
+   *p++ = '{';
+   if (change != EPMAP_CHANGE_NONE) {
+       p = put_str(p, "\"change\":\"");
+       p = put_str(p, change_string(change));
+       p = put_str(p, "\",");
+   }
+   p = put_str(p, "\"host\":");
+   p = put_json(p, server);
+   p = put_str(p, ",\"uuid\":\"");
+   p = put_uuid(p, &tower->if_id.uuid);
+   p = put_str(p, "\",\"version\":\"");
+   p = put_uint(p, tower->if_id.vers_major);
+   *p++ = '.';
+   p = put_uint(p, tower->if_id.vers_minor);
+   *p++ = '"';
+   if (tower->service != NULL) {
+       p = put_str(p, ",\"service\":");
+       p = put_json(p, tower->service);
+   }
+   p = put_str(p, ",\"protseq\":\"");
+   p = put_str(p, proto_sequence_string(tower_protseq(tower)));
+   *p++ = '"';
+   if (tower_port(tower) != 0) {
+       p = put_str(p, ",\"port\":");
+       p = put_uint(p, tower_port(tower));
+   } else {
+       p = put_str(p, ",\"pipe\":");
+       p = put_json(p, epmap_string(tower->pipe_id));
+   }
+   p = put_str(p, ",\"annotation\":");
+   p = put_json(p, epmap_string(entry->annotation_id));
+   if (previous != NULL && tower_port(&previous->tower) != 0) {
+       p = put_str(p, ",\"previous_port\":");
+       p = put_uint(p, tower_port(&previous->tower));
+   } else if (previous != NULL) {
+       p = put_str(p, ",\"previous_pipe\":");
+       p = put_json(p, epmap_string(previous->tower.pipe_id));
+   }
+   if (previous != NULL && previous->annotation_id != entry->annotation_id) {
+       p = put_str(p, ",\"previous_annotation\":");
+       p = put_json(p, epmap_string(previous->annotation_id));
+   }
+   if (entry->flags & EPMAP_ENTRY_WATCHED)
+       p = put_str(p, ",\"watched\":true");
+   if (probe != NULL) {
+       p = put_str(p, ",\"probe\":\"");
+       p = put_str(p, probe_state_string(probe->state));
+       *p++ = '"';
+       if (probe->state == EPMAP_PROBE_ALIVE) {
+           p = put_str(p, ",\"latency_us\":");
+           p = put_uint(p, probe->latency);
+       }
+   }
+   p = put_str(p, "}\n");
+
+   return p;
+}
+
+#define CSV_HEADER "host,uuid,version,service,protseq,endpoint,annotation,watched,probe,latency_us," \
+                   "change,previous_endpoint,previous_annotation\n"
+
+static char *format_csv(char *p, const char *server, const ept_entry_t *entry,
+                        const epmap_probe_t *probe, int change, const ept_entry_t *previous)
+{
+   const tower_entry_t *tower = &entry->tower;
+
+   p = put_csv(p, server);
+   *p++ = ',';
+   p = put_uuid(p, &tower->if_id.uuid);
+   *p++ = ',';
+   p = put_uint(p, tower->if_id.vers_major);
+   *p++ = '.';
+   p = put_uint(p, tower->if_id.vers_minor);
+   *p++ = ',';
+   if (tower->service != NULL)
+       p = put_csv(p, tower->service);
+   *p++ = ',';
+   p = put_str(p, proto_sequence_string(tower_protseq(tower)));
+   *p++ = ',';
+   if (tower_port(tower) != 0)
+       p = put_uint(p, tower_port(tower));
+   else
+       p = put_csv(p, epmap_string(tower->pipe_id));
+   *p++ = ',';
+   p = put_csv(p, epmap_string(entry->annotation_id));
+   *p++ = ',';
+   *p++ = (entry->flags & EPMAP_ENTRY_WATCHED) ? '1' : '0';
+   *p++ = ',';
+   if (probe != NULL)
+       p = put_str(p, probe_state_string(probe->state));
+   *p++ = ',';
+   if (probe != NULL && probe->state == EPMAP_PROBE_ALIVE)
+       p = put_uint(p, probe->latency);
+   *p++ = ',';
+   if (change != EPMAP_CHANGE_NONE)
+       p = put_str(p, change_string(change));
+   *p++ = ',';
+   if (previous != NULL && tower_port(&previous->tower) != 0)
+       p = put_uint(p, tower_port(&previous->tower));
+   else if (previous != NULL)
+       p = put_csv(p, epmap_string(previous->tower.pipe_id));
+   *p++ = ',';
+   if (previous != NULL)
+       p = put_csv(p, epmap_string(previous->annotation_id));
+   *p++ = '\n';
+
+   return p;
+}
+
+/* Longest pipe names in a binary record: the fixed part is 41 bytes, the
+ * other strings at most 255 bytes each.
+ */
+#define BINARY_MAX_PIPE ((0xffff - 41 - 3 * 0xff) / 2)
+
+static char *format_binary(char *p, const char *server, const ept_entry_t *entry,
+                           const epmap_probe_t *probe, int change, const ept_entry_t *previous)
+{
+   const tower_entry_t *tower = &entry->tower;
+   const char *pipe = epmap_string(tower->pipe_id);
+   const char *annotation = epmap_string(entry->annotation_id);
+   const char *previous_pipe = previous != NULL ? epmap_string(previous->tower.pipe_id) : "";
+   const char *previous_annotation = previous != NULL ? epmap_string(previous->annotation_id) : "";
+   size_t host_len = strlen(server);
+   size_t pipe_len = strlen(pipe);
+   size_t annotation_len = strlen(annotation);
+   size_t previous_pipe_len = strlen(previous_pipe);
+   size_t previous_annotation_len = strlen(previous_annotation);
+   char *start = p;
+   int i;
+
+   /* Longer strings are truncated, none should be. */
+   if (host_len > 0xff)
+       host_len = 0xff;
+   if (pipe_len > BINARY_MAX_PIPE)
+       pipe_len = BINARY_MAX_PIPE;
+   if (annotation_len > 0xff)
+       annotation_len = 0xff;
+   if (previous_pipe_len > BINARY_MAX_PIPE)
+       previous_pipe_len = BINARY_MAX_PIPE;
+   if (previous_annotation_len > 0xff)
+       previous_annotation_len = 0xff;
+
+   p += 2;
+   *p++ = (char)entry->flags;
+   *p++ = (char)tower_protseq(tower);
+   p = put_le16(p, tower_port(tower));
+   *p++ = (char)(probe != NULL ? probe->state : EPMAP_PROBE_PENDING);
+   *p++ = (char)host_len;
+   p = put_le32(p, tower->if_id.uuid.time_low);
+   p = put_le16(p, tower->if_id.uuid.time_mid);
+   p = put_le16(p, tower->if_id.uuid.time_hi_and_version);
+   *p++ = (char)tower->if_id.uuid.clock_seq_hi_and_reserved;
+   *p++ = (char)tower->if_id.uuid.clock_seq_low;
+   for (i = 0; i < 6; i++)
+       *p++ = (char)tower->if_id.uuid.node[i];
+   p = put_le16(p, tower->if_id.vers_major);
+   p = put_le16(p, tower->if_id.vers_minor);
+   p = put_le32(p, probe != NULL && probe->state == EPMAP_PROBE_ALIVE ? probe->latency : 0);
+   p = put_le16(p, (uint16_t)pipe_len);
+   *p++ = (char)annotation_len;
+   *p++ = (char)change;
+   p = put_le16(p, previous != NULL ? tower_port(&previous->tower) : 0);
+   p = put_le16(p, (uint16_t)previous_pipe_len);
+   *p++ = (char)previous_annotation_len;
+   memcpy(p, server, host_len);
+   p += host_len;
+   memcpy(p, pipe, pipe_len);
+   p += pipe_len;
+   memcpy(p, annotation, annotation_len);
+   p += annotation_len;
+   memcpy(p, previous_pipe, previous_pipe_len);
+   p += previous_pipe_len;
+   memcpy(p, previous_annotation, previous_annotation_len);
+   p += previous_annotation_len;
+   put_le16(start, (uint16_t)(p - start));
+
+   return p;
+}
+
+/* Start writing records to stream, which must stay open until
+ * epmap_output_close(). Returns NULL if format is unknown or on failure.
+ */
+EPMAPAPI epmap_output_t *epmap_output_open(FILE *stream, int format)
+{
+   epmap_output_t *out;
+   char *p;
+   int i;
+
+   if (format < EPMAP_OUTPUT_NDJSON || format > EPMAP_OUTPUT_BINARY)
+       return NULL;
+
+   out = calloc(1, sizeof(*out));
+   if (out == NULL)
+       return NULL;
+
+   out->stream = stream;
+   out->format = format;
+   InitializeSRWLock(&out->lock);
+   InitializeConditionVariable(&out->cond);
+
+   for (i = 0; i < EPMAP_OUTPUT_BUFFERS; i++) {
+       out->buffers[i] = malloc(EPMAP_OUTPUT_BUFSIZE);
+       if (out->buffers[i] == NULL)
+           break;
+   }
+   if (i == EPMAP_OUTPUT_BUFFERS)
+       out->thread = CreateThread(NULL, 0, output_thread, out, 0, NULL);
+   if (out->thread == NULL) {
+       while (i-- > 0)
+           free(out->buffers[i]);
+       free(out);
+       return NULL;
+   }
+
+   AcquireSRWLockExclusive(&out->lock);
+   if (format == EPMAP_OUTPUT_CSV) {
+       p = output_reserve(out, sizeof(CSV_HEADER));
+       out->length += put_str(p, CSV_HEADER) - p;
+   } else if (format == EPMAP_OUTPUT_BINARY) {
+       p = output_reserve(out, 8);
+       memcpy(p, EPMAP_OUTPUT_MAGIC, 4);
+       p[4] = EPMAP_OUTPUT_VERSION;
+       memset(p + 5, '\0', 3);
+       out->length += 8;
+   }
+   ReleaseSRWLockExclusive(&out->lock);
+
+   return out;
+}
+
+/* Queue the record of a change, see epmap_snapshot_diff(). probe may be
+ * NULL, previous is only used for EPMAP_CHANGE_CHANGED. The strings are
+ * copied, the entries may be released as soon as the call returns.
+ */
+EPMAPAPI int epmap_output_change(epmap_output_t *out, const char *server, int change,
+                                 const ept_entry_t *entry, const ept_entry_t *previous,
+                                 const epmap_probe_t *probe)
+{
+   const char *service = entry != NULL ? entry->tower.service : NULL;
+   size_t size;
+   char *p, *end;
+
+   if (out == NULL || server == NULL || entry == NULL)
+       return EPMAP_EINVAL;
+   if (change != EPMAP_CHANGE_CHANGED)
+       previous = NULL;
+
+   /* Worst case, every character escaped. */
+   size = strlen(server) + strlen(epmap_string(entry->tower.pipe_id)) +
+       strlen(epmap_string(entry->annotation_id)) + (service != NULL ? strlen(service) : 0);
+   if (previous != NULL)
+       size += strlen(epmap_string(previous->tower.pipe_id)) + strlen(epmap_string(previous->annotation_id));
+   size = 6 * size + 320;
+   if (size > EPMAP_OUTPUT_BUFSIZE)
+       return EPMAP_EINVAL;
+
+   AcquireSRWLockExclusive(&out->lock);
+   p = output_reserve(out, size);
+   if (out->format == EPMAP_OUTPUT_NDJSON)
+       end = format_ndjson(p, server, entry, probe, change, previous);
+   else if (out->format == EPMAP_OUTPUT_CSV)
+       end = format_csv(p, server, entry, probe, change, previous);
+   else
+       end = format_binary(p, server, entry, probe, change, previous);
+   out->length += end - p;
+   out->n_records++;
+   ReleaseSRWLockExclusive(&out->lock);
+
+   return EPMAP_EOK;
+}
+
+/* Queue the record of an entry, probe may be NULL. */
+EPMAPAPI int epmap_output_entry(epmap_output_t *out, const char *server,
+                                const ept_entry_t *entry, const epmap_probe_t *probe)
+{
+   return epmap_output_change(out, server, EPMAP_CHANGE_NONE, entry, NULL, probe);
+}
+
+/* Write the pending records, stop the writer and free out. Returns
+ * EPMAP_EWRITE if any of the records could not be written.
+ */
+EPMAPAPI int epmap_output_close(epmap_output_t *out)
+{
+   int error;
+   int i;
+
+   if (out == NULL)
+       return EPMAP_EINVAL;
+
+   AcquireSRWLockExclusive(&out->lock);
+   output_submit(out);
+   out->closing = 1;
+   WakeAllConditionVariable(&out->cond);
+   ReleaseSRWLockExclusive(&out->lock);
+
+   WaitForSingleObject(out->thread, INFINITE);
+   CloseHandle(out->thread);
+
+   error = out->error;
+   for (i = 0; i < EPMAP_OUTPUT_BUFFERS; i++)
+       free(out->buffers[i]);
+   free(out);
+
+   return error ? EPMAP_EWRITE : EPMAP_EOK;
+}
+
+/* Scan snapshot: a file written once per scan and memory-mapped to be read,
+ * see epmap_snapshot_create() and epmap_snapshot_open(). All the structures
+ * are stored as they are in memory (little-endian, naturally aligned), so
+ * reading one is a pointer into the mapping:
+ *
+ *   header       epmap_snapshot_header_t
+ *   entries      one block per host, epmap_snapshot_entry_t sorted by
+ *                snapshot_entry_order(), without duplicates
+ *   host index   epmap_snapshot_host_t sorted by name
+ *   strings      nul-terminated, referenced by their offset; offset 0 is ""
+ *   terms        epmap_index_term_t sorted by UUID, 8-byte aligned
+ *   postings     of the terms, see epmap_index_build()
+ *
+ * A host is found in the index with a binary search. The terms and their
+ * postings are the inverted index of the snapshot, its hosts numbered in
+ * host index order, so that -q only searches them in place.
+ */
+#define EPMAP_SNAPSHOT_MAGIC   "EPMS"
+#define EPMAP_SNAPSHOT_VERSION 3
+
+/* Fingerprint of an endpoint map, see epmap_lookup_fingerprint(): a
+ * rolling hash of the entries in the order ept_lookup returns them, and
+ * the same for the first batch alone, which is enough to tell most
+ * changes after a single call.
+ */
+typedef struct epmap_fingerprint {
+   uint32_t count;             /* Entries, duplicates included. */
+   uint32_t first_count;       /* Entries of the first batch. */
+   uint64_t first_hash;
+   uint64_t hash;
+} epmap_fingerprint_t;
+
+typedef struct epmap_snapshot_header {
+   char     magic[4];
+   uint32_t version;
+   uint32_t n_hosts;
+   uint32_t n_terms;           /* Interfaces in the index. */
+   uint64_t n_entries;
+   uint64_t hosts;             /* File offset of the host index. */
+   uint64_t strings;           /* File offset of the strings. */
+   uint64_t strings_size;
+   int64_t  time;              /* Start of the scan, seconds since 1970. */
+   uint64_t terms;             /* File offset of the index terms, 0 if none. */
+   uint64_t postings;          /* File offset of the postings. */
+   uint64_t postings_size;
+} epmap_snapshot_header_t;
+
+typedef struct epmap_snapshot_host {
+   uint32_t name;              /* String offset. */
+   uint32_t n_entries;
+   uint64_t entries;           /* File offset of the entry block. */
+   epmap_fingerprint_t fingerprint; /* Zero if not known. */
+} epmap_snapshot_host_t;
+
+typedef struct epmap_snapshot_entry {
+   uuid_t   uuid;              /* Interface. */
+   uint16_t vers_major;
+   uint16_t vers_minor;
+   uint8_t  protseq;           /* PROTO_ID_* */
+   uint8_t  flags;             /* EPMAP_ENTRY_* */
+   uint16_t port;              /* TCP or UDP port, 0 for named pipes. */
+   uint32_t pipe;              /* String offset. */
+   uint32_t annotation;        /* String offset. */
+} epmap_snapshot_entry_t;
+
+/* Interface of the inverted index, see epmap_index_build(), as stored in
+ * snapshots. 
+ */
+typedef struct epmap_index_term {
+   uuid_t   uuid;
+   uint32_t n_postings;
+   uint32_t n_hosts;           /* Distinct hosts of the postings. */
+   uint64_t offset;            /* In postings. */
+   uint64_t size;
+} epmap_index_term_t;
+
+/* Open snapshot. */
+typedef struct epmap_snapshot {
+   const epmap_snapshot_header_t *header;
+   const epmap_snapshot_host_t   *hosts;
+   const char *strings;
+   size_t      size;
+   HANDLE      file;
+   HANDLE      mapping;
+} epmap_snapshot_t;
+
+/* Snapshot being written. Entry blocks are written as hosts are added, the
+ * index and the strings once the scan is over.
+ */
+typedef struct epmap_snapshot_writer {
+   FILE     *file;
+   uint64_t  offset;           /* End of the entry blocks. */
+   epmap_snapshot_header_t header;
+   epmap_snapshot_host_t *hosts;
+   size_t    max_hosts;
+   char     *strings;
+   size_t    max_strings;
+   uint32_t *offsets;          /* String offset of each interned ID, or 0. */
+   uint32_t  max_ids;
+   epmap_snapshot_entry_t *block; /* Sort buffer. */
+   size_t    max_block;
+   int       error;
+} epmap_snapshot_writer_t;
+
+static int uuid_order(const uuid_t *a, const uuid_t *b)
+{
+   if (a->time_low != b->time_low)
+       return a->time_low < b->time_low ? -1 : 1;
+   if (a->time_mid != b->time_mid)
+       return a->time_mid < b->time_mid ? -1 : 1;
+   if (a->time_hi_and_version != b->time_hi_and_version)
+       return a->time_hi_and_version < b->time_hi_and_version ? -1 : 1;
+   if (a->clock_seq_hi_and_reserved != b->clock_seq_hi_and_reserved)
+       return a->clock_seq_hi_and_reserved < b->clock_seq_hi_and_reserved ? -1 : 1;
+   if (a->clock_seq_low != b->clock_seq_low)
+       return a->clock_seq_low < b->clock_seq_low ? -1 : 1;
+
+   return memcmp(a->node, b->node, sizeof(a->node));
+}
+
+/* Order of the entries of a host: interface, version, protocol sequence,
+ * then endpoint, pipe names being case insensitive as in endpoint_equal(). 
+ * The strings of each entry are passed, they may come from two snapshots.
+ */
+static int snapshot_entry_order(const epmap_snapshot_entry_t *a, const char *pipe_a,
+                                const epmap_snapshot_entry_t *b, const char *pipe_b)
+{
+   int order = uuid_order(&a->uuid, &b->uuid);
+
+   if (order != 0)
+       return order;
+   if (a->vers_major != b->vers_major)
+       return a->vers_major < b->vers_major ? -1 : 1;
+   if (a->vers_minor != b->vers_minor)
+       return a->vers_minor < b->vers_minor ? -1 : 1;
+   if (a->protseq != b->protseq)
+       return a->protseq < b->protseq ? -1 : 1;
+   if (a->port != b->port)
+       return a->port < b->port ? -1 : 1;
+
+   return _stricmp(pipe_a, pipe_b);
+}
+
+/* Snapshot form of a decoded entry, its strings still being interned IDs. */
+static void snapshot_entry_set(epmap_snapshot_entry_t *record, const ept_entry_t *entry)
+{
+   const tower_entry_t *tower = &entry->tower;
+
+   memset(record, '\0', sizeof(*record));
+   record->uuid = tower->if_id.uuid;
+   record->vers_major = tower->if_id.vers_major;
+   record->vers_minor = tower->if_id.vers_minor;
+   record->protseq = (uint8_t)tower_protseq(tower);
+   record->flags = (uint8_t)entry->flags;
+   record->port = tower->tcp_port != 0 ? tower->tcp_port : tower->udp_port;
+   record->pipe = tower->pipe_id;
+   record->annotation = entry->annotation_id;
+}
+
+static int snapshot_sort_compare(const void *a, const void *b)
+{
+   const epmap_snapshot_entry_t *x = a;
+   const epmap_snapshot_entry_t *y = b;
+
+   return snapshot_entry_order(x, epmap_string(x->pipe), y, epmap_string(y->pipe));
+}
+
+/* Snapshot form of entries, sorted and without duplicates, in block. 
+ * Returns the number of entries kept.
+ */
+static size_t snapshot_block(epmap_snapshot_entry_t *block, const ept_entry_t *entries, size_t n_entries)
+{
+   size_t i, n;
+
+   for (i = 0; i < n_entries; i++)
+       snapshot_entry_set(&block[i], &entries[i]);
+   qsort(block, n_entries, sizeof(epmap_snapshot_entry_t), snapshot_sort_compare);
+
+   for (i = 0, n = 0; i < n_entries; i++) {
+       if (n == 0 || snapshot_sort_compare(&block[n - 1], &block[i]) != 0)
+           block[n++] = block[i];
+   }
+
+   return n;
+}
+
+/* Decoded form of a snapshot entry whose strings are interned IDs. */
+static void snapshot_entry_get(const epmap_snapshot_entry_t *record, ept_entry_t *entry)
+{
+   tower_entry_t *tower = &entry->tower;
+
+   memset(entry, '\0', sizeof(*entry));
+   tower->if_id.uuid = record->uuid;
+   tower->if_id.vers_major = record->vers_major;
+   tower->if_id.vers_minor = record->vers_minor;
+   tower->service = epmap_uuid_name(&record->uuid);
+   tower->proto_id = record->protseq;
+   if (record->protseq == PROTO_ID_TCP)
+       tower->tcp_port = record->port;
+   else if (record->protseq == PROTO_ID_UDP)
+       tower->udp_port = record->port;
+   tower->pipe_id = record->pipe;
+   entry->annotation_id = record->annotation;
+   entry->flags = record->flags;
+}
+
+/* String offset of an interned ID, the string is added on first use. */
+static int snapshot_string(epmap_snapshot_writer_t *writer, uint32_t id, uint32_t *offset)
+{
+   const char *str = epmap_string(id);
+   size_t len = strlen(str) + 1;
+   size_t size = writer->header.strings_size;
+   uint32_t *offsets;
+   char *strings;
+   size_t max;
+   uint32_t n;
+
+   *offset = 0;
+   if (id == 0)
+       return EPMAP_EOK;
+
+   if (id >= writer->max_ids) {
+       for (n = writer->max_ids ? writer->max_ids : 1024; n <= id; n *= 2)
+           ;
+       offsets = realloc(writer->offsets, n * sizeof(uint32_t));
+       if (offsets == NULL)
+           return EPMAP_ENOMEM;
+       memset(offsets + writer->max_ids, '\0', (n - writer->max_ids) * sizeof(uint32_t));
+       writer->offsets = offsets;
+       writer->max_ids = n;
+   }
+
+   if (writer->offsets[id] == 0) {
+       if (size + len > 0xffffffff)
+           return EPMAP_ENOMEM;
+       if (size + len > writer->max_strings) {
+           for (max = writer->max_strings * 2; max < size + len; max *= 2)
+               ;
+           strings = realloc(writer->strings, max);
+           if (strings == NULL)
+               return EPMAP_ENOMEM;
+           writer->strings = strings;
+           writer->max_strings = max;
+       }
+       memcpy(writer->strings + size, str, len);
+       writer->offsets[id] = (uint32_t)size;
+       writer->header.strings_size = size + len;
+   }
+
+   *offset = writer->offsets[id];
+
+   return EPMAP_EOK;
+}
+
+static int snapshot_write(epmap_snapshot_writer_t *writer, const void *data, size_t size)
+{
+   if (size != 0 && fwrite(data, 1, size, writer->file) != size)
+       writer->error = 1;
+   writer->offset += size;
+
+   return writer->error ? EPMAP_EWRITE : EPMAP_EOK;
+}
+
+/* Create path, replacing it, and write its header. time is the start of
+ * the scan.
+ */
+EPMAPAPI int epmap_snapshot_create(epmap_snapshot_writer_t *writer, const char *path, int64_t time)
+{
+   memset(writer, '\0', sizeof(*writer));
+
+   /* Read as well, the index is built from the entry blocks. */
+   writer->file = fopen(path, "w+b");
+   if (writer->file == NULL)
+       return EPMAP_EWRITE;
+
+   /* The header is written again once complete. */
+   memcpy(writer->header.magic, EPMAP_SNAPSHOT_MAGIC, 4);
+   writer->header.version = EPMAP_SNAPSHOT_VERSION;
+   writer->header.time = time;
+   writer->header.strings_size = 1;
+   writer->max_strings = 65536;
+   writer->strings = malloc(writer->max_strings);
+   if (writer->strings == NULL) {
+       fclose(writer->file);
+       writer->file = NULL;
+       return EPMAP_ENOMEM;
+   }
+   writer->strings[0] = '\0';
+
+   return snapshot_write(writer, &writer->header, sizeof(writer->header));
+}
+
+/* Add the entries of a host, in any order, and their fingerprint if fp is
+ * not NULL. Each host must only be added once: the last one added wins.
+ */
+EPMAPAPI int epmap_snapshot_add(epmap_snapshot_writer_t *writer, const char *server,
+                                const ept_entry_t *entries, size_t n_entries,
+                                const epmap_fingerprint_t *fp)
+{
+   epmap_snapshot_host_t *host;
+   epmap_snapshot_entry_t *block;
+   uint32_t name;
+   size_t i, n;
+   int result;
+
+   if (writer->file == NULL || n_entries > 0xffffffff)
+       return EPMAP_EINVAL;
+   if (writer->error)
+       return EPMAP_EWRITE;
+
+   if (writer->header.n_hosts == writer->max_hosts) {
+       n = writer->max_hosts ? writer->max_hosts * 2 : 1024;
+       host = realloc(writer->hosts, n * sizeof(epmap_snapshot_host_t));
+       if (host == NULL)
+           return EPMAP_ENOMEM;
+       writer->hosts = host;
+       writer->max_hosts = n;
+   }
+   if (n_entries > writer->max_block) {
+       block = realloc(writer->block, n_entries * sizeof(epmap_snapshot_entry_t));
+       if (block == NULL)
+           return EPMAP_ENOMEM;
+       writer->block = block;
+       writer->max_block = n_entries;
+   }
+
+   /* Host names are interned as well, for their offset. */
+   result = epmap_intern(server, strlen(server), &name);
+   if (result == EPMAP_EOK)
+       result = snapshot_string(writer, name, &name);
+   if (result != EPMAP_EOK)
+       return result;
+
+   block = writer->block;
+   n = snapshot_block(block, entries, n_entries);
+
+   for (i = 0; i < n; i++) {
+       result = snapshot_string(writer, block[i].pipe, &block[i].pipe);
+       if (result == EPMAP_EOK)
+           result = snapshot_string(writer, block[i].annotation, &block[i].annotation);
+       if (result != EPMAP_EOK)
+           return result;
+   }
+
+   host = &writer->hosts[writer->header.n_hosts++];
+   host->name = name;
+   host->n_entries = (uint32_t)n;
+   host->entries = writer->offset;
+   if (fp != NULL)
+       host->fingerprint = *fp;
+   else
+       memset(&host->fingerprint, '\0', sizeof(host->fingerprint));
+   writer->header.n_entries += n;
+
+   return snapshot_write(writer, block, n * sizeof(epmap_snapshot_entry_t));
+}
+
+static const char *snapshot_sort_strings;
+
+static int snapshot_host_compare(const void *a, const void *b)
+{
+   const epmap_snapshot_host_t *x = a;
+   const epmap_snapshot_host_t *y = b;
+   int order = strcmp(snapshot_sort_strings + x->name, snapshot_sort_strings + y->name);
+
+   /* Later blocks last, they replace the earlier ones. */
+   if (order == 0)
+       order = x->entries < y->entries ? -1 : x->entries > y->entries;
+
+   return order;
+}
+
+static void snapshot_writer_free(epmap_snapshot_writer_t *writer)
+{
+   free(writer->hosts);
+   free(writer->strings);
+   free(writer->offsets);
+   free(writer->block);
+   memset(writer, '\0', sizeof(*writer));
+}
+
+/* Work saved by fingerprints, see epmap_lookup_fingerprint(). */
+typedef struct epmap_fingerprint_stats {
+   size_t hosts;               /* Hosts with a saved fingerprint. */
+   size_t first_matches;       /* First batch unchanged. */
+   size_t matches;             /* Whole map unchanged, nothing to diff. */
+   size_t mismatches;          /* To be diffed in full. */
+   size_t lookups_avoided;     /* ept_lookup calls not made, estimated. */
+   size_t entries_avoided;     /* Entries neither received nor decoded. */
+} epmap_fingerprint_stats_t;
+
+static uint64_t fingerprint_mix(uint64_t hash, const void *data, size_t len)
+{
+   const unsigned char *ptr = data;
+
+   while (len-- > 0)
+       hash = (hash ^ *ptr++) * 0x100000001b3ULL;
+
+   return hash;
+}
+
+/* Hash of an entry, on its fields so that it doesn't depend on the layout
+ * of ept_entry_t. The flags are left out, they depend on the watchlist.
+ */
+static uint64_t fingerprint_entry(const ept_entry_t *entry)
+{
+   const tower_entry_t *tower = &entry->tower;
+   const char *str;
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   uint32_t value;
+
+   hash = fingerprint_mix(hash, &tower->if_id.uuid, sizeof(uuid_t));
+   value = ((uint32_t)tower->if_id.vers_major << 16) | tower->if_id.vers_minor;
+   hash = fingerprint_mix(hash, &value, sizeof(value));
+   value = (tower_protseq(tower) << 16) | tower_port(tower);
+   hash = fingerprint_mix(hash, &value, sizeof(value));
+   str = epmap_string(tower->pipe_id);
+   hash = fingerprint_mix(hash, str, strlen(str) + 1);
+   str = epmap_string(entry->annotation_id);
+   hash = fingerprint_mix(hash, str, strlen(str) + 1);
+
+   return hash;
+}
+
+EPMAPAPI void epmap_fingerprint_init(epmap_fingerprint_t *fp)
+{
+   memset(fp, '\0', sizeof(*fp));
+}
+
+/* Add the next batch of entries. The first one added is the first batch. */
+EPMAPAPI void epmap_fingerprint_add(epmap_fingerprint_t *fp, const ept_entry_t *entries, size_t n)
+{
+   int first = fp->count == 0;
+   size_t i;
+
+   for (i = 0; i < n; i++) {
+       fp->hash = (fp->hash ^ fingerprint_entry(&entries[i])) * 0x9e3779b97f4a7c15ULL;
+       fp->hash ^= fp->hash >> 29;
+   }
+   fp->count += (uint32_t)n;
+
+   if (first) {
+       fp->first_count = fp->count;
+       fp->first_hash = fp->hash;
+   }
+}
+
+/* Does fp match the saved fingerprint, on the first batch only or on the
+ * whole map? An unknown (zero) fingerprint never does.
+ */
+EPMAPAPI int epmap_fingerprint_match(const epmap_fingerprint_t *fp, const epmap_fingerprint_t *known, int first)
+{
+   if (known == NULL || known->count == 0 || fp->first_count != known->first_count ||
+       fp->first_hash != known->first_hash)
+       return 0;
+
+   return first || (fp->count == known->count && fp->hash == known->hash);
+}
+
+/* Enumerate the map into result, one batch at a time, and fingerprint it.
+ * known is the fingerprint saved for the host, or NULL. If quick is set
+ * and the first batch matches it, the enumeration stops there: result
+ * only holds that batch, the map is assumed unchanged and *unchanged is
+ * set. Otherwise it goes on, and *unchanged is set if the whole map
+ * matches. stats, if not NULL, accumulates the work saved.
+ */
+EPMAPAPI int epmap_lookup_fingerprint(epmap_t *epmap, epmap_result_t *result, epmap_fingerprint_t *fp,
+                                      const epmap_fingerprint_t *known, int quick, int *unchanged,
+                                      epmap_fingerprint_stats_t *stats)
+{
+   epmap_lookup_t lookup;
+   const ept_entry_t *entries;
+   ept_entry_t *copy;
+   size_t count, left;
+   int status;
+
+   *unchanged = 0;
+   epmap_fingerprint_init(fp);
+   if (known != NULL && known->count == 0)
+       known = NULL;
+
+   status = epmap_lookup_begin(epmap, &lookup);
+   while (status == EPMAP_EOK) {
+       status = epmap_lookup_batch(&lookup, &entries, &count);
+       if (status != EPMAP_EOK)
+           break;
+
+       copy = epmap_result_reserve(result, count);
+       if (copy == NULL) {
+           status = EPMAP_ENOMEM;
+           break;
+       }
+       memcpy(copy, entries, count * sizeof(ept_entry_t));
+       result->n_entries += count;
+       epmap_fingerprint_add(fp, entries, count);
+
+       if (quick && fp->count == fp->first_count && epmap_fingerprint_match(fp, known, 1)) {
+           *unchanged = 1;
+           break;
+       }
+   }
+   epmap_lookup_end(&lookup);
+
+   if (status == EPMAP_ENODATA) {
+       status = EPMAP_EOK;
+       *unchanged = epmap_fingerprint_match(fp, known, 0);
+   }
+   if (status != EPMAP_EOK || known == NULL || stats == NULL)
+       return status;
+
+   stats->hosts++;
+   stats->first_matches += epmap_fingerprint_match(fp, known, 1);
+   if (*unchanged)
+       stats->matches++;
+   else
+       stats->mismatches++;
+   if (*unchanged && fp->count < known->count) {
+       left = known->count - fp->count;
+       stats->entries_avoided += left;
+       stats->lookups_avoided += (left + lookup.max_entries - 1) / lookup.max_entries;
+   }
+
+   return EPMAP_EOK;
+}
+
+EPMAPAPI void epmap_snapshot_close(epmap_snapshot_t *snap)
+{
+   if (snap->header != NULL)
+       UnmapViewOfFile(snap->header);
+   if (snap->mapping != NULL)
+       CloseHandle(snap->mapping);
+   if (snap->file != INVALID_HANDLE_VALUE && snap->file != NULL)
+       CloseHandle(snap->file);
+   memset(snap, '\0', sizeof(*snap));
+}
+
+/* Map a snapshot. Only the header and the index are checked, in O(number
+ * of hosts); nothing is read until it is used.
+ */
+EPMAPAPI int epmap_snapshot_open(epmap_snapshot_t *snap, const char *path)
+{
+   const epmap_snapshot_header_t *header;
+   const epmap_snapshot_host_t *host;
+   LARGE_INTEGER size;
+   uint32_t i;
+
+   memset(snap, '\0', sizeof(*snap));
+
+   snap->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+       FILE_ATTRIBUTE_NORMAL, NULL);
+   if (snap->file == INVALID_HANDLE_VALUE)
+       return EPMAP_EINVAL;
+
+   if (!GetFileSizeEx(snap->file, &size) || size.QuadPart < (LONGLONG)sizeof(*header) ||
+       (uint64_t)size.QuadPart > (SIZE_MAX >> 1)) {
+       epmap_snapshot_close(snap);
+       return EPMAP_EPROTO;
+   }
+   snap->size = (size_t)size.QuadPart;
+
+   snap->mapping = CreateFileMappingA(snap->file, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (snap->mapping != NULL)
+       snap->header = MapViewOfFile(snap->mapping, FILE_MAP_READ, 0, 0, 0);
+   if (snap->header == NULL) {
+       epmap_snapshot_close(snap);
+       return EPMAP_ENOMEM;
+   }
+
+   header = snap->header;
+   if (memcmp(header->magic, EPMAP_SNAPSHOT_MAGIC, 4) != 0 ||
+       header->version != EPMAP_SNAPSHOT_VERSION ||
+       header->hosts > snap->size || header->hosts % 8 != 0 ||
+       header->n_hosts > (snap->size - header->hosts) / sizeof(epmap_snapshot_host_t) ||
+       header->strings > snap->size || header->strings_size == 0 ||
+       header->strings_size > snap->size - header->strings ||
+       (header->terms != 0 && (header->terms > snap->size || header->terms % 8 != 0 ||
+        header->n_terms > (snap->size - header->terms) / sizeof(epmap_index_term_t) ||
+        header->postings > snap->size || header->postings_size > snap->size - header->postings))) {
+       epmap_snapshot_close(snap);
+       return EPMAP_EPROTO;
+   }
+
+   snap->hosts = (const epmap_snapshot_host_t *)((const char *)header + header->hosts);
+   snap->strings = (const char *)header + header->strings;
+
+   /* The strings must end with a nul byte, and the blocks be in the file. */
+   if (snap->strings[header->strings_size - 1] != '\0') {
+       epmap_snapshot_close(snap);
+       return EPMAP_EPROTO;
+   }
+   for (i = 0; i < header->n_hosts; i++) {
+       host = &snap->hosts[i];
+       if (host->name >= header->strings_size || host->entries % 8 != 0 ||
+           host->entries > snap->size ||
+           host->n_entries > (snap->size - host->entries) / sizeof(epmap_snapshot_entry_t)) {
+           epmap_snapshot_close(snap);
+           return EPMAP_EPROTO;
+       }
+   }
+
+   return EPMAP_EOK;
+}
+
+/* String at offset, "" if out of bounds. */
+EPMAPAPI const char *epmap_snapshot_string(const epmap_snapshot_t *snap, uint32_t offset)
+{
+   return offset < snap->header->strings_size ? snap->strings + offset : "";
+}
+
+/* Binary search of the host index, NULL if server is not in the snapshot. */
+EPMAPAPI const epmap_snapshot_host_t *epmap_snapshot_find(const epmap_snapshot_t *snap, const char *server)
+{
+   size_t lo = 0, hi = snap->header->n_hosts, mid;
+   int order;
+
+   while (lo < hi) {
+       mid = lo + (hi - lo) / 2;
+       order = strcmp(server, epmap_snapshot_string(snap, snap->hosts[mid].name));
+       if (order == 0)
+           return &snap->hosts[mid];
+       if (order < 0)
+           hi = mid;
+       else
+           lo = mid + 1;
+   }
+
+   return NULL;
+}
+
+EPMAPAPI const epmap_snapshot_entry_t *epmap_snapshot_entries(const epmap_snapshot_t *snap,
+                                                              const epmap_snapshot_host_t *host)
+{
+   return (const epmap_snapshot_entry_t *)((const char *)snap->header + host->entries);
+}
+
+/* Decoded form of a snapshot entry, for the functions that take one. Its
+ * strings are interned.
+ */
+EPMAPAPI int epmap_snapshot_entry_load(const epmap_snapshot_t *snap, const epmap_snapshot_entry_t *record,
+                                       ept_entry_t *entry)
+{
+   const char *str;
+   int result;
+
+   snapshot_entry_get(record, entry);
+
+   str = epmap_snapshot_string(snap, record->pipe);
+   result = epmap_intern(str, strlen(str), &entry->tower.pipe_id);
+   if (result == EPMAP_EOK) {
+       str = epmap_snapshot_string(snap, record->annotation);
+       result = epmap_intern(str, strlen(str), &entry->annotation_id);
+   }
+
+   return result;
+}
+
+/* Called for each change by epmap_snapshot_diff(), a non-zero value stops.
+ * entry is the snapshot's for EPMAP_CHANGE_REMOVED; previous is only set for
+ * EPMAP_CHANGE_CHANGED.
+ */
+typedef int (*epmap_change_cb)(void *context, int change, const ept_entry_t *entry,
+                               const ept_entry_t *previous);
+
+/* Interface part of snapshot_entry_order(). */
+static int snapshot_interface_order(const epmap_snapshot_entry_t *a, const epmap_snapshot_entry_t *b)
+{
+   int order = uuid_order(&a->uuid, &b->uuid);
+
+   if (order != 0)
+       return order;
+   if (a->vers_major != b->vers_major)
+       return a->vers_major < b->vers_major ? -1 : 1;
+   if (a->vers_minor != b->vers_minor)
+       return a->vers_minor < b->vers_minor ? -1 : 1;
+
+   return (int)a->protseq - (int)b->protseq;
+}
+
+/* Report a change, old from the snapshot, new from the scan (interned IDs). */
+static int diff_report(const epmap_snapshot_t *snap, epmap_change_cb callback, void *context, int change,
+                       const epmap_snapshot_entry_t *old, const epmap_snapshot_entry_t *fresh)
+{
+   ept_entry_t entry, previous;
+   int result = EPMAP_EOK;
+
+   if (old != NULL)
+       result = epmap_snapshot_entry_load(snap, old, &previous);
+   if (fresh != NULL)
+       snapshot_entry_get(fresh, &entry);
+   if (result != EPMAP_EOK)
+       return result;
+
+   if (change == EPMAP_CHANGE_REMOVED)
+       return callback(context, change, &previous, NULL);
+
+   return callback(context, change, &entry, change == EPMAP_CHANGE_CHANGED ? &previous : NULL);
+}
+
+/* Differential scan: compare the entries of server, in any order, with the
+ * ones saved in the snapshot (none if snap is NULL or does not have the
+ * host). Both sides are sorted the same way, so a single merge finds the
+ * changes. Within an interface and protocol sequence, endpoints only on one
+ * side are paired in order as EPMAP_CHANGE_CHANGED (a moved dynamic port),
+ * the others are added or removed. An endpoint whose annotation differs is
+ * changed as well. Returns EPMAP_EOK, or the non-zero value of the callback.
+ */
+EPMAPAPI int epmap_snapshot_diff(const epmap_snapshot_t *snap, const char *server,
+                                 const ept_entry_t *entries, size_t n_entries,
+                                 epmap_change_cb callback, void *context)
+{
+   const epmap_snapshot_host_t *host = snap != NULL ? epmap_snapshot_find(snap, server) : NULL;
+   const epmap_snapshot_entry_t *old = host != NULL ? epmap_snapshot_entries(snap, host) : NULL;
+   size_t n_old = host != NULL ? host->n_entries : 0;
+   epmap_snapshot_entry_t *fresh;
+   size_t *old_left, *new_left;
+   size_t n_new, n_old_left, n_new_left;
+   size_t i = 0, j = 0, k, end_i, end_j;
+   int order;
+   int result = EPMAP_EOK;
+
+   if (callback == NULL)
+       return EPMAP_EINVAL;
+
+   fresh = malloc((n_entries + 1) * sizeof(epmap_snapshot_entry_t));
+   old_left = malloc((n_old + 1) * sizeof(size_t));
+   new_left = malloc((n_entries + 1) * sizeof(size_t));
+   if (fresh == NULL || old_left == NULL || new_left == NULL) {
+       free(fresh);
+       free(old_left);
+       free(new_left);
+       return EPMAP_ENOMEM;
+   }
+   n_new = snapshot_block(fresh, entries, n_entries);
+
+   while (result == EPMAP_EOK && (i < n_old || j < n_new)) {
+       order = i == n_old ? 1 : j == n_new ? -1 : snapshot_interface_order(&old[i], &fresh[j]);
+       if (order < 0) {
+           result = diff_report(snap, callback, context, EPMAP_CHANGE_REMOVED, &old[i++], NULL);
+           continue;
+       }
+       if (order > 0) {
+           result = diff_report(snap, callback, context, EPMAP_CHANGE_ADDED, NULL, &fresh[j++]);
+           continue;
+       }
+
+       /* Same interface on both sides: merge its endpoints. */
+       for (end_i = i; end_i < n_old && snapshot_interface_order(&old[end_i], &old[i]) == 0; end_i++)
+           ;
+       for (end_j = j; end_j < n_new && snapshot_interface_order(&fresh[end_j], &fresh[j]) == 0; end_j++)
+           ;
+       n_old_left = n_new_left = 0;
+       while (result == EPMAP_EOK && (i < end_i || j < end_j)) {
+           order = i == end_i ? 1 : j == end_j ? -1 :
+               snapshot_entry_order(&old[i], epmap_snapshot_string(snap, old[i].pipe),
+                                    &fresh[j], epmap_string(fresh[j].pipe));
+           if (order < 0) {
+               old_left[n_old_left++] = i++;
+           } else if (order > 0) {
+               new_left[n_new_left++] = j++;
+           } else {
+               if (strcmp(epmap_snapshot_string(snap, old[i].annotation), epmap_string(fresh[j].annotation)) != 0)
+                   result = diff_report(snap, callback, context, EPMAP_CHANGE_CHANGED, &old[i], &fresh[j]);
+               i++;
+               j++;
+           }
+       }
+       for (k = 0; result == EPMAP_EOK && (k < n_old_left || k < n_new_left); k++) {
+           if (k < n_old_left && k < n_new_left)
+               result = diff_report(snap, callback, context, EPMAP_CHANGE_CHANGED, &old[old_left[k]], &fresh[new_left[k]]);
+           else if (k < n_old_left)
+               result = diff_report(snap, callback, context, EPMAP_CHANGE_REMOVED, &old[old_left[k]], NULL);
+           else
+               result = diff_report(snap, callback, context, EPMAP_CHANGE_ADDED, NULL, &fresh[new_left[k]]);
+       }
+   }
+
+   free(fresh);
+   free(old_left);
+   free(new_left);
+
+   return result;
+}
+
+/* Columnar export of a table, see epmap_table_export(). Interface UUIDs,
+ * pipe names and annotations are stored once in dictionaries and the
+ * columns hold their indexes; host indexes and ports are stored as the
+ * difference with the previous row. Every integer is a LEB128 varint,
+ * differences are zigzag-encoded first. The file is:
+ *
+ *   char magic[4]   "EPMC"
+ *   u32  version
+ *   u64  n_rows
+ *   u32  n_hosts, n_uuids, n_strings, reserved
+ *
+ * then EPMAP_COLUMN_SECTIONS sections, each one a u64 byte size followed by
+ * its data, in this order: host names, UUIDs (16 bytes each, NDR layout),
+ * strings (index 0 is ""), then the host, uuid, version, protseq (one byte
+ * per row), port, pipe and annotation columns. The fixed-size integers
+ * are little-endian. A reader can skip the columns it does not need.
+ */
+#define EPMAP_COLUMNS_MAGIC   "EPMC"
+#define EPMAP_COLUMNS_VERSION 1
+
+#define EPMAP_COLUMN_HOST       0x01
+#define EPMAP_COLUMN_UUID       0x02
+#define EPMAP_COLUMN_VERSION    0x04
+#define EPMAP_COLUMN_PROTSEQ    0x08
+#define EPMAP_COLUMN_PORT       0x10
+#define EPMAP_COLUMN_PIPE       0x20
+#define EPMAP_COLUMN_ANNOTATION 0x40
+#define EPMAP_COLUMN_ALL        0x7f
+
+#define EPMAP_COLUMN_SECTIONS 10
+
+typedef struct column_buffer {
+   unsigned char *data;
+   size_t length;
+   size_t max;
+} column_buffer_t;
+
+static int column_reserve(column_buffer_t *col, size_t n)
+{
+   unsigned char *data;
+   size_t max = col->max ? col->max : 4096;
+
+   if (col->max - col->length >= n)
+       return EPMAP_EOK;
+
+   while (max - col->length < n)
+       max *= 2;
+   data = realloc(col->data, max);
+   if (data == NULL)
+       return EPMAP_ENOMEM;
+   col->data = data;
+   col->max = max;
+
+   return EPMAP_EOK;
+}
+
+static int column_varint(column_buffer_t *col, uint64_t value)
+{
+   if (column_reserve(col, 10) != EPMAP_EOK)
+       return EPMAP_ENOMEM;
+
+   while (value >= 0x80) {
+       col->data[col->length++] = (unsigned char)(value | 0x80);
+       value >>= 7;
+   }
+   col->data[col->length++] = (unsigned char)value;
+
+   return EPMAP_EOK;
+}
+
+static int column_bytes(column_buffer_t *col, const void *data, size_t n)
+{
+   if (column_reserve(col, n) != EPMAP_EOK)
+       return EPMAP_ENOMEM;
+
+   memcpy(col->data + col->length, data, n);
+   col->length += n;
+
+   return EPMAP_EOK;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+   return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+   return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* UUID as 16 NDR bytes, and back. */
+static void uuid_to_ndr(unsigned char *p, const uuid_t *uuid)
+{
+   p = (unsigned char *)put_le32((char *)p, uuid->time_low);
+   p = (unsigned char *)put_le16((char *)p, uuid->time_mid);
+   p = (unsigned char *)put_le16((char *)p, uuid->time_hi_and_version);
+   *p++ = uuid->clock_seq_hi_and_reserved;
+   *p++ = uuid->clock_seq_low;
+   memcpy(p, uuid->node, 6);
+}
+
+static void uuid_from_ndr(uuid_t *uuid, const unsigned char *p)
+{
+   uuid->time_low = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+   uuid->time_mid = (uint16_t)(p[4] | (p[5] << 8));
+   uuid->time_hi_and_version = (uint16_t)(p[6] | (p[7] << 8));
+   uuid->clock_seq_hi_and_reserved = p[8];
+   uuid->clock_seq_low = p[9];
+   memcpy(uuid->node, p + 10, 6);
+}
+
+/* Export state: the dictionaries being built and the sections. */
+typedef struct column_export {
+   column_buffer_t sections[EPMAP_COLUMN_SECTIONS];
+   uint32_t *uuid_slots;       /* Open addressing: dictionary index + 1, or 0. */
+   uint32_t  uuid_mask;
+   uint32_t  n_uuids;
+   uint32_t *string_index;     /* Dictionary index + 1 of each interned ID, or 0. */
+   uint32_t  max_ids;
+   uint32_t  n_strings;
+} column_export_t;
+
+static int export_uuid(column_export_t *ex, const epmap_table_t *table, size_t row, uint32_t *index)
+{
+   column_buffer_t *dict = &ex->sections[1];
+   unsigned char ndr[16];
+   uuid_t uuid;
+   uint32_t i, slot;
+
+   table_get_uuid(table, row, &uuid);
+   uuid_to_ndr(ndr, &uuid);
+
+   for (i = uuid_hash(&uuid, 0) & ex->uuid_mask; (slot = ex->uuid_slots[i]) != 0; i = (i + 1) & ex->uuid_mask) {
+       if (memcmp(dict->data + (size_t)(slot - 1) * 16, ndr, 16) == 0) {
+           *index = slot - 1;
+           return EPMAP_EOK;
+       }
+   }
+
+   if (column_bytes(dict, ndr, 16) != EPMAP_EOK)
+       return EPMAP_ENOMEM;
+   ex->uuid_slots[i] = ++ex->n_uuids;
+   *index = ex->n_uuids - 1;
+
+   return EPMAP_EOK;
+}
+
+static int export_string(column_export_t *ex, uint32_t id, uint32_t *index)
+{
+   column_buffer_t *dict = &ex->sections[2];
+   const char *str;
+   size_t len;
+
+   *index = 0;
+   if (id == 0)
+       return EPMAP_EOK;
+   if (id >= ex->max_ids)
+       return EPMAP_EINVAL;
+
+   if (ex->string_index[id] == 0) {
+       str = epmap_string(id);
+       len = strlen(str);
+       if (column_varint(dict, len) != EPMAP_EOK || column_bytes(dict, str, len) != EPMAP_EOK)
+           return EPMAP_ENOMEM;
+       ex->string_index[id] = ++ex->n_strings;
+   }
+   *index = ex->string_index[id] - 1;
+
+   return EPMAP_EOK;
+}
+
+static int export_columns(column_export_t *ex, const epmap_table_t *table,
+                          const char *const *hosts, size_t n_hosts)
+{
+   column_buffer_t *s = ex->sections;
+   uint32_t host = 0, index;
+   uint16_t port = 0;
+   size_t row, len;
+   int result = EPMAP_EOK;
+
+   for (row = 0; row < n_hosts && result == EPMAP_EOK; row++) {
+       len = strlen(hosts[row]);
+       result = column_varint(&s[0], len);
+       if (result == EPMAP_EOK)
+           result = column_bytes(&s[0], hosts[row], len);
+   }
+
+   /* The empty string is always index 0. */
+   if (result == EPMAP_EOK)
+       result = column_varint(&s[2], 0);
+   ex->n_strings = 1;
+
+   for (row = 0; row < table->n_rows && result == EPMAP_EOK; row++) {
+       if (table->host[row] >= n_hosts)
+           return EPMAP_EINVAL;
+       result = column_varint(&s[3], zigzag((int64_t)table->host[row] - host));
+       host = table->host[row];
+       if (result == EPMAP_EOK)
+           result = export_uuid(ex, table, row, &index);
+       if (result == EPMAP_EOK)
+           result = column_varint(&s[4], index);
+       if (result == EPMAP_EOK)
+           result = column_varint(&s[5], table->version[row]);
+       if (result == EPMAP_EOK)
+           result = column_bytes(&s[6], &table->protseq[row], 1);
+       if (result == EPMAP_EOK)
+           result = column_varint(&s[7], zigzag((int64_t)table->port[row] - port));
+       port = table->port[row];
+       if (result == EPMAP_EOK)
+           result = export_string(ex, table->pipe_id[row], &index);
+       if (result == EPMAP_EOK)
+           result = column_varint(&s[8], index);
+       if (result == EPMAP_EOK)
+           result = export_string(ex, table->annotation_id[row], &index);
+       if (result == EPMAP_EOK)
+           result = column_varint(&s[9], index);
+   }
+
+   return result;
+}
+
+/* Write the rows of a table to path, hosts[i] being the name of host i. */
+EPMAPAPI int epmap_table_export(const epmap_table_t *table, const char *const *hosts,
+                                size_t n_hosts, const char *path)
+{
+   column_export_t ex;
+   unsigned char header[32];
+   unsigned char size[8];
+   FILE *file = NULL;
+   uint32_t n;
+   int error = 0;
+   int result;
+   int i;
+
+   if (table == NULL || (hosts == NULL && n_hosts != 0) || n_hosts > 0xffffffff)
+       return EPMAP_EINVAL;
+
+   memset(&ex, '\0', sizeof(ex));
+
+   /* At most one UUID per row, the table is kept at most half full. */
+   for (n = 1024; n < table->n_rows * 2 && n < 0x80000000; n *= 2)
+       ;
+   ex.uuid_slots = calloc(n, sizeof(uint32_t));
+   ex.uuid_mask = n - 1;
+
+   AcquireSRWLockShared(&epmap_strtab.lock);
+   ex.max_ids = epmap_strtab.n_strings + 1;
+   ReleaseSRWLockShared(&epmap_strtab.lock);
+   ex.string_index = calloc(ex.max_ids, sizeof(uint32_t));
+
+   result = ex.uuid_slots != NULL && ex.string_index != NULL ? EPMAP_EOK : EPMAP_ENOMEM;
+   if (result == EPMAP_EOK)
+       result = export_columns(&ex, table, hosts, n_hosts);
+
+   if (result == EPMAP_EOK) {
+       file = fopen(path, "wb");
+       result = file != NULL ? EPMAP_EOK : EPMAP_EWRITE;
+   }
+   if (result == EPMAP_EOK) {
+       memset(header, '\0', sizeof(header));
+       memcpy(header, EPMAP_COLUMNS_MAGIC, 4);
+       put_le32((char *)header + 4, EPMAP_COLUMNS_VERSION);
+       put_le32((char *)header + 8, (uint32_t)table->n_rows);
+       put_le32((char *)header + 12, (uint32_t)((uint64_t)table->n_rows >> 32));
+       put_le32((char *)header + 16, (uint32_t)n_hosts);
+       put_le32((char *)header + 20, ex.n_uuids);
+       put_le32((char *)header + 24, ex.n_strings);
+       error |= fwrite(header, 1, sizeof(header), file) != sizeof(header);
+
+       for (i = 0; i < EPMAP_COLUMN_SECTIONS; i++) {
+           put_le32((char *)size, (uint32_t)ex.sections[i].length);
+           put_le32((char *)size + 4, (uint32_t)((uint64_t)ex.sections[i].length >> 32));
+           error |= fwrite(size, 1, sizeof(size), file) != sizeof(size);
+           if (ex.sections[i].length != 0)
+               error |= fwrite(ex.sections[i].data, 1, ex.sections[i].length, file) != ex.sections[i].length;
+       }
+       error |= fclose(file) != 0;
+       if (error)
+           result = EPMAP_EWRITE;
+   }
+
+   for (i = 0; i < EPMAP_COLUMN_SECTIONS; i++)
+       free(ex.sections[i].data);
+   free(ex.uuid_slots);
+   free(ex.string_index);
+
+   return result;
+}
+
+/* Section of an export being read. */
+typedef struct column_reader {
+   const unsigned char *ptr;
+   const unsigned char *end;
+   int error;
+} column_reader_t;
+
+static uint64_t read_varint(column_reader_t *r)
+{
+   uint64_t value = 0;
+   int shift;
+
+   for (shift = 0; r->ptr < r->end && shift < 64; shift += 7) {
+       value |= (uint64_t)(*r->ptr & 0x7f) << shift;
+       if ((*r->ptr++ & 0x80) == 0)
+           return value;
+   }
+   r->error = 1;
+
+   return 0;
+}
+
+static uint64_t read_le64(const unsigned char *p)
+{
+   return (uint64_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)) |
+          ((uint64_t)(p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24)) << 32);
+}
+
+/* A whole file, mapped read-only. */
+typedef struct mapped_file {
+   HANDLE file;
+   HANDLE mapping;
+   const unsigned char *data;
+   size_t size;
+} mapped_file_t;
+
+static void unmap_file(mapped_file_t *map)
+{
+   if (map->data != NULL)
+       UnmapViewOfFile(map->data);
+   if (map->mapping != NULL)
+       CloseHandle(map->mapping);
+   if (map->file != INVALID_HANDLE_VALUE && map->file != NULL)
+       CloseHandle(map->file);
+   memset(map, '\0', sizeof(*map));
+}
+
+/* Map path, which must hold at least min_size bytes. The size is taken as
+ * 64 bits, the file is never copied. 
+ */
+static int map_file(mapped_file_t *map, const char *path, size_t min_size)
+{
+   LARGE_INTEGER size;
+
+   memset(map, '\0', sizeof(*map));
+
+   map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+       FILE_ATTRIBUTE_NORMAL, NULL);
+   if (map->file == INVALID_HANDLE_VALUE)
+       return EPMAP_EINVAL;
+
+   if (!GetFileSizeEx(map->file, &size) || size.QuadPart < (LONGLONG)min_size ||
+       (uint64_t)size.QuadPart > (SIZE_MAX >> 1)) {
+       unmap_file(map);
+       return EPMAP_EPROTO;
+   }
+   map->size = (size_t)size.QuadPart;
+
+   map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (map->mapping != NULL)
+       map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+   if (map->data == NULL) {
+       unmap_file(map);
+       return EPMAP_ENOMEM;
+   }
+
+   return EPMAP_EOK;
+}
+
+/* Read an export back into table, whose rows are replaced; *hosts is set to
+ * the host names, released with a single free(). Only the columns in
+ * columns (EPMAP_COLUMN_*) are decoded, the others are zero. Pipe names
+ * and annotations are interned, once per dictionary entry.
+ */
+EPMAPAPI int epmap_table_import(epmap_table_t *table, char ***hosts, size_t *n_hosts,
+                                const char *path, unsigned int columns)
+{
+   column_reader_t sections[EPMAP_COLUMN_SECTIONS], *r;
+   const unsigned char *data = NULL;
+   mapped_file_t map;
+   uint32_t *strings = NULL;
+   uuid_t *uuids = NULL;
+   char **names = NULL;
+   char *ptr;
+   size_t length;
+   uint64_t n_rows, size, value;
+   uint32_t n_host_names, n_uuids, n_strings;
+   uint32_t host = 0;
+   uint16_t port = 0;
+   size_t i, len, offset;
+   int result = EPMAP_EOK;
+
+   *hosts = NULL;
+   *n_hosts = 0;
+
+   /* Decoded in place, from the mapping. */
+   result = map_file(&map, path, 32);
+   if (result != EPMAP_EOK)
+       return result;
+   data = map.data;
+   length = map.size;
+
+   if (result == EPMAP_EOK && (memcmp(data, EPMAP_COLUMNS_MAGIC, 4) != 0 ||
+       (uint32_t)read_le64(data + 4) != EPMAP_COLUMNS_VERSION))
+       result = EPMAP_EPROTO;
+
+   /* Locate the sections. */
+   for (i = 0, offset = 32; result == EPMAP_EOK && i < EPMAP_COLUMN_SECTIONS; i++) {
+       if (length - offset < 8) {
+           result = EPMAP_EPROTO;
+           break;
+       }
+       size = read_le64(data + offset);
+       offset += 8;
+       if (size > length - offset) {
+           result = EPMAP_EPROTO;
+           break;
+       }
+       sections[i].ptr = data + offset;
+       sections[i].end = data + offset + size;
+       sections[i].error = 0;
+       offset += (size_t)size;
+   }
+   if (result != EPMAP_EOK) {
+       unmap_file(&map);
+       return result;
+   }
+
+   n_rows = read_le64(data + 8);
+   n_host_names = (uint32_t)read_le64(data + 16);
+   n_uuids = (uint32_t)read_le64(data + 20);
+   n_strings = (uint32_t)read_le64(data + 24);
+
+   /* Every count is bounded by the size of its section. */
+   if (n_rows > (uint64_t)(sections[6].end - sections[6].ptr) ||
+       n_host_names > (uint64_t)(sections[0].end - sections[0].ptr) ||
+       n_uuids != (uint64_t)(sections[1].end - sections[1].ptr) / 16 ||
+       n_strings > (uint64_t)(sections[2].end - sections[2].ptr)) {
+       unmap_file(&map);
+       return EPMAP_EPROTO;
+   }
+
+   /* Host names: the pointers, then the strings. */
+   names = malloc(n_host_names * sizeof(char *) + (size_t)(sections[0].end - sections[0].ptr) + n_host_names + 1);
+   uuids = malloc((n_uuids + 1) * sizeof(uuid_t));
+   strings = malloc((n_strings + 1) * sizeof(uint32_t));
+   if (names == NULL || uuids == NULL || strings == NULL)
+       result = EPMAP_ENOMEM;
+
+   r = &sections[0];
+   ptr = (char *)(names + n_host_names);
+   for (i = 0; result == EPMAP_EOK && i < n_host_names; i++) {
+       len = (size_t)read_varint(r);
+       if (r->error || len > (size_t)(r->end - r->ptr)) {
+           result = EPMAP_EPROTO;
+           break;
+       }
+       names[i] = ptr;
+       memcpy(ptr, r->ptr, len);
+       ptr[len] = '\0';
+       ptr += len + 1;
+       r->ptr += len;
+   }
+
+   for (i = 0; result == EPMAP_EOK && i < n_uuids; i++)
+       uuid_from_ndr(&uuids[i], sections[1].ptr + i * 16);
+
+   r = &sections[2];
+   for (i = 0; result == EPMAP_EOK && i < n_strings; i++) {
+       len = (size_t)read_varint(r);
+       if (r->error || len > (size_t)(r->end - r->ptr)) {
+           result = EPMAP_EPROTO;
+           break;
+       }
+       result = epmap_intern((const char *)r->ptr, len, &strings[i]);
+       r->ptr += len;
+   }
+
+   table->n_rows = 0;
+   if (result == EPMAP_EOK && n_rows > SIZE_MAX / sizeof(uint32_t))
+       result = EPMAP_ENOMEM;
+   if (result == EPMAP_EOK)
+       result = table_reserve(table, (size_t)n_rows);
+
+   /* One column at a time, each decode loop only touches its own. The
+    * rows up to the next multiple of 64 are zeroed for the filters. */
+   if (result == EPMAP_EOK && n_rows != 0) {
+       len = (size_t)(n_rows + 63) / 64 * 64;
+       if (len > table->max_rows)
+           len = table->max_rows;
+       memset(table->host, '\0', len * sizeof(uint32_t));
+       for (i = 0; i < EPMAP_UUID_LANES; i++)
+           memset(table->uuid[i], '\0', len * sizeof(uint32_t));
+       memset(table->version, '\0', len * sizeof(uint32_t));
+       memset(table->protseq, '\0', len * sizeof(uint8_t));
+       memset(table->port, '\0', len * sizeof(uint16_t));
+       memset(table->pipe_id, '\0', len * sizeof(uint32_t));
+       memset(table->annotation_id, '\0', len * sizeof(uint32_t));
+   }
+   if (result == EPMAP_EOK && (columns & EPMAP_COLUMN_HOST)) {
+       for (i = 0, r = &sections[3]; i < n_rows && !r->error; i++) {
+           host = (uint32_t)(host + unzigzag(read_varint(r)));
+           r->error |= host >= n_host_names;
+           table->host[i] = host;
+       }
+   }
+   if (result == EPMAP_EOK && (columns & EPMAP_COLUMN_UUID)) {
+       for (i = 0, r = &sections[4]; i < n_rows && !r->error; i++) {
+           value = read_varint(r);
+           r->error |= value >= n_uuids;
+           if (!r->error)
+               table_set_uuid(table, (size_t)i, &uuids[value]);
+       }
+   }
+   if (result == EPMAP_EOK && (columns & EPMAP_COLUMN_VERSION)) {
+       for (i = 0, r = &sections[5]; i < n_rows && !r->error; i++)
+           table->version[i] = (uint32_t)read_varint(r);
+   }
+   if (result == EPMAP_EOK && (columns & EPMAP_COLUMN_PROTSEQ))
+       memcpy(table->protseq, sections[6].ptr, (size_t)n_rows);
+   if (result == EPMAP_EOK && (columns & EPMAP_COLUMN_PORT)) {
+       for (i = 0, r = &sections[7]; i < n_rows && !r->error; i++) {
+           port = (uint16_t)(port + unzigzag(read_varint(r)));
+           table->port[i] = port;
+       }
+   }
+   if (result == EPMAP_EOK && (columns & EPMAP_COLUMN_PIPE)) {
+       for (i = 0, r = &sections[8]; i < n_rows && !r->error; i++) {
+           value = read_varint(r);
+           r->error |= value >= n_strings;
+           if (!r->error)
+               table->pipe_id[i] = strings[value];
+       }
+   }
+   if (result == EPMAP_EOK && (columns & EPMAP_COLUMN_ANNOTATION)) {
+       for (i = 0, r = &sections[9]; i < n_rows && !r->error; i++) {
+           value = read_varint(r);
+           r->error |= value >= n_strings;
+           if (!r->error)
+               table->annotation_id[i] = strings[value];
+       }
+   }
+   for (i = 0; result == EPMAP_EOK && i < EPMAP_COLUMN_SECTIONS; i++) {
+       if (sections[i].error)
+           result = EPMAP_EPROTO;
+   }
+
+   unmap_file(&map);
+   free(uuids);
+   free(strings);
+
+   if (result != EPMAP_EOK) {
+       free(names);
+       return result;
+   }
+
+   table->n_rows = (size_t)n_rows;
+   *hosts = names;
+   *n_hosts = n_host_names;
+
+   return EPMAP_EOK;
+}
+
+/* Inverted index of snapshots, for fleet-wide queries: for each interface
+ * UUID, the sorted list of the (host, endpoint) pairs exposing it, its
+ * postings. A posting is two varints, the difference with the host of the
+ * previous posting, then port << 8 | protseq, so a term usually takes 4
+ * or 5 bytes per host. The whole protseq byte is kept, as some protocol
+ * identifiers (0x20 and up) do not fit in 5 bits. Hosts are numbered in
+ * name order across all the snapshots indexed; their names point into the
+ * snapshots, which must stay open while the index is used.
+ */
+#define EPMAP_QUERY_AND 1
+#define EPMAP_QUERY_OR  2
+
+typedef struct epmap_index {
+   epmap_index_term_t *terms;  /* Sorted by UUID. */
+   size_t         n_terms;
+   unsigned char *postings;
+   size_t         postings_size;
+   const char   **hosts;       /* Host names by number. */
+   uint32_t       n_hosts;
+   uint64_t       n_entries;
+   int            mapped;      /* Terms and postings are in a snapshot. */
+} epmap_index_t;
+
+typedef struct epmap_posting {
+   uint32_t host;
+   uint8_t  protseq;
+   uint16_t port;              /* TCP or UDP port, 0 for named pipes. */
+} epmap_posting_t;
+
+/* Cursor over the postings of a term. */
+typedef struct epmap_postings {
+   const unsigned char *ptr;
+   const unsigned char *end;
+   uint32_t host;
+   uint32_t n_hosts;           /* Host numbers are below. */
+} epmap_postings_t;
+
+/* Entry of a snapshot, as sorted while building the index. */
+typedef struct index_pair {
+   uuid_t   uuid;
+   uint64_t key;               /* host << 32 | port << 8 | protseq */
+} index_pair_t;
+
+static int index_name_compare(const void *a, const void *b)
+{
+   return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int index_pair_compare(const void *a, const void *b)
+{
+   const index_pair_t *x = a;
+   const index_pair_t *y = b;
+   int order = uuid_order(&x->uuid, &y->uuid);
+
+   if (order == 0)
+       order = x->key < y->key ? -1 : x->key > y->key;
+
+   return order;
+}
+
+EPMAPAPI void epmap_index_free(epmap_index_t *index)
+{
+   if (!index->mapped) {
+       free(index->terms);
+       free(index->postings);
+   }
+   free((void *)index->hosts);
+   memset(index, '\0', sizeof(*index));
+}
+
+/* Number the hosts of the snapshots, by name. */
+static int index_hosts(epmap_index_t *index, const epmap_snapshot_t *snaps, size_t n_snaps)
+{
+   size_t n = 0, i, j;
+   uint32_t k;
+
+   for (i = 0; i < n_snaps; i++)
+       n += snaps[i].header->n_hosts;
+   if (n > 0xffffffff)
+       return EPMAP_EINVAL;
+
+   index->hosts = malloc((n ? n : 1) * sizeof(const char *));
+   if (index->hosts == NULL)
+       return EPMAP_ENOMEM;
+
+   for (i = 0, n = 0; i < n_snaps; i++) {
+       for (k = 0; k < snaps[i].header->n_hosts; k++)
+           index->hosts[n++] = epmap_snapshot_string(&snaps[i], snaps[i].hosts[k].name);
+   }
+   qsort((void *)index->hosts, n, sizeof(const char *), index_name_compare);
+
+   /* The same host in several snapshots is one host. */
+   for (i = 0, j = 0; i < n; i++) {
+       if (j == 0 || strcmp(index->hosts[j - 1], index->hosts[i]) != 0)
+           index->hosts[j++] = index->hosts[i];
+   }
+   index->n_hosts = (uint32_t)j;
+
+   return EPMAP_EOK;
+}
+
+/* Encode the runs of pairs with the same UUID as terms. */
+static int index_terms(epmap_index_t *index, const index_pair_t *pairs, size_t n)
+{
+   column_buffer_t postings;
+   epmap_index_term_t *term;
+   uint32_t host, previous;
+   size_t i, n_terms = 0;
+   int result = EPMAP_EOK;
+
+   for (i = 0; i < n; i++)
+       n_terms += i == 0 || uuid_order(&pairs[i - 1].uuid, &pairs[i].uuid) != 0;
+
+   index->terms = malloc((n_terms ? n_terms : 1) * sizeof(epmap_index_term_t));
+   if (index->terms == NULL)
+       return EPMAP_ENOMEM;
+   memset(&postings, '\0', sizeof(postings));
+
+   for (i = 0, term = NULL, previous = 0; i < n && result == EPMAP_EOK; i++) {
+       if (term == NULL || uuid_order(&term->uuid, &pairs[i].uuid) != 0) {
+           if (term != NULL)
+               term->size = postings.length - term->offset;
+           term = &index->terms[index->n_terms++];
+           memset(term, '\0', sizeof(*term));
+           term->uuid = pairs[i].uuid;
+           term->offset = postings.length;
+           previous = 0;
+       } else if (pairs[i].key == pairs[i - 1].key) {
+           continue;       /* Same endpoint, other version. */
+       }
+
+       host = (uint32_t)(pairs[i].key >> 32);
+       term->n_hosts += term->n_postings == 0 || host != previous;
+       term->n_postings++;
+       result = column_varint(&postings, host - previous);
+       if (result == EPMAP_EOK)
+           result = column_varint(&postings, pairs[i].key & 0xffffffff);
+       previous = host;
+   }
+   if (term != NULL)
+       term->size = postings.length - term->offset;
+
+   index->postings = postings.data;
+   index->postings_size = postings.length;
+
+   return result;
+}
+
+/* Index the entries of snapshots. */
+EPMAPAPI int epmap_index_build(epmap_index_t *index, const epmap_snapshot_t *snaps, size_t n_snaps)
+{
+   const epmap_snapshot_host_t *host;
+   const epmap_snapshot_entry_t *records;
+   const char *name;
+   const char **found;
+   index_pair_t *pairs;
+   size_t n = 0, i;
+   uint32_t k, e;
+   uint64_t id;
+   int result;
+
+   memset(index, '\0', sizeof(*index));
+
+   result = index_hosts(index, snaps, n_snaps);
+   if (result != EPMAP_EOK) {
+       epmap_index_free(index);
+       return result;
+   }
+
+   for (i = 0; i < n_snaps; i++) {
+       for (k = 0; k < snaps[i].header->n_hosts; k++)
+           n += snaps[i].hosts[k].n_entries;
+   }
+   pairs = malloc((n ? n : 1) * sizeof(index_pair_t));
+   if (pairs == NULL) {
+       epmap_index_free(index);
+       return EPMAP_ENOMEM;
+   }
+
+   for (i = 0, n = 0; i < n_snaps; i++) {
+       for (k = 0; k < snaps[i].header->n_hosts; k++) {
+           host = &snaps[i].hosts[k];
+           name = epmap_snapshot_string(&snaps[i], host->name);
+           found = bsearch(&name, index->hosts, index->n_hosts, sizeof(const char *), index_name_compare);
+           id = (uint64_t)(found - index->hosts) << 32;
+           records = epmap_snapshot_entries(&snaps[i], host);
+           for (e = 0; e < host->n_entries; e++, n++) {
+               pairs[n].uuid = records[e].uuid;
+               pairs[n].key = id | ((uint32_t)records[e].port << 8) | records[e].protseq;
+           }
+       }
+   }
+   index->n_entries = n;
+
+   qsort(pairs, n, sizeof(index_pair_t), index_pair_compare);
+   result = index_terms(index, pairs, n);
+   free(pairs);
+
+   if (result != EPMAP_EOK)
+       epmap_index_free(index);
+
+   return result;
+}
+
+/* Term of an interface, NULL if no host exposes it. */
+EPMAPAPI const epmap_index_term_t *epmap_index_find(const epmap_index_t *index, const uuid_t *uuid)
+{
+   size_t lo = 0, hi = index->n_terms, mid;
+   int order;
+
+   while (lo < hi) {
+       mid = lo + (hi - lo) / 2;
+       order = uuid_order(uuid, &index->terms[mid].uuid);
+       if (order == 0)
+           return &index->terms[mid];
+       if (order < 0)
+           hi = mid;
+       else
+           lo = mid + 1;
+   }
+
+   return NULL;
+}
+
+EPMAPAPI void epmap_index_postings(const epmap_index_t *index, const epmap_index_term_t *term,
+                                   epmap_postings_t *cursor)
+{
+   /* A term read from a file may point anywhere: then it has none. */
+   if (term->offset > index->postings_size || term->size > index->postings_size - term->offset) {
+       cursor->ptr = index->postings;
+       cursor->end = index->postings;
+   } else {
+       cursor->ptr = index->postings + term->offset;
+       cursor->end = cursor->ptr + term->size;
+   }
+   cursor->host = 0;
+   cursor->n_hosts = index->n_hosts;
+}
+
+/* Next posting, 0 at the end of the term. */
+EPMAPAPI int epmap_postings_next(epmap_postings_t *cursor, epmap_posting_t *posting)
+{
+   column_reader_t r;
+   uint64_t endpoint;
+
+   if (cursor->ptr >= cursor->end)
+       return 0;
+
+   r.ptr = cursor->ptr;
+   r.end = cursor->end;
+   r.error = 0;
+   cursor->host += (uint32_t)read_varint(&r);
+   endpoint = read_varint(&r);
+   if (r.error || cursor->host >= cursor->n_hosts) {
+       cursor->ptr = cursor->end;
+       return 0;
+   }
+   cursor->ptr = r.ptr;
+
+   posting->host = cursor->host;
+   posting->protseq = (uint8_t)(endpoint & 0xff);
+   posting->port = (uint16_t)(endpoint >> 8);
+
+   return 1;
+}
+
+/* Hosts exposing all (EPMAP_QUERY_AND) or any (EPMAP_QUERY_OR) of the
+ * interfaces, in name order. hosts must have room for index->n_hosts.
+ * AND starts from the rarest interface and intersects it with the others
+ * in a single pass over each; OR marks the hosts in a bitmap.
+ */
+EPMAPAPI int epmap_index_query(const epmap_index_t *index, const uuid_t *uuids, size_t n, int op,
+                               uint32_t *hosts, size_t *count)
+{
+   const epmap_index_term_t *term, *rarest = NULL;
+   epmap_postings_t cursor;
+   epmap_posting_t posting;
+   uint64_t *bitmap;
+   uint64_t bits;
+   size_t i, j, k;
+
+   *count = 0;
+   if (n == 0 || (op != EPMAP_QUERY_AND && op != EPMAP_QUERY_OR))
+       return EPMAP_EINVAL;
+
+   if (op == EPMAP_QUERY_OR) {
+       bitmap = calloc((index->n_hosts + 63) / 64 + 1, sizeof(uint64_t));
+       if (bitmap == NULL)
+           return EPMAP_ENOMEM;
+       for (i = 0; i < n; i++) {
+           term = epmap_index_find(index, &uuids[i]);
+           if (term == NULL)
+               continue;
+           epmap_index_postings(index, term, &cursor);
+           while (epmap_postings_next(&cursor, &posting))
+               bitmap[posting.host / 64] |= (uint64_t)1 << (posting.host % 64);
+       }
+       for (i = 0; i < (index->n_hosts + 63) / 64; i++) {
+           for (bits = bitmap[i], j = 0; bits != 0; bits >>= 1, j++) {
+               if (bits & 1)
+                   hosts[(*count)++] = (uint32_t)(i * 64 + j);
+           }
+       }
+       free(bitmap);
+       return EPMAP_EOK;
+   }
+
+   for (i = 0; i < n; i++) {
+       term = epmap_index_find(index, &uuids[i]);
+       if (term == NULL)
+           return EPMAP_EOK;
+       if (rarest == NULL || term->n_hosts < rarest->n_hosts)
+           rarest = term;
+   }
+
+   epmap_index_postings(index, rarest, &cursor);
+   while (epmap_postings_next(&cursor, &posting)) {
+       if (*count == 0 || hosts[*count - 1] != posting.host)
+           hosts[(*count)++] = posting.host;
+   }
+
+   /* Both lists are sorted: keep the hosts found while walking the term. */
+   for (i = 0; i < n && *count != 0; i++) {
+       term = epmap_index_find(index, &uuids[i]);
+       if (term == rarest)
+           continue;
+       epmap_index_postings(index, term, &cursor);
+       for (j = 0, k = 0; j < *count && epmap_postings_next(&cursor, &posting); ) {
+           while (j < *count && hosts[j] < posting.host)
+               j++;
+           if (j < *count && hosts[j] == posting.host)
+               hosts[k++] = hosts[j++];
+       }
+       *count = k;
+   }
+
+   return EPMAP_EOK;
+}
+
+/* Inverted index of a snapshot being finished, its hosts sorted by name
+ * and numbered in that order. The entry blocks are read back from the 
+ * file, one at a time.
+ */
+static int snapshot_index(epmap_snapshot_writer_t *writer, epmap_index_t *index)
+{
+   const epmap_snapshot_host_t *host;
+   epmap_snapshot_entry_t *block = writer->block;
+   index_pair_t *pairs;
+   size_t n = 0, i;
+   uint32_t e;
+   int result;
+
+   memset(index, '\0', sizeof(*index));
+
+   pairs = malloc((writer->header.n_entries ? (size_t)writer->header.n_entries : 1) * sizeof(index_pair_t));
+   if (pairs == NULL)
+       return EPMAP_ENOMEM;
+
+   for (i = 0; i < writer->header.n_hosts; i++) {
+       host = &writer->hosts[i];
+       if (host->n_entries == 0)
+           continue;
+       if (_fseeki64(writer->file, (int64_t)host->entries, SEEK_SET) != 0 ||
+           fread(block, sizeof(*block), host->n_entries, writer->file) != host->n_entries) {
+           free(pairs);
+           return EPMAP_EWRITE;
+       }
+       for (e = 0; e < host->n_entries; e++, n++) {
+           pairs[n].uuid = block[e].uuid;
+           pairs[n].key = ((uint64_t)i << 32) | ((uint32_t)block[e].port << 8) | block[e].protseq;
+       }
+   }
+   index->n_hosts = writer->header.n_hosts;
+   index->n_entries = n;
+
+   qsort(pairs, n, sizeof(index_pair_t), index_pair_compare);
+   result = index_terms(index, pairs, n);
+   free(pairs);
+
+   if (result != EPMAP_EOK)
+       epmap_index_free(index);
+
+   return result;
+}
+
+/* Write the host index, the strings and the inverted index, then the
+ * header, commit the file to disk and close it. The writer is released in
+ * any case.
+ */
+EPMAPAPI int epmap_snapshot_finish(epmap_snapshot_writer_t *writer)
+{
+   epmap_snapshot_header_t *header = &writer->header;
+   epmap_index_t index;
+   char pad[8];
+   size_t i, n;
+   int result = EPMAP_EOK;
+
+   if (writer->file == NULL)
+       return EPMAP_EINVAL;
+
+   /* Not reentrant: the string pool is only known to the comparison
+    * through a static. Snapshots are written once per scan. */
+   snapshot_sort_strings = writer->strings;
+   qsort(writer->hosts, header->n_hosts, sizeof(epmap_snapshot_host_t), snapshot_host_compare);
+   for (i = 0, n = 0; i < header->n_hosts; i++) {
+       if (n > 0 && strcmp(writer->strings + writer->hosts[n - 1].name,
+                           writer->strings + writer->hosts[i].name) == 0) {
+           header->n_entries -= writer->hosts[n - 1].n_entries;
+           n--;
+       }
+       writer->hosts[n++] = writer->hosts[i];
+   }
+   header->n_hosts = (uint32_t)n;
+
+   /* Entry blocks are multiples of 8 bytes, so is the index. */
+   header->hosts = writer->offset;
+   snapshot_write(writer, writer->hosts, n * sizeof(epmap_snapshot_host_t));
+   header->strings = writer->offset;
+   snapshot_write(writer, writer->strings, (size_t)header->strings_size);
+
+   /* Without its index, a snapshot is still usable: -q builds one. */
+   if (!writer->error) {
+       result = snapshot_index(writer, &index);
+       if (result == EPMAP_EOK) {
+           if (_fseeki64(writer->file, (int64_t)writer->offset, SEEK_SET) != 0)
+               writer->error = 1;
+           memset(pad, '\0', sizeof(pad));
+           snapshot_write(writer, pad, (size_t)(8 - writer->offset % 8) % 8);
+           header->n_terms = (uint32_t)index.n_terms;
+           header->terms = writer->offset;
+           snapshot_write(writer, index.terms, index.n_terms * sizeof(epmap_index_term_t));
+           header->postings = writer->offset;
+           header->postings_size = index.postings_size;
+           snapshot_write(writer, index.postings, index.postings_size);
+           epmap_index_free(&index);
+       }
+   }
+
+   if (fseek(writer->file, 0, SEEK_SET) != 0)
+       writer->error = 1;
+   snapshot_write(writer, header, sizeof(*header));
+   /* On disk before it can replace an older snapshot. */
+   if (fflush(writer->file) != 0 || _commit(_fileno(writer->file)) != 0)
+       writer->error = 1;
+   if (fclose(writer->file) != 0 || writer->error)
+       result = EPMAP_EWRITE;
+
+   snapshot_writer_free(writer);
+
+   return result;
+}
+
+/* Abandon a snapshot, path is left incomplete. */
+EPMAPAPI void epmap_snapshot_abort(epmap_snapshot_writer_t *writer)
+{
+   if (writer->file != NULL)
+       fclose(writer->file);
+   snapshot_writer_free(writer);
+}
+
+/* The index of a snapshot, used in place: nothing is read but the terms
+ * looked up and their postings. Hosts are numbered as in snap->hosts, and
+ * index->hosts is NULL. Returns EPMAP_ENODATA if the snapshot has none.
+ */
+EPMAPAPI int epmap_snapshot_index(const epmap_snapshot_t *snap, epmap_index_t *index)
+{
+   const epmap_snapshot_header_t *header = snap->header;
+
+   memset(index, '\0', sizeof(*index));
+   if (header->terms == 0)
+       return EPMAP_ENODATA;
+
+   index->terms = (epmap_index_term_t *)((const char *)header + header->terms);
+   index->n_terms = header->n_terms;
+   index->postings = (unsigned char *)header + header->postings;
+   index->postings_size = (size_t)header->postings_size;
+   index->n_hosts = header->n_hosts;
+   index->n_entries = header->n_entries;
+   index->mapped = 1;
+
+   return EPMAP_EOK;
+}
+
+/* Scan targets, expanded lazily: names are returned as they are, address
+ * ranges (a.b.c.d, a.b.c.d/n, a.b.c.d-e.f.g.h or a.b.c.d-h) one address at
+ * a time, and the lines of files and stdin as they are read, each line
+ * being itself a name or a range. Only the ranges are kept, never their
+ * addresses, so a /8 costs as much as a single host.
+ *
+ * Excluded ranges are subtracted from each range before it is walked. The
+ * walk is sequential, or a random permutation: the addresses of a set of
+ * ranges are numbered 0..n-1, and x, starting anywhere in the cyclic group
+ * of the integers modulo the first prime p > n, is repeatedly multiplied
+ * by a generator of the group. x visits each of 1..p-1 once, and x - 1 is
+ * the number of the next address, skipped when it is n or more.
+ *
+ * Targets can be marked, see epmap_targets_mark(): those known to answer
+ * are returned first, those known not to last or not at all, and those
+ * already done (epmap_journal_open()) are skipped. The addresses of the
+ * ranges given on their own keep their mark in two bits, by number, and
+ * the other targets as 64-bit hashes of their names, the mark in the two
+ * low bits. Marked addresses of the ranges come first in the order of
+ * their numbers; other targets can only be moved back, the streams being
+ * read as the sweep goes.
+ */
+#define EPMAP_TARGET_NONE  0
+#define EPMAP_TARGET_FIRST 1   /* Known to answer. */
+#define EPMAP_TARGET_LAST  2   /* Known not to, lately. */
+#define EPMAP_TARGET_DONE  3   /* Scanned by an earlier run. */
+
+typedef struct epmap_range {
+   uint32_t lo;                /* Host byte order, both included. */
+   uint32_t hi;
+} epmap_range_t;
+
+/* Walk of a set of ranges. */
+typedef struct target_walk {
+   epmap_range_t *ranges;
+   uint64_t      *starts;      /* Number of the first address of each range. */
+   size_t         n_ranges;
+   uint64_t       n_addresses;
+   uint64_t       n_walked;
+   uint64_t       prime;       /* 0 for a sequential walk. */
+   uint64_t       generator;
+   uint64_t       x;
+   uint64_t      *marks;       /* Two bits per number, or NULL. */
+} target_walk_t;
+
+typedef struct target_mark {
+   uint32_t       addr;
+   int            mark;
+} target_mark_t;
+
+typedef struct epmap_targets {
+   char         **names;       /* Given on their own, returned first. */
+   size_t         n_names;
+   size_t         next_name;
+   epmap_range_t *ranges;      /* Given on their own. */
+   size_t         n_ranges;
+   epmap_range_t *excluded;    /* Sorted and merged once walking starts. */
+   size_t         n_excluded;
+   FILE         **streams;     /* Files and stdin, read in turn. */
+   size_t         n_streams;
+   size_t         next_stream;
+   target_walk_t  walk;        /* Of the ranges. */
+   target_walk_t  line;        /* Of the range of the current line. */
+   int            walking;
+   int            random;
+   uint64_t       seed;
+   uint64_t       n_skipped;   /* Excluded names and addresses. */
+   target_mark_t *marks;       /* Marked addresses, until walking starts. */
+   size_t         n_marks;
+   uint64_t      *hashes;      /* Open addressing, 0 for a free slot. */
+   size_t         hash_mask;
+   size_t         n_hashes;
+   uint64_t       next_first;  /* Numbers of the walk, for its marks. */
+   uint64_t       next_last;
+   char         **last;        /* Other targets put off. */
+   size_t         n_last_names;
+   size_t         next_last_name;
+   int            drop_last;
+   uint64_t       n_done;      /* Targets skipped as done. */
+   uint64_t       n_first;     /* Targets known to answer. */
+   uint64_t       n_last;      /* Targets put off or dropped. */
+} epmap_targets_t;
+
+static int grow_array(void **array, size_t size, size_t n)
+{
+   void *ptr;
+
+   /* Powers of two, so growing one element at a time is amortized. */
+   if (n & (n - 1))
+       return EPMAP_EOK;
+
+   ptr = realloc(*array, size * (n ? n * 2 : 1));
+   if (ptr == NULL)
+       return EPMAP_ENOMEM;
+   *array = ptr;
+
+   return EPMAP_EOK;
+}
+
+/* Dotted quad, without leading zeros ambiguity: each part 0..255. */
+static const char *parse_ipv4(const char *str, uint32_t *addr)
+{
+   unsigned int part;
+   int i, digits;
+
+   *addr = 0;
+   for (i = 0; i < 4; i++) {
+       if (i > 0 && *str++ != '.')
+           return NULL;
+       for (part = 0, digits = 0; *str >= '0' && *str <= '9' && digits < 3; str++, digits++)
+           part = part * 10 + (*str - '0');
+       if (digits == 0 || part > 255)
+           return NULL;
+       *addr = (*addr << 8) | part;
+   }
+
+   return str;
+}
+
+/* Range of a spec, 0 if the spec is not one. */
+static int parse_range(const char *spec, epmap_range_t *range)
+{
+   const char *end = parse_ipv4(spec, &range->lo);
+   unsigned int n;
+   char *last;
+
+   if (end == NULL)
+       return 0;
+
+   range->hi = range->lo;
+   if (*end == '/') {
+       n = (unsigned int)strtoul(end + 1, &last, 10);
+       if (last == end + 1 || *last != '\0' || n > 32)
+           return 0;
+       range->lo &= n ? 0xffffffffu << (32 - n) : 0;
+       range->hi = range->lo | (n < 32 ? 0xffffffffu >> n : 0);
+   } else if (*end == '-') {
+       if ((last = (char *)parse_ipv4(end + 1, &range->hi)) == NULL) {
+           n = (unsigned int)strtoul(end + 1, &last, 10);
+           if (last == end + 1 || n > 255)
+               return 0;
+           range->hi = (range->lo & 0xffffff00u) | n;
+       }
+       if (*last != '\0' || range->hi < range->lo)
+           return 0;
+   } else if (*end != '\0') {
+       return 0;
+   }
+
+   return 1;
+}
+
+static int range_compare(const void *a, const void *b)
+{
+   const epmap_range_t *x = a;
+   const epmap_range_t *y = b;
+
+   return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/* Sort and merge ranges in place, return their new number. */
+static size_t ranges_merge(epmap_range_t *ranges, size_t n)
+{
+   size_t i, j;
+
+   qsort(ranges, n, sizeof(epmap_range_t), range_compare);
+   for (i = 0, j = 0; i < n; i++) {
+       if (j > 0 && (uint64_t)ranges[i].lo <= (uint64_t)ranges[j - 1].hi + 1) {
+           if (ranges[i].hi > ranges[j - 1].hi)
+               ranges[j - 1].hi = ranges[i].hi;
+       } else {
+           ranges[j++] = ranges[i];
+       }
+   }
+
+   return j;
+}
+
+/* a * b mod m, for m < 2^33: the partial products fit in 64 bits. */
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m)
+{
+   return (((a * (b >> 16)) % m << 16) + a * (b & 0xffff)) % m;
+}
+
+static uint64_t powmod(uint64_t a, uint64_t e, uint64_t m)
+{
+   uint64_t r = 1;
+
+   for (a %= m; e != 0; e >>= 1) {
+       if (e & 1)
+           r = mulmod(r, a, m);
+       a = mulmod(a, a, m);
+   }
+
+   return r;
+}
+
+static int is_prime(uint64_t n)
+{
+   uint64_t d;
+
+   if (n < 2 || (n % 2 == 0 && n != 2))
+       return 0;
+   for (d = 3; d * d <= n; d += 2) {
+       if (n % d == 0)
+           return 0;
+   }
+
+   return 1;
+}
+
+/* Random walk of n addresses: p and a generator of its group, picked from
+ * the seed. g generates the group if g^((p-1)/q) != 1 for each prime q
+ * dividing p - 1.
+ */
+static void walk_permute(target_walk_t *walk, uint64_t seed)
+{
+   uint64_t factors[16];
+   uint64_t p, m, q, g;
+   int n_factors = 0, i;
+
+   for (p = walk->n_addresses + 1; !is_prime(p); p++)
+       ;
+   for (m = p - 1, q = 2; q * q <= m; q++) {
+       if (m % q == 0) {
+           factors[n_factors++] = q;
+           while (m % q == 0)
+               m /= q;
+       }
+   }
+   if (m > 1)
+       factors[n_factors++] = m;
+
+   for (g = 2 + seed % (p - 3); ; g = g + 1 < p ? g + 1 : 2) {
+       for (i = 0; i < n_factors && powmod(g, (p - 1) / factors[i], p) != 1; i++)
+           ;
+       if (i == n_factors)
+           break;
+   }
+
+   walk->prime = p;
+   walk->generator = g;
+   walk->x = 1 + (seed >> 16) % (p - 1);
+}
+
+static void walk_free(target_walk_t *walk)
+{
+   free(walk->ranges);
+   free(walk->starts);
+   free(walk->marks);
+   memset(walk, '\0', sizeof(*walk));
+}
+
+/* Walk ranges minus the excluded ones; ranges is sorted and merged. */
+static int walk_init(epmap_targets_t *targets, target_walk_t *walk, const epmap_range_t *ranges, size_t n)
+{
+   const epmap_range_t *ex = targets->excluded;
+   size_t n_ex = targets->n_excluded;
+   uint64_t lo, hi;
+   size_t i, j, k;
+
+   walk_free(walk);
+
+   /* Each excluded range splits at most one range in two. */
+   walk->ranges = malloc((n + n_ex + 1) * sizeof(epmap_range_t));
+   walk->starts = malloc((n + n_ex + 1) * sizeof(uint64_t));
+   if (walk->ranges == NULL || walk->starts == NULL) {
+       walk_free(walk);
+       return EPMAP_ENOMEM;
+   }
+
+   for (i = 0, j = 0, k = 0; i < n; i++) {
+       for (lo = ranges[i].lo, hi = ranges[i].hi; j < n_ex && ex[j].hi < lo; j++)
+           ;
+       for ( ; j < n_ex && ex[j].lo <= hi && lo <= hi; j++) {
+           if (ex[j].lo > lo) {
+               walk->ranges[k].lo = (uint32_t)lo;
+               walk->ranges[k++].hi = ex[j].lo - 1;
+           }
+           lo = (uint64_t)ex[j].hi + 1;
+           if (ex[j].hi > hi)
+               break;
+       }
+       if (lo <= hi) {
+           walk->ranges[k].lo = (uint32_t)lo;
+           walk->ranges[k++].hi = (uint32_t)hi;
+       }
+       targets->n_skipped += (uint64_t)ranges[i].hi - ranges[i].lo + 1;
+   }
+   walk->n_ranges = k;
+
+   for (i = 0; i < k; i++) {
+       walk->starts[i] = walk->n_addresses;
+       walk->n_addresses += (uint64_t)walk->ranges[i].hi - walk->ranges[i].lo + 1;
+   }
+   targets->n_skipped -= walk->n_addresses;
+
+   if (targets->random && walk->n_addresses > 3)
+       walk_permute(walk, targets->seed++ * 0x9e3779b97f4a7c15ull);
+
+   return EPMAP_EOK;
+}
+
+/* Address of a number of the walk. */
+static uint32_t walk_address(const target_walk_t *walk, uint64_t number)
+{
+   size_t lo, hi, mid;
+
+   for (lo = 0, hi = walk->n_ranges; hi - lo > 1; ) {
+       mid = lo + (hi - lo) / 2;
+       if (walk->starts[mid] <= number)
+           lo = mid;
+       else
+           hi = mid;
+   }
+
+   return walk->ranges[lo].lo + (uint32_t)(number - walk->starts[lo]);
+}
+
+/* Number of an address of the walk, 0 if it is not walked. */
+static int walk_number(const target_walk_t *walk, uint32_t addr, uint64_t *number)
+{
+   size_t lo, hi, mid;
+
+   for (lo = 0, hi = walk->n_ranges; hi - lo > 1; ) {
+       mid = lo + (hi - lo) / 2;
+       if (walk->ranges[mid].lo <= addr)
+           lo = mid;
+       else
+           hi = mid;
+   }
+   if (walk->n_ranges == 0 || addr < walk->ranges[lo].lo || addr > walk->ranges[lo].hi)
+       return 0;
+
+   *number = walk->starts[lo] + (addr - walk->ranges[lo].lo);
+
+   return 1;
+}
+
+/* Next address of the walk and its number, 0 at its end. */
+static int walk_next(target_walk_t *walk, uint32_t *addr, uint64_t *number)
+{
+   uint64_t index;
+
+   if (walk->n_walked >= walk->n_addresses)
+       return 0;
+
+   if (walk->prime != 0) {
+       do {
+           index = walk->x - 1;
+           walk->x = mulmod(walk->x, walk->generator, walk->prime);
+       } while (index >= walk->n_addresses);
+   } else {
+       index = walk->n_walked;
+   }
+   walk->n_walked++;
+
+   *addr = walk_address(walk, index);
+   *number = index;
+
+   return 1;
+}
+
+static int walk_mark(const target_walk_t *walk, uint64_t number)
+{
+   return walk->marks != NULL ? (int)(walk->marks[number / 32] >> (number % 32 * 2)) & 3 : EPMAP_TARGET_NONE;
+}
+
+/* Next address marked mark from *number on, in the order of the numbers,
+ * 0 if there is none left. Words without the mark are skipped whole.
+ */
+static int walk_next_marked(const target_walk_t *walk, uint64_t *number, int mark, uint32_t *addr)
+{
+   uint64_t n = *number;
+   uint64_t bits;
+   unsigned int i;
+
+   if (walk->marks == NULL)
+       return 0;
+
+   for ( ; n < walk->n_addresses; n = (n / 32 + 1) * 32) {
+       /* 11 in each pair of bits equal to mark, then the low bit alone. */
+       bits = ~(walk->marks[n / 32] ^ (0x5555555555555555ull * (uint64_t)mark));
+       bits &= (bits >> 1) & 0x5555555555555555ull;
+       bits &= ~0ull << (n % 32 * 2);
+       if (bits == 0)
+           continue;
+       for (i = 0; !(bits & 1); bits >>= 2, i++)
+           ;
+       n = n / 32 * 32 + i;
+       if (n >= walk->n_addresses)
+           break;
+       *addr = walk_address(walk, n);
+       *number = n + 1;
+       return 1;
+   }
+
+   *number = walk->n_addresses;
+
+   return 0;
+}
+
+/* Hash of a name, its two low bits left for the mark and never 0. */
+static uint64_t target_hash(const char *target)
+{
+   uint64_t hash = fingerprint_mix(0xcbf29ce484222325ULL, target, strlen(target)) & ~3ull;
+
+   return hash != 0 ? hash : 4;
+}
+
+static size_t target_slot(const epmap_targets_t *targets, uint64_t hash)
+{
+   size_t i;
+
+   for (i = (size_t)(hash >> 2) & targets->hash_mask; targets->hashes[i] != 0; i = (i + 1) & targets->hash_mask) {
+       if ((targets->hashes[i] & ~3ull) == hash)
+           break;
+   }
+
+   return i;
+}
+
+static int target_hash_mark(const epmap_targets_t *targets, uint64_t hash)
+{
+   if (targets->n_hashes == 0)
+       return EPMAP_TARGET_NONE;
+
+   return (int)targets->hashes[target_slot(targets, hash)] & 3;
+}
+
+/* Mark a hash, the table kept at most half full. A done mark stays. */
+static int target_hash_set(epmap_targets_t *targets, uint64_t hash, int mark)
+{
+   uint64_t *hashes, *old = targets->hashes;
+   size_t size = targets->hash_mask + 1, i, j;
+
+   if (old == NULL || (targets->n_hashes + 1) * 2 > size) {
+       size = old != NULL ? size * 2 : 1024;
+       hashes = calloc(size, sizeof(uint64_t));
+       if (hashes == NULL)
+           return EPMAP_ENOMEM;
+       for (i = 0; old != NULL && i <= targets->hash_mask; i++) {
+           if (old[i] == 0)
+               continue;
+           for (j = (size_t)(old[i] >> 2) & (size - 1); hashes[j] != 0; j = (j + 1) & (size - 1))
+               ;
+           hashes[j] = old[i];
+       }
+       free(old);
+       targets->hashes = hashes;
+       targets->hash_mask = size - 1;
+   }
+
+   i = target_slot(targets, hash);
+   if (targets->hashes[i] == 0)
+       targets->n_hashes++;
+   else if ((targets->hashes[i] & 3) == EPMAP_TARGET_DONE)
+       return EPMAP_EOK;
+   targets->hashes[i] = hash | (uint64_t)mark;
+
+   return EPMAP_EOK;
+}
+
+/* Turn the marked addresses into the marks of the walk of the ranges given
+ * on their own, two bits per number; the other addresses are hashed. The
+ * later mark of an address wins, but for a done one.
+ */
+static int walk_set_marks(epmap_targets_t *targets)
+{
+   target_walk_t *walk = &targets->walk;
+   const target_mark_t *mark;
+   char target[16];
+   uint64_t number;
+   size_t i;
+   int result = EPMAP_EOK;
+
+   if (targets->n_marks == 0)
+       return EPMAP_EOK;
+
+   walk->marks = calloc((size_t)(walk->n_addresses / 32 + 1), sizeof(uint64_t));
+   if (walk->marks == NULL)
+       return EPMAP_ENOMEM;
+
+   for (i = 0; i < targets->n_marks && result == EPMAP_EOK; i++) {
+       mark = &targets->marks[i];
+       if (walk_number(walk, mark->addr, &number)) {
+           if (walk_mark(walk, number) != EPMAP_TARGET_DONE) {
+               walk->marks[number / 32] &= ~(3ull << (number % 32 * 2));
+               walk->marks[number / 32] |= (uint64_t)mark->mark << (number % 32 * 2);
+           }
+       } else {
+           sprintf(target, "%u.%u.%u.%u", mark->addr >> 24, (mark->addr >> 16) & 0xff,
+               (mark->addr >> 8) & 0xff, mark->addr & 0xff);
+           result = target_hash_set(targets, target_hash(target), mark->mark);
+       }
+   }
+
+   free(targets->marks);
+   targets->marks = NULL;
+   targets->n_marks = 0;
+
+   return result;
+}
+
+/* Names known to answer first, in their order. */
+static int names_order(epmap_targets_t *targets)
+{
+   char **names;
+   size_t i, n = 0;
+   int pass, first;
+
+   if (targets->n_hashes == 0 || targets->n_names == 0)
+       return EPMAP_EOK;
+
+   names = malloc(targets->n_names * sizeof(char *));
+   if (names == NULL)
+       return EPMAP_ENOMEM;
+   for (pass = 0; pass < 2; pass++) {
+       for (i = 0; i < targets->n_names; i++) {
+           first = target_hash_mark(targets, target_hash(targets->names[i])) == EPMAP_TARGET_FIRST;
+           if (first == (pass == 0))
+               names[n++] = targets->names[i];
+       }
+   }
+   memcpy(targets->names, names, n * sizeof(char *));
+   free(names);
+
+   return EPMAP_EOK;
+}
+
+/* Whether to return a target now: a done one is skipped, one known not to
+ * answer put off to the end, or dropped.
+ */
+static int target_take(epmap_targets_t *targets, const char *target, int mark, int *result)
+{
+   char *copy;
+
+   if (mark == EPMAP_TARGET_DONE) {
+       targets->n_done++;
+       return 0;
+   }
+   if (mark == EPMAP_TARGET_LAST) {
+       targets->n_last++;
+       if (targets->drop_last)
+           return 0;
+       copy = malloc(strlen(target) + 1);
+       *result = copy != NULL ? grow_array((void **)&targets->last, sizeof(char *), targets->n_last_names) : EPMAP_ENOMEM;
+       if (*result == EPMAP_EOK)
+           targets->last[targets->n_last_names++] = strcpy(copy, target);
+       else
+           free(copy);
+       return 0;
+   }
+   targets->n_first += mark == EPMAP_TARGET_FIRST;
+
+   return 1;
+}
+
+EPMAPAPI void epmap_targets_init(epmap_targets_t *targets)
+{
+   memset(targets, '\0', sizeof(*targets));
+}
+
+/* Walk the addresses in a random order, drawn from seed. */
+EPMAPAPI void epmap_targets_randomize(epmap_targets_t *targets, uint64_t seed)
+{
+   targets->random = 1;
+   targets->seed = seed;
+}
+
+EPMAPAPI void epmap_targets_free(epmap_targets_t *targets)
+{
+   size_t i;
+
+   for (i = 0; i < targets->n_names; i++)
+       free(targets->names[i]);
+   for (i = targets->next_stream; i < targets->n_streams; i++) {
+       if (targets->streams[i] != stdin)
+           fclose(targets->streams[i]);
+   }
+   free(targets->names);
+   free(targets->ranges);
+   free(targets->excluded);
+   free(targets->streams);
+   for (i = targets->next_last_name; i < targets->n_last_names; i++)
+       free(targets->last[i]);
+   free(targets->last);
+   free(targets->marks);
+   free(targets->hashes);
+   walk_free(&targets->walk);
+   walk_free(&targets->line);
+   memset(targets, '\0', sizeof(*targets));
+}
+
+/* Add targets: a name, a range, "-" for the lines of stdin or "@path" for
+ * those of a file.
+ */
+EPMAPAPI int epmap_targets_add(epmap_targets_t *targets, const char *spec)
+{
+   epmap_range_t range;
+   FILE *stream;
+   char *name;
+
+   if (*spec == '\0' || targets->walking)
+       return EPMAP_EINVAL;
+
+   if (strcmp(spec, "-") == 0 || *spec == '@') {
+       stream = *spec == '-' ? stdin : fopen(spec + 1, "r");
+       if (stream == NULL)
+           return EPMAP_EINVAL;
+       if (grow_array((void **)&targets->streams, sizeof(FILE *), targets->n_streams) != EPMAP_EOK) {
+           if (stream != stdin)
+               fclose(stream);
+           return EPMAP_ENOMEM;
+       }
+       targets->streams[targets->n_streams++] = stream;
+   } else if (parse_range(spec, &range)) {
+       if (grow_array((void **)&targets->ranges, sizeof(epmap_range_t), targets->n_ranges) != EPMAP_EOK)
+           return EPMAP_ENOMEM;
+       targets->ranges[targets->n_ranges++] = range;
+   } else {
+       name = malloc(strlen(spec) + 1);
+       if (name == NULL || grow_array((void **)&targets->names, sizeof(char *), targets->n_names) != EPMAP_EOK) {
+           free(name);
+           return EPMAP_ENOMEM;
+       }
+       strcpy(name, spec);
+       targets->names[targets->n_names++] = name;
+   }
+
+   return EPMAP_EOK;
+}
+
+/* Mark a target, whichever spec it comes from, see EPMAP_TARGET_*. The
+ * later mark wins, but for EPMAP_TARGET_DONE.
+ */
+EPMAPAPI int epmap_targets_mark(epmap_targets_t *targets, const char *target, int mark)
+{
+   const char *end;
+   uint32_t addr;
+
+   if (*target == '\0' || targets->walking || mark < EPMAP_TARGET_NONE || mark > EPMAP_TARGET_DONE)
+       return EPMAP_EINVAL;
+
+   end = parse_ipv4(target, &addr);
+   if (end == NULL || *end != '\0')
+       return target_hash_set(targets, target_hash(target), mark);
+
+   if (grow_array((void **)&targets->marks, sizeof(target_mark_t), targets->n_marks) != EPMAP_EOK)
+       return EPMAP_ENOMEM;
+   targets->marks[targets->n_marks].addr = addr;
+   targets->marks[targets->n_marks++].mark = mark;
+
+   return EPMAP_EOK;
+}
+
+/* Skip a target already done. */
+EPMAPAPI int epmap_targets_skip(epmap_targets_t *targets, const char *target)
+{
+   return epmap_targets_mark(targets, target, EPMAP_TARGET_DONE);
+}
+
+/* Drop the targets known not to answer instead of putting them off. */
+EPMAPAPI void epmap_targets_drop_last(epmap_targets_t *targets)
+{
+   targets->drop_last = 1;
+}
+
+/* Read a line of a stream: trimmed, without comment, "" if blank. */
+static char *read_target_line(FILE *stream, char *line, size_t size)
+{
+   char *start, *end;
+   int c;
+
+   if (fgets(line, (int)size, stream) == NULL)
+       return NULL;
+
+   /* Too long for a target: skip the rest. */
+   if (strchr(line, '\n') == NULL && !feof(stream)) {
+       while ((c = fgetc(stream)) != EOF && c != '\n')
+           ;
+       line[0] = '\0';
+   }
+
+   line[strcspn(line, "#")] = '\0';
+   for (start = line; *start == ' ' || *start == '\t'; start++)
+       ;
+   for (end = start + strlen(start); end > start && (end[-1] == ' ' || end[-1] == '\t' ||
+       end[-1] == '\r' || end[-1] == '\n'); end--)
+       ;
+   *end = '\0';
+
+   return start;
+}
+
+/* Exclude a range, or the ranges listed in a file ("@path"). */
+EPMAPAPI int epmap_targets_exclude(epmap_targets_t *targets, const char *spec)
+{
+   epmap_range_t range;
+   char line[256];
+   char *str;
+   FILE *stream;
+   int result = EPMAP_EOK;
+
+   if (targets->walking)
+       return EPMAP_EINVAL;
+
+   if (*spec != '@') {
+       if (!parse_range(spec, &range))
+           return EPMAP_EINVAL;
+       if (grow_array((void **)&targets->excluded, sizeof(epmap_range_t), targets->n_excluded) != EPMAP_EOK)
+           return EPMAP_ENOMEM;
+       targets->excluded[targets->n_excluded++] = range;
+       return EPMAP_EOK;
+   }
+
+   stream = fopen(spec + 1, "r");
+   if (stream == NULL)
+       return EPMAP_EINVAL;
+   while (result == EPMAP_EOK && (str = read_target_line(stream, line, sizeof(line))) != NULL) {
+       if (*str != '\0')
+           result = epmap_targets_exclude(targets, str);
+   }
+   fclose(stream);
+
+   return result;
+}
+
+/* Copy the next target to target, EPMAP_ENODATA once all are returned.
+ * The addresses of the ranges known to answer come first, then the names,
+ * the other addresses of the ranges and the streams, and the targets put
+ * off last.
+ */
+EPMAPAPI int epmap_targets_next(epmap_targets_t *targets, char *target, size_t size)
+{
+   target_walk_t *walk = &targets->walk;
+   epmap_range_t range;
+   char line[512];
+   char *str;
+   uint32_t addr;
+   uint64_t number;
+   FILE *stream;
+   int mark;
+   int result = EPMAP_EOK;
+
+   if (!targets->walking) {
+       targets->walking = 1;
+       targets->n_excluded = ranges_merge(targets->excluded, targets->n_excluded);
+       targets->n_ranges = ranges_merge(targets->ranges, targets->n_ranges);
+       result = walk_init(targets, walk, targets->ranges, targets->n_ranges);
+       if (result == EPMAP_EOK)
+           result = walk_set_marks(targets);
+       if (result == EPMAP_EOK)
+           result = names_order(targets);
+       if (result != EPMAP_EOK)
+           return result;
+   }
+
+   for (;;) {
+       if (walk_next_marked(walk, &targets->next_first, EPMAP_TARGET_FIRST, &addr)) {
+           targets->n_first++;
+           break;
+       }
+
+       if (targets->next_name < targets->n_names) {
+           str = targets->names[targets->next_name++];
+           if (strlen(str) >= size)
+               return EPMAP_EINVAL;
+           if (!target_take(targets, str, target_hash_mark(targets, target_hash(str)), &result)) {
+               if (result != EPMAP_EOK)
+                   return result;
+               continue;
+           }
+           strcpy(target, str);
+           return EPMAP_EOK;
+       }
+
+       /* The marks of the ranges by number, a hash lookup for the lines. */
+       if (walk_next(walk, &addr, &number)) {
+           mark = walk_mark(walk, number);
+           if (mark == EPMAP_TARGET_NONE)
+               break;
+           targets->n_done += mark == EPMAP_TARGET_DONE;
+           targets->n_last += mark == EPMAP_TARGET_LAST;
+           continue;
+       }
+
+       if (walk_next(&targets->line, &addr, &number)) {
+           _snprintf(target, size, "%u.%u.%u.%u", addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+           if (target_take(targets, target, target_hash_mark(targets, target_hash(target)), &result))
+               return EPMAP_EOK;
+           if (result != EPMAP_EOK)
+               return result;
+           continue;
+       }
+
+       if (targets->next_stream == targets->n_streams) {
+           if (!targets->drop_last && walk_next_marked(walk, &targets->next_last, EPMAP_TARGET_LAST, &addr))
+               break;
+           if (targets->next_last_name == targets->n_last_names)
+               return EPMAP_ENODATA;
+           str = targets->last[targets->next_last_name++];
+           _snprintf(target, size, "%s", str);
+           free(str);
+           return EPMAP_EOK;
+       }
+
+       /* One line at a time: a name is returned as one, a range walked. */
+       stream = targets->streams[targets->next_stream];
+       str = read_target_line(stream, line, sizeof(line));
+       if (str == NULL) {
+           if (stream != stdin)
+               fclose(stream);
+           targets->next_stream++;
+       } else if (parse_range(str, &range)) {
+           result = walk_init(targets, &targets->line, &range, 1);
+           if (result != EPMAP_EOK)
+               return result;
+       } else if (*str != '\0') {
+           if (strlen(str) >= size)
+               return EPMAP_EINVAL;
+           if (target_take(targets, str, target_hash_mark(targets, target_hash(str)), &result)) {
+               strcpy(target, str);
+               return EPMAP_EOK;
+           }
+           if (result != EPMAP_EOK)
+               return result;
+       }
+   }
+
+   _snprintf(target, size, "%u.%u.%u.%u", addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+
+   return EPMAP_EOK;
+}
+
+/* Journal of a sweep, to resume it after a crash: a line per target, added
+ * as each host is reported,
+ *
+ *   result time target
+ *
+ * result being the EPMAP_* code in hex, 0 once the endpoint map has been
+ * read, and time the seconds since the epoch. Lines are committed in
+ * groups, fflush() then _commit(), once EPMAP_JOURNAL_GROUP of them are
+ * pending or the oldest pending one is a second old. That is checked as
+ * lines are added, and by epmap_journal_tick(), to be called regularly
+ * while no line is. A line cut short by a crash has no newline, it is
+ * ignored.
+ */
+#define EPMAP_JOURNAL_GROUP 256
+#define EPMAP_JOURNAL_DELAY 1000000    /* Microseconds. */
+
+/* Line of a history, while it is compacted. */
+typedef struct history_line {
+   uint64_t       hash;        /* Of the target. */
+   size_t         order;       /* In the file. */
+   int            result;
+   int64_t        when;
+   char          *target;
+} history_line_t;
+
+typedef struct epmap_journal {
+   FILE          *file;
+   size_t         n_pending;
+   uint64_t       pending_since;
+   size_t         n_done;      /* Lines read back, by result. */
+   size_t         n_failed;
+   epmap_targets_t *targets;   /* Marked as the lines are read back. */
+   int64_t        since;       /* History: failures before are forgotten. */
+   history_line_t *lines;      /* History: lines read back to compact. */
+   size_t         n_lines;
+} epmap_journal_t;
+
+/* Failure telling that nothing listens on the host, or that it is down:
+ * the connection was refused or timed out.
+ */
+static int epmap_unreachable(int result)
+{
+   return (result & 0xfff) == EPMAP_ESOCKET &&
+          ((result >> 12) == WSAECONNREFUSED || (result >> 12) == WSAETIMEDOUT);
+}
+
+static int journal_done(epmap_journal_t *journal, const char *target, int result, int64_t when)
+{
+   if (result != EPMAP_EOK) {
+       journal->n_failed++;
+       return EPMAP_EOK;
+   }
+
+   journal->n_done++;
+
+   return journal->targets != NULL ? epmap_targets_skip(journal->targets, target) : EPMAP_EOK;
+}
+
+/* Hosts that answered go first, those unreachable since journal->since
+ * last; the last line of a target decides.
+ */
+static int journal_history(epmap_journal_t *journal, const char *target, int result, int64_t when)
+{
+   int mark = EPMAP_TARGET_NONE;
+
+   if (result == EPMAP_EOK) {
+       journal->n_done++;
+       mark = EPMAP_TARGET_FIRST;
+   } else if (epmap_unreachable(result) && when >= journal->since) {
+       journal->n_failed++;
+       mark = EPMAP_TARGET_LAST;
+   }
+
+   return journal->targets != NULL ? epmap_targets_mark(journal->targets, target, mark) : EPMAP_EOK;
+}
+
+/* Read a whole line into *line, grown as needed, and set *len to its
+ * length, 0 at the end of the file. Targets are written as they are, so a
+ * line has no length limit.
+ */
+static int journal_line(FILE *file, char **line, size_t *size, size_t *len)
+{
+   char *ptr;
+   size_t n;
+
+   *len = 0;
+   for (;;) {
+       if (*size - *len < 128) {
+           n = *size ? *size * 2 : 512;
+           ptr = realloc(*line, n);
+           if (ptr == NULL)
+               return EPMAP_ENOMEM;
+           *line = ptr;
+           *size = n;
+       }
+       if (fgets(*line + *len, (int)(*size - *len), file) == NULL)
+           return EPMAP_EOK;
+       *len += strlen(*line + *len);
+       if (*len != 0 && (*line)[*len - 1] == '\n')
+           return EPMAP_EOK;
+   }
+}
+
+/* Split a complete line into its fields, 0 if it is not a record. */
+static int journal_parse(char *line, unsigned int *code, long long *when, char **target)
+{
+   char *end;
+
+   *code = (unsigned int)strtoul(line, &end, 16);
+   if (end == line || *end != ' ')
+       return 0;
+   line = end + 1;
+   *when = strtoll(line, &end, 10);
+   if (end == line || *end != ' ')
+       return 0;
+   *target = end + 1;
+   (*target)[strcspn(*target, " \t\r\n")] = '\0';
+
+   return **target != '\0';
+}
+
+/* Read the lines of a journal back, created if needed, and open it to add
+ * more.
+ */
+static int journal_open(epmap_journal_t *journal, const char *path,
+                        int (*record)(epmap_journal_t *, const char *, int, int64_t))
+{
+   char *line = NULL;
+   char *target;
+   size_t size = 0, len;
+   unsigned int code;
+   long long when;
+   int cut = 0;
+   int result = EPMAP_EOK;
+
+   journal->file = fopen(path, "a+b");
+   if (journal->file == NULL)
+       return EPMAP_EINVAL;
+
+   rewind(journal->file);
+   while (result == EPMAP_EOK && (result = journal_line(journal->file, &line, &size, &len)) == EPMAP_EOK && len != 0) {
+       cut = line[len - 1] != '\n';
+       if (cut || line[0] == '#' || !journal_parse(line, &code, &when, &target))
+           continue;
+       result = record(journal, target, (int)code, (int64_t)when);
+   }
+   free(line);
+   if (result == EPMAP_EOK && ferror(journal->file))
+       result = EPMAP_EINVAL;
+
+   /* Appending, after the line a crash cut short if any. */
+   if (result == EPMAP_EOK) {
+       fseek(journal->file, 0, SEEK_END);
+       if (ftell(journal->file) == 0)
+           fprintf(journal->file, "# epdump journal: result time target\n");
+       else if (cut)
+           fputc('\n', journal->file);
+       if (fflush(journal->file) != 0)
+           result = EPMAP_EWRITE;
+   }
+
+   if (result != EPMAP_EOK) {
+       fclose(journal->file);
+       journal->file = NULL;
+   }
+
+   return result;
+}
+
+/* Open a journal of the sweep. The targets it records as done are skipped
+ * by targets, if not NULL; the failed ones are scanned again.
+ */
+EPMAPAPI int epmap_journal_open(epmap_journal_t *journal, const char *path, epmap_targets_t *targets)
+{
+   memset(journal, '\0', sizeof(*journal));
+   journal->targets = targets;
+
+   return journal_open(journal, path, journal_done);
+}
+
+static int history_collect(epmap_journal_t *history, const char *target, int result, int64_t when)
+{
+   history_line_t *line;
+
+   if (grow_array((void **)&history->lines, sizeof(history_line_t), history->n_lines) != EPMAP_EOK)
+       return EPMAP_ENOMEM;
+
+   line = &history->lines[history->n_lines];
+   line->target = malloc(strlen(target) + 1);
+   if (line->target == NULL)
+       return EPMAP_ENOMEM;
+   strcpy(line->target, target);
+   line->hash = target_hash(target);
+   line->order = history->n_lines++;
+   line->result = result;
+   line->when = when;
+
+   return EPMAP_EOK;
+}
+
+static int history_line_compare(const void *a, const void *b)
+{
+   const history_line_t *x = a;
+   const history_line_t *y = b;
+
+   int order;
+
+   if (x->hash != y->hash)
+       return x->hash < y->hash ? -1 : 1;
+   /* Targets whose hashes collide are kept apart. */
+   order = strcmp(x->target, y->target);
+   if (order != 0)
+       return order;
+
+   return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Rewrite the history with the last line of each target only, and without
+ * the failures that are forgotten, so that it grows with the number of 
+ * targets rather than with the number of sweeps. 
+ */
+static int history_compact(epmap_journal_t *history, const char *path)
+{
+   history_line_t *line;
+   char *temp = NULL;
+   FILE *file = NULL;
+   size_t i, n_kept = 0;
+   int result;
+
+   result = journal_open(history, path, history_collect);
+   if (history->file != NULL) {
+       fclose(history->file);
+       history->file = NULL;
+   }
+
+   qsort(history->lines, history->n_lines, sizeof(history_line_t), history_line_compare);
+   for (i = 0; i < history->n_lines; i++) {
+       line = &history->lines[i];
+       /* A later line of the target decides. */
+       if (i + 1 < history->n_lines && line[1].hash == line->hash &&
+           strcmp(line[1].target, line->target) == 0)
+           line->target[0] = '\0';
+       else if (line->result != EPMAP_EOK && line->when < history->since)
+           line->target[0] = '\0';
+       else
+           n_kept++;
+   }
+
+   if (result == EPMAP_EOK && n_kept < history->n_lines) {
+       temp = malloc(strlen(path) + 5);
+       if (temp != NULL) {
+           sprintf(temp, "%s.tmp", path);
+           file = fopen(temp, "wb");
+       }
+       if (file != NULL) {
+           fprintf(file, "# epdump journal: result time target\n");
+           for (i = 0; i < history->n_lines; i++) {
+               line = &history->lines[i];
+               if (line->target[0] != '\0')
+                   fprintf(file, "%03x %lld %s\n", (unsigned int)line->result, (long long)line->when, line->target);
+           }
+           /* On disk before it replaces the history, which is never missing. */
+           if (ferror(file) || fflush(file) != 0 || _commit(_fileno(file)) != 0)
+               result = EPMAP_EWRITE;
+           if (fclose(file) != 0)
+               result = EPMAP_EWRITE;
+       } else
+           result = temp != NULL ? EPMAP_EWRITE : EPMAP_ENOMEM;
+       if (result == EPMAP_EOK) {
+           if (!MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+               result = EPMAP_EWRITE;
+       }
+       if (result != EPMAP_EOK && file != NULL)
+           remove(temp);
+       free(temp);
+   }
+
+   for (i = 0; i < history->n_lines; i++)
+       free(history->lines[i].target);
+   free(history->lines);
+   history->lines = NULL;
+   history->n_lines = 0;
+
+   return result;
+}
+
+/* Open a history of the hosts, kept across sweeps, in the format of the
+ * journal, but of the hosts that answered or were unreachable only, see
+ * epmap_history_add(). The hosts that answered last time are returned
+ * first by targets, and those unreachable in the last ttl seconds last.
+ * The history is compacted first: the lines read back are those of the
+ * targets, not of every sweep.
+ */
+EPMAPAPI int epmap_history_open(epmap_journal_t *history, const char *path, epmap_targets_t *targets,
+                                int64_t ttl)
+{
+   int result;
+
+   memset(history, '\0', sizeof(*history));
+   history->since = (int64_t)time(NULL) - ttl;
+
+   result = history_compact(history, path);
+   if (result != EPMAP_EOK)
+       return result;
+
+   history->targets = targets;
+
+   return journal_open(history, path, journal_history);
+}
+
+/* Write the pending lines through to the disk. */
+EPMAPAPI int epmap_journal_commit(epmap_journal_t *journal)
+{
+   if (journal->n_pending == 0)
+       return EPMAP_EOK;
+
+   journal->n_pending = 0;
+   if (fflush(journal->file) != 0 || _commit(_fileno(journal->file)) != 0)
+       return EPMAP_EWRITE;
+
+   return EPMAP_EOK;
+}
+
+/* Commit the pending lines if the group is full or its deadline passed. */
+EPMAPAPI int epmap_journal_tick(epmap_journal_t *journal)
+{
+   if (journal->n_pending == 0)
+       return EPMAP_EOK;
+
+   if (journal->n_pending >= EPMAP_JOURNAL_GROUP ||
+       epmap_clock_us() - journal->pending_since >= EPMAP_JOURNAL_DELAY)
+       return epmap_journal_commit(journal);
+
+   return EPMAP_EOK;
+}
+
+EPMAPAPI int epmap_journal_add(epmap_journal_t *journal, const char *target, int result)
+{
+   if (fprintf(journal->file, "%03x %lld %s\n", (unsigned int)result, (long long)time(NULL), target) < 0)
+       return EPMAP_EWRITE;
+
+   if (journal->n_pending++ == 0)
+       journal->pending_since = epmap_clock_us();
+
+   return epmap_journal_tick(journal);
+}
+
+/* Add a host to the history if it answered or was unreachable: other
+ * failures tell nothing of the next sweep.
+ */
+EPMAPAPI int epmap_history_add(epmap_journal_t *history, const char *target, int result)
+{
+   if (result != EPMAP_EOK && !epmap_unreachable(result))
+       return EPMAP_EOK;
+
+   return epmap_journal_add(history, target, result);
+}
+
+EPMAPAPI int epmap_journal_close(epmap_journal_t *journal)
+{
+   int result = EPMAP_EOK;
+
+   if (journal->file != NULL) {
+       result = epmap_journal_commit(journal);
+       if (fclose(journal->file) != 0)
+           result = EPMAP_EWRITE;
+       journal->file = NULL;
+   }
+
+   return result;
+}
+
+/* Bounded lock-free queue of pointers, for any number of producers and
+ * consumers (D. Vyukov's MPMC ring). Each cell carries a sequence number
+ * telling whether it is free for the push of the current round, or full
+ * for its pop. Push and pop claim a position with a compare-and-swap and
+ * never wait for each other, unless the queue is full or empty. The two
+ * positions are on cache lines of their own. Once the producers are done,
+ * closing the queue lets the consumers drain it and stop.
+ *
+ * A thread that finds the queue full or empty spins a little, then parks
+ * with WaitOnAddress() on a word the other side bumps: pushed for the
+ * consumers, popped for the producers. The side that makes progress only
+ * bumps and wakes when a thread is parked, so the fast path stays a single
+ * compare-and-swap.
+ */
+typedef struct epmap_queue_cell {
+   volatile LONG64 sequence;
+   void *data;
+} epmap_queue_cell_t;
+
+typedef struct epmap_queue {
+   epmap_queue_cell_t *cells;
+   LONG64          mask;
+   char            pad0[64];
+   volatile LONG64 head;       /* Next push. */
+   char            pad1[64];
+   volatile LONG64 tail;       /* Next pop. */
+   char            pad2[64];
+   volatile LONG64 max_depth;  /* Statistics. */
+   volatile LONG64 n_full;     /* Pushes that had to wait. */
+   volatile LONG   closed;
+   volatile LONG   pushed;     /* Bumped to wake parked consumers... */
+   volatile LONG   popped;     /* ...and parked producers. */
+   volatile LONG   n_consumers; /* Parked, or about to. */
+   volatile LONG   n_producers;
+} epmap_queue_t;
+
+/* size is rounded up to a power of two. */
+EPMAPAPI int epmap_queue_init(epmap_queue_t *queue, size_t size)
+{
+   size_t n, i;
+
+   memset(queue, '\0', sizeof(*queue));
+   for (n = 2; n < size; n *= 2)
+       ;
+
+   queue->cells = malloc(n * sizeof(epmap_queue_cell_t));
+   if (queue->cells == NULL)
+       return EPMAP_ENOMEM;
+   for (i = 0; i < n; i++) {
+       queue->cells[i].sequence = (LONG64)i;
+       queue->cells[i].data = NULL;
+   }
+   queue->mask = (LONG64)n - 1;
+
+   return EPMAP_EOK;
+}
+
+EPMAPAPI void epmap_queue_free(epmap_queue_t *queue)
+{
+   free(queue->cells);
+   queue->cells = NULL;
+}
+
+/* Items in the queue, at the time of the call. */
+EPMAPAPI size_t epmap_queue_depth(const epmap_queue_t *queue)
+{
+   LONG64 depth = queue->head - queue->tail;
+
+   return depth > 0 ? (size_t)depth : 0;
+}
+
+EPMAPAPI size_t epmap_queue_size(const epmap_queue_t *queue)
+{
+   return (size_t)queue->mask + 1;
+}
+
+/* Wake the threads parked on word, if any. waiters is read after the cell
+ * was published by an interlocked operation, a full barrier, and a parked
+ * thread counts itself before it checks the queue again: either it sees
+ * the cell, or this sees it and bumps the word it waits on.
+ */
+static void queue_wake(volatile LONG *word, volatile LONG *waiters)
+{
+   if (*waiters != 0) {
+       InterlockedIncrement(word);
+       WakeByAddressAll((PVOID)word);
+   }
+}
+
+/* Push data, 0 if the queue is full. */
+EPMAPAPI int epmap_queue_try_push(epmap_queue_t *queue, void *data)
+{
+   epmap_queue_cell_t *cell;
+   LONG64 pos = queue->head;
+   LONG64 depth, max;
+
+   for (;;) {
+       cell = &queue->cells[pos & queue->mask];
+       if (cell->sequence == pos) {
+           if (InterlockedCompareExchange64(&queue->head, pos + 1, pos) == pos)
+               break;
+       } else if (cell->sequence < pos) {
+           return 0;
+       }
+       pos = queue->head;
+   }
+
+   /* The cell is ours until its sequence is published. */
+   cell->data = data;
+   InterlockedExchange64(&cell->sequence, pos + 1);
+   queue_wake(&queue->pushed, &queue->n_consumers);
+
+   depth = pos + 1 - queue->tail;
+   while (depth > (max = queue->max_depth) &&
+          InterlockedCompareExchange64(&queue->max_depth, depth, max) != max)
+       ;
+
+   return 1;
+}
+
+/* Pop into *data, 0 if the queue is empty. */
+EPMAPAPI int epmap_queue_try_pop(epmap_queue_t *queue, void **data)
+{
+   epmap_queue_cell_t *cell;
+   LONG64 pos = queue->tail;
+
+   for (;;) {
+       cell = &queue->cells[pos & queue->mask];
+       if (cell->sequence == pos + 1) {
+           if (InterlockedCompareExchange64(&queue->tail, pos + 1, pos) == pos)
+               break;
+       } else if (cell->sequence < pos + 1) {
+           return 0;
+       }
+       pos = queue->tail;
+   }
+
+   *data = cell->data;
+   InterlockedExchange64(&cell->sequence, pos + queue->mask + 1);
+   queue_wake(&queue->popped, &queue->n_producers);
+
+   return 1;
+}
+
+/* Spins before a thread parks: busy, then yielding. */
+#define QUEUE_SPINS 128
+
+/* Back off while a queue is full or empty: spin, then yield. */
+static void queue_backoff(unsigned int *spins)
+{
+   if (*spins < QUEUE_SPINS / 2)
+       YieldProcessor();
+   else
+       SwitchToThread();
+   (*spins)++;
+}
+
+/* Push, waiting for room: the backpressure of the consumers. */
+EPMAPAPI void epmap_queue_push(epmap_queue_t *queue, void *data)
+{
+   unsigned int spins = 0;
+   LONG seen;
+   int done;
+
+   if (epmap_queue_try_push(queue, data))
+       return;
+
+   InterlockedIncrement64(&queue->n_full);
+   for (done = 0; !done; ) {
+       if (spins < QUEUE_SPINS) {
+           queue_backoff(&spins);
+           done = epmap_queue_try_push(queue, data);
+           continue;
+       }
+       InterlockedIncrement(&queue->n_producers);
+       seen = queue->popped;
+       done = epmap_queue_try_push(queue, data);
+       if (!done)
+           WaitOnAddress(&queue->popped, &seen, sizeof(seen), INFINITE);
+       InterlockedDecrement(&queue->n_producers);
+   }
+}
+
+/* No more pushes. */
+EPMAPAPI void epmap_queue_close(epmap_queue_t *queue)
+{
+   InterlockedExchange(&queue->closed, 1);
+   queue_wake(&queue->pushed, &queue->n_consumers);
+}
+
+/* Pop, waiting at most timeout milliseconds for data if not negative.
+ * Returns 0 once the queue is closed and empty, -1 on timeout. 
+ */
+EPMAPAPI int epmap_queue_pop_wait(epmap_queue_t *queue, void **data, int timeout)
+{
+   uint64_t deadline = epmap_clock_us() + (uint64_t)timeout * 1000;
+   uint64_t now;
+   unsigned int spins = 0;
+   LONG seen;
+   int done = 0;
+
+   while (!done) {
+       if (epmap_queue_try_pop(queue, data))
+           break;
+       /* The last pushes came before the close. */
+       if (queue->closed) {
+           MemoryBarrier();
+           return epmap_queue_try_pop(queue, data);
+       }
+       now = epmap_clock_us();
+       if (timeout >= 0 && now >= deadline)
+           return -1;
+       if (spins < QUEUE_SPINS) {
+           queue_backoff(&spins);
+           continue;
+       }
+       InterlockedIncrement(&queue->n_consumers);
+       seen = queue->pushed;
+       done = epmap_queue_try_pop(queue, data);
+       if (!done && !queue->closed)
+           WaitOnAddress(&queue->pushed, &seen, sizeof(seen),
+               timeout >= 0 ? (DWORD)((deadline - now + 999) / 1000) : INFINITE);
+       InterlockedDecrement(&queue->n_consumers);
+   }
+
+   return 1;
+}
+
+/* Pop, waiting for data. Returns 0 once the queue is closed and empty. */
+EPMAPAPI int epmap_queue_pop(epmap_queue_t *queue, void **data)
+{
+   return epmap_queue_pop_wait(queue, data, -1);
+}
+
+EPMAPAPI char *epmap_uuid_to_string(const uuid_t *uuid)
+{
+   static char str[100] = { 0 };
+
+   _snprintf(str, 100, "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+       uuid->time_low, uuid->time_mid, uuid->time_hi_and_version,
+       uuid->clock_seq_hi_and_reserved, uuid->clock_seq_low,
+       uuid->node[0], uuid->node[1], uuid->node[2], 
+       uuid->node[3], uuid->node[4], uuid->node[5]); 
+   
+   return str;   
+}
+
+/************************
+struct bind_rejection {
+   int check;    
+   const char *str;
+} rejection[7] = { 0 }; 
+*****************************/
+
+struct epmap_error {
+   uint32_t code;
+   const char *str;
+} list[] = { 
+   { EPMAP_EOK,      "Operation completed successfully" },
+   { EPMAP_ENOMEM,   "Insufficient memory to perform the requested operation" },
+   { EPMAP_EINVAL,   "An invalid argument was passed to a library function" }, 
+   { EPMAP_EBADPTR,  "The system attempted to perform an invalid memory access" }, 
+   { EPMAP_EWSAINIT, "The system could not initialize Windows Sockets" },
+   { EPMAP_EDNSFAIL, "Could not resolve host name" },
+   { EPMAP_ESOCKET,  "Could not connect to the endpoint mapper" },
+   { EPMAP_ESEND,    "An error has occurred while sending " },
+   { EPMAP_ERECV,    "An error has occurred while receiving " },
+   { EPMAP_EWRITE,   "An error has occurred while writing the output" },
+
+   { EPMAP_EACK,     "ACK received. " },
+   { EPMAP_ENAK,     "The endpoint mapper did not acknowledge the bind request" }, 
+   { EPMAP_EFAULT,   "The endpoint mapped rejected the call request" },
+   { EPMAP_EPROTO,   "Protocol error" },
+   { EPMAP_ECONTEXT, "The server rejected the presentation context" },
+   { EPMAP_EAGAIN,   "The operation is in progress" },
+   { EPMAP_ESTOPPED, "The enumeration was stopped by the caller" },
+   { 0x402,          "??????????????????????" },
+
+   { EPMAP_ENODATA,  "The endpoint mapped completed. " },
+   { 0x407,          "?????????????????????????????????????????????" },
+   { 0x408,          "?????????????????????????????????????" },
+
+   { 0xffffffff,      NULL }, 
+};
+
+/* Message of a result, without its extended error. Unlike epmap_error(),
+ * safe to call from any thread, with any value. 
+ */
+EPMAPAPI const char *epmap_strerror(int result)
+{
+   int status = result & 0xfff; /* Mask extended errors, if any. */
+   int i;
+
+   for (i = 0; list[i].str != NULL; i++) {
+       if (list[i].code == status)
+           return list[i].str;
+   }
+
+   return "Unknown error";
+}
+
+EPMAPAPI char *epmap_error(int result)
+{
+   static char buffer[256] = { 0 };
+   int offset = 0;
+   int status = result & 0xfff;
+
+   offset = _snprintf(buffer, sizeof(buffer), "%s", epmap_strerror(result)); 
+
+   if (status == EPMAP_ESOCKET) 
+       offset = _snprintf(buffer+offset, sizeof(buffer)-offset, " (errno: %u)", result>>12);
+   else if (status == EPMAP_ENAK) 
+       offset = _snprintf(buffer+offset, sizeof(buffer)-offset, " (reason: %u)", result>>12); 
+   else if (status == EPMAP_EFAULT) 
+       offset = 0;
+  
+   return &buffer[0];
+}
+
+/* Command line tool. Define EPMAP_NO_MAIN to embed the library. */
+#ifndef EPMAP_NO_MAIN
+
+#define SCAN_QUEUE_SIZE  64   /* Targets waiting between two stages. */
+#define SCAN_MAX_WORKERS 256
+#define SCAN_TICK        100  /* Milliseconds between journal deadline checks. */
+
+void display_usage(char *progname)
+{
+    printf("Usage: %s [-p port] [-f frag_size] [-i uuid [-v major.minor] [-m option]]\n"
+           "       [-o uuid] [-w file] [-s protseqs] [-r lo-hi] [-a prefix] [-H]\n"
+           "       [-l [-c concurrency] [-t timeout]] [-g] [-F format] [-S file | -L file] [-D file [-Q]]\n"
+           "       [-C file] [-J file] [-A file] [-N file [-T ttl] [-K]] [-R] [-x range|@file]\n"
+           "       [-j workers] target...\n"
+           "       %s -q uuid[,uuid...|+uuid...] snapshot\n\n", progname, progname);
+    printf("  target    Host name or address, address range as a.b.c.d/n, a.b.c.d-e.f.g.h\n");
+    printf("            or a.b.c.d-h, or @file or - (stdin) for one target per line.\n");
+    printf("  -p port   Endpoint mapper port (default: %u).\n", DEFAULT_EPMAP_PORT);
+    printf("  -f bytes  Fragment size advertised at bind time (default: %u, min: %u).\n",
+        EPMAP_FRAG_SIZE, EPMAP_MIN_FRAG_SIZE);
+    printf("  -i uuid   Only return entries for this interface.\n");
+    printf("  -v vers   Interface version, as major.minor (default: 0.0).\n");
+    printf("  -m option Version matching: all, compatible, exact, major or upto\n");
+    printf("            (default: exact when -v is given, all otherwise).\n");
+    printf("  -o uuid   Only return entries for this object.\n");
+    printf("  -w file   Flag the interfaces listed in file, one UUID per line.\n");
+    printf("  -s list   Only keep these protocol sequences: tcp, udp, np (default: all).\n");
+    printf("  -r lo-hi  Only keep the TCP and UDP endpoints in this port range.\n");
+    printf("  -a text   Only keep the entries whose annotation starts with text.\n");
+    printf("  -H        Health check: query the management interface over the\n");
+    printf("            same association once the map has been enumerated.\n");
+    printf("  -l        Probe every dynamic TCP endpoint (connect + BIND).\n");
+    printf("  -c count  Maximum number of probes in flight (default: 32, max: %u).\n", EPMAP_PROBE_MAX_CONCURRENCY);
+    printf("  -t msecs  Deadline of each probe (default: 2000).\n");
+    printf("  -g        Group the endpoints by interface and version.\n");
+    printf("  -F format Write one record per endpoint to stdout instead, as ndjson,\n");
+    printf("            csv or bin; the other messages go to stderr.\n");
+    printf("  -S file   Save the entries in a snapshot file.\n");
+    printf("  -L file   List the entries of hostname saved in a snapshot, without\n");
+    printf("            querying it.\n");
+    printf("  -D file   Only report the endpoints added, removed or changed since\n");
+    printf("            the snapshot. Maps whose fingerprint has not changed are\n");
+    printf("            not compared.\n");
+    printf("  -Q        Stop after the first ept_lookup call if it matches the\n");
+    printf("            fingerprint, and reuse the snapshot.\n");
+    printf("  -C file   Export the endpoints as a compact columnar table.\n");
+    printf("  -J file   Record each target scanned in a journal, and skip the ones\n");
+    printf("            it holds as done: an interrupted sweep resumes where it was.\n");
+    printf("  -A file   Scan the hosts saved in a snapshot first.\n");
+    printf("  -N file   Keep a history of the hosts that answered, scanned first, and\n");
+    printf("            of those refused or timed out, scanned last.\n");
+    printf("  -T secs   How long a host stays known unreachable (default: 86400).\n");
+    printf("  -K        Skip the hosts known unreachable instead.\n");
+    printf("  -x range  Skip the addresses of a range, or of the ranges listed in @file.\n");
+    printf("  -R        Scan the addresses of the ranges in a random order.\n");
+    printf("  -j r,c,e  Threads resolving names, connecting and enumerating the\n");
+    printf("            endpoint maps (default: 4,16,16, max: %u each).\n", SCAN_MAX_WORKERS);
+    printf("  -q query  List the hosts of a snapshot exposing an interface, any of\n");
+    printf("            several (uuid,uuid) or all of them (uuid+uuid).\n");
+}
+
+/* Load a watchlist file: one interface UUID per line, blank lines and
+ * lines starting with '#' are ignored. 
+ */
+static int load_watchlist(const char *path, epmap_watchlist_t *wl)
+{
+   uuid_t *uuids = NULL, *ptr;
+   size_t n = 0, max = 0;
+   char line[128];
+   char *str;
+   size_t len;
+   FILE *fp;
+   int result = EPMAP_EOK;
+
+   fp = fopen(path, "r");
+   if (fp == NULL)
+       return EPMAP_EINVAL;
+
+   while (result == EPMAP_EOK && fgets(line, sizeof(line), fp) != NULL) {
+       for (str = line; *str == ' ' || *str == '\t'; str++)
+           ;
+       for (len = strlen(str); len > 0 && (unsigned char)str[len - 1] <= ' '; len--)
+           str[len - 1] = '\0';
+       if (*str == '\0' || *str == '#')
+           continue;
+       if (n == max) {
+           max = max ? max * 2 : 256;
+           ptr = realloc(uuids, sizeof(uuid_t) * max);
+           if (ptr == NULL) {
+               result = EPMAP_ENOMEM;
+               break;
+           }
+           uuids = ptr;
+       }
+       if (epmap_string_to_uuid(&uuids[n++], str) == 0)
+           result = EPMAP_EINVAL;
+   }
+   fclose(fp);
+
+   if (result == EPMAP_EOK)
+       result = epmap_watchlist_init(wl, uuids, n);
+   free(uuids);
+
+   return result;
+}
+
+/* Map a comma separated list of tcp, udp and np to a protseq mask, or 0. */
+static uint32_t protseqs_from_string(const char *str)
+{
+   uint32_t protseqs = 0;
+   size_t len;
+
+   while (*str != '\0') {
+       len = strcspn(str, ",");
+       if (len == 3 && strncmp(str, "tcp", 3) == 0)
+           protseqs |= 1u << PROTO_ID_TCP;
+       else if (len == 3 && strncmp(str, "udp", 3) == 0)
+           protseqs |= 1u << PROTO_ID_UDP;
+       else if (len == 2 && strncmp(str, "np", 2) == 0)
+           protseqs |= 1u << PROTO_ID_NAMED_PIPES;
+       else
+           return 0;
+       str += len;
+       if (*str == ',')
+           str++;
+   }
+
+   return protseqs;
+}
+
+/* Map a version option name to its RPC_C_VERS_* value, or 0. */
+static int output_format_from_string(const char *str)
+{
+   if (_stricmp(str, "ndjson") == 0 || _stricmp(str, "json") == 0)
+       return EPMAP_OUTPUT_NDJSON;
+   if (_stricmp(str, "csv") == 0)
+       return EPMAP_OUTPUT_CSV;
+   if (_stricmp(str, "bin") == 0 || _stricmp(str, "binary") == 0)
+       return EPMAP_OUTPUT_BINARY;
+
+   return 0;
+}
+
+static uint32_t vers_option_from_string(const char *str)
+{
+   static const struct {
+      const char *name;
+      uint32_t    option;
+   } options[] = {
+      { "all",        RPC_C_VERS_ALL        },
+      { "compatible", RPC_C_VERS_COMPATIBLE },
+      { "exact",      RPC_C_VERS_EXACT      },
+      { "major",      RPC_C_VERS_MAJOR_ONLY },
+      { "upto",       RPC_C_VERS_UPTO       },
+   };
+   int i;
+
+   for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+       if (strcmp(str, options[i].name) == 0)
+           return options[i].option;
+   }
+
+   return 0;
+}
+
+
+static int probe_compare(const void *a, const void *b)
+{
+   return (int)((const epmap_probe_t *)a)->port - (int)((const epmap_probe_t *)b)->port;
+}
+
+/* Probe each distinct TCP port once, using the first interface seen on it.
+ * The probes are returned sorted by port.
+ */
+static int probe_entries(epmap_t *epmap, const ept_entry_t *entries, size_t count, int concurrency,
+                         int timeout, epmap_probe_t **probes, size_t *n_probes)
+{
+   epmap_probe_t *list = NULL;
+   size_t i, n = 0;
+   int result;
+
+   *probes = NULL;
+   *n_probes = 0;
+
+   list = malloc(sizeof(epmap_probe_t) * (count ? count : 1));
+   if (list == NULL)
+       return EPMAP_ENOMEM;
+
+   for (i = 0; i < count; i++) {
+       if (entries[i].tower.tcp_port == 0)
+           continue;
+       list[n].port = entries[i].tower.tcp_port;
+       list[n].if_id = entries[i].tower.if_id;
+       list[n].state = EPMAP_PROBE_PENDING;
+       n++;
+   }
+
+   /* Stable enough: the interface of any duplicate will do. */
+   qsort(list, n, sizeof(epmap_probe_t), probe_compare);
+   for (i = 0, count = 0; i < n; i++) {
+       if (count == 0 || list[count - 1].port != list[i].port)
+           list[count++] = list[i];
+   }
+   n = count;
+
+   result = epmap_probe(epmap, list, n, concurrency, timeout);
+   if (result != EPMAP_EOK) {
+       free(list);
+       return result;
+   }
+
+   *probes = list;
+   *n_probes = n;
+
+   return EPMAP_EOK;
+}
+
+static const epmap_probe_t *find_probe(const epmap_probe_t *probes, size_t n_probes, const tower_entry_t *tower)
+{
+   epmap_probe_t key;
+
+   if (probes == NULL || tower->tcp_port == 0)
+       return NULL;
+
+   key.port = tower->tcp_port;
+   return bsearch(&key, probes, n_probes, sizeof(epmap_probe_t), probe_compare);
+}
+
+static void print_interface(const ept_entry_t *entry, int version)
+{
+   const tower_entry_t *tower = &entry->tower;
+
+   printf("UUID: %s ", epmap_uuid_to_string(&tower->if_id.uuid));
+   if (version)
+       printf("v%u.%u ", tower->if_id.vers_major, tower->if_id.vers_minor);
+   if (tower->service != NULL)
+       printf("[%s] ", tower->service);
+   if (entry->flags & EPMAP_ENTRY_WATCHED)
+       printf("(watchlist) ");
+   printf("%s\n", epmap_string(entry->annotation_id)); 
+}
+
+static void print_endpoint(const char *server, const tower_entry_t *tower, const epmap_probe_t *probe)
+{
+   static const char *states[] = { 
+       "pending", "alive", "refused", "timeout", "not rpc", "error" 
+   };
+
+   if (tower->tcp_port != 0) {
+       printf("%s:%s[%u]", proto_sequence_string(PROTO_ID_TCP), server, tower->tcp_port);
+       if (probe != NULL && probe->state == EPMAP_PROBE_ALIVE) 
+           printf(" alive (%u.%03u ms)", probe->latency / 1000, probe->latency % 1000);
+       else if (probe != NULL)
+           printf(" %s", states[probe->state]);
+       printf("\n");
+   } else if (tower->udp_port != 0) {
+       printf("%s:%s[%u]\n", proto_sequence_string(PROTO_ID_UDP), server, tower->udp_port);   
+   } else {
+       printf("%s:%s[\\%s]\n", proto_sequence_string(PROTO_ID_NAMED_PIPES), 
+           server, epmap_string(tower->pipe_id));
+   }
+}
+
+/* -D -Q: the entries of the host in the snapshot replace the first batch. */
+static int load_snapshot_entries(const epmap_snapshot_t *snap, const epmap_snapshot_host_t *known,
+                                 epmap_result_t *host)
+{
+   const epmap_snapshot_entry_t *records = epmap_snapshot_entries(snap, known);
+   ept_entry_t *entries;
+   uint32_t i;
+   int result = EPMAP_EOK;
+
+   host->n_entries = 0;
+   entries = epmap_result_reserve(host, known->n_entries);
+   if (entries == NULL)
+       return EPMAP_ENOMEM;
 
-       memset(&tower, '\0', sizeof(tower_entry_t)); 
-       memset(&uuid, '\0', sizeof(uuid_t)); 
-       annotation[0] = '\0';
-   
-       result = epmap_request(epmap, &tower, &uuid, annotation);   
-                  
-           if (result == EPMAP_EOK) {
-               if (tower.tcp_port != 0) {
-                   printf("UUID: %s %s\n", epmap_uuid_to_string(&uuid), 
-                       strlen(annotation) > 0 ? annotation : ""); 
-                   printf("%s:%s[%u]\n\n", 
-                       proto_sequence_string(0x07), epmap->server, tower.tcp_port);
-                   count++;
-               } else if (tower.udp_port != 0) {
-                   printf("UUID: %s %s\n", epmap_uuid_to_string(&uuid),
-                       strlen(annotation) > 0 ? annotation : "");
-                   printf("%s:%s[%u]\n\n",
-                       proto_sequence_string(0x08), epmap->server,tower.udp_port);   
-                   count++;
-               } else {
-                   if (tower.named_pipe[0] == '\\' ) { 
-                       printf("UUID: %s %s\n", epmap_uuid_to_string(&uuid), annotation);
-                       printf("%s:%s[\\%s]\n\n", proto_sequence_string(0x0f), 
-                           epmap->server, tower.named_pipe);
-                       count++;
-               }
+   for (i = 0; i < known->n_entries && result == EPMAP_EOK; i++)
+       result = epmap_snapshot_entry_load(snap, &records[i], &entries[i]);
+   if (result == EPMAP_EOK)
+       host->n_entries = known->n_entries;
+
+   return result;
+}
+
+/* -D: changes found by epmap_snapshot_diff(). */
+typedef struct diff_context {
+   const char          *server;
+   epmap_output_t      *output;
+   const epmap_probe_t *probes;
+   size_t               n_probes;
+   unsigned int         counts[EPMAP_CHANGE_CHANGED + 1];
+} diff_context_t;
+
+static int print_change(void *context, int change, const ept_entry_t *entry, const ept_entry_t *previous)
+{
+   diff_context_t *diff = context;
+   const epmap_probe_t *probe = NULL;
+
+   if (change != EPMAP_CHANGE_REMOVED)
+       probe = find_probe(diff->probes, diff->n_probes, &entry->tower);
+   diff->counts[change]++;
+
+   if (diff->output != NULL)
+       return epmap_output_change(diff->output, diff->server, change, entry, previous, probe);
+
+   printf("%c ", "=+-~"[change]);
+   print_interface(entry, 1);
+   printf("  ");
+   print_endpoint(diff->server, &entry->tower, probe);
+   if (previous != NULL && previous->annotation_id != entry->annotation_id) {
+       printf("  was: %s\n", epmap_string(previous->annotation_id));
+   } else if (previous != NULL) {
+       printf("  was: ");
+       print_endpoint(diff->server, &previous->tower, NULL);
+   }
+   printf("\n");
+
+   return EPMAP_EOK;
+}
+
+/* -L: the endpoints of server in a snapshot, printed as by a scan. */
+static int list_snapshot(const char *path, const char *server, int format)
+{
+   epmap_snapshot_t snap;
+   const epmap_snapshot_host_t *host;
+   const epmap_snapshot_entry_t *records;
+   epmap_output_t *output = NULL;
+   ept_entry_t entry;
+   uint32_t i;
+   int result;
+
+   result = epmap_snapshot_open(&snap, path);
+   if (result != EPMAP_EOK) {
+       fprintf(stderr, "-epmap: Cannot open the snapshot %s.\n", path);
+       return EXIT_FAILURE;
+   }
+
+   host = epmap_snapshot_find(&snap, server);
+   if (host == NULL) {
+       fprintf(stderr, "-epmap: %s is not in the snapshot.\n", server);
+       epmap_snapshot_close(&snap);
+       return EXIT_FAILURE;
+   }
+
+   if (format != 0) {
+       output = epmap_output_open(stdout, format);
+       if (output == NULL) {
+           fprintf(stderr, "-epmap: %s.\n", epmap_error(EPMAP_ENOMEM));
+           epmap_snapshot_close(&snap);
+           return EXIT_FAILURE;
+       }
+   }
+
+   records = epmap_snapshot_entries(&snap, host);
+   for (i = 0; i < host->n_entries && result == EPMAP_EOK; i++) {
+       result = epmap_snapshot_entry_load(&snap, &records[i], &entry);
+       if (result == EPMAP_EOK && output != NULL) {
+           result = epmap_output_entry(output, server, &entry, NULL);
+       } else if (result == EPMAP_EOK) {
+           print_interface(&entry, 0);
+           print_endpoint(server, &entry.tower, NULL);
+           printf("\n");
+       }
+   }
+   if (output != NULL && epmap_output_close(output) != EPMAP_EOK && result == EPMAP_EOK)
+       result = EPMAP_EWRITE;
+
+   if (result == EPMAP_EOK)
+       fprintf(format != 0 ? stderr : stdout, "Total endpoints found: %u \n", host->n_entries);
+   else
+       fprintf(stderr, "-epmap: %s.\n", epmap_error(result));
+
+   epmap_snapshot_close(&snap);
+   epmap_strings_cleanup();
+
+   return result == EPMAP_EOK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* -q: the hosts of a snapshot exposing the interfaces of query, which is
+ * one UUID, or several joined by ',' (any of them) or '+' (all of them).
+ */
+static int query_snapshot(const char *path, const char *query)
+{
+   epmap_snapshot_t snap;
+   epmap_index_t index;
+   epmap_postings_t cursor;
+   epmap_posting_t posting;
+   const epmap_index_term_t *term;
+   uuid_t uuids[64];
+   char token[40];
+   uint32_t *hosts;
+   size_t n_uuids = 0, count = 0, len, i;
+   uint64_t started, built;
+   const char *name;
+   int op = 0;
+   int result;
+
+   while (*query != '\0') {
+       len = strcspn(query, ",+");
+       if (len >= sizeof(token) || n_uuids == 64)
+           break;
+       memcpy(token, query, len);
+       token[len] = '\0';
+       if (epmap_string_to_uuid(&uuids[n_uuids], token) == 0)
+           break;
+       n_uuids++;
+       query += len;
+       if (*query == '\0')
+           break;
+       if (op != 0 && op != (*query == '+' ? EPMAP_QUERY_AND : EPMAP_QUERY_OR))
+           break;
+       op = *query++ == '+' ? EPMAP_QUERY_AND : EPMAP_QUERY_OR;
+   }
+   /* A trailing separator would be an empty term. */
+   if (n_uuids == 0 || *query != '\0' || query[-1] == ',' || query[-1] == '+') {
+       fprintf(stderr, "-epmap: Invalid query.\n");
+       return EXIT_FAILURE;
+   }
+
+   result = epmap_snapshot_open(&snap, path);
+   if (result != EPMAP_EOK) {
+       fprintf(stderr, "-epmap: Cannot open the snapshot %s.\n", path);
+       return EXIT_FAILURE;
+   }
+
+   /* The index saved with the snapshot, or built for older ones. Either
+    * way, hosts are numbered in host index order. */
+   started = epmap_clock_us();
+   result = epmap_snapshot_index(&snap, &index);
+   if (result == EPMAP_ENODATA)
+       result = epmap_index_build(&index, &snap, 1);
+   built = epmap_clock_us();
+   if (result != EPMAP_EOK) {
+       fprintf(stderr, "-epmap: %s.\n", epmap_error(result));
+       epmap_snapshot_close(&snap);
+       return EXIT_FAILURE;
+   }
+
+   /* A single interface lists its endpoints, a set only the hosts. */
+   if (n_uuids == 1) {
+       term = epmap_index_find(&index, &uuids[0]);
+       if (term != NULL) {
+           epmap_index_postings(&index, term, &cursor);
+           while (epmap_postings_next(&cursor, &posting)) {
+               name = epmap_snapshot_string(&snap, snap.hosts[posting.host].name);
+               if (posting.port != 0)
+                   printf("%s %s[%u]\n", name, proto_sequence_string(posting.protseq), posting.port);
+               else
+                   printf("%s %s\n", name, proto_sequence_string(posting.protseq));
            }
-                   
+           count = term->n_hosts;
        }
- 
-   } while (result == EPMAP_EOK || result != EPMAP_ENODATA);
+   } else {
+       hosts = malloc((index.n_hosts ? index.n_hosts : 1) * sizeof(uint32_t));
+       result = hosts != NULL ? epmap_index_query(&index, uuids, n_uuids, op, hosts, &count) : EPMAP_ENOMEM;
+       for (i = 0; i < count; i++)
+           printf("%s\n", epmap_snapshot_string(&snap, snap.hosts[hosts[i]].name));
+       free(hosts);
+   }
+
+   if (result == EPMAP_EOK)
+       printf("\nMatching hosts: %u\n"
+              "Index: %u interfaces, %u hosts, %u entries, %u bytes of postings, %s in %u ms\n"
+              "Query: %u us\n", (unsigned int)count, (unsigned int)index.n_terms, index.n_hosts,
+              (unsigned int)index.n_entries, (unsigned int)index.postings_size,
+              index.mapped ? "mapped" : "built", (unsigned int)((built - started) / 1000),
+              (unsigned int)(epmap_clock_us() - built));
+   else
+       fprintf(stderr, "-epmap: %s.\n", epmap_error(result));
+
+   epmap_index_free(&index);
+   epmap_snapshot_close(&snap);
+
+   return result == EPMAP_EOK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* The scan is a pipeline: a thread reads the targets, then each one goes
+ * through the resolve, connect and enumerate stages, each run by its own
+ * workers, and is reported by the main thread. Stages are linked by
+ * bounded queues, so a slow stage holds the ones before it back instead of
+ * letting targets pile up. A stage only does network work; all the output
+ * is written by the report stage, in the order the targets complete.
+ */
+#define SCAN_RESOLVE   0
+#define SCAN_CONNECT   1
+#define SCAN_ENUMERATE 2
+#define SCAN_REPORT    3
+#define SCAN_STAGES    4
+
+/* A target on its way through the pipeline. */
+typedef struct scan_job {
+   char           target[256];
+   char           address[256];    /* Numeric if the name has one address. */
+   int            stage;           /* The stage it failed at, or SCAN_REPORT. */
+   int            result;
+   epmap_t       *epmap;
+   epmap_result_t host;
+   epmap_probe_t *probes;
+   size_t         n_probes;
+   const epmap_snapshot_host_t *known;
+   epmap_fingerprint_t fingerprint;
+   epmap_fingerprint_stats_t fp_stats;
+   int            unchanged;
+   int            health;          /* Result of the management calls. */
+   int            answered;        /* Whether the server said if it listens. */
+   int            listening;
+   rpc_if_id_t    if_ids[64];
+   size_t         n_if_ids;
+} scan_job_t;
+
+struct scan;
+
+typedef struct scan_stage {
+   struct scan   *scan;
+   int            index;
+   const char    *name;
+   epmap_queue_t  queue;           /* Jobs waiting for the stage. */
+   int            n_workers;
+   volatile LONG  n_running;
+   HANDLE        *threads;
+} scan_stage_t;
+
+/* Options and outputs shared by the scans of all the targets. */
+typedef struct scan {
+   uint16_t           port;
+   uint16_t           frag_size;
+   uint32_t           inquiry_type;
+   uuid_t             object;
+   uuid_t             if_uuid;
+   uint16_t           vers_major;
+   uint16_t           vers_minor;
+   uint32_t           vers_option;
+   epmap_predicate_t  predicate;
+   epmap_watchlist_t  watchlist;
+   int                watching;         /* -w */
+   int                filters;          /* -s, -r or -a */
+   int                liveness;
+   int                concurrency;
+   int                timeout;
+   int                grouped;
+   int                health;
+   int                quick;
+   FILE              *info;
+   epmap_output_t    *output;           /* -F */
+   epmap_snapshot_t  *previous;         /* -D */
+   const char        *diff_path;
+   epmap_snapshot_writer_t *snapshot;   /* -S */
+   epmap_table_t     *table;            /* -C */
+   char             **names;            /* -C: name of each table host. */
+   size_t             n_names;
+   epmap_journal_t   *journal;          /* -J */
+   epmap_journal_t   *history;          /* -N */
+   size_t             n_hosts;
+   size_t             n_failed;
+   size_t             n_endpoints;
+   epmap_targets_t   *targets;
+   int                targets_result;
+   volatile LONG      stop;             /* Set by the report stage on error. */
+   scan_stage_t       stages[SCAN_STAGES];
+   HANDLE             reader;
+} scan_t;
+
+/* Resolve stage: the address to connect to, so that a slow name server
+ * only holds a resolver. A name with several addresses is left for
+ * create_socket() to try them in turn.
+ */
+static void scan_resolve(scan_t *scan, scan_job_t *job)
+{
+   struct addrinfo hints, *info = NULL;
+
+   if (winsock_init() != 0) {
+       job->result = EPMAP_EWSAINIT;
+       return;
+   }
+
+   memset(&hints, '\0', sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_protocol = IPPROTO_TCP;
+
+   if (getaddrinfo(job->target, NULL, &hints, &info) != 0)
+       job->result = EPMAP_EDNSFAIL;
+   else if (info->ai_next != NULL || getnameinfo(info->ai_addr, (int)info->ai_addrlen,
+       job->address, sizeof(job->address), NULL, 0, NI_NUMERICHOST) != 0)
+       strcpy(job->address, job->target);
+
+   if (info != NULL)
+       freeaddrinfo(info);
+   WSACleanup();
+}
+
+/* Connect stage: bind, and set the filters. */
+static void scan_connect(scan_t *scan, scan_job_t *job)
+{
+   job->result = epmap_bind_ex(&job->epmap, job->address, scan->port, scan->frag_size);
+   if (job->result == EPMAP_EOK)
+       job->result = epmap_set_filter(job->epmap, scan->inquiry_type, &scan->object, &scan->if_uuid,
+           scan->vers_major, scan->vers_minor, scan->vers_option);
+   if (job->result == EPMAP_EOK) {
+       epmap_set_watchlist(job->epmap, &scan->watchlist);
+       epmap_set_predicate(job->epmap, &scan->predicate);
+   }
+}
+
+/* Enumerate stage: the endpoint map, the probes and the management
+ * interface. Each ept_lookup call returns up to epmap->max_entries
+ * entries, see epmap_bind_ex().
+ */
+static void scan_enumerate(scan_t *scan, scan_job_t *job)
+{
+   if (scan->previous != NULL)
+       job->known = epmap_snapshot_find(scan->previous, job->target);
+
+   epmap_result_init(&job->host, job->target, scan->port);
+   job->result = epmap_lookup_fingerprint(job->epmap, &job->host, &job->fingerprint,
+       job->known != NULL ? &job->known->fingerprint : NULL, scan->quick, &job->unchanged, &job->fp_stats);
+   if (job->result == EPMAP_EOK && scan->quick && job->unchanged) {
+       job->fingerprint = job->known->fingerprint;
+       job->result = load_snapshot_entries(scan->previous, job->known, &job->host);
+   }
+
+   /* The session is kept for -H, but not its receive buffer. */
+   epmap_idle(job->epmap);
+
+   if (job->result == EPMAP_EOK && scan->liveness)
+       job->result = probe_entries(job->epmap, job->host.entries, job->host.n_entries,
+           scan->concurrency, scan->timeout, &job->probes, &job->n_probes);
+
+   /* No second connection: the management interface is added to the
+    * association we used for the endpoint map. */
+   if (job->result == EPMAP_EOK && scan->health) {
+       job->health = epmap_mgmt_is_server_listening(job->epmap, &job->listening);
+       job->answered = job->health == EPMAP_EOK;
+       if (job->health == EPMAP_EOK)
+           job->health = epmap_mgmt_inq_if_ids(job->epmap, job->if_ids, 64, &job->n_if_ids);
+   }
+}
+
+static void scan_job_free(scan_job_t *job)
+{
+   if (job->epmap != NULL)
+       epmap_destroy(job->epmap);
+   epmap_result_free(&job->host);
+   free(job->probes);
+   free(job);
+}
+
+/* Report stage, on the main thread. Returns an error only if the scan
+ * cannot go on; a host that could not be scanned is counted in n_failed.
+ */
+static int scan_report(scan_t *scan, scan_job_t *job)
+{
+   const char *server = job->target;
+   epmap_aggregate_t agg;
+   const epmap_group_t *group;
+   const tower_entry_t *tower;
+   const epmap_probe_t *probes = job->probes;
+   size_t n_probes = job->n_probes;
+   ept_entry_t *entries = job->host.entries;
+   size_t count = job->host.n_entries;
+   diff_context_t diff;
+   FILE *info = scan->info;
+   unsigned int alive, watched;
+   size_t i;
+   uint32_t j;
+   char *name;
+   int result = EPMAP_EOK;
+
+   scan->n_hosts++;
+   fprintf(info, "\nBinding to endpoint portmapper: %s[%u] ...\n", server, scan->port);
+   if (job->stage > SCAN_CONNECT)
+       fprintf(info, "Querying Endpoint Mapper Database...\n\n");
+   if (job->stage == SCAN_REPORT && scan->liveness)
+       fprintf(info, "Probing %u dynamic TCP endpoints...\n\n", (unsigned int)n_probes);
+   if (job->stage != SCAN_REPORT) {
+       fprintf(stderr, "-epmap: %s: %s.\n", server, epmap_error(job->result));
+       scan->n_failed++;
+       return EPMAP_EOK;
+   }
+
+   /* Each distinct endpoint is printed once. */
+   result = epmap_aggregate_init(&agg, count ? count : 1);
+   if (result != EPMAP_EOK)
+       return result;
+
+   for (i = 0; i < count; i++)
+       epmap_aggregate_add(&agg, &entries[i]);
+
+   if (scan->previous != NULL) {
+       memset(&diff, '\0', sizeof(diff));
+       diff.server = server;
+       diff.output = scan->output;
+       diff.probes = probes;
+       diff.n_probes = n_probes;
+       /* Nothing to compare if the fingerprint matches. */
+       if (!job->unchanged)
+           result = epmap_snapshot_diff(scan->previous, server, entries, count, print_change, &diff);
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: Cannot compare with the snapshot %s: %s.\n", scan->diff_path,
+               epmap_error(result));
+       else
+           fprintf(info, "Changes since the snapshot: %u added, %u removed, %u changed\n",
+               diff.counts[EPMAP_CHANGE_ADDED], diff.counts[EPMAP_CHANGE_REMOVED],
+               diff.counts[EPMAP_CHANGE_CHANGED]);
+       if (result == EPMAP_EOK && job->known != NULL)
+           fprintf(info, "Fingerprint: %s%s, %u lookups and %u entries avoided\n",
+               job->fp_stats.first_matches ? "first batch matched" : "first batch changed",
+               job->fp_stats.matches ? (scan->quick ? ", map assumed unchanged" : ", map unchanged") : "",
+               (unsigned int)job->fp_stats.lookups_avoided, (unsigned int)job->fp_stats.entries_avoided);
+       if (result == EPMAP_EOK)
+           fprintf(info, "\n");
+   } else if (scan->output != NULL) {
+       /* -g does not apply, records carry the interface. */
+       for (i = 0; i < agg.n_endpoints && result == EPMAP_EOK; i++) {
+           tower = &agg.endpoints[i].entry->tower;
+           result = epmap_output_entry(scan->output, server, agg.endpoints[i].entry,
+               find_probe(probes, n_probes, tower));
+       }
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: %s.\n", epmap_error(result));
+   } else if (scan->grouped) {
+       for (i = 0; i < agg.n_groups; i++) {
+           group = &agg.groups[i];
+           print_interface(group->entry, 1);
+           for (j = group->first; j != EPMAP_NONE; j = agg.endpoints[j].next) {
+               tower = &agg.endpoints[j].entry->tower;
+               print_endpoint(server, tower, find_probe(probes, n_probes, tower));
+           }
+           printf("\n");
+       }
+   } else {
+       for (i = 0; i < agg.n_endpoints; i++) {
+           tower = &agg.endpoints[i].entry->tower;
+           print_interface(agg.endpoints[i].entry, 0);
+           print_endpoint(server, tower, find_probe(probes, n_probes, tower));
+           printf("\n");
+       }
+   }
+
+   if (result == EPMAP_EOK) {
+       if (agg.n_endpoints != count) 
+           fprintf(info, "Duplicate entries collapsed: %u\n", (unsigned int)(count - agg.n_endpoints));
+       if (scan->filters)
+           fprintf(info, "Entries skipped by the filters: %u\n", (unsigned int)job->epmap->n_skipped);
+       if (scan->watching) {
+           for (i = 0, watched = 0; i < agg.n_endpoints; i++)
+               watched += (agg.endpoints[i].entry->flags & EPMAP_ENTRY_WATCHED) != 0;
+           fprintf(info, "Watchlist matches: %u\n", watched);
+       }
+   }
+
+   /* One row per collapsed endpoint, the host numbered in names. */
+   if (result == EPMAP_EOK && scan->table != NULL) {
+       name = malloc(strlen(server) + 1);
+       result = name != NULL ? grow_array((void **)&scan->names, sizeof(char *), scan->n_names) : EPMAP_ENOMEM;
+       if (result == EPMAP_EOK) {
+           scan->names[scan->n_names] = strcpy(name, server);
+           for (i = 0; i < agg.n_endpoints && result == EPMAP_EOK; i++)
+               result = epmap_table_append(scan->table, (uint32_t)scan->n_names, agg.endpoints[i].entry, 1);
+           scan->n_names++;
+       } else {
+           free(name);
+       }
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: %s.\n", epmap_error(result));
+   }
+   scan->n_endpoints += agg.n_endpoints;
+   epmap_aggregate_free(&agg);
+
+   if (result == EPMAP_EOK && scan->snapshot != NULL) {
+       result = epmap_snapshot_add(scan->snapshot, server, entries, count, &job->fingerprint);
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: Cannot write the snapshot: %s.\n", epmap_error(result));
+   }
+
+   if (result == EPMAP_EOK && scan->liveness) {
+       for (i = 0, alive = 0; i < n_probes; i++) 
+           alive += probes[i].state == EPMAP_PROBE_ALIVE;
+       fprintf(info, "Live TCP endpoints: %u/%u\n\n", alive, (unsigned int)n_probes);
+   }
+
+   if (result == EPMAP_EOK && scan->health) {
+       fprintf(info, "Querying Management Interface...\n\n");
+       if (job->answered)
+           fprintf(info, "Server listening: %s\n", job->listening ? "yes" : "no");
+       if (job->health != EPMAP_EOK) {
+           fprintf(stderr, "-epmap: %s: %s.\n", server, epmap_error(job->health));
+           scan->n_failed++;
+       } else {
+           fprintf(info, "Registered interfaces: %u\n", (unsigned int)job->n_if_ids);
+           for (i = 0; i < job->n_if_ids && i < 64; i++) {
+               fprintf(info, "UUID: %s v%u.%u\n", epmap_uuid_to_string(&job->if_ids[i].uuid),
+                   job->if_ids[i].vers_major, job->if_ids[i].vers_minor);
+           }
+           fprintf(info, "\n");
+       }
+   }
+
+   return result;
+}
+
+/* Worker of the resolve, connect or enumerate stage. The last worker of a
+ * stage to run out of jobs closes the queue of the next one.
+ */
+static DWORD WINAPI scan_worker(LPVOID param)
+{
+   scan_stage_t *stage = param;
+   scan_t *scan = stage->scan;
+   scan_stage_t *next = &scan->stages[stage->index + 1];
+   scan_job_t *job;
+
+   while (epmap_queue_pop(&stage->queue, (void **)&job)) {
+       /* After an error, jobs only go through to be freed. */
+       if (job->result == EPMAP_EOK && !scan->stop) {
+           if (stage->index == SCAN_RESOLVE)
+               scan_resolve(scan, job);
+           else if (stage->index == SCAN_CONNECT)
+               scan_connect(scan, job);
+           else
+               scan_enumerate(scan, job);
+           job->stage = job->result == EPMAP_EOK ? stage->index + 1 : stage->index;
+       }
+       epmap_queue_push(&next->queue, job);
+   }
 
-   epmap_destroy(epmap);
+   if (InterlockedDecrement(&stage->n_running) == 0)
+       epmap_queue_close(&next->queue);
 
-   if (result != EPMAP_ENODATA) {
-       fprintf(stderr, "-epmap: An error has occurred.\n");
-       fprintf(stderr, " \n");
+   return 0;
+}
+
+/* Reader of the targets, the first stage of the pipeline. */
+static DWORD WINAPI scan_reader(LPVOID param)
+{
+   scan_t *scan = param;
+   scan_stage_t *first = &scan->stages[SCAN_RESOLVE];
+   scan_job_t *job;
+   int result = EPMAP_EOK;
+
+   while (!scan->stop) {
+       job = calloc(1, sizeof(scan_job_t));
+       if (job == NULL) {
+           result = EPMAP_ENOMEM;
+           break;
+       }
+       result = epmap_targets_next(scan->targets, job->target, sizeof(job->target));
+       if (result != EPMAP_EOK) {
+           free(job);
+           break;
+       }
+       epmap_queue_push(&first->queue, job);
+   }
+   scan->targets_result = result == EPMAP_ENODATA ? EPMAP_EOK : result;
+   epmap_queue_close(&first->queue);
+
+   return 0;
+}
+
+/* Start the reader and the workers of each stage, the last stage first: if
+ * a stage cannot start any worker, the queue after it is closed so that the
+ * stages after it still wind down.
+ */
+static int scan_start(scan_t *scan, const int *workers)
+{
+   static const char *names[SCAN_STAGES] = { "resolve", "connect", "enumerate", "report" };
+   scan_stage_t *stage;
+   int result = EPMAP_EOK;
+   int i, j;
+
+   for (i = 0; i < SCAN_STAGES; i++) {
+       stage = &scan->stages[i];
+       stage->scan = scan;
+       stage->index = i;
+       stage->name = names[i];
+       stage->n_workers = i < SCAN_REPORT ? workers[i] : 1;
+       if (result == EPMAP_EOK)
+           result = epmap_queue_init(&stage->queue, SCAN_QUEUE_SIZE);
+   }
+   if (result != EPMAP_EOK)
+       return result;
+
+   for (i = SCAN_ENUMERATE; i >= SCAN_RESOLVE; i--) {
+       stage = &scan->stages[i];
+       stage->threads = calloc(stage->n_workers, sizeof(HANDLE));
+       for (j = 0; stage->threads != NULL && j < stage->n_workers; j++) {
+           stage->n_running = j + 1;
+           stage->threads[j] = CreateThread(NULL, 0, scan_worker, stage, 0, NULL);
+           if (stage->threads[j] == NULL)
+               break;
+       }
+       /* Fewer workers will do. */
+       stage->n_workers = stage->n_running = j;
+       if (j == 0)
+           break;
+   }
+
+   if (i < SCAN_RESOLVE)
+       scan->reader = CreateThread(NULL, 0, scan_reader, scan, 0, NULL);
+   if (scan->reader == NULL) {
+       scan->targets_result = EPMAP_ENOMEM;
+       epmap_queue_close(&scan->stages[i + 1].queue);
+       for (; i >= SCAN_RESOLVE; i--)
+           scan->stages[i].n_workers = 0;
+   }
+
+   return EPMAP_EOK;
+}
+
+/* No host reported for a while: commit the lines past their deadline, so
+ * that a slow tail of timeouts does not keep them pending. 
+ */
+static int scan_tick(scan_t *scan)
+{
+   int result = EPMAP_EOK;
+
+   if (scan->journal != NULL) {
+       result = epmap_journal_tick(scan->journal);
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: Cannot write the journal: %s.\n", epmap_error(result));
+   }
+   if (result == EPMAP_EOK && scan->history != NULL) {
+       result = epmap_journal_tick(scan->history);
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: Cannot write the history: %s.\n", epmap_error(result));
+   }
+
+   return result;
+}
+
+/* Report the jobs as they complete, then wait for all the threads. */
+static int scan_run(scan_t *scan)
+{
+   scan_stage_t *report = &scan->stages[SCAN_REPORT];
+   scan_job_t *job;
+   int result = EPMAP_EOK;
+   int popped;
+   int i, j;
+
+   while ((popped = epmap_queue_pop_wait(&report->queue, (void **)&job, SCAN_TICK)) != 0) {
+       if (popped < 0) {
+           if (result == EPMAP_EOK && (result = scan_tick(scan)) != EPMAP_EOK)
+               InterlockedIncrement(&scan->stop);
+           continue;
+       }
+       if (result == EPMAP_EOK) {
+           result = scan_report(scan, job);
+           /* Once reported, the host is done or failed for good. */
+           if (result == EPMAP_EOK && scan->journal != NULL) {
+               result = epmap_journal_add(scan->journal, job->target,
+                   job->stage == SCAN_REPORT ? EPMAP_EOK : job->result);
+               if (result != EPMAP_EOK)
+                   fprintf(stderr, "-epmap: Cannot write the journal: %s.\n", epmap_error(result));
+           }
+           if (result == EPMAP_EOK && scan->history != NULL) {
+               result = epmap_history_add(scan->history, job->target,
+                   job->stage == SCAN_REPORT ? EPMAP_EOK : job->result);
+               if (result != EPMAP_EOK)
+                   fprintf(stderr, "-epmap: Cannot write the history: %s.\n", epmap_error(result));
+           }
+           if (result != EPMAP_EOK)
+               InterlockedIncrement(&scan->stop);
+       }
+       scan_job_free(job);
+   }
+
+   if (scan->reader != NULL) {
+       WaitForSingleObject(scan->reader, INFINITE);
+       CloseHandle(scan->reader);
+   }
+   for (i = 0; i < SCAN_REPORT; i++) {
+       for (j = 0; j < scan->stages[i].n_workers; j++) {
+           WaitForSingleObject(scan->stages[i].threads[j], INFINITE);
+           CloseHandle(scan->stages[i].threads[j]);
+       }
+   }
+
+   return result != EPMAP_EOK ? result : scan->targets_result;
+}
+
+static void scan_cleanup(scan_t *scan)
+{
+   int i;
+
+   for (i = 0; i < SCAN_STAGES; i++) {
+       free(scan->stages[i].threads);
+       epmap_queue_free(&scan->stages[i].queue);
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   scan_t scan;
+   epmap_targets_t targets;
+   const epmap_queue_t *queue;
+   int workers[SCAN_REPORT] = { 4, 16, 16 };
+   const char *first = NULL;
+   size_t n_specs = 0;
+   int format = 0;
+   int random = 0;
+   int drop = 0;
+   int ttl_set = 0;
+   int sweeping;
+   int resumed;
+   long long ttl = 86400;
+   const char *watchlist_path = NULL;
+   const char *snapshot_path = NULL;
+   const char *list_path = NULL;
+   const char *diff_path = NULL;
+   const char *columns_path = NULL;
+   const char *journal_path = NULL;
+   const char *history_path = NULL;
+   const char *answered_path = NULL;
+   const char *query = NULL;
+   char *snapshot_temp = NULL;
+   epmap_table_t table;
+   epmap_snapshot_t previous;
+   epmap_snapshot_writer_t snapshot;
+   epmap_journal_t journal;
+   epmap_journal_t history;
+   epmap_snapshot_t answered;
+   int64_t started = (int64_t)time(NULL);
+   unsigned int port, port_lo, port_hi;
+   unsigned int vers_major = 0, vers_minor = 0;
+   int frag_size = EPMAP_FRAG_SIZE;
+   const char *arg;
+   int error = 0;
+   int result = EPMAP_EOK;
+   size_t k;
+   int i;
+   
+   memset(&scan, '\0', sizeof(scan));
+   scan.port = DEFAULT_EPMAP_PORT;
+   scan.inquiry_type = RPC_C_EP_ALL_ELTS;
+   scan.concurrency = 32;
+   scan.timeout = 2000;
+   scan.info = stdout;
+   epmap_targets_init(&targets);
+
+   /* NAMED_PIPES_2 (local RPC) endpoints are not reachable remotely, they
+    * are skipped while decoding unless -s says otherwise. */
+   scan.predicate.protseqs = (1u << PROTO_ID_TCP) | (1u << PROTO_ID_UDP) | (1u << PROTO_ID_NAMED_PIPES);
+
+   /* Parse arguments here. */
+   for (i = 1; i < argc && !error; i++) {
+       if (argv[i][0] != '-' || argv[i][1] == '\0') {
+           /* Targets, "-" being stdin. */
+           if (first == NULL)
+               first = argv[i];
+           n_specs++;
+           error = epmap_targets_add(&targets, argv[i]) != EPMAP_EOK;
+           continue;
+       }
+       if (strcmp(argv[i], "-H") == 0) {
+           scan.health = 1;
+           continue;
+       }
+       if (strcmp(argv[i], "-l") == 0) {
+           scan.liveness = 1;
+           continue;
+       }
+       if (strcmp(argv[i], "-g") == 0) {
+           scan.grouped = 1;
+           continue;
+       }
+       if (strcmp(argv[i], "-Q") == 0) {
+           scan.quick = 1;
+           continue;
+       }
+       if (strcmp(argv[i], "-R") == 0) {
+           random = 1;
+           continue;
+       }
+       if (strcmp(argv[i], "-K") == 0) {
+           drop = 1;
+           continue;
+       }
+       /* All other options take an argument. */
+       if (argv[i][2] != '\0' || i + 1 >= argc) {
+           error = 1;
+           break;
+       }
+       arg = argv[i + 1];
+       switch (argv[i++][1]) {
+           case 'p': case 'P':
+               port = (unsigned int)atoi(arg);
+               error = port == 0 || port > 0xffff;
+               scan.port = (uint16_t)port;
+               break;
+           case 'i':
+               error = epmap_string_to_uuid(&scan.if_uuid, arg) == 0;
+               scan.inquiry_type |= RPC_C_EP_MATCH_BY_IF;
+               break;
+           case 'o':
+               error = epmap_string_to_uuid(&scan.object, arg) == 0;
+               scan.inquiry_type |= RPC_C_EP_MATCH_BY_OBJ;
+               break;
+           case 'v':
+               error = sscanf(arg, "%u.%u", &vers_major, &vers_minor) != 2 ||
+                   vers_major > 0xffff || vers_minor > 0xffff;
+               if (scan.vers_option == 0)
+                   scan.vers_option = RPC_C_VERS_EXACT;
+               break;
+           case 'm':
+               scan.vers_option = vers_option_from_string(arg);
+               error = scan.vers_option == 0;
+               break;
+           case 'c':
+               scan.concurrency = atoi(arg);
+               error = scan.concurrency <= 0 || scan.concurrency > EPMAP_PROBE_MAX_CONCURRENCY;
+               break;
+           case 't':
+               scan.timeout = atoi(arg);
+               error = scan.timeout <= 0;
+               break;
+           case 'f':
+               frag_size = atoi(arg);
+               error = frag_size < EPMAP_MIN_FRAG_SIZE || frag_size > 0xffff;
+               break;
+           case 'w':
+               watchlist_path = arg;
+               break;
+           case 's':
+               scan.predicate.protseqs = protseqs_from_string(arg);
+               error = scan.predicate.protseqs == 0;
+               scan.filters = 1;
+               break;
+           case 'r':
+               error = sscanf(arg, "%u-%u", &port_lo, &port_hi) != 2 ||
+                   port_lo > port_hi || port_hi == 0 || port_hi > 0xffff;
+               scan.predicate.port_lo = (uint16_t)port_lo;
+               scan.predicate.port_hi = (uint16_t)port_hi;
+               scan.filters = 1;
+               break;
+           case 'a':
+               scan.predicate.prefix = arg;
+               scan.filters = 1;
+               break;
+           case 'x':
+               error = epmap_targets_exclude(&targets, arg) != EPMAP_EOK;
+               break;
+           case 'F':
+               format = output_format_from_string(arg);
+               error = format == 0;
+               break;
+           case 'S':
+               snapshot_path = arg;
+               break;
+           case 'L':
+               list_path = arg;
+               break;
+           case 'D':
+               diff_path = arg;
+               break;
+           case 'C':
+               columns_path = arg;
+               break;
+           case 'J':
+               journal_path = arg;
+               break;
+           case 'N':
+               history_path = arg;
+               break;
+           case 'T':
+               error = sscanf(arg, "%lld", &ttl) != 1 || ttl < 0;
+               ttl_set = 1;
+               break;
+           case 'A':
+               answered_path = arg;
+               break;
+           case 'q':
+               query = arg;
+               break;
+           case 'j':
+               error = sscanf(arg, "%d,%d,%d", &workers[SCAN_RESOLVE], &workers[SCAN_CONNECT],
+                   &workers[SCAN_ENUMERATE]) != 3;
+               for (k = 0; k < SCAN_REPORT; k++)
+                   error |= workers[k] <= 0 || workers[k] > SCAN_MAX_WORKERS;
+               break;
+           default:
+               error = 1;
+               break;
+       }
+   }
+
+   /* -L and -q read a single name, not targets. */
+   sweeping = snapshot_path != NULL || diff_path != NULL || columns_path != NULL || journal_path != NULL ||
+       history_path != NULL || answered_path != NULL;
+   if (error || first == NULL || ((list_path != NULL || query != NULL) && (sweeping || n_specs != 1)) ||
+       (list_path != NULL && query != NULL) || (scan.quick && diff_path == NULL) ||
+       ((drop || ttl_set) && history_path == NULL)) {
+       fprintf(stderr, "-epmap: Invalid arguments.\n");
+       display_usage(argv[0]);
+       epmap_targets_free(&targets);
        return EXIT_FAILURE;
    }
-       
-   printf("Total endpoints found: %u \n", count);
-   printf("\n======= End of RPC Endpoint Mapper query response =======\n");
 
+   if (format == EPMAP_OUTPUT_BINARY)
+       _setmode(_fileno(stdout), _O_BINARY);
+   if (list_path != NULL || query != NULL) {
+       epmap_targets_free(&targets);
+       return list_path != NULL ? list_snapshot(list_path, first, format) : query_snapshot(first, query);
+   }
+
+   if (random)
+       epmap_targets_randomize(&targets, epmap_clock_us() ^ ((uint64_t)started << 20));
+
+   scan.frag_size = (uint16_t)frag_size;
+   scan.vers_major = (uint16_t)vers_major;
+   scan.vers_minor = (uint16_t)vers_minor;
+   if (scan.vers_option == 0)
+       scan.vers_option = RPC_C_VERS_ALL;
+
+   /* The snapshot of -D is mapped up front, for the fingerprints. */
+   if (diff_path != NULL) {
+       result = epmap_snapshot_open(&previous, diff_path);
+       if (result != EPMAP_EOK) {
+           fprintf(stderr, "-epmap: Cannot open the snapshot %s.\n", diff_path);
+           epmap_targets_free(&targets);
+           return EXIT_FAILURE;
+       }
+       scan.previous = &previous;
+       scan.diff_path = diff_path;
+   }
+
+   if (watchlist_path != NULL) {
+       result = load_watchlist(watchlist_path, &scan.watchlist);
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: Cannot load the watchlist %s.\n", watchlist_path);
+       scan.watching = 1;
+   }
+
+   /* The hosts of the snapshot of -A come first, then the history may put
+    * some of them off, and the journal skips those done. */
+   if (result == EPMAP_EOK && answered_path != NULL) {
+       result = epmap_snapshot_open(&answered, answered_path);
+       for (k = 0; result == EPMAP_EOK && k < answered.header->n_hosts; k++)
+           result = epmap_targets_mark(&targets, epmap_snapshot_string(&answered, answered.hosts[k].name),
+               EPMAP_TARGET_FIRST);
+       epmap_snapshot_close(&answered);
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: Cannot read the snapshot %s: %s.\n", answered_path, epmap_error(result));
+   }
+
+   if (result == EPMAP_EOK && history_path != NULL) {
+       result = epmap_history_open(&history, history_path, &targets, (int64_t)ttl);
+       if (result == EPMAP_EOK)
+           scan.history = &history;
+       else
+           fprintf(stderr, "-epmap: Cannot open the history %s: %s.\n", history_path, epmap_error(result));
+       if (drop)
+           epmap_targets_drop_last(&targets);
+   }
+
+   if (result == EPMAP_EOK && journal_path != NULL) {
+       result = epmap_journal_open(&journal, journal_path, &targets);
+       if (result == EPMAP_EOK)
+           scan.journal = &journal;
+       else
+           fprintf(stderr, "-epmap: Cannot open the journal %s: %s.\n", journal_path, epmap_error(result));
+   }
+
+   /* -S writes next to the file and replaces it once the sweep is over:
+    * -D may be reading it, and an interrupted sweep leaves it as it was. */
+   if (result == EPMAP_EOK && snapshot_path != NULL) {
+       snapshot_temp = malloc(strlen(snapshot_path) + 5);
+       result = snapshot_temp != NULL ? EPMAP_EOK : EPMAP_ENOMEM;
+       if (result == EPMAP_EOK) {
+           sprintf(snapshot_temp, "%s.tmp", snapshot_path);
+           result = epmap_snapshot_create(&snapshot, snapshot_temp, started);
+       }
+       if (result == EPMAP_EOK)
+           scan.snapshot = &snapshot;
+       else
+           fprintf(stderr, "-epmap: Cannot write the snapshot %s: %s.\n", snapshot_path, epmap_error(result));
+   }
+
+   if (columns_path != NULL) {
+       epmap_table_init(&table);
+       scan.table = &table;
+   }
+
+   /* Records only on stdout, the rest is for humans. */
+   if (result == EPMAP_EOK && format != 0) {
+       scan.info = stderr;
+       scan.output = epmap_output_open(stdout, format);
+       result = scan.output != NULL ? EPMAP_EOK : EPMAP_ENOMEM;
+   }
+
+   if (result == EPMAP_EOK) {
+       scan.targets = &targets;
+       result = scan_start(&scan, workers);
+       if (result == EPMAP_EOK)
+           result = scan_run(&scan);
+       if (result == EPMAP_EINVAL)
+           fprintf(stderr, "-epmap: Invalid target.\n");
+       else if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: %s.\n", epmap_error(result));
+   }
+
+   if (scan.output != NULL && epmap_output_close(scan.output) != EPMAP_EOK && result == EPMAP_EOK) {
+       result = EPMAP_EWRITE;
+       fprintf(stderr, "-epmap: %s.\n", epmap_error(result));
+   }
+
+   if (scan.journal != NULL && epmap_journal_close(&journal) != EPMAP_EOK && result == EPMAP_EOK) {
+       result = EPMAP_EWRITE;
+       fprintf(stderr, "-epmap: Cannot write the journal %s: %s.\n", journal_path, epmap_error(result));
+   }
+   if (scan.history != NULL && epmap_journal_close(&history) != EPMAP_EOK && result == EPMAP_EOK) {
+       result = EPMAP_EWRITE;
+       fprintf(stderr, "-epmap: Cannot write the history %s: %s.\n", history_path, epmap_error(result));
+   }
+
+   if (scan.previous != NULL)
+       epmap_snapshot_close(&previous);
+   if (scan.snapshot != NULL) {
+       if (result == EPMAP_EOK)
+           result = epmap_snapshot_finish(&snapshot);
+       else
+           epmap_snapshot_abort(&snapshot);
+       /* Atomic: the old snapshot stays until the new one replaces it. */
+       if (result == EPMAP_EOK &&
+           !MoveFileExA(snapshot_temp, snapshot_path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+           result = EPMAP_EWRITE;
+       if (result != EPMAP_EOK)
+           fprintf(stderr, "-epmap: Cannot write the snapshot %s: %s.\n", snapshot_path, epmap_error(result));
+   }
+   free(snapshot_temp);
+
+   if (scan.table != NULL) {
+       if (result == EPMAP_EOK) {
+           result = epmap_table_export(&table, (const char *const *)scan.names, scan.n_names, columns_path);
+           if (result != EPMAP_EOK)
+               fprintf(stderr, "-epmap: Cannot export the table %s: %s.\n", columns_path, epmap_error(result));
+       }
+       epmap_table_free(&table);
+       for (k = 0; k < scan.n_names; k++)
+           free(scan.names[k]);
+       free(scan.names);
+   }
+
+   epmap_pool_cleanup();
+   epmap_strings_cleanup();
+   epmap_watchlist_free(&scan.watchlist);
+
+   if (result == EPMAP_EOK && scan.n_hosts > 1) {
+       fprintf(scan.info, "Hosts scanned: %u, failed: %u, excluded addresses: %u\n",
+           (unsigned int)scan.n_hosts, (unsigned int)scan.n_failed, (unsigned int)targets.n_skipped);
+       /* The queue of a stage is its input: a full one is a bottleneck. */
+       for (i = 0; i < SCAN_STAGES; i++) {
+           queue = &scan.stages[i].queue;
+           fprintf(scan.info, "Stage %-9s workers: %2u, queue depth: %u/%u max, full %u times\n",
+               scan.stages[i].name, (unsigned int)scan.stages[i].n_workers, (unsigned int)queue->max_depth,
+               (unsigned int)epmap_queue_size(queue), (unsigned int)queue->n_full);
+       }
+   }
+   if (result == EPMAP_EOK && scan.journal != NULL)
+       fprintf(scan.info, "Targets done by an earlier run: %u\n", (unsigned int)targets.n_done);
+   if (result == EPMAP_EOK && (scan.history != NULL || answered_path != NULL))
+       fprintf(scan.info, "Targets known to answer: %u, known unreachable: %u (%s)\n", (unsigned int)targets.n_first,
+           (unsigned int)targets.n_last, drop ? "skipped" : "scanned last");
+   /* Nothing left to scan is not a failure when resuming. */
+   resumed = targets.n_done != 0;
+   scan_cleanup(&scan);
+   epmap_targets_free(&targets);
+
+   if (result != EPMAP_EOK || (scan.n_failed == scan.n_hosts && (scan.n_hosts != 0 || !resumed)))
+       return EXIT_FAILURE;
+
+   fprintf(scan.info, "Total endpoints found: %u \n", (unsigned int)scan.n_endpoints);
+   fprintf(scan.info, "\n======= End of RPC Endpoint Mapper query response =======\n");
 
    return EXIT_SUCCESS;
 }
 
+#endif /* EPMAP_NO_MAIN */
+
 /******** EOF ********/
\ No newline at end of file
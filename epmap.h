@@ -0,0 +1,253 @@
+/*******************************************************************************
+ * epmap.h - Public interface of the endpoint mapper client in epdump.c.
+ * To embed the library, compile epdump.c with EPMAP_NO_MAIN defined and
+ * include this header. epmap.hpp wraps it for C++.
+ ******************************************************************************/
+
+#ifndef EPMAP_H
+#define EPMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct uuid {
+   uint32_t  time_low;
+   uint16_t  time_mid;
+   uint16_t  time_hi_and_version;
+   uint8_t   clock_seq_hi_and_reserved;
+   uint8_t   clock_seq_low;
+   uint8_t   node[6];
+} epmap_uuid_t, *epmap_uuid_p_t;
+
+/* rpcdce.h, included by <windows.h> unless WIN32_LEAN_AND_MEAN is defined,
+ * defines uuid_t as UUID when it is not defined yet. Make the name ours
+ * whichever header comes first. 
+ */
+#undef uuid_t
+#undef uuid_p_t
+#define uuid_t   epmap_uuid_t
+#define uuid_p_t epmap_uuid_p_t
+
+#define UUID_SIZE  16
+
+/* Interface identifier, as returned by rpc__mgmt_inq_if_ids. */
+typedef struct rpc_if_id {
+   uuid_t   uuid;
+   uint16_t vers_major;
+   uint16_t vers_minor;
+} rpc_if_id_t, *rpc_if_id_p_t;
+
+#define DEFAULT_EPMAP_PORT 135
+
+/* Inquiry types. */
+#define RPC_C_EP_ALL_ELTS             0  /* Return all elements from the endpoint map. */
+#define RPC_C_EP_MATCH_BY_IF          1
+#define RPC_C_EP_MATCH_BY_OBJ         2
+#define RPC_C_EP_MATCH_BY_BOTH        3
+
+#define RPC_C_VERS_ALL                1
+#define RPC_C_VERS_COMPATIBLE         2
+#define RPC_C_VERS_EXACT              3
+#define RPC_C_VERS_MAJOR_ONLY         4
+#define RPC_C_VERS_UPTO               5
+
+/* Fragment size we advertise by default, and the smallest one every
+ * implementation must accept. 
+ */
+#define EPMAP_FRAG_SIZE     5840
+#define EPMAP_MIN_FRAG_SIZE 1432
+
+/* Protocol identifiers. */
+#define PROTO_ID_OSI_OID        0x00 /* OSI OID */
+#define PROTO_ID_DNA_SESSCTL    0x02 /* DNA Session Control */
+#define PROTO_ID_DNA_SESSCTL_V3 0x03 /* DNA Session Control V3 */
+#define PROTO_ID_DNA_NSP        0x04 /* DNA NSP Transport */
+#define PROTO_ID_OSI_TP4        0x05 /* OSI TP4 */
+#define PROTO_ID_OSI_CLNS       0x06 /* OSI CLNS or DNA Routing */  
+#define PROTO_ID_TCP            0x07 /* DOD TCP, 16-bit unsigned, big-endian */
+#define PROTO_ID_UDP            0x08 /* DOD UDP, 16-bit unsigned, big-endian */
+#define PROTO_ID_IP             0x09 /* DOD IP */
+#define PROTO_ID_RPC_CL         0x0a /* RPC Connectionless Protcol */
+#define PROTO_ID_RPC_CO         0x0b /* RPC Connection-Oriented Protocol */    
+#define PROTO_ID_SPX            0x0c /* Netware SPX */
+#define PROTO_ID_UUID           0x0d /* UUID */
+#define PROTO_ID_IPX            0x0e /* Netware IPX */
+#define PROTO_ID_NAMED_PIPES    0x0f /* Microsoft Named Pipes */
+#define PROTO_ID_NAMED_PIPES_2  0x10 /* Microsoft Named Pipes (SMB?) */   
+#define PROTO_ID_NETBIOS        0x11 /* Microsoft NetBIOS */
+#define PROTO_ID_NETBEUI        0x12 /* Microsoft NetBEUI */ 
+#define PROTO_ID_NETWARE_SPX    0x13 /* Netware SPX transport-layer protocol */
+#define PROTO_ID_NETWARE_IPX    0x14 /* Netware IPX transport-layer protocol */
+#define PROTO_ID_ATALK_STREAM   0x16 /* Appletalk Stream */
+#define PROTO_ID_ATALK_DATAGRAM 0x17 /* Appletalk Datagram */
+#define PROTO_ID_ATALK          0x18 /* Appletalk */ 
+#define PROTO_ID_NETBIOS_2      0x19 /* NetBIOS, CL over all protocols */
+#define PROTO_ID_VINES_SPP      0x1a /* Vines SPP */
+#define PROTO_ID_VINES_IPC      0x1b /* Vines IPC */
+#define PROTO_ID_STREETTALK     0x1c /* StreetTalk name */
+#define PROTO_ID_HTTP           0x1f /* RPC over HTTP */         
+#define PROTO_ID_UNIX_DOMAIN    0x20 /* Unix Domain socket */
+#define PROTO_ID_NULL           0x21 /* NULL */
+#define PROTO_ID_NETBIOS_3      0x22 /* NetBIOS */
+
+/* Decoded protocol tower. Floor 1 holds the interface identifier. */
+typedef struct tower_entry {
+   rpc_if_id_t if_id;
+   const char *service;        /* Well-known interface name, or NULL. */
+   unsigned int proto_id;
+   uint16_t tcp_port;
+   uint16_t udp_port;
+   uint32_t host_addr;
+   uint32_t pipe_id;           /* Interned pipe name, 0 if none. */
+} tower_entry_t;
+
+typedef struct ept_entry {
+   uuid_t object;
+   tower_entry_t tower;
+   uint32_t annotation_id;     /* Interned annotation, 0 if none. */
+   uint32_t flags;             /* EPMAP_ENTRY_* */
+} ept_entry_t, *ept_entry_p_t;
+
+#define EPMAP_ENTRY_WATCHED 0x01 /* The interface is on the watchlist. */
+
+/* Set of interface UUIDs to flag while decoding. A Bloom filter rejects
+ * most UUIDs without touching the key table; the others are looked up in
+ * an open addressing table of 128-bit keys, the nil UUID marking free slots.
+ */
+typedef struct epmap_watchlist {
+   uint64_t *bloom;
+   uint32_t  bloom_mask;       /* Size of the filter in bits, minus one. */
+   uint64_t *keys;             /* Two lanes per key. */
+   uint32_t  mask;
+   size_t    n_keys;
+} epmap_watchlist_t;
+
+/* Decode-time filter, see epmap_set_predicate(). Entries are kept only if
+ * they match every condition that is set. 
+ */
+typedef struct epmap_predicate {
+   uint32_t protseqs;          /* 1 << PROTO_ID_*, 0 keeps any. */
+   const epmap_watchlist_t *uuids; /* Interfaces to keep, NULL keeps any. */
+   uint16_t port_lo;           /* If port_hi is not zero, only TCP and UDP */
+   uint16_t port_hi;           /* endpoints in [port_lo, port_hi] match.   */
+   const char *prefix;         /* Annotation prefix, NULL keeps any. */
+   size_t prefix_len;          /* Set by epmap_set_predicate(). */
+} epmap_predicate_t;
+
+/* Session with an endpoint mapper, see epmap_bind(). */
+typedef struct epmap_session epmap_t;
+
+/* Streaming enumeration, see epmap_lookup_begin(). Entries are decoded one
+ * ept_lookup batch at a time, and only stay valid until the next batch is
+ * fetched. Their strings are interned and outlive the iterator.
+ */
+typedef struct epmap_lookup {
+   epmap_t *epmap;
+   ept_entry_t *entries;       /* Current batch. */
+   size_t n_entries;
+   size_t next;                /* Next entry to return. */
+   size_t max_entries;
+   int result;                 /* Result of the last ept_lookup call. */
+} epmap_lookup_t;
+
+/* Called for each entry by epmap_lookup_each(). A non-zero value stops the
+ * enumeration, which then returns EPMAP_ESTOPPED; the value itself is not
+ * passed back.
+ */
+typedef int (*epmap_entry_cb)(void *context, const ept_entry_t *entry);
+
+/* Error and status codes. */
+
+#define EPMAP_EOK       0x000 /* Operation completed successfully. */
+#define EPMAP_ENOMEM    0x200 /* A call to malloc() failed. */
+#define EPMAP_EINVAL    0x201 /* An invalid argument was passed to a library function. */
+#define EPMAP_EBADPTR   0x202 /* An invalid pointer was detected. */
+#define EPMAP_EWSAINIT  0x203 /* WSAStartup() initialization failed. */
+#define EPMAP_EDNSFAIL  0x204 /* Could not resolve host name. */
+#define EPMAP_ESOCKET   0x205 /* Could not create socket or connect to server. */
+#define EPMAP_ESEND     0x206 /* A call to send() failed. */
+#define EPMAP_ERECV     0x207 /* A call to recv() failed. */
+#define EPMAP_EWRITE    0x208 /* Output could not be written. */
+
+#define EPMAP_EACK      0x300 /* BIND-ACK PDU */
+#define EPMAP_ENAK      0x301 /* BIND-NAK PDU */
+#define EPMAP_EFAULT    0x302 /* Received a FAULT PDU. */
+#define EPMAP_EPROTO    0x303 /* Generic protocol error. */
+#define EPMAP_ENODATA   0x304 /* The enumeration is complete. */
+#define EPMAP_ECONTEXT  0x305 /* The presentation context was rejected. */
+#define EPMAP_EAGAIN    0x306 /* Non-blocking operation in progress. */
+#define EPMAP_ESTOPPED  0x307 /* The callback stopped the enumeration. */
+                              
+#define EPMAP_EDEBUG    0x400
+
+#define EPMAPAPI extern
+
+/* Socket events a non-blocking operation waits for. */
+#define EPMAP_WANT_READ  0x01
+#define EPMAP_WANT_WRITE 0x02
+
+/* Sessions. On failure, epmap_bind() and epmap_bind_ex() set *epmap to
+ * NULL and there is nothing to destroy.
+ */
+EPMAPAPI epmap_t *epmap_init(size_t snd_len, size_t rcv_len);
+EPMAPAPI int epmap_bind(epmap_t **epmap, const char *server, uint16_t port);
+EPMAPAPI int epmap_bind_ex(epmap_t **epmap, const char *server, uint16_t port, uint16_t frag_size);
+EPMAPAPI int epmap_shutdown(epmap_t *epmap);
+EPMAPAPI void epmap_idle(epmap_t *epmap);
+EPMAPAPI void epmap_destroy(epmap_t *epmap);
+EPMAPAPI void epmap_pool_cleanup(void);
+
+/* Filters. */
+EPMAPAPI int epmap_set_filter(epmap_t *epmap, uint32_t inquiry_type,
+                              const uuid_t *object, const uuid_t *if_uuid,
+                              uint16_t vers_major, uint16_t vers_minor,
+                              uint32_t vers_option);
+EPMAPAPI void epmap_set_predicate(epmap_t *epmap, const epmap_predicate_t *pred);
+EPMAPAPI void epmap_set_watchlist(epmap_t *epmap, const epmap_watchlist_t *wl);
+EPMAPAPI int epmap_watchlist_init(epmap_watchlist_t *wl, const uuid_t *uuids, size_t n);
+EPMAPAPI void epmap_watchlist_free(epmap_watchlist_t *wl);
+EPMAPAPI int epmap_watchlist_match(const epmap_watchlist_t *wl, const uuid_t *uuid);
+
+/* Enumeration. */
+EPMAPAPI int epmap_lookup_begin(epmap_t *epmap, epmap_lookup_t *lookup);
+EPMAPAPI int epmap_lookup_next(epmap_lookup_t *lookup, const ept_entry_t **entry);
+EPMAPAPI int epmap_lookup_batch(epmap_lookup_t *lookup, const ept_entry_t **entries, size_t *count);
+EPMAPAPI void epmap_lookup_end(epmap_lookup_t *lookup);
+EPMAPAPI int epmap_lookup_each(epmap_t *epmap, epmap_entry_cb callback, void *context);
+
+/* Non-blocking operations. Once started, an operation is advanced with
+ * epmap_async_step() each time the socket is ready for the events given by
+ * epmap_async_events(), until it returns something else than EPMAP_EAGAIN.
+ * epmap_lookup_async() completes with EPMAP_EOK once a batch is available
+ * to epmap_lookup_next() or epmap_lookup_batch(). Name resolution is still
+ * synchronous.
+ */
+EPMAPAPI int epmap_bind_async(epmap_t **epmap, const char *server, uint16_t port, uint16_t frag_size);
+EPMAPAPI int epmap_lookup_async(epmap_lookup_t *lookup);
+EPMAPAPI int epmap_async_step(epmap_t *epmap);
+EPMAPAPI int epmap_async_events(const epmap_t *epmap);
+EPMAPAPI uintptr_t epmap_async_socket(const epmap_t *epmap);
+
+/* Management interface, on the same association. */
+EPMAPAPI int epmap_mgmt_inq_if_ids(epmap_t *epmap, rpc_if_id_t *if_ids, 
+                                   size_t max_ids, size_t *count);
+EPMAPAPI int epmap_mgmt_is_server_listening(epmap_t *epmap, int *listening);
+
+/* Strings and UUIDs. */
+EPMAPAPI int epmap_intern(const char *str, size_t len, uint32_t *id);
+EPMAPAPI const char *epmap_string(uint32_t id);
+EPMAPAPI void epmap_strings_cleanup(void);
+EPMAPAPI const char *epmap_uuid_name(const uuid_t *uuid);
+EPMAPAPI char *epmap_uuid_to_string(const uuid_t *uuid);
+EPMAPAPI char *epmap_error(int result);
+EPMAPAPI const char *epmap_strerror(int result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EPMAP_H */
@@ -0,0 +1,285 @@
+/*******************************************************************************
+ * epmap.hpp - C++ wrapper for the endpoint mapper client (epmap.h), C++20.
+ * Session owns an epmap_t and destroys it exactly once, whatever the path.
+ * Nothing throws: operations return a std::error_code in the "epmap"
+ * category, whose value is the EPMAP_* result of the C function. Entries
+ * are the decoded ept_entry_t themselves, seen through std::span, and their
+ * strings through std::string_view over the interned string table.
+ ******************************************************************************/
+
+#ifndef EPMAP_HPP
+#define EPMAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "epmap.h"
+
+namespace epmap {
+
+/* A batch of entries, valid until the next batch is fetched. */
+using Entry = ept_entry_t;
+using Batch = std::span<const ept_entry_t>;
+
+class ErrorCategory : public std::error_category {
+public:
+   const char *name() const noexcept override { return "epmap"; }
+
+   /* Built here: epmap_error() formats into a static buffer. */
+   std::string message(int result) const override
+   {
+       std::string text = epmap_strerror(result);
+       unsigned int extended = static_cast<unsigned int>(result) >> 12;
+
+       if ((result & 0xfff) == EPMAP_ESOCKET)
+           text += " (errno: " + std::to_string(extended) + ")";
+       else if ((result & 0xfff) == EPMAP_ENAK)
+           text += " (reason: " + std::to_string(extended) + ")";
+       return text;
+   }
+};
+
+inline const std::error_category &error_category() noexcept
+{
+   static const ErrorCategory category;
+   return category;
+}
+
+inline std::error_code make_error_code(int result) noexcept
+{
+   return result == EPMAP_EOK ? std::error_code() : std::error_code(result, error_category());
+}
+
+/* Entry accessors. Interned strings live until epmap_strings_cleanup(). */
+inline std::string_view annotation(const Entry &entry) noexcept
+{
+   return epmap_string(entry.annotation_id);
+}
+
+inline std::string_view pipe(const Entry &entry) noexcept
+{
+   return epmap_string(entry.tower.pipe_id);
+}
+
+inline std::string_view service(const Entry &entry) noexcept
+{
+   return entry.tower.service != nullptr ? entry.tower.service : std::string_view();
+}
+
+inline const rpc_if_id_t &interface_id(const Entry &entry) noexcept
+{
+   return entry.tower.if_id;
+}
+
+/* TCP or UDP port, zero for the other protocol sequences. */
+inline std::uint16_t port(const Entry &entry) noexcept
+{
+   return entry.tower.tcp_port != 0 ? entry.tower.tcp_port : entry.tower.udp_port;
+}
+
+inline bool watched(const Entry &entry) noexcept
+{
+   return (entry.flags & EPMAP_ENTRY_WATCHED) != 0;
+}
+
+/* Move-only owner of a session with one endpoint mapper. */
+class Session {
+public:
+   Session() noexcept = default;
+
+   /* Adopt a session bound with the C API. */
+   explicit Session(epmap_t *epmap) noexcept : epmap_(epmap) {}
+
+   Session(Session &&other) noexcept
+       : epmap_(std::exchange(other.epmap_, nullptr)), lookup_(other.lookup_)
+   {
+       other.lookup_.entries = nullptr;
+   }
+
+   Session &operator=(Session &&other) noexcept
+   {
+       if (this != &other) {
+           reset();
+           epmap_ = std::exchange(other.epmap_, nullptr);
+           lookup_ = other.lookup_;
+           other.lookup_.entries = nullptr;
+       }
+       return *this;
+   }
+
+   Session(const Session &) = delete;
+   Session &operator=(const Session &) = delete;
+
+   ~Session() { reset(); }
+
+   /* Connect and bind. server is not copied, it must outlive the session. */
+   std::error_code bind(const char *server, std::uint16_t port = DEFAULT_EPMAP_PORT,
+                        std::uint16_t frag_size = EPMAP_FRAG_SIZE) noexcept
+   {
+       reset();
+       return make_error_code(epmap_bind_ex(&epmap_, server, port, frag_size));
+   }
+
+   /* Server-side filter, see epmap_set_filter(). */
+   std::error_code set_filter(std::uint32_t inquiry_type, const uuid_t *object,
+                              const uuid_t *if_uuid, std::uint16_t vers_major = 0,
+                              std::uint16_t vers_minor = 0,
+                              std::uint32_t vers_option = RPC_C_VERS_ALL) noexcept
+   {
+       end();
+       return make_error_code(epmap_set_filter(epmap_, inquiry_type, object, if_uuid,
+           vers_major, vers_minor, vers_option));
+   }
+
+   /* Decode-time filter and watchlist. The predicate is copied, but not
+    * the watchlist nor the strings it points to.
+    */
+   void set_predicate(const epmap_predicate_t *pred) noexcept
+   {
+       epmap_set_predicate(epmap_, pred);
+   }
+
+   void set_watchlist(const epmap_watchlist_t *wl) noexcept
+   {
+       epmap_set_watchlist(epmap_, wl);
+   }
+
+   /* Return the next batch of entries, an empty one at the end of the
+    * endpoint map. The first call starts the enumeration, the one after
+    * the end starts it over.
+    */
+   std::error_code next_batch(Batch &batch) noexcept
+   {
+       int result = EPMAP_EOK;
+
+       if (lookup_.entries == nullptr)
+           result = epmap_lookup_begin(epmap_, &lookup_);
+
+       return finish_batch(result, batch);
+   }
+
+   /* Call f(const Entry &) for each entry, as each batch is decoded. */
+   template <class F>
+   std::error_code for_each(F &&f) noexcept(noexcept(f(std::declval<const Entry &>())))
+   {
+       Batch batch;
+       std::error_code ec;
+
+       end();
+       while (!(ec = next_batch(batch)) && !batch.empty()) {
+           for (const Entry &entry : batch)
+               f(entry);
+       }
+       return ec;
+   }
+
+   /* Abandon the enumeration in progress. */
+   void end() noexcept
+   {
+       if (lookup_.entries != nullptr)
+           epmap_lookup_end(&lookup_);
+   }
+
+   /* Non-blocking operations, see epmap_coro.hpp: start one, then call
+    * step() whenever socket() is ready for events(), until the result is
+    * no longer EPMAP_EAGAIN. finish_bind() and finish_batch() turn that
+    * result into the one of bind() and next_batch().
+    */
+   int start_bind(const char *server, std::uint16_t port = DEFAULT_EPMAP_PORT,
+                  std::uint16_t frag_size = EPMAP_FRAG_SIZE) noexcept
+   {
+       reset();
+       return epmap_bind_async(&epmap_, server, port, frag_size);
+   }
+
+   int start_batch() noexcept
+   {
+       int result = EPMAP_EOK;
+
+       if (lookup_.entries == nullptr)
+           result = epmap_lookup_begin(epmap_, &lookup_);
+       if (result == EPMAP_EOK)
+           result = epmap_lookup_async(&lookup_);
+       return result;
+   }
+
+   int step() noexcept { return epmap_async_step(epmap_); }
+   int events() const noexcept { return epmap_async_events(epmap_); }
+   std::uintptr_t socket() const noexcept { return epmap_async_socket(epmap_); }
+
+   std::error_code finish_bind(int result) noexcept
+   {
+       if (result != EPMAP_EOK)
+           reset();
+       return make_error_code(result);
+   }
+
+   std::error_code finish_batch(int result, Batch &batch) noexcept
+   {
+       const ept_entry_t *entries = nullptr;
+       std::size_t count = 0;
+
+       batch = Batch();
+       if (result == EPMAP_EOK)
+           result = epmap_lookup_batch(&lookup_, &entries, &count);
+
+       if (result == EPMAP_EOK) {
+           batch = Batch(entries, count);
+           return std::error_code();
+       }
+
+       end();
+       return make_error_code(result == EPMAP_ENODATA ? EPMAP_EOK : result);
+   }
+
+   /* Management interface, on the same association. */
+   std::error_code inq_if_ids(std::span<rpc_if_id_t> ids, std::size_t &count) noexcept
+   {
+       return make_error_code(epmap_mgmt_inq_if_ids(epmap_, ids.data(), ids.size(), &count));
+   }
+
+   std::error_code is_server_listening(bool &listening) noexcept
+   {
+       int value = 0;
+       int result = epmap_mgmt_is_server_listening(epmap_, &value);
+
+       listening = value != 0;
+       return make_error_code(result);
+   }
+
+   /* Give the receive buffer back to the pool between calls. */
+   void idle() noexcept
+   {
+       if (epmap_ != nullptr)
+           epmap_idle(epmap_);
+   }
+
+   void reset() noexcept
+   {
+       end();
+       if (epmap_ != nullptr)
+           epmap_destroy(std::exchange(epmap_, nullptr));
+   }
+
+   epmap_t *release() noexcept
+   {
+       end();
+       return std::exchange(epmap_, nullptr);
+   }
+
+   epmap_t *get() const noexcept { return epmap_; }
+   explicit operator bool() const noexcept { return epmap_ != nullptr; }
+
+private:
+   epmap_t *epmap_ = nullptr;
+   epmap_lookup_t lookup_ = {};
+};
+
+} /* namespace epmap */
+
+#endif /* EPMAP_HPP */
@@ -0,0 +1,274 @@
+/*******************************************************************************
+ * epmap_coro.hpp - C++20 coroutine interface to the endpoint mapper client.
+ * AsyncSession::bind() and AsyncSession::next_batch() are awaitable: they
+ * run the non-blocking session state machine (epmap_async_step()) and
+ * suspend the coroutine while the socket is not ready. Waiting for the
+ * socket is left to a Reactor, which any executor can implement; Scheduler
+ * is a single-threaded reference implementation over WSAPoll().
+ *
+ *   epmap::Task enumerate(epmap::Scheduler &scheduler, const char *server)
+ *   {
+ *       epmap::AsyncSession session(scheduler);
+ *       epmap::Batch batch;
+ *       std::error_code ec = co_await session.bind(server);
+ *       while (!ec && !(ec = co_await session.next_batch(batch)) && !batch.empty())
+ *           ...
+ *   }
+ *
+ *   scheduler.spawn(enumerate(scheduler, "192.168.1.4"));
+ *   scheduler.run();
+ ******************************************************************************/
+
+#ifndef EPMAP_CORO_HPP
+#define EPMAP_CORO_HPP
+
+#include <winsock2.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "epmap.hpp"
+
+namespace epmap {
+
+/* Suspended on a socket, told by the reactor once the socket is ready, or
+ * has failed. 
+ */
+class Waiter {
+public:
+   virtual void ready(bool failed) noexcept = 0;
+
+protected:
+   ~Waiter() = default;
+};
+
+/* Executor interface. wait() registers the waiter for one notification,
+ * when socket is ready for events (EPMAP_WANT_*) or has failed (an error
+ * or a hang-up), which must be delivered on the thread running the
+ * coroutines.
+ */
+class Reactor {
+public:
+   virtual void wait(std::uintptr_t socket, int events, Waiter &waiter) noexcept = 0;
+
+protected:
+   ~Reactor() = default;
+};
+
+/* Awaitable non-blocking operation of a session. */
+class Operation : private Waiter {
+public:
+   Operation(Session &session, Reactor &reactor, int result, Batch *batch) noexcept
+       : session_(session), reactor_(reactor), result_(result), batch_(batch) {}
+
+   bool await_ready() const noexcept { return result_ != EPMAP_EAGAIN; }
+
+   void await_suspend(std::coroutine_handle<> handle) noexcept
+   {
+       handle_ = handle;
+       reactor_.wait(session_.socket(), session_.events(), *this);
+   }
+
+   std::error_code await_resume() noexcept
+   {
+       return batch_ != nullptr ? session_.finish_batch(result_, *batch_) : session_.finish_bind(result_);
+   }
+
+private:
+   /* A failed socket that the step cannot get past would be reported
+    * again at once: finish with the socket error instead of waiting. 
+    */
+   void ready(bool failed) noexcept override
+   {
+       result_ = session_.step();
+       if (result_ == EPMAP_EAGAIN && failed)
+           result_ = socket_error();
+       if (result_ == EPMAP_EAGAIN)
+           reactor_.wait(session_.socket(), session_.events(), *this);
+       else
+           handle_.resume();
+   }
+
+   int socket_error() const noexcept
+   {
+       int error = 0;
+       int errlen = sizeof(error);
+
+       getsockopt((SOCKET)session_.socket(), SOL_SOCKET, SO_ERROR, (char *)&error, &errlen);
+       return (error << 12) | EPMAP_ESOCKET;
+   }
+
+   Session &session_;
+   Reactor &reactor_;
+   int result_;
+   Batch *batch_;               /* Null for bind(). */
+   std::coroutine_handle<> handle_;
+};
+
+/* Session whose operations are awaited. It must not be moved while one is
+ * in progress. There is no deadline: time out the connection in the
+ * reactor if needed.
+ */
+class AsyncSession : public Session {
+public:
+   explicit AsyncSession(Reactor &reactor) noexcept : reactor_(&reactor) {}
+
+   Operation bind(const char *server, std::uint16_t port = DEFAULT_EPMAP_PORT,
+                  std::uint16_t frag_size = EPMAP_FRAG_SIZE) noexcept
+   {
+       return Operation(*this, *reactor_, start_bind(server, port, frag_size), nullptr);
+   }
+
+   /* The batch is empty at the end of the endpoint map. */
+   Operation next_batch(Batch &batch) noexcept
+   {
+       return Operation(*this, *reactor_, start_batch(), &batch);
+   }
+
+private:
+   Reactor *reactor_;
+};
+
+/* Coroutine run by a Scheduler. Exceptions are not expected. */
+class Task {
+public:
+   struct promise_type {
+       Task get_return_object() noexcept
+       {
+           return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+       }
+       std::suspend_always initial_suspend() noexcept { return {}; }
+       std::suspend_always final_suspend() noexcept { return {}; }
+       void return_void() noexcept {}
+       void unhandled_exception() noexcept { std::terminate(); }
+   };
+
+   Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+   Task(const Task &) = delete;
+   Task &operator=(const Task &) = delete;
+   Task &operator=(Task &&) = delete;
+
+   ~Task()
+   {
+       if (handle_)
+           handle_.destroy();
+   }
+
+   std::coroutine_handle<> release() noexcept { return std::exchange(handle_, nullptr); }
+
+private:
+   explicit Task(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+
+   std::coroutine_handle<promise_type> handle_;
+};
+
+/* Single-threaded reference scheduler: runs the spawned tasks until they
+ * all complete, polling the sockets they wait on.
+ */
+class Scheduler : public Reactor {
+public:
+   Scheduler() = default;
+   Scheduler(const Scheduler &) = delete;
+   Scheduler &operator=(const Scheduler &) = delete;
+
+   ~Scheduler()
+   {
+       for (std::coroutine_handle<> task : tasks_)
+           task.destroy();
+   }
+
+   void spawn(Task task)
+   {
+       std::coroutine_handle<> handle = task.release();
+
+       tasks_.push_back(handle);
+       runnable_.push_back(handle);
+   }
+
+   void wait(std::uintptr_t socket, int events, Waiter &waiter) noexcept override
+   {
+       WSAPOLLFD fd;
+
+       fd.fd = (SOCKET)socket;
+       fd.events = ((events & EPMAP_WANT_READ) ? POLLRDNORM : 0) |
+                   ((events & EPMAP_WANT_WRITE) ? POLLWRNORM : 0);
+       fd.revents = 0;
+       fds_.push_back(fd);
+       waiters_.push_back(&waiter);
+   }
+
+   /* Run until all the tasks have completed. Returns false if WSAPoll()
+    * fails, or if tasks are left suspended on something else than a socket.
+    */
+   bool run()
+   {
+       std::vector<std::pair<Waiter *, bool>> ready;
+       std::size_t i;
+
+       while (!tasks_.empty()) {
+           while (!runnable_.empty()) {
+               std::coroutine_handle<> handle = runnable_.back();
+               runnable_.pop_back();
+               handle.resume();
+           }
+           reap();
+           if (tasks_.empty())
+               break;
+           if (fds_.empty())
+               return false;
+
+           if (WSAPoll(fds_.data(), (ULONG)fds_.size(), -1) == SOCKET_ERROR)
+               return false;
+
+           /* Waiters may wait again from ready(), take them out first. */
+           ready.clear();
+           for (i = 0; i < fds_.size(); ) {
+               if (fds_[i].revents != 0) {
+                   ready.emplace_back(waiters_[i], (fds_[i].revents & (POLLERR | POLLHUP)) != 0);
+                   fds_[i] = fds_.back();
+                   fds_.pop_back();
+                   waiters_[i] = waiters_.back();
+                   waiters_.pop_back();
+               } else
+                   i++;
+           }
+           for (auto [waiter, failed] : ready)
+               waiter->ready(failed);
+       }
+
+       return true;
+   }
+
+   std::size_t tasks() const noexcept { return tasks_.size(); }
+   std::size_t waiting() const noexcept { return fds_.size(); }
+
+private:
+   /* Destroy the tasks that have run to completion. */
+   void reap() noexcept
+   {
+       std::size_t i;
+
+       for (i = 0; i < tasks_.size(); ) {
+           if (tasks_[i].done()) {
+               tasks_[i].destroy();
+               tasks_[i] = tasks_.back();
+               tasks_.pop_back();
+           } else
+               i++;
+       }
+   }
+
+   std::vector<std::coroutine_handle<>> tasks_;
+   std::vector<std::coroutine_handle<>> runnable_;
+   std::vector<WSAPOLLFD> fds_;
+   std::vector<Waiter *> waiters_;
+};
+
+} /* namespace epmap */
+
+#endif /* EPMAP_CORO_HPP */
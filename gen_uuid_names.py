@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+#
+# gen_uuid_names.py - Generate uuid_names.h, the perfect hash table that maps
+# well-known DCE/RPC interface UUIDs to service names.
+#
+# A key is placed in bucket uuid_hash(uuid, 0) % UUID_NAMES_BUCKETS, and the
+# bucket's seed places it in slot uuid_hash(uuid, seed) % UUID_NAMES_SIZE. The
+# seeds are searched here, largest buckets first, so that no two keys share a
+# slot. uuid_hash() must match the function of the same name in epdump.c.
+#
+# Usage: python3 gen_uuid_names.py > uuid_names.h
+
+import sys
+import uuid as U
+
+UUID_NAMES = [
+    # DCE/RPC runtime.
+    ("e1af8308-5d1f-11c9-91a4-08002b14a0fa", "epmapper"),
+    ("afa8bd80-7d8a-11c9-bef4-08002b102989", "mgmt"),
+    ("e33c0cc4-0482-101a-bc0c-02608c6ba218", "locator"),
+    # Security and directory services.
+    ("12345778-1234-abcd-ef00-0123456789ab", "lsarpc"),
+    ("12345778-1234-abcd-ef00-0123456789ac", "samr"),
+    ("12345678-1234-abcd-ef00-01234567cffb", "netlogon"),
+    ("e3514235-4b06-11d1-ab04-00c04fc2dcd2", "drsuapi"),
+    ("7c44d7d4-31d5-424c-bd5e-2b3e1f323d22", "dsaop"),
+    ("3919286a-b10c-11d0-9ba8-00c04fd92ef5", "dssetup"),
+    ("3dde7c30-165d-11d1-ab8f-00805f14db40", "backupkey"),
+    ("b25a52bf-e5dd-4f4a-aea6-8ca7272a0e86", "keyiso"),
+    ("c681d488-d850-11d0-8c52-00c04fd90f7e", "efsrpc"),
+    ("df1941c5-fe89-4e79-bf10-463657acf44d", "efsrpc"),
+    ("12b81e99-f207-4a4c-85d3-77b42f76fd14", "seclogon"),
+    ("91ae6020-9e3c-11cf-8d7c-00aa00c091be", "icertpassage"),
+    # File, print and session services.
+    ("4b324fc8-1670-01d3-1278-5a47bf6ee188", "srvsvc"),
+    ("6bffd098-a112-3610-9833-46c3f87e345a", "wkssvc"),
+    ("6bffd098-a112-3610-9833-012892020162", "browser"),
+    ("12345678-1234-abcd-ef00-0123456789ab", "spoolss"),
+    ("76f03f96-cdfd-44fc-a22c-64950a001209", "winspool"),
+    ("4fc742e0-4a10-11cf-8273-00aa004ae673", "netdfs"),
+    ("f5cc59b4-4264-101a-8c59-08002b2f8426", "frsrpc"),
+    ("d049b186-814f-11d1-9a3c-00c04fc9b232", "frsapi"),
+    ("897e2e5f-93f3-4376-9c9c-fd2277495c27", "frs2"),
+    ("ccd8c074-d0e5-4a40-92b4-d074faa6ba28", "witness"),
+    ("a8e0653c-2744-4389-a61d-7373df8b2292", "fsrvp"),
+    ("c8cb7687-e6d3-11d2-a958-00c04f682e16", "davclnt"),
+    ("300f3532-38cc-11d0-a3f0-0020af6b0add", "trkwks"),
+    ("4da1c422-943d-11d1-acae-00c04fc2aa3f", "trksvr"),
+    ("5ca4a760-ebb1-11cf-8611-00a0245420ed", "winsta"),
+    ("484809d6-4239-471b-b5bc-61df8c23ac48", "lsm_session"),
+    # System management.
+    ("367abb81-9844-35f1-ad32-98f038001003", "svcctl"),
+    ("338cd001-2244-31f1-aaaa-900038001003", "winreg"),
+    ("82273fdc-e32a-18c3-3f78-827929dc23ea", "eventlog"),
+    ("f6beaff7-1e19-4fbb-9f8f-b89e2018337c", "even6"),
+    ("1ff70682-0a51-30e8-076d-740be8cee98b", "atsvc"),
+    ("378e52b0-c0a9-11cf-822d-00aa0051e40f", "sasec"),
+    ("86d35949-83c9-4044-b424-db363231fd0c", "tsch"),
+    ("894de0c0-0d55-11d3-a322-00c04fa321a1", "initshutdown"),
+    ("d95afe70-a6d5-4259-822e-2c84da1ddb0d", "windowsshutdown"),
+    ("8d9f4e40-a03d-11ce-8f69-08003e30051b", "pnp"),
+    ("83da7c00-e84f-11d2-9807-00c04f8ec850", "sfcapi"),
+    ("8fb6d884-2388-11d0-8c35-00c04fda2795", "w32time"),
+    ("8c7daf44-b6dc-11d1-9a4c-0020af6e7c57", "appmgmt"),
+    ("6b5bdd1e-528c-422c-af8c-a4079be4fe48", "remotefw"),
+    ("b97db8b2-4c63-11cf-bff6-08002be23f2f", "clusapi"),
+    ("342cfd40-3c6c-11ce-a893-08002b2e9c6d", "llsrpc"),
+    ("4b112204-0e19-11d3-b42b-0000f81feb9f", "ssdpsrv"),
+    ("5a7b91f8-ff00-11d0-a9b2-00c04fb6e6fc", "msgsvc"),
+    ("2f5f3220-c126-1076-b549-074d078619da", "netdde"),
+    # Network services.
+    ("50abc2a4-574d-40b3-9d66-ee4fd5fba076", "dnsserver"),
+    ("6bffd098-a112-3610-9833-46c3f874532d", "dhcpsrv"),
+    ("5b821720-f63b-11d0-aad2-00c04fc324db", "dhcpsrv2"),
+    ("45f52c28-7f9f-101a-b52b-08002b2efabe", "winsif"),
+    ("811109bf-a4e1-11d1-ab54-00a0c91e9b45", "winsi2"),
+    ("8f09f000-b7ed-11ce-bbd2-00001a181cad", "rras"),
+    ("20610036-fa22-11cf-9823-00a0c911e5df", "rasrpc"),
+    ("2f5f6520-ca46-1067-b319-00dd010662da", "tapsrv"),
+    # DCOM and WMI.
+    ("4d9f4ab8-7d1c-11cf-861e-0020af6e7c57", "IActivation"),
+    ("000001a0-0000-0000-c000-000000000046", "IRemoteSCMActivator"),
+    ("99fcfec4-5260-101b-bbcb-00aa0021347a", "IObjectExporter"),
+    ("00000131-0000-0000-c000-000000000046", "IRemUnknown"),
+    ("00000143-0000-0000-c000-000000000046", "IRemUnknown2"),
+    ("f309ad18-d86a-11d0-a075-00c04fb68820", "IWbemLevel1Login"),
+    ("9556dc99-828c-11cf-a37e-00aa003240c7", "IWbemServices"),
+    # Messaging and transactions.
+    ("a4f1db00-ca47-1067-b31f-00dd010662da", "emsmdb"),
+    ("f5cc5a18-4264-101a-8c59-08002b2f8426", "nspi"),
+    ("1544f5e0-613c-11d1-93df-00c04fd7bd09", "rfr"),
+    ("fdb3a030-065f-11d1-bb9b-00a024ea5525", "qmcomm"),
+    ("76d12b80-3467-11d3-91ff-0090272f9ea3", "qmcomm2"),
+    ("906b0ce0-c70b-1067-b317-00dd010662da", "msdtc"),
+]
+
+UUID_NAMES_BUCKETS = 32
+UUID_NAMES_SIZE = 128
+
+M64 = (1 << 64) - 1
+
+
+def uuid_words(u):
+    """The two 64-bit words uuid_hash() is computed on, from the fields."""
+    time_low, time_mid, time_hi, seq_hi, seq_low, node = u.fields
+    a = time_low | (time_mid << 32) | (time_hi << 48)
+    b = seq_hi | (seq_low << 8) | ((node & 0xffffffffffff) << 16)
+    return a, b
+
+
+def uuid_hash(u, seed):
+    a, b = uuid_words(u)
+    h = ((a ^ ((seed * 0x9e3779b97f4a7c15) & M64)) * 0xff51afd7ed558ccd) & M64
+    h ^= (b + (h >> 29)) & M64
+    h = (h * 0xc4ceb9fe1a85ec53) & M64
+    h ^= h >> 32
+    return h & 0xffffffff
+
+
+def main():
+    keys = [(U.UUID(s), name) for s, name in UUID_NAMES]
+    assert len({k for k, _ in keys}) == len(keys), "duplicate UUID"
+
+    buckets = [[] for _ in range(UUID_NAMES_BUCKETS)]
+    for key in keys:
+        buckets[uuid_hash(key[0], 0) % UUID_NAMES_BUCKETS].append(key)
+
+    seeds = [0] * UUID_NAMES_BUCKETS
+    table = [None] * UUID_NAMES_SIZE
+    order = sorted(range(UUID_NAMES_BUCKETS), key=lambda i: -len(buckets[i]))
+    for i in order:
+        if not buckets[i]:
+            continue
+        for seed in range(1, 65536):
+            slots = [uuid_hash(k, seed) % UUID_NAMES_SIZE for k, _ in buckets[i]]
+            if len(set(slots)) == len(slots) and all(table[s] is None for s in slots):
+                break
+        else:
+            sys.exit("no seed found for bucket %d" % i)
+        seeds[i] = seed
+        for slot, key in zip(slots, buckets[i]):
+            table[slot] = key
+
+    out = sys.stdout
+    out.write("/* uuid_names.h - Well-known interface UUIDs, perfect hash table.\n")
+    out.write(" * Generated by gen_uuid_names.py, do not edit. */\n\n")
+    out.write("#define UUID_NAMES_BUCKETS %d\n" % UUID_NAMES_BUCKETS)
+    out.write("#define UUID_NAMES_SIZE    %d\n\n" % UUID_NAMES_SIZE)
+    out.write("static const uint16_t uuid_names_seed[UUID_NAMES_BUCKETS] = {\n")
+    for i in range(0, UUID_NAMES_BUCKETS, 8):
+        out.write("   " + " ".join("%5d," % s for s in seeds[i:i + 8]) + "\n")
+    out.write("};\n\n")
+    out.write("static const struct uuid_name {\n")
+    out.write("   uuid_t      uuid;\n")
+    out.write("   const char *name;\n")
+    out.write("} uuid_names[UUID_NAMES_SIZE] = {\n")
+    for slot in table:
+        if slot is None:
+            out.write("   { { 0 }, NULL },\n")
+            continue
+        u, name = slot
+        tl, tm, th, sh, sl, node = u.fields
+        nodes = ", ".join("0x%02x" % b for b in node.to_bytes(6, "big"))
+        out.write("   { { 0x%08x, 0x%04x, 0x%04x, 0x%02x, 0x%02x, { %s } }, \"%s\" },\n"
+                  % (tl, tm, th, sh, sl, nodes, name))
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,146 @@
+/* uuid_names.h - Well-known interface UUIDs, perfect hash table.
+ * Generated by gen_uuid_names.py, do not edit. */
+
+#define UUID_NAMES_BUCKETS 32
+#define UUID_NAMES_SIZE    128
+
+static const uint16_t uuid_names_seed[UUID_NAMES_BUCKETS] = {
+       8,     3,     3,     1,     1,     3,     2,     1,
+       1,     1,     1,     4,     6,     2,    13,     0,
+       2,     1,     0,     1,     4,     1,     2,     1,
+       1,     0,     1,     0,     1,     2,     2,     1,
+};
+
+static const struct uuid_name {
+   uuid_t      uuid;
+   const char *name;
+} uuid_names[UUID_NAMES_SIZE] = {
+   { { 0 }, NULL },
+   { { 0xd049b186, 0x814f, 0x11d1, 0x9a, 0x3c, { 0x00, 0xc0, 0x4f, 0xc9, 0xb2, 0x32 } }, "frsapi" },
+   { { 0xb25a52bf, 0xe5dd, 0x4f4a, 0xae, 0xa6, { 0x8c, 0xa7, 0x27, 0x2a, 0x0e, 0x86 } }, "keyiso" },
+   { { 0x12345778, 0x1234, 0xabcd, 0xef, 0x00, { 0x01, 0x23, 0x45, 0x67, 0x89, 0xac } }, "samr" },
+   { { 0 }, NULL },
+   { { 0x894de0c0, 0x0d55, 0x11d3, 0xa3, 0x22, { 0x00, 0xc0, 0x4f, 0xa3, 0x21, 0xa1 } }, "initshutdown" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0xdf1941c5, 0xfe89, 0x4e79, 0xbf, 0x10, { 0x46, 0x36, 0x57, 0xac, 0xf4, 0x4d } }, "efsrpc" },
+   { { 0x300f3532, 0x38cc, 0x11d0, 0xa3, 0xf0, { 0x00, 0x20, 0xaf, 0x6b, 0x0a, 0xdd } }, "trkwks" },
+   { { 0 }, NULL },
+   { { 0xe3514235, 0x4b06, 0x11d1, 0xab, 0x04, { 0x00, 0xc0, 0x4f, 0xc2, 0xdc, 0xd2 } }, "drsuapi" },
+   { { 0xf5cc5a18, 0x4264, 0x101a, 0x8c, 0x59, { 0x08, 0x00, 0x2b, 0x2f, 0x84, 0x26 } }, "nspi" },
+   { { 0xf6beaff7, 0x1e19, 0x4fbb, 0x9f, 0x8f, { 0xb8, 0x9e, 0x20, 0x18, 0x33, 0x7c } }, "even6" },
+   { { 0x76d12b80, 0x3467, 0x11d3, 0x91, 0xff, { 0x00, 0x90, 0x27, 0x2f, 0x9e, 0xa3 } }, "qmcomm2" },
+   { { 0x12345678, 0x1234, 0xabcd, 0xef, 0x00, { 0x01, 0x23, 0x45, 0x67, 0xcf, 0xfb } }, "netlogon" },
+   { { 0 }, NULL },
+   { { 0x8d9f4e40, 0xa03d, 0x11ce, 0x8f, 0x69, { 0x08, 0x00, 0x3e, 0x30, 0x05, 0x1b } }, "pnp" },
+   { { 0x5a7b91f8, 0xff00, 0x11d0, 0xa9, 0xb2, { 0x00, 0xc0, 0x4f, 0xb6, 0xe6, 0xfc } }, "msgsvc" },
+   { { 0x6b5bdd1e, 0x528c, 0x422c, 0xaf, 0x8c, { 0xa4, 0x07, 0x9b, 0xe4, 0xfe, 0x48 } }, "remotefw" },
+   { { 0 }, NULL },
+   { { 0x45f52c28, 0x7f9f, 0x101a, 0xb5, 0x2b, { 0x08, 0x00, 0x2b, 0x2e, 0xfa, 0xbe } }, "winsif" },
+   { { 0 }, NULL },
+   { { 0x897e2e5f, 0x93f3, 0x4376, 0x9c, 0x9c, { 0xfd, 0x22, 0x77, 0x49, 0x5c, 0x27 } }, "frs2" },
+   { { 0x82273fdc, 0xe32a, 0x18c3, 0x3f, 0x78, { 0x82, 0x79, 0x29, 0xdc, 0x23, 0xea } }, "eventlog" },
+   { { 0x3919286a, 0xb10c, 0x11d0, 0x9b, 0xa8, { 0x00, 0xc0, 0x4f, 0xd9, 0x2e, 0xf5 } }, "dssetup" },
+   { { 0 }, NULL },
+   { { 0x00000143, 0x0000, 0x0000, 0xc0, 0x00, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } }, "IRemUnknown2" },
+   { { 0 }, NULL },
+   { { 0x4d9f4ab8, 0x7d1c, 0x11cf, 0x86, 0x1e, { 0x00, 0x20, 0xaf, 0x6e, 0x7c, 0x57 } }, "IActivation" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x6bffd098, 0xa112, 0x3610, 0x98, 0x33, { 0x46, 0xc3, 0xf8, 0x7e, 0x34, 0x5a } }, "wkssvc" },
+   { { 0x4b112204, 0x0e19, 0x11d3, 0xb4, 0x2b, { 0x00, 0x00, 0xf8, 0x1f, 0xeb, 0x9f } }, "ssdpsrv" },
+   { { 0x91ae6020, 0x9e3c, 0x11cf, 0x8d, 0x7c, { 0x00, 0xaa, 0x00, 0xc0, 0x91, 0xbe } }, "icertpassage" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x342cfd40, 0x3c6c, 0x11ce, 0xa8, 0x93, { 0x08, 0x00, 0x2b, 0x2e, 0x9c, 0x6d } }, "llsrpc" },
+   { { 0xe1af8308, 0x5d1f, 0x11c9, 0x91, 0xa4, { 0x08, 0x00, 0x2b, 0x14, 0xa0, 0xfa } }, "epmapper" },
+   { { 0x8fb6d884, 0x2388, 0x11d0, 0x8c, 0x35, { 0x00, 0xc0, 0x4f, 0xda, 0x27, 0x95 } }, "w32time" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x8f09f000, 0xb7ed, 0x11ce, 0xbb, 0xd2, { 0x00, 0x00, 0x1a, 0x18, 0x1c, 0xad } }, "rras" },
+   { { 0 }, NULL },
+   { { 0x12b81e99, 0xf207, 0x4a4c, 0x85, 0xd3, { 0x77, 0xb4, 0x2f, 0x76, 0xfd, 0x14 } }, "seclogon" },
+   { { 0xccd8c074, 0xd0e5, 0x4a40, 0x92, 0xb4, { 0xd0, 0x74, 0xfa, 0xa6, 0xba, 0x28 } }, "witness" },
+   { { 0xc8cb7687, 0xe6d3, 0x11d2, 0xa9, 0x58, { 0x00, 0xc0, 0x4f, 0x68, 0x2e, 0x16 } }, "davclnt" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x00000131, 0x0000, 0x0000, 0xc0, 0x00, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } }, "IRemUnknown" },
+   { { 0x5ca4a760, 0xebb1, 0x11cf, 0x86, 0x11, { 0x00, 0xa0, 0x24, 0x54, 0x20, 0xed } }, "winsta" },
+   { { 0 }, NULL },
+   { { 0x86d35949, 0x83c9, 0x4044, 0xb4, 0x24, { 0xdb, 0x36, 0x32, 0x31, 0xfd, 0x0c } }, "tsch" },
+   { { 0x7c44d7d4, 0x31d5, 0x424c, 0xbd, 0x5e, { 0x2b, 0x3e, 0x1f, 0x32, 0x3d, 0x22 } }, "dsaop" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x4fc742e0, 0x4a10, 0x11cf, 0x82, 0x73, { 0x00, 0xaa, 0x00, 0x4a, 0xe6, 0x73 } }, "netdfs" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x50abc2a4, 0x574d, 0x40b3, 0x9d, 0x66, { 0xee, 0x4f, 0xd5, 0xfb, 0xa0, 0x76 } }, "dnsserver" },
+   { { 0 }, NULL },
+   { { 0xafa8bd80, 0x7d8a, 0x11c9, 0xbe, 0xf4, { 0x08, 0x00, 0x2b, 0x10, 0x29, 0x89 } }, "mgmt" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x6bffd098, 0xa112, 0x3610, 0x98, 0x33, { 0x46, 0xc3, 0xf8, 0x74, 0x53, 0x2d } }, "dhcpsrv" },
+   { { 0xc681d488, 0xd850, 0x11d0, 0x8c, 0x52, { 0x00, 0xc0, 0x4f, 0xd9, 0x0f, 0x7e } }, "efsrpc" },
+   { { 0x4b324fc8, 0x1670, 0x01d3, 0x12, 0x78, { 0x5a, 0x47, 0xbf, 0x6e, 0xe1, 0x88 } }, "srvsvc" },
+   { { 0x4da1c422, 0x943d, 0x11d1, 0xac, 0xae, { 0x00, 0xc0, 0x4f, 0xc2, 0xaa, 0x3f } }, "trksvr" },
+   { { 0x378e52b0, 0xc0a9, 0x11cf, 0x82, 0x2d, { 0x00, 0xaa, 0x00, 0x51, 0xe4, 0x0f } }, "sasec" },
+   { { 0xa8e0653c, 0x2744, 0x4389, 0xa6, 0x1d, { 0x73, 0x73, 0xdf, 0x8b, 0x22, 0x92 } }, "fsrvp" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x906b0ce0, 0xc70b, 0x1067, 0xb3, 0x17, { 0x00, 0xdd, 0x01, 0x06, 0x62, 0xda } }, "msdtc" },
+   { { 0xa4f1db00, 0xca47, 0x1067, 0xb3, 0x1f, { 0x00, 0xdd, 0x01, 0x06, 0x62, 0xda } }, "emsmdb" },
+   { { 0 }, NULL },
+   { { 0x76f03f96, 0xcdfd, 0x44fc, 0xa2, 0x2c, { 0x64, 0x95, 0x0a, 0x00, 0x12, 0x09 } }, "winspool" },
+   { { 0x12345678, 0x1234, 0xabcd, 0xef, 0x00, { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab } }, "spoolss" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x8c7daf44, 0xb6dc, 0x11d1, 0x9a, 0x4c, { 0x00, 0x20, 0xaf, 0x6e, 0x7c, 0x57 } }, "appmgmt" },
+   { { 0 }, NULL },
+   { { 0xfdb3a030, 0x065f, 0x11d1, 0xbb, 0x9b, { 0x00, 0xa0, 0x24, 0xea, 0x55, 0x25 } }, "qmcomm" },
+   { { 0 }, NULL },
+   { { 0xf309ad18, 0xd86a, 0x11d0, 0xa0, 0x75, { 0x00, 0xc0, 0x4f, 0xb6, 0x88, 0x20 } }, "IWbemLevel1Login" },
+   { { 0xd95afe70, 0xa6d5, 0x4259, 0x82, 0x2e, { 0x2c, 0x84, 0xda, 0x1d, 0xdb, 0x0d } }, "windowsshutdown" },
+   { { 0 }, NULL },
+   { { 0xe33c0cc4, 0x0482, 0x101a, 0xbc, 0x0c, { 0x02, 0x60, 0x8c, 0x6b, 0xa2, 0x18 } }, "locator" },
+   { { 0 }, NULL },
+   { { 0x367abb81, 0x9844, 0x35f1, 0xad, 0x32, { 0x98, 0xf0, 0x38, 0x00, 0x10, 0x03 } }, "svcctl" },
+   { { 0 }, NULL },
+   { { 0x338cd001, 0x2244, 0x31f1, 0xaa, 0xaa, { 0x90, 0x00, 0x38, 0x00, 0x10, 0x03 } }, "winreg" },
+   { { 0x99fcfec4, 0x5260, 0x101b, 0xbb, 0xcb, { 0x00, 0xaa, 0x00, 0x21, 0x34, 0x7a } }, "IObjectExporter" },
+   { { 0 }, NULL },
+   { { 0x12345778, 0x1234, 0xabcd, 0xef, 0x00, { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab } }, "lsarpc" },
+   { { 0 }, NULL },
+   { { 0x484809d6, 0x4239, 0x471b, 0xb5, 0xbc, { 0x61, 0xdf, 0x8c, 0x23, 0xac, 0x48 } }, "lsm_session" },
+   { { 0 }, NULL },
+   { { 0x83da7c00, 0xe84f, 0x11d2, 0x98, 0x07, { 0x00, 0xc0, 0x4f, 0x8e, 0xc8, 0x50 } }, "sfcapi" },
+   { { 0 }, NULL },
+   { { 0x811109bf, 0xa4e1, 0x11d1, 0xab, 0x54, { 0x00, 0xa0, 0xc9, 0x1e, 0x9b, 0x45 } }, "winsi2" },
+   { { 0xb97db8b2, 0x4c63, 0x11cf, 0xbf, 0xf6, { 0x08, 0x00, 0x2b, 0xe2, 0x3f, 0x2f } }, "clusapi" },
+   { { 0xf5cc59b4, 0x4264, 0x101a, 0x8c, 0x59, { 0x08, 0x00, 0x2b, 0x2f, 0x84, 0x26 } }, "frsrpc" },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0 }, NULL },
+   { { 0x20610036, 0xfa22, 0x11cf, 0x98, 0x23, { 0x00, 0xa0, 0xc9, 0x11, 0xe5, 0xdf } }, "rasrpc" },
+   { { 0x2f5f6520, 0xca46, 0x1067, 0xb3, 0x19, { 0x00, 0xdd, 0x01, 0x06, 0x62, 0xda } }, "tapsrv" },
+   { { 0x5b821720, 0xf63b, 0x11d0, 0xaa, 0xd2, { 0x00, 0xc0, 0x4f, 0xc3, 0x24, 0xdb } }, "dhcpsrv2" },
+   { { 0x1544f5e0, 0x613c, 0x11d1, 0x93, 0xdf, { 0x00, 0xc0, 0x4f, 0xd7, 0xbd, 0x09 } }, "rfr" },
+   { { 0x9556dc99, 0x828c, 0x11cf, 0xa3, 0x7e, { 0x00, 0xaa, 0x00, 0x32, 0x40, 0xc7 } }, "IWbemServices" },
+   { { 0x000001a0, 0x0000, 0x0000, 0xc0, 0x00, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } }, "IRemoteSCMActivator" },
+   { { 0x2f5f3220, 0xc126, 0x1076, 0xb5, 0x49, { 0x07, 0x4d, 0x07, 0x86, 0x19, 0xda } }, "netdde" },
+   { { 0x3dde7c30, 0x165d, 0x11d1, 0xab, 0x8f, { 0x00, 0x80, 0x5f, 0x14, 0xdb, 0x40 } }, "backupkey" },
+   { { 0x1ff70682, 0x0a51, 0x30e8, 0x07, 0x6d, { 0x74, 0x0b, 0xe8, 0xce, 0xe9, 0x8b } }, "atsvc" },
+   { { 0x6bffd098, 0xa112, 0x3610, 0x98, 0x33, { 0x01, 0x28, 0x92, 0x02, 0x01, 0x62 } }, "browser" },
+   { { 0 }, NULL },
+};